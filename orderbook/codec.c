@@ -0,0 +1,561 @@
+/*
+Copyright (C) 2020-2026  Bryant Moscon - bmoscon@gmail.com
+
+Please see the LICENSE file for the terms and conditions
+associated with this software.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "codec.h"
+#include "utils.h"
+
+
+enum ValueTag {
+    TAG_NONE = 'n',
+    TAG_INT = 'i',
+    TAG_BIGINT = 'l',
+    TAG_FLOAT = 'f',
+    TAG_DECIMAL = 'd',
+    TAG_STR = 's',
+    TAG_PICKLE = 'p'
+};
+
+
+// decimal.Decimal, imported on first use and held for the life of the process
+static PyObject *decimal_type = NULL;
+
+
+PyObject *codec_decimal_type(void)
+{
+    if (!decimal_type) {
+        PyObject *decimal = PyImport_ImportModule("decimal");
+        if (!decimal) {
+            return NULL;
+        }
+
+        decimal_type = PyObject_GetAttrString(decimal, "Decimal");
+        Py_DECREF(decimal);
+    }
+
+    return decimal_type;
+}
+
+
+int codec_corrupt(void)
+{
+    PyErr_SetString(PyExc_ValueError, "corrupt or truncated order book encoding");
+    return -1;
+}
+
+
+/* Writer */
+void codec_writer_release(CodecWriter *w)
+{
+    PyMem_Free(w->data);
+    w->data = NULL;
+    w->len = 0;
+    w->cap = 0;
+}
+
+
+// the written bytes as a bytes object, the writer is released either way
+PyObject *codec_writer_bytes(CodecWriter *w)
+{
+    PyObject *ret = PyBytes_FromStringAndSize(w->data, w->len);
+
+    codec_writer_release(w);
+    return ret;
+}
+
+
+int codec_put(CodecWriter *w, const void *src, Py_ssize_t n)
+{
+    if (w->len + n > w->cap) {
+        Py_ssize_t cap = w->cap ? w->cap : 256;
+        while (cap < w->len + n) {
+            cap *= 2;
+        }
+
+        char *data = PyMem_Realloc(w->data, cap);
+        if (EXPECT(!data, 0)) {
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        w->data = data;
+        w->cap = cap;
+    }
+
+    memcpy(w->data + w->len, src, n);
+    w->len += n;
+    return 0;
+}
+
+
+int codec_put_u8(CodecWriter *w, uint8_t value)
+{
+    return codec_put(w, &value, 1);
+}
+
+
+int codec_put_u64(CodecWriter *w, uint64_t value)
+{
+    uint8_t bytes[8];
+
+    for (int i = 0; i < 8; ++i) {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+
+    return codec_put(w, bytes, 8);
+}
+
+
+int codec_put_i64(CodecWriter *w, int64_t value)
+{
+    return codec_put_u64(w, (uint64_t)value);
+}
+
+
+int codec_put_varint(CodecWriter *w, uint64_t value)
+{
+    uint8_t bytes[10];
+    int n = 0;
+
+    while (value >= 0x80) {
+        bytes[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[n++] = (uint8_t)value;
+
+    return codec_put(w, bytes, n);
+}
+
+
+static int put_string(CodecWriter *w, uint8_t tag, const char *s, Py_ssize_t len)
+{
+    if (codec_put_u8(w, tag) || codec_put_varint(w, (uint64_t)len)) {
+        return -1;
+    }
+
+    return codec_put(w, s, len);
+}
+
+
+// tag plus the text of an object, for types that round trip through str()
+static int put_text(CodecWriter *w, uint8_t tag, PyObject *obj)
+{
+    PyObject *repr = PyUnicode_CheckExact(obj) ? Py_NewRef(obj) : PyObject_Str(obj);
+    if (EXPECT(!repr, 0)) {
+        return -1;
+    }
+
+    Py_ssize_t len;
+    const char *s = PyUnicode_AsUTF8AndSize(repr, &len);
+    int ret = s ? put_string(w, tag, s, len) : -1;
+
+    Py_DECREF(repr);
+    return ret;
+}
+
+
+static int put_pickle(CodecWriter *w, PyObject *obj)
+{
+    PyObject *pickle = PyImport_ImportModule("pickle");
+    if (!pickle) {
+        return -1;
+    }
+
+    PyObject *blob = PyObject_CallMethod(pickle, "dumps", "Oi", obj, 4);
+    Py_DECREF(pickle);
+    if (!blob) {
+        return -1;
+    }
+
+    int ret = put_string(w, TAG_PICKLE, PyBytes_AS_STRING(blob), PyBytes_GET_SIZE(blob));
+    Py_DECREF(blob);
+    return ret;
+}
+
+
+int codec_put_value(CodecWriter *w, PyObject *obj)
+{
+    if (obj == Py_None) {
+        return codec_put_u8(w, TAG_NONE);
+    }
+
+    if (PyFloat_CheckExact(obj)) {
+        double value = PyFloat_AS_DOUBLE(obj);
+        uint64_t bits;
+
+        memcpy(&bits, &value, sizeof(bits));
+        return codec_put_u8(w, TAG_FLOAT) || codec_put_u64(w, bits);
+    }
+
+    if (PyLong_CheckExact(obj)) {
+        int overflow;
+        long long value = PyLong_AsLongLongAndOverflow(obj, &overflow);
+        if (EXPECT(value == -1 && PyErr_Occurred(), 0)) {
+            return -1;
+        }
+
+        if (!overflow) {
+            return codec_put_u8(w, TAG_INT) || codec_put_i64(w, value);
+        }
+
+        return put_text(w, TAG_BIGINT, obj);
+    }
+
+    if (PyUnicode_CheckExact(obj)) {
+        return put_text(w, TAG_STR, obj);
+    }
+
+    PyObject *decimal = codec_decimal_type();
+    if (EXPECT(!decimal, 0)) {
+        return -1;
+    }
+
+    // str() of a Decimal is exact, including its exponent and trailing zeros
+    if (Py_TYPE(obj) == (PyTypeObject *)decimal) {
+        return put_text(w, TAG_DECIMAL, obj);
+    }
+
+    return put_pickle(w, obj);
+}
+
+
+/* Reader */
+int codec_get(CodecReader *r, void *dst, Py_ssize_t n)
+{
+    if (EXPECT(n < 0 || n > r->len - r->pos, 0)) {
+        return codec_corrupt();
+    }
+
+    memcpy(dst, r->data + r->pos, n);
+    r->pos += n;
+    return 0;
+}
+
+
+int codec_get_u8(CodecReader *r, uint8_t *value)
+{
+    return codec_get(r, value, 1);
+}
+
+
+int codec_get_u64(CodecReader *r, uint64_t *value)
+{
+    uint8_t bytes[8];
+
+    if (codec_get(r, bytes, 8)) {
+        return -1;
+    }
+
+    *value = 0;
+    for (int i = 0; i < 8; ++i) {
+        *value |= (uint64_t)bytes[i] << (8 * i);
+    }
+
+    return 0;
+}
+
+
+int codec_get_i64(CodecReader *r, int64_t *value)
+{
+    return codec_get_u64(r, (uint64_t *)value);
+}
+
+
+int codec_get_varint(CodecReader *r, uint64_t *value)
+{
+    uint64_t result = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (EXPECT(r->pos >= r->len, 0)) {
+            return codec_corrupt();
+        }
+
+        uint8_t byte = (uint8_t)r->data[r->pos++];
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 0;
+        }
+    }
+
+    return codec_corrupt();
+}
+
+
+// a count or length, which can never exceed the bytes left to read
+int codec_get_count(CodecReader *r, Py_ssize_t *count)
+{
+    uint64_t value;
+
+    if (codec_get_varint(r, &value)) {
+        return -1;
+    }
+
+    if (EXPECT(value > (uint64_t)(r->len - r->pos), 0)) {
+        return codec_corrupt();
+    }
+
+    *count = (Py_ssize_t)value;
+    return 0;
+}
+
+
+// borrowed view of a length prefixed run of bytes
+static const char *get_string(CodecReader *r, Py_ssize_t *len)
+{
+    if (codec_get_count(r, len)) {
+        return NULL;
+    }
+
+    const char *s = r->data + r->pos;
+    r->pos += *len;
+    return s;
+}
+
+
+PyObject *codec_get_value(CodecReader *r)
+{
+    uint8_t tag;
+    Py_ssize_t len;
+    const char *s;
+
+    if (codec_get_u8(r, &tag)) {
+        return NULL;
+    }
+
+    switch (tag) {
+    case TAG_NONE:
+        Py_RETURN_NONE;
+    case TAG_INT: {
+        int64_t value;
+        return codec_get_i64(r, &value) ? NULL : PyLong_FromLongLong(value);
+    }
+    case TAG_FLOAT: {
+        uint64_t bits;
+        double value;
+        if (codec_get_u64(r, &bits)) {
+            return NULL;
+        }
+        memcpy(&value, &bits, sizeof(value));
+        return PyFloat_FromDouble(value);
+    }
+    case TAG_STR:
+        s = get_string(r, &len);
+        return s ? PyUnicode_DecodeUTF8(s, len, NULL) : NULL;
+    case TAG_BIGINT:
+    case TAG_DECIMAL: {
+        s = get_string(r, &len);
+        PyObject *text = s ? PyUnicode_DecodeASCII(s, len, NULL) : NULL;
+        if (!text) {
+            return NULL;
+        }
+
+        PyObject *ret;
+        if (tag == TAG_BIGINT) {
+            ret = PyLong_FromUnicodeObject(text, 10);
+        } else {
+            PyObject *decimal = codec_decimal_type();
+            ret = decimal ? PyObject_CallOneArg(decimal, text) : NULL;
+        }
+
+        Py_DECREF(text);
+        return ret;
+    }
+    case TAG_PICKLE: {
+        s = get_string(r, &len);
+        PyObject *pickle = s ? PyImport_ImportModule("pickle") : NULL;
+        if (!pickle) {
+            return NULL;
+        }
+
+        PyObject *ret = PyObject_CallMethod(pickle, "loads", "y#", s, len);
+        Py_DECREF(pickle);
+        return ret;
+    }
+    default:
+        codec_corrupt();
+        return NULL;
+    }
+}
+
+
+int codec_expect(CodecReader *r, const char *magic)
+{
+    if (EXPECT(r->len - r->pos < CODEC_MAGIC_LEN || memcmp(r->data + r->pos, magic, CODEC_MAGIC_LEN), 0)) {
+        PyErr_SetString(PyExc_ValueError, "not an order book encoding, or from an unsupported version");
+        return -1;
+    }
+
+    r->pos += CODEC_MAGIC_LEN;
+    return 0;
+}
+
+
+// every byte has to be consumed, trailing data means the input was not what it claimed
+int codec_finish(const CodecReader *r)
+{
+    return (r->pos == r->len) ? 0 : codec_corrupt();
+}
+
+
+/* Files */
+// reserve room for the file header, the payload is written after it
+int codec_file_begin(CodecWriter *w)
+{
+    static const char header[CODEC_FILE_HEADER] = {0};
+
+    return codec_put(w, header, CODEC_FILE_HEADER);
+}
+
+
+int codec_write_all(int fd, const char *data, Py_ssize_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+// fill in the header and replace path with the file in one rename, so a reader never
+// sees a partial write. sync also flushes it to disk before the rename
+int codec_file_write(CodecWriter *w, const char *path, const uint64_t *sequence, bool sync)
+{
+    char *header = w->data;
+    Py_ssize_t payload = w->len - CODEC_FILE_HEADER;
+
+    PyObject *tmp = PyBytes_FromFormat("%s.tmp", path);
+    if (EXPECT(!tmp, 0)) {
+        return -1;
+    }
+    const char *tmp_path = PyBytes_AS_STRING(tmp);
+    int failed = 0;
+
+    memcpy(header, CODEC_MAGIC_FILE, CODEC_MAGIC_LEN);
+    header[CODEC_MAGIC_LEN + 4] = sequence != NULL;
+    codec_store_le(header + CODEC_MAGIC_LEN + 5, sequence ? *sequence : 0, 8);
+    codec_store_le(header + CODEC_MAGIC_LEN + 13, (uint64_t)payload, 8);
+
+    Py_BEGIN_ALLOW_THREADS
+    codec_store_le(header + CODEC_MAGIC_LEN, crc32_orderbook((const uint8_t *)header + CODEC_MAGIC_LEN + 4, w->len - CODEC_MAGIC_LEN - 4), 4);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        failed = 1;
+    } else {
+        failed = codec_write_all(fd, w->data, w->len) || (sync && fsync(fd));
+        failed = close(fd) || failed;
+        failed = failed || rename(tmp_path, path);
+        if (failed) {
+            int saved = errno;
+            unlink(tmp_path);
+            errno = saved;
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    }
+
+    Py_DECREF(tmp);
+    return failed ? -1 : 0;
+}
+
+
+// map a saved file and check its header and crc, the payload is left for the caller to decode
+int codec_file_open(const char *path, CodecFile *file)
+{
+    struct stat st;
+    void *map = MAP_FAILED;
+    int failed;
+
+    memset(file, 0, sizeof(CodecFile));
+
+    Py_BEGIN_ALLOW_THREADS
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    failed = fd < 0 || fstat(fd, &st);
+    if (!failed && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        failed = map == MAP_FAILED;
+    }
+    if (fd >= 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return -1;
+    }
+
+    const char *data = (map == MAP_FAILED) ? "" : map;
+    size_t size = (map == MAP_FAILED) ? 0 : (size_t)st.st_size;
+
+    file->map = (map == MAP_FAILED) ? NULL : map;
+    file->size = size;
+
+    if (size < CODEC_FILE_HEADER || memcmp(data, CODEC_MAGIC_FILE, CODEC_MAGIC_LEN)) {
+        PyErr_SetString(PyExc_ValueError, "not a saved order book, or from an unsupported version");
+        codec_file_close(file);
+        return -1;
+    }
+
+    uint32_t crc = (uint32_t)codec_load_le(data + CODEC_MAGIC_LEN, 4);
+    uint32_t actual;
+
+    Py_BEGIN_ALLOW_THREADS
+    actual = crc32_orderbook((const uint8_t *)data + CODEC_MAGIC_LEN + 4, size - CODEC_MAGIC_LEN - 4);
+    Py_END_ALLOW_THREADS
+
+    if (actual != crc) {
+        PyErr_SetString(PyExc_ValueError, "saved order book failed its integrity check");
+        codec_file_close(file);
+        return -1;
+    }
+
+    uint64_t payload = codec_load_le(data + CODEC_MAGIC_LEN + 13, 8);
+    if (payload != size - CODEC_FILE_HEADER || (uint8_t)data[CODEC_MAGIC_LEN + 4] > 1) {
+        codec_file_close(file);
+        return codec_corrupt();
+    }
+
+    file->has_sequence = data[CODEC_MAGIC_LEN + 4];
+    file->sequence = codec_load_le(data + CODEC_MAGIC_LEN + 5, 8);
+    file->payload.data = data + CODEC_FILE_HEADER;
+    file->payload.len = (Py_ssize_t)payload;
+    file->payload.pos = 0;
+
+    return 0;
+}
+
+
+void codec_file_close(CodecFile *file)
+{
+    if (file->map) {
+        munmap(file->map, file->size);
+    }
+
+    memset(file, 0, sizeof(CodecFile));
+}
@@ -0,0 +1,118 @@
+/*
+Copyright (C) 2020-2026  Bryant Moscon - bmoscon@gmail.com
+
+Please see the LICENSE file for the terms and conditions
+associated with this software.
+*/
+#ifndef __CODEC__
+#define __CODEC__
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PY_SSIZE_T_CLEAN
+#include "Python.h"
+
+
+/*
+binary encoding of book contents. integers are little endian, counts and lengths
+are LEB128 varints, and python objects are a one byte tag followed by a native
+form for the types books hold (int, float, Decimal, str, None) or a pickle for
+anything else. the reader never trusts a length: every read is bounds checked and
+malformed input raises ValueError
+*/
+#define CODEC_MAGIC_BOOK "OBK\x01"
+#define CODEC_MAGIC_SIDE "OBS\x01"
+#define CODEC_MAGIC_FILE "OBF\x01"
+#define CODEC_MAGIC_DELTA_BOOK "OBD\x01"
+#define CODEC_MAGIC_DELTA_SIDE "OSD\x01"
+#define CODEC_MAGIC_LEN 4
+
+// saved files: magic, then a crc32 of everything after it: has sequence flag, sequence,
+// payload length and the payload
+#define CODEC_FILE_HEADER (CODEC_MAGIC_LEN + 4 + 1 + 8 + 8)
+
+
+typedef struct {
+    char *data;
+    Py_ssize_t len;
+    Py_ssize_t cap;
+} CodecWriter;
+
+
+typedef struct {
+    const char *data;
+    Py_ssize_t len;
+    Py_ssize_t pos;
+} CodecReader;
+
+
+// a saved file mapped read only, the payload reads straight out of the mapping
+typedef struct {
+    void *map;
+    size_t size;
+    CodecReader payload;
+    uint64_t sequence;
+    bool has_sequence;
+} CodecFile;
+
+
+void codec_writer_release(CodecWriter *w);
+PyObject *codec_writer_bytes(CodecWriter *w);
+
+int codec_put(CodecWriter *w, const void *src, Py_ssize_t n);
+int codec_put_u8(CodecWriter *w, uint8_t value);
+int codec_put_u64(CodecWriter *w, uint64_t value);
+int codec_put_i64(CodecWriter *w, int64_t value);
+int codec_put_varint(CodecWriter *w, uint64_t value);
+int codec_put_value(CodecWriter *w, PyObject *obj);
+
+int codec_get(CodecReader *r, void *dst, Py_ssize_t n);
+int codec_get_u8(CodecReader *r, uint8_t *value);
+int codec_get_u64(CodecReader *r, uint64_t *value);
+int codec_get_i64(CodecReader *r, int64_t *value);
+int codec_get_varint(CodecReader *r, uint64_t *value);
+int codec_get_count(CodecReader *r, Py_ssize_t *count);
+PyObject *codec_get_value(CodecReader *r);
+int codec_expect(CodecReader *r, const char *magic);
+int codec_finish(const CodecReader *r);
+int codec_corrupt(void);
+PyObject *codec_decimal_type(void);
+
+int codec_write_all(int fd, const char *data, Py_ssize_t len);
+int codec_file_begin(CodecWriter *w);
+int codec_file_write(CodecWriter *w, const char *path, const uint64_t *sequence, bool sync);
+int codec_file_open(const char *path, CodecFile *file);
+void codec_file_close(CodecFile *file);
+
+static inline void codec_store_le(char *dst, uint64_t value, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        dst[i] = (char)(value >> (8 * i));
+    }
+}
+
+static inline uint64_t codec_load_le(const char *src, int n)
+{
+    uint64_t value = 0;
+
+    for (int i = 0; i < n; ++i) {
+        value |= (uint64_t)(uint8_t)src[i] << (8 * i);
+    }
+
+    return value;
+}
+
+static inline uint64_t codec_zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t codec_unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+
+#endif
@@ -0,0 +1,1240 @@
+/*
+Copyright (C) 2020-2026  Bryant Moscon - bmoscon@gmail.com
+
+Please see the LICENSE file for the terms and conditions
+associated with this software.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "history.h"
+#include "ticks.h"
+#include "utils.h"
+
+
+static PyTypeObject *history_book_type;
+
+
+void History_set_book_type(PyTypeObject *type)
+{
+    history_book_type = type;
+}
+
+
+/* Scales */
+static int scales_init(HistoryScales *s, PyObject *tick, PyObject *size_tick)
+{
+    if (SortedDict_parse_tick(tick, &s->price_scale, &s->price_units, &s->price_box)) {
+        return -1;
+    }
+
+    if (SortedDict_parse_tick(size_tick, &s->size_scale, &s->size_units, &s->size_box)) {
+        Py_CLEAR(s->price_box);
+        return -1;
+    }
+
+    s->tick = Py_NewRef(tick);
+    s->size_tick = Py_NewRef(size_tick);
+    return 0;
+}
+
+
+static void scales_release(HistoryScales *s)
+{
+    Py_CLEAR(s->tick);
+    Py_CLEAR(s->size_tick);
+    Py_CLEAR(s->price_box);
+    Py_CLEAR(s->size_box);
+}
+
+
+// a number as a count of ticks of 10^-scale units each
+// ret 0 - success, 1 - not a whole number of ticks, -1 - exception
+static int to_ticks(PyObject *obj, int scale, int64_t units, int64_t *out)
+{
+    int64_t value;
+
+    int ret = SortedDict_fixed_units(obj, scale, &value);
+    if (ret) {
+        return ret;
+    }
+
+    if (value % units || value / units == INT64_MIN) {
+        return 1;
+    }
+
+    *out = value / units;
+    return 0;
+}
+
+
+/* Sides */
+static int side_reserve(HistorySide *side, Py_ssize_t n)
+{
+    if (n <= side->cap) {
+        return 0;
+    }
+
+    Py_ssize_t cap = side->cap ? side->cap : 64;
+    while (cap < n) {
+        cap *= 2;
+    }
+
+    int64_t *ticks = PyMem_Realloc(side->ticks, cap * sizeof(int64_t));
+    if (EXPECT(!ticks, 0)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    side->ticks = ticks;
+
+    int64_t *sizes = PyMem_Realloc(side->sizes, cap * sizeof(int64_t));
+    if (EXPECT(!sizes, 0)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    side->sizes = sizes;
+
+    side->cap = cap;
+    return 0;
+}
+
+
+static void side_release(HistorySide *side)
+{
+    PyMem_Free(side->ticks);
+    PyMem_Free(side->sizes);
+    memset(side, 0, sizeof(HistorySide));
+}
+
+
+// room to merge both sides of an update. the merges rotate buffers between the sides and
+// scratch, so every one of them has to fit either side
+static int merge_reserve(HistorySide *held, const HistorySide *update, HistorySide *scratch)
+{
+    Py_ssize_t room = Py_MAX(held[0].len + update[0].len, held[1].len + update[1].len);
+
+    return side_reserve(&held[0], room) || side_reserve(&held[1], room) || side_reserve(scratch, room);
+}
+
+
+// fold an update into the levels held, a size of 0 deleting its level. reserved with
+// merge_reserve first this cannot fail. held and scratch trade buffers
+static void side_merge(HistorySide *held, const HistorySide *update, HistorySide *scratch)
+{
+    Py_ssize_t i = 0, j = 0, n = 0;
+
+    while (i < held->len || j < update->len) {
+        if (j == update->len || (i < held->len && held->ticks[i] < update->ticks[j])) {
+            scratch->ticks[n] = held->ticks[i];
+            scratch->sizes[n++] = held->sizes[i++];
+            continue;
+        }
+
+        if (i < held->len && held->ticks[i] == update->ticks[j]) {
+            ++i;
+        }
+
+        if (update->sizes[j]) {
+            scratch->ticks[n] = update->ticks[j];
+            scratch->sizes[n++] = update->sizes[j];
+        }
+        ++j;
+    }
+    scratch->len = n;
+
+    HistorySide swap = *held;
+    *held = *scratch;
+    *scratch = swap;
+}
+
+
+typedef struct {
+    int64_t tick;
+    int64_t size;
+    Py_ssize_t order;
+} HistoryLevel;
+
+
+static int level_cmp(const void *a, const void *b)
+{
+    const HistoryLevel *x = a;
+    const HistoryLevel *y = b;
+
+    if (x->tick != y->tick) {
+        return (x->tick < y->tick) ? -1 : 1;
+    }
+
+    return (x->order < y->order) ? -1 : (x->order > y->order);
+}
+
+
+// one level of an update, a (price, size) pair
+static int collect_level(const HistoryScales *s, PyObject *pair, HistoryLevel *level)
+{
+    PyObject *fast = PySequence_Fast(pair, "levels must be (price, size) pairs");
+    if (!fast) {
+        return -1;
+    }
+
+    int ret = -1;
+    if (PySequence_Fast_GET_SIZE(fast) != 2) {
+        PyErr_SetString(PyExc_ValueError, "levels must be (price, size) pairs");
+        goto done;
+    }
+
+    PyObject *price = PySequence_Fast_GET_ITEM(fast, 0);
+    PyObject *size = PySequence_Fast_GET_ITEM(fast, 1);
+
+    int failed = to_ticks(price, s->price_scale, s->price_units, &level->tick);
+    if (failed) {
+        if (failed > 0) {
+            PyErr_Format(PyExc_ValueError, "price %R is not a multiple of the tick", price);
+        }
+        goto done;
+    }
+
+    failed = to_ticks(size, s->size_scale, s->size_units, &level->size);
+    if (failed) {
+        if (failed > 0) {
+            PyErr_Format(PyExc_ValueError, "size %R is not a multiple of the size tick", size);
+        }
+        goto done;
+    }
+
+    if (level->size < 0) {
+        PyErr_Format(PyExc_ValueError, "size %R is negative", size);
+        goto done;
+    }
+
+    ret = 0;
+
+done:
+    Py_DECREF(fast);
+    return ret;
+}
+
+
+// the levels of one side of an update, a dict or (price, size) pairs, sorted by price
+// with the last of any duplicates kept
+static int collect_levels(const HistoryScales *s, PyObject *levels, HistorySide *out)
+{
+    out->len = 0;
+    if (!levels || levels == Py_None) {
+        return 0;
+    }
+
+    PyObject *items = PyDict_Check(levels) ? PyDict_Items(levels) : PySequence_Fast(levels, "levels must be a dict or a sequence of (price, size) pairs");
+    if (!items) {
+        return -1;
+    }
+
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(items);
+    HistoryLevel *parsed = PyMem_New(HistoryLevel, n > 0 ? n : 1);
+    int ret = -1;
+
+    if (EXPECT(!parsed, 0)) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    bool sorted = true;
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        if (collect_level(s, PySequence_Fast_GET_ITEM(items, i), &parsed[i])) {
+            goto done;
+        }
+
+        parsed[i].order = i;
+        sorted = sorted && (i == 0 || parsed[i - 1].tick < parsed[i].tick);
+    }
+
+    // feeds mostly send levels in price order already
+    if (!sorted) {
+        qsort(parsed, n, sizeof(HistoryLevel), level_cmp);
+    }
+
+    if (side_reserve(out, n)) {
+        goto done;
+    }
+
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        if (i + 1 < n && parsed[i + 1].tick == parsed[i].tick) {
+            continue;
+        }
+
+        out->ticks[out->len] = parsed[i].tick;
+        out->sizes[out->len++] = parsed[i].size;
+    }
+
+    ret = 0;
+
+done:
+    PyMem_Free(parsed);
+    Py_DECREF(items);
+    return ret;
+}
+
+
+/* Encoding */
+static int encode_side(CodecWriter *w, const HistorySide *side)
+{
+    if (codec_put_varint(w, (uint64_t)side->len)) {
+        return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < side->len; ++i) {
+        // ticks strictly increase, so the gap always fits unsigned
+        uint64_t value = i ? (uint64_t)side->ticks[i] - (uint64_t)side->ticks[i - 1] : codec_zigzag(side->ticks[0]);
+        if (codec_put_varint(w, value)) {
+            return -1;
+        }
+    }
+
+    for (Py_ssize_t i = 0; i < side->len; ++i) {
+        if (codec_put_varint(w, (uint64_t)side->sizes[i])) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int decode_side(const HistoryScales *s, CodecReader *r, HistorySide *side, bool keyframe)
+{
+    Py_ssize_t n;
+    int64_t tick = 0;
+    int64_t check;
+
+    if (codec_get_count(r, &n) || side_reserve(side, n)) {
+        return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        uint64_t value;
+        if (codec_get_varint(r, &value)) {
+            return -1;
+        }
+
+        int64_t previous = tick;
+        tick = i ? (int64_t)((uint64_t)previous + value) : codec_unzigzag(value);
+
+        // ticks strictly increase, and have to box back into a price without overflow
+        if ((i && tick <= previous) || tick == INT64_MIN || __builtin_mul_overflow(tick, s->price_units, &check)) {
+            return codec_corrupt();
+        }
+        side->ticks[i] = tick;
+    }
+
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        uint64_t value;
+        if (codec_get_varint(r, &value)) {
+            return -1;
+        }
+
+        if (value > INT64_MAX || (keyframe && !value) || __builtin_mul_overflow((int64_t)value, s->size_units, &check)) {
+            return codec_corrupt();
+        }
+        side->sizes[i] = (int64_t)value;
+    }
+
+    side->len = n;
+    return 0;
+}
+
+
+// frame a record body written after 'start' with its length and crc
+static int frame_record(CodecWriter *w, Py_ssize_t start)
+{
+    Py_ssize_t body = w->len - start - HISTORY_FRAME;
+
+    if (body > UINT32_MAX) {
+        w->len = start;
+        PyErr_SetString(PyExc_ValueError, "update is too large for a history record");
+        return -1;
+    }
+
+    codec_store_le(w->data + start, (uint64_t)body, 4);
+    codec_store_le(w->data + start + 4, crc32_orderbook((const uint8_t *)w->data + start + HISTORY_FRAME, body), 4);
+    return 0;
+}
+
+
+static int put_record(CodecWriter *w, uint8_t kind, uint64_t sequence, const HistorySide *sides)
+{
+    static const char frame[HISTORY_FRAME] = {0};
+    Py_ssize_t start = w->len;
+
+    if (codec_put(w, frame, HISTORY_FRAME) || codec_put_u8(w, kind) || codec_put_u64(w, sequence) || encode_side(w, &sides[0]) || encode_side(w, &sides[1])) {
+        w->len = start;
+        return -1;
+    }
+
+    return frame_record(w, start);
+}
+
+
+/* Writer */
+static int writer_check_open(const HistoryWriter *self)
+{
+    if (self->fd < 0) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on a closed history file");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int writer_flush(HistoryWriter *self)
+{
+    int failed;
+
+    if (!self->buffer.len) {
+        return 0;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    failed = codec_write_all(self->fd, self->buffer.data, self->buffer.len);
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, PyBytes_AS_STRING(self->path));
+        return -1;
+    }
+
+    self->buffer.len = 0;
+    return 0;
+}
+
+
+// flush and close, the levels held are released with it
+static int writer_close(HistoryWriter *self)
+{
+    if (self->fd < 0) {
+        return 0;
+    }
+
+    int failed = writer_flush(self);
+    int fd = self->fd;
+
+    self->fd = -1;
+    if (close(fd) && !failed) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, PyBytes_AS_STRING(self->path));
+        failed = -1;
+    }
+
+    codec_writer_release(&self->buffer);
+    for (int i = 0; i < 2; ++i) {
+        side_release(&self->held[i]);
+        side_release(&self->update[i]);
+    }
+    side_release(&self->scratch);
+
+    return failed ? -1 : 0;
+}
+
+
+static void HistoryWriter_dealloc(HistoryWriter *self)
+{
+    if (writer_close(self)) {
+        PyErr_WriteUnraisable((PyObject *)self);
+    }
+
+    scales_release(&self->scales);
+    Py_XDECREF(self->path);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+
+static PyObject *HistoryWriter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    HistoryWriter *self = (HistoryWriter *)type->tp_alloc(type, 0);
+
+    if (self) {
+        self->fd = -1;
+    }
+
+    return (PyObject *)self;
+}
+
+
+static int HistoryWriter_init(HistoryWriter *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"path", "tick", "size_tick", "keyframe_interval", NULL};
+    PyObject *path = NULL;
+    PyObject *tick = NULL;
+    PyObject *size_tick = NULL;
+    Py_ssize_t interval = HISTORY_DEFAULT_KEYFRAMES;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&OO|n", kwlist, PyUnicode_FSConverter, &path, &tick, &size_tick, &interval)) {
+        return -1;
+    }
+
+    if (self->fd >= 0 || self->path) {
+        Py_DECREF(path);
+        PyErr_SetString(PyExc_TypeError, "HistoryWriter is already initialized");
+        return -1;
+    }
+
+    if (interval < 0) {
+        Py_DECREF(path);
+        PyErr_SetString(PyExc_ValueError, "keyframe_interval must be 0 or more");
+        return -1;
+    }
+
+    self->path = path;
+    if (scales_init(&self->scales, tick, size_tick)) {
+        return -1;
+    }
+
+    // the first record holds the ticks the rest are counted in
+    CodecWriter *w = &self->buffer;
+    static const char frame[HISTORY_FRAME] = {0};
+    if (codec_put(w, HISTORY_MAGIC, CODEC_MAGIC_LEN) || codec_put(w, frame, HISTORY_FRAME) || codec_put_value(w, tick) || codec_put_value(w, size_tick) || frame_record(w, CODEC_MAGIC_LEN)) {
+        return -1;
+    }
+
+    int fd;
+    Py_BEGIN_ALLOW_THREADS
+    fd = open(PyBytes_AS_STRING(path), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    Py_END_ALLOW_THREADS
+
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, PyBytes_AS_STRING(path));
+        return -1;
+    }
+
+    self->fd = fd;
+    self->keyframe_interval = interval;
+    return 0;
+}
+
+
+static PyObject *HistoryWriter_append(HistoryWriter *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"sequence", "bids", "asks", NULL};
+    PyObject *sequence_arg = NULL;
+    PyObject *bids = NULL;
+    PyObject *asks = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!|OO", kwlist, &PyLong_Type, &sequence_arg, &bids, &asks)) {
+        return NULL;
+    }
+
+    if (writer_check_open(self)) {
+        return NULL;
+    }
+
+    uint64_t sequence = PyLong_AsUnsignedLongLong(sequence_arg);
+    if (sequence == (uint64_t)-1 && PyErr_Occurred()) {
+        return NULL;
+    }
+
+    if (self->started && sequence <= self->sequence) {
+        PyErr_Format(PyExc_ValueError, "sequence %llu does not follow %llu", (unsigned long long)sequence, (unsigned long long)self->sequence);
+        return NULL;
+    }
+
+    // everything that can fail does so before the levels held change
+    if (collect_levels(&self->scales, bids, &self->update[0]) || collect_levels(&self->scales, asks, &self->update[1])) {
+        return NULL;
+    }
+
+    if (merge_reserve(self->held, self->update, &self->scratch) || put_record(&self->buffer, HISTORY_UPDATE, sequence, self->update)) {
+        return NULL;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        side_merge(&self->held[i], &self->update[i], &self->scratch);
+    }
+    self->sequence = sequence;
+    self->started = true;
+
+    // a keyframe that cannot be written is retried on the next append, readers only need them to skip ahead.
+    // the update is already recorded, so the failure is not raised
+    if (self->keyframe_interval && ++self->since_keyframe >= self->keyframe_interval) {
+        if (put_record(&self->buffer, HISTORY_KEYFRAME, sequence, self->held)) {
+            PyErr_Clear();
+        } else {
+            self->since_keyframe = 0;
+        }
+    }
+
+    if (self->buffer.len >= HISTORY_FLUSH_SIZE && writer_flush(self)) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *HistoryWriter_flush(HistoryWriter *self, PyObject *Py_UNUSED(ignored))
+{
+    if (writer_check_open(self) || writer_flush(self)) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *HistoryWriter_close(HistoryWriter *self, PyObject *Py_UNUSED(ignored))
+{
+    if (writer_close(self)) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *HistoryWriter_enter(HistoryWriter *self, PyObject *Py_UNUSED(ignored))
+{
+    if (writer_check_open(self)) {
+        return NULL;
+    }
+
+    return Py_NewRef(self);
+}
+
+
+static PyObject *HistoryWriter_exit(HistoryWriter *self, PyObject *Py_UNUSED(args))
+{
+    if (writer_close(self)) {
+        return NULL;
+    }
+
+    Py_RETURN_FALSE;
+}
+
+
+static PyObject *HistoryWriter_get_sequence(HistoryWriter *self, void *Py_UNUSED(closure))
+{
+    return self->started ? PyLong_FromUnsignedLongLong(self->sequence) : Py_NewRef(Py_None);
+}
+
+
+static PyObject *HistoryWriter_get_closed(HistoryWriter *self, void *Py_UNUSED(closure))
+{
+    return PyBool_FromLong(self->fd < 0);
+}
+
+
+static PyMethodDef HistoryWriter_methods[] = {
+    {"append", (PyCFunction) HistoryWriter_append, METH_VARARGS | METH_KEYWORDS, "append(sequence, bids=None, asks=None): record the levels that changed at a sequence, size 0 deleting a level"},
+    {"flush", (PyCFunction) HistoryWriter_flush, METH_NOARGS, "write out the buffered records"},
+    {"close", (PyCFunction) HistoryWriter_close, METH_NOARGS, "flush and close the file"},
+    {"__enter__", (PyCFunction) HistoryWriter_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) HistoryWriter_exit, METH_VARARGS, NULL},
+    {NULL}
+};
+
+
+static PyGetSetDef HistoryWriter_getset[] = {
+    {"sequence", (getter) HistoryWriter_get_sequence, NULL, "the last sequence appended, None before the first", NULL},
+    {"closed", (getter) HistoryWriter_get_closed, NULL, "True once the file is closed", NULL},
+    {NULL}
+};
+
+
+static PyMemberDef HistoryWriter_members[] = {
+    {"tick", T_OBJECT_EX, offsetof(HistoryWriter, scales.tick), READONLY, "price tick"},
+    {"size_tick", T_OBJECT_EX, offsetof(HistoryWriter, scales.size_tick), READONLY, "size tick"},
+    {"keyframe_interval", T_PYSSIZET, offsetof(HistoryWriter, keyframe_interval), READONLY, "updates between keyframes, 0 for none"},
+    {NULL}
+};
+
+
+PyTypeObject HistoryWriterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "order_book.HistoryWriter",
+    .tp_doc = "HistoryWriter(path, tick, size_tick, keyframe_interval=1000): write a columnar history of book updates",
+    .tp_basicsize = sizeof(HistoryWriter),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = HistoryWriter_new,
+    .tp_init = (initproc) HistoryWriter_init,
+    .tp_dealloc = (destructor) HistoryWriter_dealloc,
+    .tp_methods = HistoryWriter_methods,
+    .tp_members = HistoryWriter_members,
+    .tp_getset = HistoryWriter_getset,
+};
+
+
+/* Reader */
+static int reader_check_open(const HistoryReader *self)
+{
+    if (!self->records) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on a closed history file");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void reader_close(HistoryReader *self)
+{
+    if (self->map) {
+        munmap(self->map, self->size);
+        self->map = NULL;
+    }
+
+    PyMem_Free(self->records);
+    self->records = NULL;
+    self->count = 0;
+    self->updates = 0;
+
+    for (int i = 0; i < 2; ++i) {
+        side_release(&self->held[i]);
+        side_release(&self->update[i]);
+    }
+    side_release(&self->scratch);
+}
+
+
+static void HistoryReader_dealloc(HistoryReader *self)
+{
+    reader_close(self);
+    scales_release(&self->scales);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+
+// a record body as a reader, its crc checked the first time it is read
+static int record_reader(HistoryReader *self, HistoryRecord *record, CodecReader *r)
+{
+    const char *body = (const char *)self->map + record->offset;
+
+    if (!record->checked) {
+        uint32_t crc = (uint32_t)codec_load_le(body - 4, 4);
+        if (crc32_orderbook((const uint8_t *)body, record->len) != crc) {
+            PyErr_SetString(PyExc_ValueError, "history record failed its integrity check");
+            return -1;
+        }
+        record->checked = true;
+    }
+
+    r->data = body;
+    r->len = record->len;
+    r->pos = 0;
+    return 0;
+}
+
+
+static int read_record(HistoryReader *self, HistoryRecord *record, HistorySide *sides)
+{
+    CodecReader r;
+    uint8_t kind;
+    uint64_t sequence;
+
+    if (record_reader(self, record, &r) || codec_get_u8(&r, &kind) || codec_get_u64(&r, &sequence)) {
+        return -1;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (decode_side(&self->scales, &r, &sides[i], kind == HISTORY_KEYFRAME)) {
+            return -1;
+        }
+    }
+
+    return codec_finish(&r);
+}
+
+
+// walk the records once, keeping where each starts with its kind and sequence. a record
+// cut short at the end is a write still in progress and is left out
+static int reader_index(HistoryReader *self, Py_ssize_t pos)
+{
+    const char *data = self->map;
+    Py_ssize_t size = (Py_ssize_t)self->size;
+    Py_ssize_t cap = 0;
+    bool any = false;
+    uint64_t last = 0;
+
+    while (size - pos >= HISTORY_FRAME) {
+        uint32_t len = (uint32_t)codec_load_le(data + pos, 4);
+        if (len > size - pos - HISTORY_FRAME) {
+            break;
+        }
+
+        if (len < 9) {
+            return codec_corrupt();
+        }
+
+        uint8_t kind = (uint8_t)data[pos + HISTORY_FRAME];
+        uint64_t sequence = codec_load_le(data + pos + HISTORY_FRAME + 1, 8);
+
+        // updates strictly increase, a keyframe repeats the update it follows
+        bool valid = (kind == HISTORY_UPDATE) ? (!any || sequence > last) : (kind == HISTORY_KEYFRAME && any && sequence == last);
+        if (!valid) {
+            return codec_corrupt();
+        }
+
+        if (self->count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            HistoryRecord *records = PyMem_Realloc(self->records, cap * sizeof(HistoryRecord));
+            if (EXPECT(!records, 0)) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            self->records = records;
+        }
+
+        self->records[self->count++] = (HistoryRecord) {
+            .offset = pos + HISTORY_FRAME,
+            .len = len,
+            .kind = kind,
+            .checked = false,
+            .sequence = sequence,
+        };
+
+        self->updates += (kind == HISTORY_UPDATE);
+        any = true;
+        last = sequence;
+        pos += HISTORY_FRAME + len;
+    }
+
+    // a closed reader has no index, an open one always has one
+    if (!self->records) {
+        self->records = PyMem_Malloc(sizeof(HistoryRecord));
+        if (EXPECT(!self->records, 0)) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int HistoryReader_init(HistoryReader *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"path", NULL};
+    PyObject *path = NULL;
+    struct stat st;
+    void *map = MAP_FAILED;
+    int failed;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&", kwlist, PyUnicode_FSConverter, &path)) {
+        return -1;
+    }
+
+    if (self->records) {
+        Py_DECREF(path);
+        PyErr_SetString(PyExc_TypeError, "HistoryReader is already initialized");
+        return -1;
+    }
+
+    const char *name = PyBytes_AS_STRING(path);
+
+    Py_BEGIN_ALLOW_THREADS
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    failed = fd < 0 || fstat(fd, &st);
+    if (!failed && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        failed = map == MAP_FAILED;
+    }
+    if (fd >= 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, name);
+        Py_DECREF(path);
+        return -1;
+    }
+    Py_DECREF(path);
+
+    if (map != MAP_FAILED) {
+        self->map = map;
+        self->size = (size_t)st.st_size;
+    }
+
+    const char *data = self->map;
+    if (self->size < CODEC_MAGIC_LEN + HISTORY_FRAME || memcmp(data, HISTORY_MAGIC, CODEC_MAGIC_LEN)) {
+        PyErr_SetString(PyExc_ValueError, "not a book history, or from an unsupported version");
+        reader_close(self);
+        return -1;
+    }
+
+    HistoryRecord header = {
+        .offset = CODEC_MAGIC_LEN + HISTORY_FRAME,
+        .len = (uint32_t)codec_load_le(data + CODEC_MAGIC_LEN, 4),
+    };
+    if (header.len > self->size - CODEC_MAGIC_LEN - HISTORY_FRAME) {
+        reader_close(self);
+        return codec_corrupt();
+    }
+
+    CodecReader r;
+    PyObject *tick = NULL;
+    PyObject *size_tick = NULL;
+
+    failed = record_reader(self, &header, &r) || !(tick = codec_get_value(&r)) || !(size_tick = codec_get_value(&r)) || codec_finish(&r) || scales_init(&self->scales, tick, size_tick) || reader_index(self, header.offset + header.len);
+
+    Py_XDECREF(tick);
+    Py_XDECREF(size_tick);
+
+    if (failed) {
+        reader_close(self);
+        scales_release(&self->scales);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// records up to and including the last at or before 'sequence'
+static Py_ssize_t records_until(const HistoryReader *self, uint64_t sequence)
+{
+    Py_ssize_t lo = 0, hi = self->count;
+
+    while (lo < hi) {
+        Py_ssize_t mid = lo + (hi - lo) / 2;
+        if (self->records[mid].sequence <= sequence) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+
+// a sequence argument, ret 1 when it is negative and so before any record
+static int get_sequence(PyObject *obj, uint64_t *out)
+{
+    if (!PyLong_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "sequence must be an int");
+        return -1;
+    }
+
+    int overflow;
+    long long value = PyLong_AsLongLongAndOverflow(obj, &overflow);
+    if (value == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+
+    if (overflow < 0 || (!overflow && value < 0)) {
+        *out = 0;
+        return 1;
+    }
+
+    // past the last sequence a file could hold reads as the last one
+    *out = overflow ? PyLong_AsUnsignedLongLong(obj) : (uint64_t)value;
+    if (*out == (uint64_t)-1 && PyErr_Occurred()) {
+        PyErr_Clear();
+        *out = UINT64_MAX;
+    }
+
+    return 0;
+}
+
+
+// the levels of one side boxed into a book's side, already in price order
+static int install_side(const HistoryReader *self, PyObject *book, const char *name, const HistorySide *side)
+{
+    const HistoryScales *s = &self->scales;
+    PyObject *dict = PyObject_GetAttrString(book, name);
+    PyObject **values = PyMem_New(PyObject *, side->len > 0 ? side->len : 1);
+    Py_ssize_t boxed = 0;
+    int ret = -1;
+
+    if (EXPECT(!dict || !values, 0)) {
+        if (!values) {
+            PyErr_NoMemory();
+        }
+        goto done;
+    }
+
+    for (; boxed < side->len; ++boxed) {
+        // cannot overflow, sizes were range checked when decoded
+        values[boxed] = SortedDict_box_units(s->size_box, side->sizes[boxed] * s->size_units, s->size_scale);
+        if (EXPECT(!values[boxed], 0)) {
+            goto done;
+        }
+    }
+
+    ret = SortedDict_load_ticks(dict, side->ticks, values, side->len);
+
+done:
+    for (Py_ssize_t i = 0; i < boxed; ++i) {
+        Py_DECREF(values[i]);
+    }
+    PyMem_Free(values);
+    Py_XDECREF(dict);
+    return ret;
+}
+
+
+static PyObject *HistoryReader_book_at(HistoryReader *self, PyObject *arg)
+{
+    uint64_t sequence;
+
+    if (reader_check_open(self)) {
+        return NULL;
+    }
+
+    int before = get_sequence(arg, &sequence);
+    if (before < 0) {
+        return NULL;
+    }
+
+    Py_ssize_t end = before ? 0 : records_until(self, sequence);
+    if (!end) {
+        PyErr_Format(PyExc_ValueError, "history has no book at sequence %R", arg);
+        return NULL;
+    }
+
+    // the book starts from the last keyframe before it, or from the start of the file
+    Py_ssize_t start = end;
+    while (start > 0 && self->records[start - 1].kind != HISTORY_KEYFRAME) {
+        --start;
+    }
+
+    if (start > 0) {
+        if (read_record(self, &self->records[start - 1], self->held)) {
+            return NULL;
+        }
+    } else {
+        self->held[0].len = 0;
+        self->held[1].len = 0;
+    }
+
+    for (Py_ssize_t i = start; i < end; ++i) {
+        if (self->records[i].kind != HISTORY_UPDATE) {
+            continue;
+        }
+
+        if (read_record(self, &self->records[i], self->update)) {
+            return NULL;
+        }
+
+        if (merge_reserve(self->held, self->update, &self->scratch)) {
+            return NULL;
+        }
+
+        for (int side = 0; side < 2; ++side) {
+            side_merge(&self->held[side], &self->update[side], &self->scratch);
+        }
+    }
+
+    PyObject *kwargs = Py_BuildValue("{s:s,s:O}", "key_type", "fixed", "tick", self->scales.tick);
+    if (!kwargs) {
+        return NULL;
+    }
+
+    PyObject *empty = PyTuple_New(0);
+    PyObject *book = empty ? PyObject_Call((PyObject *)history_book_type, empty, kwargs) : NULL;
+    Py_XDECREF(empty);
+    Py_DECREF(kwargs);
+
+    if (book && (install_side(self, book, "bids", &self->held[0]) || install_side(self, book, "asks", &self->held[1]))) {
+        Py_CLEAR(book);
+    }
+
+    return book;
+}
+
+
+// bids list best first, as a feed sends them
+static PyObject *levels_list(const HistoryReader *self, const HistorySide *side, bool descending)
+{
+    const HistoryScales *s = &self->scales;
+    PyObject *ret = PyList_New(side->len);
+
+    if (!ret) {
+        return NULL;
+    }
+
+    for (Py_ssize_t i = 0; i < side->len; ++i) {
+        PyObject *price = SortedDict_box_units(s->price_box, side->ticks[i] * s->price_units, s->price_scale);
+        PyObject *size = price ? SortedDict_box_units(s->size_box, side->sizes[i] * s->size_units, s->size_scale) : NULL;
+        PyObject *pair = size ? PyTuple_Pack(2, price, size) : NULL;
+
+        Py_XDECREF(price);
+        Py_XDECREF(size);
+        if (!pair) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+
+        PyList_SET_ITEM(ret, descending ? side->len - 1 - i : i, pair);
+    }
+
+    return ret;
+}
+
+
+static PyObject *HistoryReader_read(HistoryReader *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"start", "stop", NULL};
+    PyObject *start_arg = Py_None;
+    PyObject *stop_arg = Py_None;
+    uint64_t start = 0;
+    uint64_t stop = UINT64_MAX;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO", kwlist, &start_arg, &stop_arg)) {
+        return NULL;
+    }
+
+    if (reader_check_open(self)) {
+        return NULL;
+    }
+
+    if (start_arg != Py_None && get_sequence(start_arg, &start) < 0) {
+        return NULL;
+    }
+
+    Py_ssize_t first = 0;
+    Py_ssize_t end = self->count;
+    if (stop_arg != Py_None) {
+        int before = get_sequence(stop_arg, &stop);
+        if (before < 0) {
+            return NULL;
+        }
+        end = before ? 0 : records_until(self, stop);
+    }
+    if (start) {
+        first = records_until(self, start - 1);
+    }
+
+    PyObject *ret = PyList_New(0);
+    if (!ret) {
+        return NULL;
+    }
+
+    for (Py_ssize_t i = first; i < end; ++i) {
+        HistoryRecord *record = &self->records[i];
+        if (record->kind != HISTORY_UPDATE) {
+            continue;
+        }
+
+        if (read_record(self, record, self->update)) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+
+        PyObject *bids = levels_list(self, &self->update[0], true);
+        PyObject *asks = bids ? levels_list(self, &self->update[1], false) : NULL;
+        PyObject *entry = asks ? Py_BuildValue("(KOO)", (unsigned long long)record->sequence, bids, asks) : NULL;
+
+        Py_XDECREF(bids);
+        Py_XDECREF(asks);
+        if (!entry || PyList_Append(ret, entry)) {
+            Py_XDECREF(entry);
+            Py_DECREF(ret);
+            return NULL;
+        }
+        Py_DECREF(entry);
+    }
+
+    return ret;
+}
+
+
+static PyObject *HistoryReader_close(HistoryReader *self, PyObject *Py_UNUSED(ignored))
+{
+    reader_close(self);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *HistoryReader_enter(HistoryReader *self, PyObject *Py_UNUSED(ignored))
+{
+    if (reader_check_open(self)) {
+        return NULL;
+    }
+
+    return Py_NewRef(self);
+}
+
+
+static PyObject *HistoryReader_exit(HistoryReader *self, PyObject *Py_UNUSED(args))
+{
+    reader_close(self);
+    Py_RETURN_FALSE;
+}
+
+
+static Py_ssize_t HistoryReader_len(HistoryReader *self)
+{
+    return self->updates;
+}
+
+
+static PyObject *sequence_of(const HistoryReader *self, bool last)
+{
+    if (!self->count) {
+        Py_RETURN_NONE;
+    }
+
+    return PyLong_FromUnsignedLongLong(self->records[last ? self->count - 1 : 0].sequence);
+}
+
+
+static PyObject *HistoryReader_get_first(HistoryReader *self, void *Py_UNUSED(closure))
+{
+    return sequence_of(self, false);
+}
+
+
+static PyObject *HistoryReader_get_last(HistoryReader *self, void *Py_UNUSED(closure))
+{
+    return sequence_of(self, true);
+}
+
+
+static PyMethodDef HistoryReader_methods[] = {
+    {"book_at", (PyCFunction) HistoryReader_book_at, METH_O, "book_at(sequence): the book as it stood after the last update at or before a sequence"},
+    {"read", (PyCFunction) HistoryReader_read, METH_VARARGS | METH_KEYWORDS, "read(start=None, stop=None): the updates between two sequences, inclusive, as (sequence, bids, asks)"},
+    {"close", (PyCFunction) HistoryReader_close, METH_NOARGS, "unmap the file"},
+    {"__enter__", (PyCFunction) HistoryReader_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) HistoryReader_exit, METH_VARARGS, NULL},
+    {NULL}
+};
+
+
+static PyGetSetDef HistoryReader_getset[] = {
+    {"first", (getter) HistoryReader_get_first, NULL, "the first sequence in the file, None when it has no updates", NULL},
+    {"last", (getter) HistoryReader_get_last, NULL, "the last sequence in the file, None when it has no updates", NULL},
+    {NULL}
+};
+
+
+static PyMemberDef HistoryReader_members[] = {
+    {"tick", T_OBJECT_EX, offsetof(HistoryReader, scales.tick), READONLY, "price tick"},
+    {"size_tick", T_OBJECT_EX, offsetof(HistoryReader, scales.size_tick), READONLY, "size tick"},
+    {NULL}
+};
+
+
+static PySequenceMethods HistoryReader_seq = {
+    .sq_length = (lenfunc) HistoryReader_len,
+};
+
+
+PyTypeObject HistoryReaderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "order_book.HistoryReader",
+    .tp_doc = "HistoryReader(path): rebuild books from a history file at any sequence",
+    .tp_basicsize = sizeof(HistoryReader),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) HistoryReader_init,
+    .tp_dealloc = (destructor) HistoryReader_dealloc,
+    .tp_methods = HistoryReader_methods,
+    .tp_members = HistoryReader_members,
+    .tp_getset = HistoryReader_getset,
+    .tp_as_sequence = &HistoryReader_seq,
+};
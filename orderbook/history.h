@@ -0,0 +1,110 @@
+/*
+Copyright (C) 2020-2026  Bryant Moscon - bmoscon@gmail.com
+
+Please see the LICENSE file for the terms and conditions
+associated with this software.
+*/
+#ifndef __HISTORY__
+#define __HISTORY__
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PY_SSIZE_T_CLEAN
+#include "Python.h"
+#include "structmember.h"
+#include "codec.h"
+
+
+/*
+columnar history of a fixed tick book. a file is the magic and then framed records, each
+a u32 body length, a u32 crc32 of the body and the body. the first record holds the price
+and size ticks. every other one is a kind byte, the sequence, and for bids then asks a
+level count, a column of prices as tick counts (the first zigzag encoded, then the gap to
+the one before) and a column of sizes as counts of the size tick, 0 deleting the level.
+an update record holds the levels that changed, a keyframe the whole book after the update
+at its sequence. the book at any sequence is the last keyframe before it with the updates
+after that applied, or the updates from the start of the file when there is none
+*/
+#define HISTORY_MAGIC "OBH\x01"
+#define HISTORY_FRAME 8
+#define HISTORY_FLUSH_SIZE (1 << 16)
+#define HISTORY_DEFAULT_KEYFRAMES 1000
+
+
+enum HistoryKind {
+    HISTORY_UPDATE,
+    HISTORY_KEYFRAME
+};
+
+
+// prices and sizes as counts of their ticks, and the python types they box back to
+typedef struct {
+    PyObject *tick;
+    PyObject *size_tick;
+    PyObject *price_box;
+    PyObject *size_box;
+    int64_t price_units;
+    int64_t size_units;
+    int price_scale;
+    int size_scale;
+} HistoryScales;
+
+
+// the levels of one side, ascending by price tick
+typedef struct {
+    int64_t *ticks;
+    int64_t *sizes;
+    Py_ssize_t len;
+    Py_ssize_t cap;
+} HistorySide;
+
+
+typedef struct {
+    PyObject_HEAD
+    HistoryScales scales;
+    HistorySide held[2];        // the book after the last append, kept for keyframes
+    HistorySide update[2];
+    HistorySide scratch;
+    CodecWriter buffer;         // records not yet written out
+    PyObject *path;             // filesystem encoded bytes
+    int fd;                     // -1 once closed
+    uint64_t sequence;
+    Py_ssize_t keyframe_interval;
+    Py_ssize_t since_keyframe;
+    bool started;
+} HistoryWriter;
+
+
+typedef struct {
+    Py_ssize_t offset;          // of the body
+    uint32_t len;
+    uint8_t kind;
+    bool checked;               // crc verified, done on first decode
+    uint64_t sequence;
+} HistoryRecord;
+
+
+typedef struct {
+    PyObject_HEAD
+    HistoryScales scales;
+    HistorySide held[2];
+    HistorySide update[2];
+    HistorySide scratch;
+    void *map;
+    size_t size;
+    HistoryRecord *records;
+    Py_ssize_t count;
+    Py_ssize_t updates;
+} HistoryReader;
+
+
+extern PyTypeObject HistoryWriterType;
+extern PyTypeObject HistoryReaderType;
+
+// the book type readers build, set once at module init
+void History_set_book_type(PyTypeObject *type);
+
+
+#endif
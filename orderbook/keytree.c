@@ -0,0 +1,522 @@
+/*
+Copyright (C) 2020-2026  Bryant Moscon - bmoscon@gmail.com
+
+Please see the LICENSE file for the terms and conditions
+associated with this software.
+*/
+#include "keytree.h"
+#include "utils.h"
+
+
+/* fenwick index over leaf sizes */
+static void sizes_rebuild(KeyTree *tree)
+{
+    Py_ssize_t *sizes = tree->sizes;
+
+    for (Py_ssize_t i = 1; i <= tree->count; ++i) {
+        sizes[i] = tree->leaves[i - 1]->len;
+    }
+
+    for (Py_ssize_t i = 1; i <= tree->count; ++i) {
+        Py_ssize_t parent = i + (i & -i);
+        if (parent <= tree->count) {
+            sizes[parent] += sizes[i];
+        }
+    }
+}
+
+
+static void sizes_add(KeyTree *tree, Py_ssize_t leaf, Py_ssize_t delta)
+{
+    for (Py_ssize_t i = leaf + 1; i <= tree->count; i += i & -i) {
+        tree->sizes[i] += delta;
+    }
+}
+
+
+// number of keys held in the leaves before 'leaf'
+static Py_ssize_t sizes_prefix(const KeyTree *tree, Py_ssize_t leaf)
+{
+    Py_ssize_t sum = 0;
+
+    for (Py_ssize_t i = leaf; i > 0; i -= i & -i) {
+        sum += tree->sizes[i];
+    }
+
+    return sum;
+}
+
+
+// index a leaf just added at the end, in O(log n) rather than a rebuild
+static void sizes_append(KeyTree *tree)
+{
+    Py_ssize_t i = tree->count;
+
+    tree->sizes[i] = tree->leaves[i - 1]->len + sizes_prefix(tree, i - 1) - sizes_prefix(tree, i - (i & -i));
+}
+
+
+static int leaves_reserve(KeyTree *tree, Py_ssize_t need)
+{
+    if (need <= tree->cap) {
+        return 0;
+    }
+
+    Py_ssize_t cap = tree->cap ? tree->cap : 4;
+    while (cap < need) {
+        cap *= 2;
+    }
+
+    KeyLeaf **leaves = PyMem_Realloc(tree->leaves, cap * sizeof(KeyLeaf *));
+    if (EXPECT(!leaves, 0)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    tree->leaves = leaves;
+
+    Py_ssize_t *sizes = PyMem_Realloc(tree->sizes, (cap + 1) * sizeof(Py_ssize_t));
+    if (EXPECT(!sizes, 0)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    tree->sizes = sizes;
+    tree->cap = cap;
+
+    return 0;
+}
+
+
+// detach everything before dropping any key, finalizers can reenter
+void keytree_release(KeyTree *tree)
+{
+    KeyLeaf **leaves = tree->leaves;
+    Py_ssize_t count = tree->count;
+    Py_ssize_t *sizes = tree->sizes;
+
+    tree->leaves = NULL;
+    tree->sizes = NULL;
+    tree->count = 0;
+    tree->cap = 0;
+    tree->size = 0;
+
+    for (Py_ssize_t i = 0; i < count; ++i) {
+        for (Py_ssize_t j = 0; j < leaves[i]->len; ++j) {
+            Py_DECREF(leaves[i]->keys[j]);
+        }
+        PyMem_Free(leaves[i]);
+    }
+
+    PyMem_Free(leaves);
+    PyMem_Free(sizes);
+}
+
+
+// bulk build from an already sorted array of borrowed refs, replacing the contents
+int keytree_load(KeyTree *tree, PyObject *const *keys, Py_ssize_t n)
+{
+    KeyTree fresh = {0};
+    Py_ssize_t count = (n + KT_LEAF_FILL - 1) / KT_LEAF_FILL;
+
+    if (EXPECT(leaves_reserve(&fresh, count), 0)) {
+        keytree_release(&fresh);
+        return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < count; ++i) {
+        KeyLeaf *leaf = PyMem_Malloc(sizeof(KeyLeaf));
+        if (EXPECT(!leaf, 0)) {
+            keytree_release(&fresh);
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        Py_ssize_t start = i * KT_LEAF_FILL;
+        leaf->len = (n - start < KT_LEAF_FILL) ? n - start : KT_LEAF_FILL;
+        for (Py_ssize_t j = 0; j < leaf->len; ++j) {
+            leaf->keys[j] = Py_NewRef(keys[start + j]);
+        }
+
+        fresh.leaves[fresh.count++] = leaf;
+        fresh.size += leaf->len;
+    }
+
+    if (fresh.sizes) {
+        sizes_rebuild(&fresh);
+    }
+
+    KeyTree previous = *tree;
+    *tree = fresh;
+    keytree_release(&previous);
+
+    return 0;
+}
+
+
+// a private copy of src in dst, holding its own key refs. dst is overwritten, not released
+int keytree_clone(const KeyTree *src, KeyTree *dst)
+{
+    KeyTree fresh = {0};
+
+    if (EXPECT(leaves_reserve(&fresh, src->count), 0)) {
+        keytree_release(&fresh);
+        return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < src->count; ++i) {
+        KeyLeaf *leaf = PyMem_Malloc(sizeof(KeyLeaf));
+        if (EXPECT(!leaf, 0)) {
+            keytree_release(&fresh);
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        leaf->len = src->leaves[i]->len;
+        memcpy(leaf->keys, src->leaves[i]->keys, leaf->len * sizeof(PyObject *));
+        for (Py_ssize_t j = 0; j < leaf->len; ++j) {
+            Py_INCREF(leaf->keys[j]);
+        }
+
+        fresh.leaves[fresh.count++] = leaf;
+    }
+
+    if (fresh.count) {
+        memcpy(fresh.sizes, src->sizes, (src->count + 1) * sizeof(Py_ssize_t));
+    }
+    fresh.size = src->size;
+
+    *dst = fresh;
+    return 0;
+}
+
+
+// the leaf holding position 'index'. index == size resolves to the end of the last leaf
+KeyPos keytree_locate(const KeyTree *tree, Py_ssize_t index)
+{
+    KeyPos pos = {0, 0};
+
+    if (tree->count == 0) {
+        return pos;
+    }
+
+    if (index >= tree->size) {
+        pos.leaf = tree->count - 1;
+        pos.offset = tree->leaves[pos.leaf]->len;
+        return pos;
+    }
+
+    // the first leaf is the top of the book, kept current by every write, so the
+    // levels strategies read most resolve without walking the index
+    if (index < tree->leaves[0]->len) {
+        pos.offset = index;
+        return pos;
+    }
+
+    // descend the fenwick tree for the last leaf whose prefix does not pass index
+    Py_ssize_t step = 1;
+    while (step * 2 <= tree->count) {
+        step *= 2;
+    }
+
+    Py_ssize_t at = 0;
+    Py_ssize_t remaining = index;
+    for (; step; step >>= 1) {
+        if (at + step <= tree->count && tree->sizes[at + step] <= remaining) {
+            at += step;
+            remaining -= tree->sizes[at];
+        }
+    }
+
+    pos.leaf = at;
+    pos.offset = remaining;
+    return pos;
+}
+
+
+Py_ssize_t keytree_rank(const KeyTree *tree, KeyPos pos)
+{
+    return sizes_prefix(tree, pos.leaf) + pos.offset;
+}
+
+
+// borrowed ref to the key at 'index', which must be in range
+PyObject *keytree_at(const KeyTree *tree, Py_ssize_t index)
+{
+    KeyPos pos = keytree_locate(tree, index);
+    return tree->leaves[pos.leaf]->keys[pos.offset];
+}
+
+
+/*
+insertion point for key: the first position whose key is not before it under op
+(Py_LT ascending, Py_GT descending). every compare can reenter and reshape the
+tree, so the caller's version is checked after each one before a leaf is touched
+  ret >= 0 - rank of the position, pos filled in
+  ret -1   - exception
+  ret -2   - the book mutated mid-search
+*/
+Py_ssize_t keytree_bisect(const KeyTree *tree, PyObject *key, int op, const uint64_t *version, KeyPos *pos)
+{
+    uint64_t expected = *version;
+    Py_ssize_t lo = 0;
+    Py_ssize_t hi = tree->count;
+
+    if (hi == 0) {
+        *pos = keytree_locate(tree, 0);
+        return 0;
+    }
+
+    // a book grows mostly at its back after a reconnect or a deep refill, so the last
+    // key is tried first. past it the insert is an append at the cost of one compare
+    KeyLeaf *last = tree->leaves[hi - 1];
+    PyObject *tail = Py_NewRef(last->keys[last->len - 1]);
+    int append = PyObject_RichCompareBool(tail, key, op);
+    Py_DECREF(tail);
+
+    if (EXPECT(append < 0, 0)) {
+        return -1;
+    }
+
+    if (EXPECT(*version != expected, 0)) {
+        return -2;
+    }
+
+    if (append) {
+        *pos = keytree_locate(tree, tree->size);
+        return tree->size;
+    }
+    hi--;
+
+    // the leaf whose last key is not before key
+    while (lo < hi) {
+        Py_ssize_t mid = lo + ((hi - lo) >> 1);
+        KeyLeaf *leaf = tree->leaves[mid];
+        PyObject *probe = Py_NewRef(leaf->keys[leaf->len - 1]);
+        int before = PyObject_RichCompareBool(probe, key, op);
+        Py_DECREF(probe);
+
+        if (EXPECT(before < 0, 0)) {
+            return -1;
+        }
+
+        if (EXPECT(*version != expected, 0)) {
+            return -2;
+        }
+
+        if (before) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    Py_ssize_t leaf_index = lo;
+    lo = 0;
+    hi = tree->leaves[leaf_index]->len - 1;
+
+    // the last key already compared as not before, so it bounds the search
+    while (lo < hi) {
+        Py_ssize_t mid = lo + ((hi - lo) >> 1);
+        PyObject *probe = Py_NewRef(tree->leaves[leaf_index]->keys[mid]);
+        int before = PyObject_RichCompareBool(probe, key, op);
+        Py_DECREF(probe);
+
+        if (EXPECT(before < 0, 0)) {
+            return -1;
+        }
+
+        if (EXPECT(*version != expected, 0)) {
+            return -2;
+        }
+
+        if (before) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    pos->leaf = leaf_index;
+    pos->offset = lo;
+
+    return keytree_rank(tree, *pos);
+}
+
+
+// a fresh leaf at the end, for appends past a full last leaf. splitting it instead would
+// leave every leaf of a book grown at the back half full
+static int append_leaf(KeyTree *tree)
+{
+    if (EXPECT(leaves_reserve(tree, tree->count + 1), 0)) {
+        return -1;
+    }
+
+    KeyLeaf *leaf = PyMem_Malloc(sizeof(KeyLeaf));
+    if (EXPECT(!leaf, 0)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    leaf->len = 0;
+    tree->leaves[tree->count++] = leaf;
+    sizes_append(tree);
+
+    return 0;
+}
+
+
+static int split_leaf(KeyTree *tree, Py_ssize_t index)
+{
+    if (EXPECT(leaves_reserve(tree, tree->count + 1), 0)) {
+        return -1;
+    }
+
+    KeyLeaf *right = PyMem_Malloc(sizeof(KeyLeaf));
+    if (EXPECT(!right, 0)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    KeyLeaf *left = tree->leaves[index];
+    Py_ssize_t keep = left->len / 2;
+
+    right->len = left->len - keep;
+    memcpy(right->keys, left->keys + keep, right->len * sizeof(PyObject *));
+    left->len = keep;
+
+    memmove(tree->leaves + index + 2, tree->leaves + index + 1, (tree->count - index - 1) * sizeof(KeyLeaf *));
+    tree->leaves[index + 1] = right;
+    tree->count++;
+    sizes_rebuild(tree);
+
+    return 0;
+}
+
+
+// insert a new ref to key at pos, as returned by keytree_bisect or keytree_locate
+int keytree_insert(KeyTree *tree, KeyPos pos, PyObject *key)
+{
+    // an empty tree, or an append past a full last leaf, starts a new leaf
+    if (tree->count == 0 || (pos.leaf == tree->count - 1 && pos.offset == KT_LEAF_MAX)) {
+        if (EXPECT(append_leaf(tree), 0)) {
+            return -1;
+        }
+        pos.leaf = tree->count - 1;
+        pos.offset = 0;
+    } else if (tree->leaves[pos.leaf]->len == KT_LEAF_MAX) {
+        if (EXPECT(split_leaf(tree, pos.leaf), 0)) {
+            return -1;
+        }
+
+        Py_ssize_t keep = tree->leaves[pos.leaf]->len;
+        if (pos.offset > keep) {
+            pos.leaf++;
+            pos.offset -= keep;
+        }
+    }
+
+    KeyLeaf *leaf = tree->leaves[pos.leaf];
+    memmove(leaf->keys + pos.offset + 1, leaf->keys + pos.offset, (leaf->len - pos.offset) * sizeof(PyObject *));
+    leaf->keys[pos.offset] = Py_NewRef(key);
+    leaf->len++;
+    tree->size++;
+    sizes_add(tree, pos.leaf, 1);
+
+    return 0;
+}
+
+
+static void drop_leaf(KeyTree *tree, Py_ssize_t index)
+{
+    PyMem_Free(tree->leaves[index]);
+    memmove(tree->leaves + index, tree->leaves + index + 1, (tree->count - index - 1) * sizeof(KeyLeaf *));
+    tree->count--;
+}
+
+
+// unlink the key at pos and hand its reference to the caller
+PyObject *keytree_remove(KeyTree *tree, KeyPos pos)
+{
+    KeyLeaf *leaf = tree->leaves[pos.leaf];
+    PyObject *key = leaf->keys[pos.offset];
+
+    memmove(leaf->keys + pos.offset, leaf->keys + pos.offset + 1, (leaf->len - pos.offset - 1) * sizeof(PyObject *));
+    leaf->len--;
+    tree->size--;
+
+    if (leaf->len == 0) {
+        drop_leaf(tree, pos.leaf);
+        sizes_rebuild(tree);
+        return key;
+    }
+
+    // fold a thin leaf into its neighbour so leaves stay dense
+    if (leaf->len < KT_LEAF_MAX / 4 && tree->count > 1) {
+        Py_ssize_t left = (pos.leaf + 1 < tree->count) ? pos.leaf : pos.leaf - 1;
+        KeyLeaf *a = tree->leaves[left];
+        KeyLeaf *b = tree->leaves[left + 1];
+
+        if (a->len + b->len <= KT_LEAF_FILL) {
+            memcpy(a->keys + a->len, b->keys, b->len * sizeof(PyObject *));
+            a->len += b->len;
+            drop_leaf(tree, left + 1);
+            sizes_rebuild(tree);
+            return key;
+        }
+    }
+
+    sizes_add(tree, pos.leaf, -1);
+    return key;
+}
+
+
+// cut the tree down to len keys, moving the evicted refs into 'evicted'. returns how many
+Py_ssize_t keytree_truncate(KeyTree *tree, Py_ssize_t len, PyObject **evicted)
+{
+    if (len >= tree->size) {
+        return 0;
+    }
+
+    Py_ssize_t moved = keytree_copy(tree, len, tree->size - len, evicted);
+    KeyPos pos = keytree_locate(tree, len);
+
+    for (Py_ssize_t i = pos.leaf + (pos.offset ? 1 : 0); i < tree->count; ++i) {
+        PyMem_Free(tree->leaves[i]);
+    }
+
+    tree->count = pos.leaf + (pos.offset ? 1 : 0);
+    if (pos.offset) {
+        tree->leaves[pos.leaf]->len = pos.offset;
+    }
+
+    tree->size = len;
+    sizes_rebuild(tree);
+
+    return moved;
+}
+
+
+// copy up to n borrowed refs starting at position start into out, in order. returns how many
+Py_ssize_t keytree_copy(const KeyTree *tree, Py_ssize_t start, Py_ssize_t n, PyObject **out)
+{
+    if (start >= tree->size || n <= 0) {
+        return 0;
+    }
+
+    KeyPos pos = keytree_locate(tree, start);
+    Py_ssize_t copied = 0;
+
+    for (Py_ssize_t i = pos.leaf; i < tree->count && copied < n; ++i) {
+        const KeyLeaf *leaf = tree->leaves[i];
+        Py_ssize_t from = (i == pos.leaf) ? pos.offset : 0;
+        Py_ssize_t take = leaf->len - from;
+
+        if (take > n - copied) {
+            take = n - copied;
+        }
+
+        memcpy(out + copied, leaf->keys + from, take * sizeof(PyObject *));
+        copied += take;
+    }
+
+    return copied;
+}
@@ -0,0 +1,70 @@
+/*
+Copyright (C) 2020-2026  Bryant Moscon - bmoscon@gmail.com
+
+Please see the LICENSE file for the terms and conditions
+associated with this software.
+*/
+#ifndef __KEYTREE__
+#define __KEYTREE__
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PY_SSIZE_T_CLEAN
+#include "Python.h"
+
+
+/*
+order statistics B+tree of fixed height two for the sorted keys of an object keyed
+side. the keys live in fixed size leaves, the root is the array of leaves plus a
+fenwick tree over the leaf sizes so a position resolves to a leaf in O(log n).
+searches cost O(log n) rich compares. an insert or delete inside a leaf moves at
+most one leaf's worth of pointers and updates the fenwick tree in O(log n). a leaf
+split, drop or merge, and a truncate, shift the leaf array and rebuild the fenwick
+tree, a full pass over the n / KT_LEAF_FILL leaves; splits and merges only happen
+when a leaf fills or thins out. the tree never needs a full re-sort to stay current
+*/
+#define KT_LEAF_MAX 128
+// leaves are filled to this on bulk loads and splits, leaving room for inserts
+#define KT_LEAF_FILL 96
+
+
+typedef struct {
+    Py_ssize_t len;
+    PyObject *keys[KT_LEAF_MAX];   // owned refs
+} KeyLeaf;
+
+
+typedef struct {
+    KeyLeaf **leaves;
+    Py_ssize_t count;
+    Py_ssize_t cap;
+    Py_ssize_t *sizes;   // fenwick tree over leaf lengths, 1-based
+    Py_ssize_t size;
+} KeyTree;
+
+
+// a position in the tree, the leaf and the offset inside it
+typedef struct {
+    Py_ssize_t leaf;
+    Py_ssize_t offset;
+} KeyPos;
+
+
+void keytree_release(KeyTree *tree);
+int keytree_load(KeyTree *tree, PyObject *const *keys, Py_ssize_t n);
+int keytree_clone(const KeyTree *src, KeyTree *dst);
+
+PyObject *keytree_at(const KeyTree *tree, Py_ssize_t index);
+KeyPos keytree_locate(const KeyTree *tree, Py_ssize_t index);
+Py_ssize_t keytree_rank(const KeyTree *tree, KeyPos pos);
+Py_ssize_t keytree_bisect(const KeyTree *tree, PyObject *key, int op, const uint64_t *version, KeyPos *pos);
+
+int keytree_insert(KeyTree *tree, KeyPos pos, PyObject *key);
+PyObject *keytree_remove(KeyTree *tree, KeyPos pos);
+Py_ssize_t keytree_truncate(KeyTree *tree, Py_ssize_t len, PyObject **evicted);
+Py_ssize_t keytree_copy(const KeyTree *tree, Py_ssize_t start, Py_ssize_t n, PyObject **out);
+
+
+#endif
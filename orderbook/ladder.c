@@ -0,0 +1,185 @@
+/*
+Copyright (C) 2020-2026  Bryant Moscon - bmoscon@gmail.com
+
+Please see the LICENSE file for the terms and conditions
+associated with this software.
+*/
+#include "ladder.h"
+#include "utils.h"
+
+
+// allocate an empty ladder of at least 'band' slots, rounded up to whole bitmap words
+int ladder_alloc(Ladder *ladder, Py_ssize_t band)
+{
+    Py_ssize_t words = (band + 63) / 64;
+
+    PyObject **slots = PyMem_Calloc(words * 64, sizeof(PyObject *));
+    uint64_t *bits = PyMem_Calloc(words, sizeof(uint64_t));
+    if (EXPECT(!slots || !bits, 0)) {
+        PyMem_Free(slots);
+        PyMem_Free(bits);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    ladder->slots = slots;
+    ladder->bits = bits;
+    ladder->base = 0;
+    ladder->band = words * 64;
+    ladder->best = ladder->band;
+    ladder->len = 0;
+
+    return 0;
+}
+
+
+// a private copy of src in dst, holding its own value refs. dst is overwritten, not released
+int ladder_clone(const Ladder *src, Ladder *dst)
+{
+    Ladder fresh = *src;
+
+    if (!src->band) {
+        *dst = fresh;
+        return 0;
+    }
+
+    fresh.slots = PyMem_Malloc(src->band * sizeof(PyObject *));
+    fresh.bits = PyMem_Malloc((src->band >> 6) * sizeof(uint64_t));
+    if (EXPECT(!fresh.slots || !fresh.bits, 0)) {
+        PyMem_Free(fresh.slots);
+        PyMem_Free(fresh.bits);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    memcpy(fresh.slots, src->slots, src->band * sizeof(PyObject *));
+    memcpy(fresh.bits, src->bits, (src->band >> 6) * sizeof(uint64_t));
+    for (Py_ssize_t slot = ladder_next(&fresh, 0); slot < fresh.band; slot = ladder_next(&fresh, slot + 1)) {
+        Py_INCREF(fresh.slots[slot]);
+    }
+
+    *dst = fresh;
+    return 0;
+}
+
+
+// detach everything before dropping any value, finalizers can reenter
+void ladder_release(Ladder *ladder)
+{
+    Ladder previous = *ladder;
+
+    memset(ladder, 0, sizeof(Ladder));
+
+    for (Py_ssize_t slot = ladder_next(&previous, 0); slot < previous.band; slot = ladder_next(&previous, slot + 1)) {
+        Py_DECREF(previous.slots[slot]);
+    }
+
+    PyMem_Free(previous.slots);
+    PyMem_Free(previous.bits);
+}
+
+
+// slot of a tick, -1 when it falls outside the band
+Py_ssize_t ladder_slot(const Ladder *ladder, int64_t tick)
+{
+    int64_t offset;
+
+    if (!ladder->band || __builtin_sub_overflow(tick, ladder->base, &offset)) {
+        return -1;
+    }
+
+    return (offset >= 0 && offset < ladder->band) ? (Py_ssize_t)offset : -1;
+}
+
+
+// first occupied slot at or after 'slot', band when there is none
+Py_ssize_t ladder_next(const Ladder *ladder, Py_ssize_t slot)
+{
+    if (slot >= ladder->band) {
+        return ladder->band;
+    }
+
+    Py_ssize_t word = slot >> 6;
+    uint64_t bits = ladder->bits[word] & (~(uint64_t)0 << (slot & 63));
+    Py_ssize_t words = ladder->band >> 6;
+
+    while (!bits) {
+        if (++word == words) {
+            return ladder->band;
+        }
+        bits = ladder->bits[word];
+    }
+
+    return (word << 6) + __builtin_ctzll(bits);
+}
+
+
+// slot of the level at 'rank', which must be below len
+Py_ssize_t ladder_seek(const Ladder *ladder, Py_ssize_t rank)
+{
+    Py_ssize_t word = ladder->best >> 6;
+    uint64_t bits = ladder->bits[word];
+
+    for (Py_ssize_t count = __builtin_popcountll(bits); count <= rank; count = __builtin_popcountll(bits)) {
+        rank -= count;
+        bits = ladder->bits[++word];
+    }
+
+    while (rank--) {
+        bits &= bits - 1;
+    }
+
+    return (word << 6) + __builtin_ctzll(bits);
+}
+
+
+// occupied slots before 'slot', which may be band
+Py_ssize_t ladder_rank(const Ladder *ladder, Py_ssize_t slot)
+{
+    if (slot <= ladder->best) {
+        return 0;
+    }
+
+    Py_ssize_t rank = 0;
+    Py_ssize_t word = ladder->best >> 6;
+
+    for (; word < (slot >> 6); ++word) {
+        rank += __builtin_popcountll(ladder->bits[word]);
+    }
+
+    if (slot & 63) {
+        rank += __builtin_popcountll(ladder->bits[word] & ~(~(uint64_t)0 << (slot & 63)));
+    }
+
+    return rank;
+}
+
+
+// store a value in an empty slot, stealing the reference
+void ladder_put(Ladder *ladder, Py_ssize_t slot, PyObject *value)
+{
+    ladder->slots[slot] = value;
+    ladder->bits[slot >> 6] |= (uint64_t)1 << (slot & 63);
+    ladder->len++;
+
+    if (slot < ladder->best) {
+        ladder->best = slot;
+    }
+}
+
+
+// empty an occupied slot and hand its reference to the caller
+PyObject *ladder_take(Ladder *ladder, Py_ssize_t slot)
+{
+    PyObject *value = ladder->slots[slot];
+
+    ladder->slots[slot] = NULL;
+    ladder->bits[slot >> 6] &= ~((uint64_t)1 << (slot & 63));
+    ladder->len--;
+
+    if (slot == ladder->best) {
+        ladder->best = ladder_next(ladder, slot + 1);
+    }
+
+    return value;
+}
@@ -0,0 +1,51 @@
+/*
+Copyright (C) 2020-2026  Bryant Moscon - bmoscon@gmail.com
+
+Please see the LICENSE file for the terms and conditions
+associated with this software.
+*/
+#ifndef __LADDER__
+#define __LADDER__
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PY_SSIZE_T_CLEAN
+#include "Python.h"
+
+
+/*
+dense tick ladder for a fixed key side. one slot per tick across a band starting at
+base, a bitmap of the occupied slots and the first occupied slot kept current, so
+stores are O(1) and finding the nth level is a popcount scan of the bitmap. ticks
+are book ordered (negated on DESC sides) so slot 0 is always the best end
+*/
+#define LADDER_DEFAULT_BAND 4096
+#define LADDER_MAX_BAND (1 << 24)
+
+
+typedef struct {
+    PyObject **slots;   // owned refs, NULL where no level rests
+    uint64_t *bits;     // occupied slots
+    int64_t base;       // tick count of slot 0
+    Py_ssize_t band;    // slot count, 0 when the side has no ladder
+    Py_ssize_t best;    // first occupied slot, band when empty
+    Py_ssize_t len;     // occupied slots
+} Ladder;
+
+
+int ladder_alloc(Ladder *ladder, Py_ssize_t band);
+void ladder_release(Ladder *ladder);
+int ladder_clone(const Ladder *src, Ladder *dst);
+
+Py_ssize_t ladder_slot(const Ladder *ladder, int64_t tick);
+Py_ssize_t ladder_next(const Ladder *ladder, Py_ssize_t slot);
+Py_ssize_t ladder_seek(const Ladder *ladder, Py_ssize_t rank);
+Py_ssize_t ladder_rank(const Ladder *ladder, Py_ssize_t slot);
+
+void ladder_put(Ladder *ladder, Py_ssize_t slot, PyObject *value);
+PyObject *ladder_take(Ladder *ladder, Py_ssize_t slot);
+
+
+#endif
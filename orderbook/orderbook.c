@@ -4,38 +4,73 @@ Copyright (C) 2020-2026  Bryant Moscon - bmoscon@gmail.com
 Please see the LICENSE file for the terms and conditions
 associated with this software.
 */
+#include <pthread.h>
+
 #include "orderbook.h"
+#include "history.h"
 #include "utils.h"
 
 
-typedef int (*string_builder_t)(PyObject *pydata, uint8_t *data, int *pos, int size);
-
-
 static int checksum_overflow(void)
 {
     PyErr_SetString(PyExc_ValueError, "book values too long for this checksum format");
     return -1;
 }
 
-static void replace_side(SortedDict *side, PyObject *data)
+// drop the price and size refs of rendered levels
+static void render_release(LevelRender *levels, Py_ssize_t *len)
 {
-    PyObject *previous = side->data;
+    Py_ssize_t n = *len;
+
+    *len = 0;
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        Py_DECREF(levels[i].price);
+        Py_DECREF(levels[i].size);
+    }
+}
 
-    side->data = data;
-    side->dirty = true;
-    SortedDict_drop_key_cache(side);
-    // flush before dropping previous - finalizers can reenter
-    SortedDict_flush_pending(side);
 
-    Py_DECREF(previous);
+// free the render caches, then size them for 'cap' levels a side when it is non zero
+static int render_caches_reset(Orderbook *self, Py_ssize_t cap)
+{
+    for (int side = BID; side <= ASK; ++side) {
+        RenderCache *cache = &self->renders[side];
+
+        render_release(cache->held, &cache->held_len);
+        render_release(cache->fresh, &cache->fresh_len);
+        PyMem_Free(cache->held);
+        PyMem_Free(cache->fresh);
+        cache->held = NULL;
+        cache->fresh = NULL;
+        cache->cap = 0;
+        cache->next = 0;
+    }
+
+    for (int side = BID; cap && side <= ASK; ++side) {
+        RenderCache *cache = &self->renders[side];
+
+        cache->held = PyMem_New(LevelRender, cap);
+        cache->fresh = PyMem_New(LevelRender, cap);
+        if (EXPECT(!cache->held || !cache->fresh, 0)) {
+            render_caches_reset(self, 0);
+            PyErr_NoMemory();
+            return -1;
+        }
+        cache->cap = cap;
+    }
+
+    return 0;
 }
 
 
 void Orderbook_dealloc(Orderbook *self)
 {
     PyObject_GC_UnTrack(self);
+    render_caches_reset(self, 0);
     free(self->checksum_buffer);
+    free(self->checksum_previous);
     self->checksum_buffer = NULL;
+    self->checksum_previous = NULL;
     Py_CLEAR(self->bids);
     Py_CLEAR(self->asks);
     Py_TYPE(self)->tp_free((PyObject *) self);
@@ -46,6 +81,16 @@ int Orderbook_traverse(Orderbook *self, visitproc visit, void *arg)
 {
     Py_VISIT(self->bids);
     Py_VISIT(self->asks);
+
+    for (int side = BID; side <= ASK; ++side) {
+        const RenderCache *cache = &self->renders[side];
+
+        for (Py_ssize_t i = 0; i < cache->held_len; ++i) {
+            Py_VISIT(cache->held[i].price);
+            Py_VISIT(cache->held[i].size);
+        }
+    }
+
     return 0;
 }
 
@@ -62,6 +107,10 @@ int Orderbook_clear(Orderbook *self)
         SortedDict_clear(self->asks);
     }
 
+    for (int side = BID; side <= ASK; ++side) {
+        render_release(self->renders[side].held, &self->renders[side].held_len);
+    }
+
     return 0;
 }
 
@@ -87,19 +136,71 @@ PyObject *Orderbook_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 
         self->max_depth = 0;
         self->truncate = false;
-        self->checksum = INVALID_CHECKSUM_FORMAT;
+        self->checksum = NULL;
         self->checksum_buffer = NULL;
+        self->checksum_previous = NULL;
         self->checksum_len = 0;
+        memset(self->renders, 0, sizeof(self->renders));
+        self->checksum_crc = 0;
+        self->checksum_crc_len = -1;
         self->checksumming = false;
     }
     return (PyObject *) self;
 }
 
 
+// allocate the render buffers and caches for a checksum format, or drop them for NULL
+static int set_checksum_format(Orderbook *self, const ChecksumFormat *format)
+{
+    uint32_t buffer_len = format ? format->buffer_len : 0;
+    uint8_t *buffer = NULL;
+    uint8_t *previous = NULL;
+
+    if (format) {
+        buffer = calloc(buffer_len, sizeof(uint8_t));
+        previous = calloc(buffer_len, sizeof(uint8_t));
+        if (!buffer || !previous) {
+            free(buffer);
+            free(previous);
+            PyErr_SetNone(PyExc_MemoryError);
+            return -1;
+        }
+    }
+
+    // __init__ can be called more than once on the same book
+    // so make sure we are properly cleaning up
+    if (render_caches_reset(self, format ? format->depth : 0)) {
+        free(buffer);
+        free(previous);
+        return -1;
+    }
+
+    free(self->checksum_buffer);
+    free(self->checksum_previous);
+    self->checksum = format;
+    self->checksum_buffer = buffer;
+    self->checksum_previous = previous;
+    self->checksum_len = buffer ? buffer_len : 0;
+    self->checksum_crc_len = -1;
+
+    return 0;
+}
+
+
 int Orderbook_init(Orderbook *self, PyObject *args, PyObject *kwds)
 {
-    static char *kwlist[] = {"max_depth", "max_depth_strict", "checksum_format", NULL};
+    static char *kwlist[] = {"max_depth", "max_depth_strict", "checksum_format", "key_type", "tick", "ladder", "band", "intern", "delta_log", "journal", "journal_time", NULL};
     Py_buffer checksum_str = {0};
+    PyObject *key_type_arg = NULL;
+    PyObject *tick = NULL;
+    PyObject *ladder = NULL;
+    PyObject *band = NULL;
+    PyObject *intern = Py_None;
+    PyObject *delta_log = NULL;
+    PyObject *journal = NULL;
+    PyObject *journal_time = NULL;
+    int max_depth = self->max_depth;
+    int truncate = self->truncate;
 
    // reachable because rendering a level calls __str__ (which could be re-entrant)
     if (EXPECT(self->checksumming, 0)) {
@@ -107,59 +208,62 @@ int Orderbook_init(Orderbook *self, PyObject *args, PyObject *kwds)
         return -1;
     }
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ipz*", kwlist, &self->max_depth, &self->truncate, &checksum_str)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ipz*OOOOOOOO", kwlist, &max_depth, &truncate, &checksum_str, &key_type_arg, &tick, &ladder, &band, &intern, &delta_log, &journal, &journal_time)) {
         return -1;
     }
 
-    if (checksum_str.buf && checksum_str.len) {
-        enum Checksums format;
-        uint32_t buffer_len;
+    // every argument is checked before either side changes, so a bad one leaves the book as it was
+    const ChecksumFormat *format = NULL;
+    enum KeyType key_type;
+    Py_ssize_t slots;
+    Py_ssize_t count;
+    int timed = journal_time ? PyObject_IsTrue(journal_time) : 0;
 
-        if (strncmp(checksum_str.buf, "KRAKEN", checksum_str.len) == 0) {
-            format = KRAKEN;
-            buffer_len = 2048;
-        } else if ((checksum_str.len > 2) && ((strncmp(checksum_str.buf, "OKX", 3) == 0) || (strncmp(checksum_str.buf, "OKCO", 4) == 0))) {
-            format = OKX;
-            buffer_len = 4096;
-        } else if (strncmp(checksum_str.buf, "BITGET", checksum_str.len) == 0) {
-            format = BITGET;
-            buffer_len = 4096;
-        } else if (strncmp(checksum_str.buf, "BITFINEX", checksum_str.len) == 0) {
-            format = BITFINEX;
-            buffer_len = 4096;
-        } else {
-            PyBuffer_Release(&checksum_str);
-            PyErr_SetString(PyExc_TypeError, "invalid checksum format specified");
-            return -1;
-        }
+    bool named = checksum_str.buf && checksum_str.len;
 
-        uint8_t *buffer = calloc(buffer_len, sizeof(uint8_t));
-        if (!buffer) {
-            PyBuffer_Release(&checksum_str);
-            PyErr_SetNone(PyExc_MemoryError);
-            return -1;
-        }
+    if (named) {
+        format = checksum_format_find(checksum_str.buf, checksum_str.len);
+    }
+    PyBuffer_Release(&checksum_str);
 
-        // __init__ can be called more than once on the same book
-        // so make sure we are properly cleaning up
-        free(self->checksum_buffer);
-        self->checksum = format;
-        self->checksum_buffer = buffer;
-        self->checksum_len = buffer_len;
-    } else {
-        free(self->checksum_buffer);
-        self->checksum_buffer = NULL;
-        self->checksum_len = 0;
-        self->checksum = INVALID_CHECKSUM_FORMAT;
+    if (named && !format) {
+        PyErr_SetString(PyExc_TypeError, "invalid checksum format specified");
+        return -1;
+    }
+
+    if (timed < 0 ||
+        SortedDict_parse_key_type(key_type_arg, ladder, band, &key_type, &slots) ||
+        SortedDict_check_key_type(self->bids, key_type, tick, slots, intern) ||
+        SortedDict_check_key_type(self->asks, key_type, tick, slots, intern) ||
+        (delta_log && SortedDict_parse_count(delta_log, "delta_log", &count)) ||
+        (journal && SortedDict_parse_count(journal, "journal", &count))) {
+        return -1;
+    }
+
+    if (journal_time) {
+        journal_time = timed ? Py_True : Py_False;
+    }
+
+    // only object keys are interned, so interning is turned off before a change to fixed
+    // keys and set after a change to object keys
+    bool intern_first = key_type == KEY_FIXED;
+    if ((intern_first && (SortedDict_set_intern(self->bids, intern) || SortedDict_set_intern(self->asks, intern))) ||
+        SortedDict_set_key_type(self->bids, key_type, tick, slots) ||
+        SortedDict_set_key_type(self->asks, key_type, tick, slots) ||
+        (!intern_first && (SortedDict_set_intern(self->bids, intern) || SortedDict_set_intern(self->asks, intern))) ||
+        (delta_log && (SortedDict_set_delta_log(self->bids, delta_log) || SortedDict_set_delta_log(self->asks, delta_log))) ||
+        ((journal || journal_time) && (SortedDict_set_journal(self->bids, journal, journal_time) || SortedDict_set_journal(self->asks, journal, journal_time))) ||
+        set_checksum_format(self, format)) {
+        return -1;
     }
 
+    self->max_depth = max_depth;
+    self->truncate = truncate;
     self->bids->depth = self->max_depth;
     self->bids->truncate = self->truncate;
     self->asks->depth = self->max_depth;
     self->asks->truncate = self->truncate;
 
-    PyBuffer_Release(&checksum_str);
-
     return 0;
 }
 
@@ -213,24 +317,91 @@ PyObject* Orderbook_todict(const Orderbook *self, PyObject *unused, PyObject *kw
 }
 
 
-PyObject* Orderbook_checksum(const Orderbook *self, PyObject *Py_UNUSED(ignored))
+PyObject* Orderbook_toarrays(const Orderbook *self, PyObject *args, PyObject *kwargs)
 {
-    if (EXPECT(self->checksum == INVALID_CHECKSUM_FORMAT, 0)) {
-        PyErr_SetString(PyExc_ValueError, "no checksum format specified");
+    static char *kwlist[] = {"depth", "dtype", "out", NULL};
+    PyObject *depth_arg = Py_None;
+    const char *dtype = "float64";
+    PyObject *out = NULL;
+    PyObject *bid_out = NULL;
+    PyObject *ask_out = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|Os$O", kwlist, &depth_arg, &dtype, &out)) {
         return NULL;
     }
 
+    Py_ssize_t depth = -1;
+    if (depth_arg != Py_None) {
+        depth = PyLong_AsSsize_t(depth_arg);
+        if (depth == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+
+        if (depth < 0) {
+            PyErr_SetString(PyExc_ValueError, "depth must not be negative");
+            return NULL;
+        }
+    }
+
+    if (out && out != Py_None) {
+        if (EXPECT(!PyTuple_Check(out) || PyTuple_GET_SIZE(out) != 4, 0)) {
+            PyErr_SetString(PyExc_TypeError, "out must be a tuple of four buffers: bid prices, bid sizes, ask prices, ask sizes");
+            return NULL;
+        }
+
+        bid_out = PyTuple_GetSlice(out, 0, 2);
+        ask_out = PyTuple_GetSlice(out, 2, 4);
+        if (EXPECT(!bid_out || !ask_out, 0)) {
+            Py_XDECREF(bid_out);
+            Py_XDECREF(ask_out);
+            return NULL;
+        }
+    }
+
+    PyObject *ret = NULL;
+    PyObject *bids = SortedDict_arrays(self->bids, depth, dtype, bid_out);
+    PyObject *asks = bids ? SortedDict_arrays(self->asks, depth, dtype, ask_out) : NULL;
+
+    if (EXPECT(asks != NULL, 1)) {
+        // (bid prices, bid sizes, ask prices, ask sizes), or the two level counts when filling
+        ret = out && out != Py_None ? PyTuple_Pack(2, bids, asks) : PySequence_Concat(bids, asks);
+    }
+
+    Py_XDECREF(bids);
+    Py_XDECREF(asks);
+    Py_XDECREF(bid_out);
+    Py_XDECREF(ask_out);
+
+    return ret;
+}
+
+
+// ret 0 - the book can be checksummed and its keys are up to date
+// ret -1 - it cannot, with the exception set
+static int checksum_ready(const Orderbook *self)
+{
+    if (EXPECT(!self->checksum, 0)) {
+        PyErr_SetString(PyExc_ValueError, "no checksum format specified");
+        return -1;
+    }
+
     // see __init__
     if (EXPECT(self->checksumming, 0)) {
         PyErr_SetString(PyExc_RuntimeError, "cannot checksum while checksumming");
-        return NULL;
+        return -1;
     }
 
     if (EXPECT(update_keys(self->bids), 0)) {
-        return NULL;
+        return -1;
     }
 
-    if (EXPECT(update_keys(self->asks), 0)) {
+    return update_keys(self->asks);
+}
+
+
+PyObject* Orderbook_checksum(const Orderbook *self, PyObject *Py_UNUSED(ignored))
+{
+    if (EXPECT(checksum_ready(self), 0)) {
         return NULL;
     }
 
@@ -243,703 +414,2294 @@ PyObject* Orderbook_checksum(const Orderbook *self, PyObject *Py_UNUSED(ignored)
 }
 
 
-/* Orderbook Mapping Functions */
-Py_ssize_t Orderbook_len(const Orderbook *self)
-{
-    return SortedDict_len(self->bids) + SortedDict_len(self->asks);
-}
-
-
-PyObject *Orderbook_getitem(const Orderbook *self, PyObject *key)
+// a read only book over snapshots of both sides, taken together so they come from the same update
+PyObject* Orderbook_snapshot(const Orderbook *self, PyObject *Py_UNUSED(ignored))
 {
-    if (EXPECT(!PyUnicode_Check(key), 0)) {
-        PyErr_SetString(PyExc_ValueError, "key must one of bid/ask");
-        return NULL;
-    }
+    PyObject *bids = SortedDict_snapshot(self->bids, NULL);
+    PyObject *asks = bids ? SortedDict_snapshot(self->asks, NULL) : NULL;
+    Orderbook *snap = asks ? (Orderbook *)Orderbook_new(Py_TYPE(self), NULL, NULL) : NULL;
 
-    const char *name = PyUnicode_AsUTF8(key);
-    if (EXPECT(!name, 0)) {
+    if (EXPECT(!snap, 0)) {
+        Py_XDECREF(bids);
+        Py_XDECREF(asks);
         return NULL;
     }
 
-    enum side_e key_int = check_key(name);
+    Py_SETREF(snap->bids, (SortedDict *)bids);
+    Py_SETREF(snap->asks, (SortedDict *)asks);
+    snap->max_depth = self->max_depth;
+    snap->truncate = self->truncate;
 
-    if (key_int == BID) {
-        Py_INCREF(self->bids);
-        return (PyObject *)self->bids;
-    } else if (key_int == ASK) {
-        Py_INCREF(self->asks);
-        return (PyObject *)self->asks;
+    if (set_checksum_format(snap, self->checksum)) {
+        Py_DECREF(snap);
+        return NULL;
     }
 
-    // key not bid or ask
-    PyErr_SetString(PyExc_KeyError, "key does not exist");
-    return NULL;
+    return (PyObject *)snap;
 }
 
 
-int Orderbook_setitem(const Orderbook *self, PyObject *key, PyObject *value)
+// book settings followed by both sides, see SortedDict_encode
+static int encode_book(const Orderbook *self, CodecWriter *w)
 {
-    if (EXPECT(!PyUnicode_Check(key), 0)) {
-        PyErr_SetString(PyExc_ValueError, "key must one of bid/ask");
-        return -1;
-    }
+    return codec_put(w, CODEC_MAGIC_BOOK, CODEC_MAGIC_LEN) ||
+           encode_checksum_format(self->checksum, w) ||
+           codec_put_varint(w, self->max_depth) ||
+           codec_put_u8(w, self->truncate) ||
+           SortedDict_encode(self->bids, w) ||
+           SortedDict_encode(self->asks, w);
+}
 
-    const char *name = PyUnicode_AsUTF8(key);
-    if (EXPECT(!name, 0)) {
-        return -1;
-    }
 
-    enum side_e key_int = check_key(name);
+static PyObject *decode_book(PyTypeObject *type, CodecReader *r)
+{
+    Orderbook *self = (Orderbook *)Orderbook_new(type, NULL, NULL);
+    const ChecksumFormat *checksum = NULL;
+    uint8_t truncate;
+    uint64_t max_depth;
 
-    if (EXPECT(key_int == INVALID_SIDE, 0)) {
-        PyErr_SetString(PyExc_ValueError, "key must one of bid/ask");
-        return -1;
+    if (!self || codec_expect(r, CODEC_MAGIC_BOOK) || decode_checksum_format(r, &checksum) || codec_get_varint(r, &max_depth) || codec_get_u8(r, &truncate)) {
+        goto error;
     }
 
-    if (EXPECT(!value, 0)) {
-        PyErr_SetString(PyExc_ValueError, "cannot delete");
-        return -1;
+    if (max_depth > INT_MAX || truncate > 1) {
+        codec_corrupt();
+        goto error;
     }
 
-    if (EXPECT(!PyDict_Check(value), 0)) {
-        PyErr_SetString(PyExc_ValueError, "value must be a dict");
-        return -1;
+    if (set_checksum_format(self, checksum) ||
+        SortedDict_decode(self->bids, r) ||
+        SortedDict_decode(self->asks, r) ||
+        codec_finish(r)) {
+        goto error;
     }
 
-    PyObject *copy = PyDict_Copy(value);
-    if (EXPECT(!copy, 0)) {
-        return -1;
-    }
+    self->max_depth = (uint32_t)max_depth;
+    self->truncate = truncate;
 
-    replace_side(key_int == BID ? self->bids : self->asks, copy);
+    return (PyObject *)self;
 
-    return 0;
+error:
+    Py_XDECREF(self);
+    return NULL;
 }
 
 
-int Orderbook_setattr(const PyObject *self, PyObject *attr, PyObject *value)
+PyObject* Orderbook_tobytes(const Orderbook *self, PyObject *Py_UNUSED(ignored))
 {
-    return Orderbook_setitem((Orderbook *)self, attr, value);
+    CodecWriter w = {0};
+
+    if (encode_book(self, &w)) {
+        codec_writer_release(&w);
+        return NULL;
+    }
+
+    return codec_writer_bytes(&w);
 }
 
 
-PyMODINIT_FUNC PyInit_order_book(void)
+PyObject* Orderbook_frombytes(PyTypeObject *type, PyObject *data)
 {
-    PyObject *m;
-    OrderBookModuleState *st;
+    Py_buffer view;
 
-    if (crc32_orderbook_init() != 0) {
-        PyErr_SetString(PyExc_ImportError, "orderbook requires CRC32 CPU support");
+    if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE)) {
         return NULL;
     }
 
-    if (PyType_Ready(&OrderbookType) < 0 || PyType_Ready(&SortedDictType) < 0 || PyType_Ready(&SortedDictIterType) < 0) {
-        return NULL;
-    }
+    CodecReader r = {view.buf, view.len, 0};
+    PyObject *ret = decode_book(type, &r);
 
-    m = PyModule_Create(&orderbookmodule);
-    if (m == NULL)
-        return NULL;
+    PyBuffer_Release(&view);
+    return ret;
+}
 
-    Py_INCREF(&OrderbookType);
-    if (PyModule_AddObject(m, "OrderBook", (PyObject *) &OrderbookType) < 0) {
-        Py_DECREF(&OrderbookType);
-        Py_DECREF(m);
+
+// the encoding behind a header with the feed sequence number and a crc of the rest
+PyObject* Orderbook_save(const Orderbook *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"path", "sequence", "fsync", NULL};
+    PyObject *path = NULL;
+    PyObject *sequence = Py_None;
+    int sync = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&|O$p", kwlist, PyUnicode_FSConverter, &path, &sequence, &sync)) {
         return NULL;
     }
 
-    Py_INCREF(&SortedDictType);
-    if (PyModule_AddObject(m, "SortedDict", (PyObject *) &SortedDictType) < 0) {
-        Py_DECREF(&SortedDictType);
-        Py_DECREF(m);
-        return NULL;
+    uint64_t number = 0;
+    if (sequence != Py_None) {
+        number = PyLong_AsUnsignedLongLong(sequence);
+        if (number == (uint64_t)-1 && PyErr_Occurred()) {
+            Py_DECREF(path);
+            return NULL;
+        }
     }
 
-    st = get_order_book_state(m);
+    CodecWriter w = {0};
+    int failed = codec_file_begin(&w) ||
+                 encode_book(self, &w) ||
+                 codec_file_write(&w, PyBytes_AS_STRING(path), (sequence != Py_None) ? &number : NULL, sync);
 
-    // dont use addModule here (borrowed ref), needs a strong ref
-    PyObject* builtins = PyImport_ImportModule("builtins");
-    if (builtins == NULL) {
-        Py_DECREF(m);
+    codec_writer_release(&w);
+    Py_DECREF(path);
+
+    if (failed) {
         return NULL;
     }
 
-    st->format = PyObject_GetAttrString(builtins, "format");
-    Py_DECREF(builtins);
-    if (st->format == NULL) {
-        Py_DECREF(m);
+    Py_RETURN_NONE;
+}
+
+
+// (book, sequence) from a saved file, decoded straight out of a read only mapping
+PyObject* Orderbook_load(PyTypeObject *type, PyObject *arg)
+{
+    PyObject *path;
+    CodecFile file;
+
+    if (!PyUnicode_FSConverter(arg, &path)) {
         return NULL;
     }
 
-    st->formatf = PyUnicode_FromString("f");
-    if (st->formatf == NULL) {
-        Py_CLEAR(st->format);
-        Py_DECREF(m);
+    int failed = codec_file_open(PyBytes_AS_STRING(path), &file);
+    Py_DECREF(path);
+    if (failed) {
         return NULL;
     }
 
-    return m;
-}
+    PyObject *book = decode_book(type, &file.payload);
+    PyObject *sequence = NULL;
+    PyObject *ret = NULL;
+
+    if (book) {
+        sequence = file.has_sequence ? PyLong_FromUnsignedLongLong(file.sequence) : Py_NewRef(Py_None);
+    }
+    if (sequence) {
+        ret = PyTuple_Pack(2, book, sequence);
+    }
 
+    codec_file_close(&file);
+    Py_XDECREF(book);
+    Py_XDECREF(sequence);
 
-static int order_book_traverse(PyObject *m, visitproc visit, void *arg)
-{
-    OrderBookModuleState* st = get_order_book_state(m);
-    Py_VISIT(st->format);
-    Py_VISIT(st->formatf);
-    return 0;
+    return ret;
 }
 
 
-static int order_book_clear(PyObject* m)
+// pickles as the binary encoding, restored through from_bytes
+PyObject* Orderbook_reduce(const Orderbook *self, PyObject *Py_UNUSED(ignored))
 {
-    OrderBookModuleState* st = get_order_book_state(m);
-    Py_CLEAR(st->format);
-    Py_CLEAR(st->formatf);
-    return 0;
+    PyObject *blob = Orderbook_tobytes(self, NULL);
+    PyObject *restore = blob ? PyObject_GetAttrString((PyObject *)Py_TYPE(self), "from_bytes") : NULL;
+    PyObject *ret = restore ? Py_BuildValue("(O(O))", restore, blob) : NULL;
+
+    Py_XDECREF(restore);
+    Py_XDECREF(blob);
+    return ret;
 }
 
 
-static void order_book_free(PyObject *m)
+// (bids version, asks version), what encode_delta takes deltas since
+PyObject* Orderbook_version(const Orderbook *self, void *Py_UNUSED(closure))
 {
-    order_book_clear(m);
+    return Py_BuildValue("(KK)", (unsigned long long)self->bids->changes, (unsigned long long)self->asks->changes);
 }
 
 
-static OrderBookModuleState* get_order_book_state(PyObject *m)
+PyObject* Orderbook_encode_delta(const Orderbook *self, PyObject *args, PyObject *kwargs)
 {
-    if (m == NULL) {
-        return (OrderBookModuleState*) PyModule_GetState(PyState_FindModule(&orderbookmodule));
-    } else {
-        return (OrderBookModuleState*) PyModule_GetState(m);
+    static char *kwlist[] = {"since", NULL};
+    PyObject *since = Py_None;
+    PyObject *bid_since = Py_None;
+    PyObject *ask_since = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &since)) {
+        return NULL;
+    }
+
+    if (since != Py_None && !PyArg_ParseTuple(since, "OO;since must be None or a (bids, asks) version pair", &bid_since, &ask_since)) {
+        return NULL;
     }
+
+    CodecWriter w = {0};
+    if (codec_put(&w, CODEC_MAGIC_DELTA_BOOK, CODEC_MAGIC_LEN) ||
+        SortedDict_encode_delta(self->bids, bid_since, &w) ||
+        SortedDict_encode_delta(self->asks, ask_since, &w)) {
+        codec_writer_release(&w);
+        return NULL;
+    }
+
+    return codec_writer_bytes(&w);
 }
 
 
-// Checksum Code
-static int kraken_string_builder(PyObject *pydata, uint8_t *data, int *pos, int size)
+// both sides are read and checked before either changes
+PyObject* Orderbook_apply_delta(const Orderbook *self, PyObject *blob)
 {
-    PyObject *repr = PyObject_Str(pydata);
-    if (EXPECT(!repr, 0)) {
-        return -1;
-    }
+    Py_buffer view;
+    SideDelta bids = {0};
+    SideDelta asks = {0};
 
-    // the utf8 view is cached on the str object
-    const char *string = PyUnicode_AsUTF8(repr);
-    if (EXPECT(!string, 0)) {
-        Py_DECREF(repr);
-        return -1;
+    if (EXPECT(self->checksumming, 0)) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot modify orderbook while checksumming");
+        return NULL;
     }
 
-    bool leading_zero = true;
-    while (*string) {
-        if (*string != '.') {
-            if (*string == 'E' || *string == 'e') {
-                break;
-            }
-            if (*string != '0' && leading_zero) {
-                leading_zero = false;
-            }
-            if (*string == '0' && leading_zero) {
-                string++;
-                continue;
-            }
-            if (EXPECT(*pos >= size, 0)) {
-                Py_DECREF(repr);
-                return checksum_overflow();
-            }
-            data[(*pos)++] = *string;
-        }
-        string++;
+    if (PyObject_GetBuffer(blob, &view, PyBUF_SIMPLE)) {
+        return NULL;
     }
 
-    Py_DECREF(repr);
+    CodecReader r = {view.buf, view.len, 0};
+    int failed = codec_expect(&r, CODEC_MAGIC_DELTA_BOOK) ||
+                 SortedDict_read_delta(&r, &bids) ||
+                 SortedDict_read_delta(&r, &asks) ||
+                 codec_finish(&r) ||
+                 SortedDict_check_delta(self->bids, &bids) ||
+                 SortedDict_check_delta(self->asks, &asks) ||
+                 SortedDict_install_delta(self->bids, &bids) ||
+                 SortedDict_install_delta(self->asks, &asks) ||
+                 SortedDict_notify(self->bids) ||
+                 SortedDict_notify(self->asks);
 
-    return 0;
+    Py_XDECREF(bids.levels);
+    Py_XDECREF(asks.levels);
+    PyBuffer_Release(&view);
+
+    if (failed) {
+        return NULL;
+    }
+
+    return Py_BuildValue("(KK)", (unsigned long long)self->bids->applied, (unsigned long long)self->asks->applied);
+}
+
+
+// (side, price, size) triples across both sides
+static int apply_deltas(const Orderbook *self, PyObject *deltas)
+{
+    PyObject *seq = PySequence_Fast(deltas, "deltas must be an iterable of (side, price, size) tuples");
+    if (EXPECT(!seq, 0)) {
+        return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); ++i) {
+        PyObject *delta = PySequence_Fast(PySequence_Fast_GET_ITEM(seq, i), "each delta must be a (side, price, size) tuple");
+        if (EXPECT(!delta, 0)) {
+            Py_DECREF(seq);
+            return -1;
+        }
+
+        PyObject *side = (PySequence_Fast_GET_SIZE(delta) == 3) ? PySequence_Fast_GET_ITEM(delta, 0) : NULL;
+        const char *name = (side && PyUnicode_Check(side)) ? PyUnicode_AsUTF8(side) : NULL;
+        enum side_e key = name ? check_key(name) : INVALID_SIDE;
+
+        if (EXPECT(key == INVALID_SIDE, 0)) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_ValueError, "each delta must be a (side, price, size) tuple with side one of bid/ask");
+            }
+            Py_DECREF(delta);
+            Py_DECREF(seq);
+            return -1;
+        }
+
+        PyObject *price = Py_NewRef(PySequence_Fast_GET_ITEM(delta, 1));
+        PyObject *size = Py_NewRef(PySequence_Fast_GET_ITEM(delta, 2));
+        int failed = SortedDict_apply_level(key == BID ? self->bids : self->asks, price, size);
+
+        Py_DECREF(price);
+        Py_DECREF(size);
+        Py_DECREF(delta);
+        if (EXPECT(failed, 0)) {
+            Py_DECREF(seq);
+            return -1;
+        }
+    }
+
+    Py_DECREF(seq);
+    return 0;
+}
+
+
+PyObject* Orderbook_apply(const Orderbook *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"deltas", "bids", "asks", "checksum", NULL};
+    PyObject *deltas = NULL;
+    PyObject *bids = NULL;
+    PyObject *asks = NULL;
+    int checksum = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O$OOp", kwlist, &deltas, &bids, &asks, &checksum)) {
+        return NULL;
+    }
+
+    // see __init__
+    if (EXPECT(self->checksumming, 0)) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot modify orderbook while checksumming");
+        return NULL;
+    }
+
+    if (EXPECT(checksum && !self->checksum, 0)) {
+        PyErr_SetString(PyExc_ValueError, "no checksum format specified");
+        return NULL;
+    }
+
+    int failed = (deltas && deltas != Py_None) ? apply_deltas(self, deltas) : 0;
+
+    if (!failed && bids && bids != Py_None) {
+        failed = SortedDict_apply(self->bids, bids, NULL);
+    }
+
+    if (!failed && asks && asks != Py_None) {
+        failed = SortedDict_apply(self->asks, asks, NULL);
+    }
+
+    if (EXPECT(failed, 0)) {
+        // whatever was applied before the failure is kept, and still truncated
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        if (SortedDict_apply_done(self->bids) || SortedDict_apply_done(self->asks)) {
+            PyErr_Clear();
+        }
+        PyErr_Restore(type, value, traceback);
+
+        return NULL;
+    }
+
+    // max_depth truncation is deferred to the end of the batch
+    if (EXPECT(SortedDict_apply_done(self->bids) || SortedDict_apply_done(self->asks), 0)) {
+        return NULL;
+    }
+
+    if (checksum) {
+        return Orderbook_checksum(self, NULL);
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+PyObject* Orderbook_load_snapshot(const Orderbook *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"bids", "asks", "parse", NULL};
+    PyObject *bids = NULL;
+    PyObject *asks = NULL;
+    const char *parse = "decimal";
+    enum SnapshotParse mode;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO$s", kwlist, &bids, &asks, &parse)) {
+        return NULL;
+    }
+
+    // see __init__
+    if (EXPECT(self->checksumming, 0)) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot modify orderbook while checksumming");
+        return NULL;
+    }
+
+    if (SortedDict_parse_mode(parse, &mode)) {
+        return NULL;
+    }
+
+    int failed = (bids && bids != Py_None) ? SortedDict_load_levels(self->bids, bids, mode) : 0;
+
+    if (!failed && asks && asks != Py_None) {
+        failed = SortedDict_load_levels(self->asks, asks, mode);
+    }
+
+    if (EXPECT(failed, 0)) {
+        // a side loaded before the failure is kept, and still truncated
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        if (SortedDict_apply_done(self->bids) || SortedDict_apply_done(self->asks)) {
+            PyErr_Clear();
+        }
+        PyErr_Restore(type, value, traceback);
+
+        return NULL;
+    }
+
+    if (EXPECT(SortedDict_apply_done(self->bids) || SortedDict_apply_done(self->asks), 0)) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+// returns {'bid': (added, changed, removed), 'ask': ...} for the sides given
+PyObject* Orderbook_reconcile(const Orderbook *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"bids", "asks", NULL};
+    PyObject *bids = NULL;
+    PyObject *asks = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO", kwlist, &bids, &asks)) {
+        return NULL;
+    }
+
+    // see __init__
+    if (EXPECT(self->checksumming, 0)) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot modify orderbook while checksumming");
+        return NULL;
+    }
+
+    PyObject *ret = PyDict_New();
+    if (EXPECT(!ret, 0)) {
+        return NULL;
+    }
+
+    if (bids && bids != Py_None) {
+        PyObject *diff = SortedDict_reconcile(self->bids, bids);
+        if (EXPECT(!diff || PyDict_SetItemString(ret, "bid", diff), 0)) {
+            Py_XDECREF(diff);
+            Py_DECREF(ret);
+            return NULL;
+        }
+        Py_DECREF(diff);
+    }
+
+    if (asks && asks != Py_None) {
+        PyObject *diff = SortedDict_reconcile(self->asks, asks);
+        if (EXPECT(!diff || PyDict_SetItemString(ret, "ask", diff), 0)) {
+            Py_XDECREF(diff);
+            Py_DECREF(ret);
+            return NULL;
+        }
+        Py_DECREF(diff);
+    }
+
+    return ret;
+}
+
+
+PyObject* Orderbook_observe(const Orderbook *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"callback", "depth", NULL};
+    PyObject *callback;
+    Py_ssize_t depth = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|n", kwlist, &callback, &depth)) {
+        return NULL;
+    }
+
+    PyObject *bid = PyUnicode_FromString("bid");
+    PyObject *ask = bid ? PyUnicode_FromString("ask") : NULL;
+    int failed = !ask || SortedDict_add_observer(self->bids, callback, depth, bid);
+
+    // registered on both sides or neither
+    if (!failed && SortedDict_add_observer(self->asks, callback, depth, ask)) {
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        if (SortedDict_remove_observer(self->bids, callback)) {
+            PyErr_Clear();
+        }
+        PyErr_Restore(type, value, traceback);
+        failed = 1;
+    }
+
+    Py_XDECREF(bid);
+    Py_XDECREF(ask);
+    if (failed) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+PyObject* Orderbook_unobserve(const Orderbook *self, PyObject *callback)
+{
+    if (SortedDict_remove_observer(self->bids, callback) || SortedDict_remove_observer(self->asks, callback)) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+// both sides' journals merged in the order the changes were made
+PyObject* Orderbook_journal(const Orderbook *self, PyObject *Py_UNUSED(ignored))
+{
+    PyObject *bid = PyUnicode_FromString("bid");
+    PyObject *ask = bid ? PyUnicode_FromString("ask") : NULL;
+    PyObject *bids = ask ? SortedDict_journal_entries(self->bids, bid) : NULL;
+    PyObject *asks = bids ? SortedDict_journal_entries(self->asks, ask) : NULL;
+    PyObject *ret = asks ? PyList_New(PyList_GET_SIZE(bids) + PyList_GET_SIZE(asks)) : NULL;
+
+    if (EXPECT(!ret, 0)) {
+        goto done;
+    }
+
+    Py_ssize_t i = 0;
+    Py_ssize_t j = 0;
+    while (i < PyList_GET_SIZE(bids) || j < PyList_GET_SIZE(asks)) {
+        // building the lists ran no python, they still match the rings
+        bool take_bid = (j == PyList_GET_SIZE(asks)) ||
+                        (i < PyList_GET_SIZE(bids) && SortedDict_journal_seq(self->bids, i) < SortedDict_journal_seq(self->asks, j));
+
+        PyObject *entry = take_bid ? PyList_GET_ITEM(bids, i++) : PyList_GET_ITEM(asks, j++);
+        PyList_SET_ITEM(ret, i + j - 1, Py_NewRef(entry));
+    }
+
+done:
+    Py_XDECREF(bid);
+    Py_XDECREF(ask);
+    Py_XDECREF(bids);
+    Py_XDECREF(asks);
+
+    return ret;
+}
+
+
+PyObject* Orderbook_replay(const Orderbook *self, PyObject *journal)
+{
+    // see __init__
+    if (EXPECT(self->checksumming, 0)) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot modify orderbook while checksumming");
+        return NULL;
+    }
+
+    PyObject *entries = PySequence_Tuple(journal);
+    if (EXPECT(!entries, 0)) {
+        return NULL;
+    }
+
+    int failed = 0;
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(entries) && !failed; ++i) {
+        PyObject *entry = PyTuple_GET_ITEM(entries, i);
+        PyObject *name = (PyTuple_Check(entry) && PyTuple_GET_SIZE(entry)) ? PyTuple_GET_ITEM(entry, 0) : NULL;
+        const char *key = (name && PyUnicode_Check(name)) ? PyUnicode_AsUTF8(name) : NULL;
+        enum side_e side = key ? check_key(key) : INVALID_SIDE;
+
+        if (EXPECT(side == INVALID_SIDE, 0)) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_ValueError, "journal entries must be tuples from journal(), led by bid or ask");
+            }
+            failed = 1;
+        } else {
+            failed = SortedDict_replay_entry(side == BID ? self->bids : self->asks, entry, 1);
+        }
+    }
+    Py_DECREF(entries);
+
+    if (EXPECT(failed, 0)) {
+        // whatever was applied before the failure is kept, and still truncated
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        if (SortedDict_apply_done(self->bids) || SortedDict_apply_done(self->asks)) {
+            PyErr_Clear();
+        }
+        PyErr_Restore(type, value, traceback);
+
+        return NULL;
+    }
+
+    if (EXPECT(SortedDict_apply_done(self->bids) || SortedDict_apply_done(self->asks), 0)) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+PyObject* Orderbook_batch(const Orderbook *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"checksum", NULL};
+    int checksum = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$p", kwlist, &checksum)) {
+        return NULL;
+    }
+
+    if (checksum && !self->checksum) {
+        PyErr_SetString(PyExc_ValueError, "no checksum format specified");
+        return NULL;
+    }
+
+    return SortedDict_batch_new((PyObject *)self, self->bids, self->asks, checksum);
+}
+
+
+/* Orderbook Mapping Functions */
+Py_ssize_t Orderbook_len(const Orderbook *self)
+{
+    return SortedDict_len(self->bids) + SortedDict_len(self->asks);
+}
+
+
+PyObject *Orderbook_getitem(const Orderbook *self, PyObject *key)
+{
+    if (EXPECT(!PyUnicode_Check(key), 0)) {
+        PyErr_SetString(PyExc_ValueError, "key must one of bid/ask");
+        return NULL;
+    }
+
+    const char *name = PyUnicode_AsUTF8(key);
+    if (EXPECT(!name, 0)) {
+        return NULL;
+    }
+
+    enum side_e key_int = check_key(name);
+
+    if (key_int == BID) {
+        Py_INCREF(self->bids);
+        return (PyObject *)self->bids;
+    } else if (key_int == ASK) {
+        Py_INCREF(self->asks);
+        return (PyObject *)self->asks;
+    }
+
+    // key not bid or ask
+    PyErr_SetString(PyExc_KeyError, "key does not exist");
+    return NULL;
+}
+
+
+int Orderbook_setitem(const Orderbook *self, PyObject *key, PyObject *value)
+{
+    if (EXPECT(!PyUnicode_Check(key), 0)) {
+        PyErr_SetString(PyExc_ValueError, "key must one of bid/ask");
+        return -1;
+    }
+
+    const char *name = PyUnicode_AsUTF8(key);
+    if (EXPECT(!name, 0)) {
+        return -1;
+    }
+
+    enum side_e key_int = check_key(name);
+
+    if (EXPECT(key_int == INVALID_SIDE, 0)) {
+        PyErr_SetString(PyExc_ValueError, "key must one of bid/ask");
+        return -1;
+    }
+
+    if (EXPECT(!value, 0)) {
+        PyErr_SetString(PyExc_ValueError, "cannot delete");
+        return -1;
+    }
+
+    if (EXPECT(!PyDict_Check(value), 0)) {
+        PyErr_SetString(PyExc_ValueError, "value must be a dict");
+        return -1;
+    }
+
+    SortedDict *side = (key_int == BID) ? self->bids : self->asks;
+    if (SortedDict_replace(side, value)) {
+        return -1;
+    }
+
+    return SortedDict_notify(side);
+}
+
+
+int Orderbook_setattr(const PyObject *self, PyObject *attr, PyObject *value)
+{
+    return Orderbook_setitem((Orderbook *)self, attr, value);
+}
+
+
+PyMODINIT_FUNC PyInit_order_book(void)
+{
+    PyObject *m;
+    OrderBookModuleState *st;
+
+    if (crc32_orderbook_init() != 0) {
+        PyErr_SetString(PyExc_ImportError, "orderbook requires CRC32 CPU support");
+        return NULL;
+    }
+
+    if (PyType_Ready(&OrderbookType) < 0 || PyType_Ready(&SortedDictType) < 0 || PyType_Ready(&SortedDictIterType) < 0 || PyType_Ready(&SortedDictBatchType) < 0) {
+        return NULL;
+    }
+
+    if (PyType_Ready(&HistoryWriterType) < 0 || PyType_Ready(&HistoryReaderType) < 0) {
+        return NULL;
+    }
+    History_set_book_type(&OrderbookType);
+
+    m = PyModule_Create(&orderbookmodule);
+    if (m == NULL)
+        return NULL;
+
+    Py_INCREF(&OrderbookType);
+    if (PyModule_AddObject(m, "OrderBook", (PyObject *) &OrderbookType) < 0) {
+        Py_DECREF(&OrderbookType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&SortedDictType);
+    if (PyModule_AddObject(m, "SortedDict", (PyObject *) &SortedDictType) < 0) {
+        Py_DECREF(&SortedDictType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&HistoryWriterType);
+    if (PyModule_AddObject(m, "HistoryWriter", (PyObject *) &HistoryWriterType) < 0) {
+        Py_DECREF(&HistoryWriterType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&HistoryReaderType);
+    if (PyModule_AddObject(m, "HistoryReader", (PyObject *) &HistoryReaderType) < 0) {
+        Py_DECREF(&HistoryReaderType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    st = get_order_book_state(m);
+
+    // dont use addModule here (borrowed ref), needs a strong ref
+    PyObject* builtins = PyImport_ImportModule("builtins");
+    if (builtins == NULL) {
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    st->format = PyObject_GetAttrString(builtins, "format");
+    Py_DECREF(builtins);
+    if (st->format == NULL) {
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    st->formatf = PyUnicode_FromString("f");
+    if (st->formatf == NULL) {
+        Py_CLEAR(st->format);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    return m;
+}
+
+
+static int order_book_traverse(PyObject *m, visitproc visit, void *arg)
+{
+    OrderBookModuleState* st = get_order_book_state(m);
+    Py_VISIT(st->format);
+    Py_VISIT(st->formatf);
+    return 0;
+}
+
+
+static int order_book_clear(PyObject* m)
+{
+    OrderBookModuleState* st = get_order_book_state(m);
+    Py_CLEAR(st->format);
+    Py_CLEAR(st->formatf);
+    return 0;
+}
+
+
+static void order_book_free(PyObject *m)
+{
+    order_book_clear(m);
+}
+
+
+static OrderBookModuleState* get_order_book_state(PyObject *m)
+{
+    if (m == NULL) {
+        return (OrderBookModuleState*) PyModule_GetState(PyState_FindModule(&orderbookmodule));
+    } else {
+        return (OrderBookModuleState*) PyModule_GetState(m);
+    }
+}
+
+
+// Checksum Code
+
+/* Native rendering */
+
+// text longer than this, and the types below do not cover, comes from str()
+#define NATIVE_TEXT_MAX 96
+
+
+/*
+str(obj) for exact ints and floats, written to out which holds NATIVE_TEXT_MAX bytes.
+Decimals and everything else are left to str()
+  ret  0 - success, *len set
+  ret  1 - another type, or a value whose text str() has to give
+  ret -1 - error
+*/
+static int native_str(PyObject *obj, char *out, Py_ssize_t *len)
+{
+    if (PyLong_CheckExact(obj)) {
+        int overflow;
+        long long value = PyLong_AsLongLongAndOverflow(obj, &overflow);
+        if (EXPECT(value == -1 && PyErr_Occurred(), 0)) {
+            return -1;
+        }
+
+        if (overflow) {
+            return 1;
+        }
+
+        *len = render_fixed(value, 0, out);
+        return 0;
+    }
+
+    if (PyFloat_CheckExact(obj)) {
+        // what float's repr does, less the str object
+        char *text = PyOS_double_to_string(PyFloat_AS_DOUBLE(obj), 'r', 0, Py_DTSF_ADD_DOT_0, NULL);
+        if (EXPECT(!text, 0)) {
+            return -1;
+        }
+
+        size_t n = strlen(text);
+        int ret = 1;
+        if (n < NATIVE_TEXT_MAX) {
+            memcpy(out, text, n);
+            *len = n;
+            ret = 0;
+        }
+
+        PyMem_Free(text);
+        return ret;
+    }
+
+    return 1;
+}
+
+
+// exactly a decimal.Decimal, whose text only depends on its value
+static bool decimal_exact(PyObject *obj)
+{
+    PyObject *decimal = codec_decimal_type();
+    if (EXPECT(!decimal, 0)) {
+        PyErr_Clear();
+        return false;
+    }
+
+    return Py_IS_TYPE(obj, (PyTypeObject *)decimal);
+}
+
+
+/*
+format(obj, 'f') of a Decimal from text, its str(). the two only differ when str() gave an
+exponent, then the coefficient's digits are shifted by it. written to out which holds
+NATIVE_TEXT_MAX bytes
+  ret  0 - success, *len set
+  ret  1 - not a finite value, or text longer than NATIVE_TEXT_MAX
+*/
+static int decimal_formatf(const char *text, Py_ssize_t n, char *out, Py_ssize_t *len)
+{
+    if (n >= NATIVE_TEXT_MAX) {
+        return 1;
+    }
+
+    const char *end = text + n;
+    bool negative = (n && text[0] == '-');
+    const char *at = text + negative;
+
+    // NaN, sNaN and Infinity
+    if (at == end || *at < '0' || *at > '9') {
+        return 1;
+    }
+
+    const char *mark = memchr(at, 'E', end - at);
+    if (!mark) {
+        memcpy(out, text, n);
+        *len = n;
+        return 0;
+    }
+
+    // the coefficient, and the exponent of its last digit
+    char digits[NATIVE_TEXT_MAX];
+    Py_ssize_t count = 0;
+    int64_t exponent = 0;
+
+    for (const char *c = at; c < mark; ++c) {
+        if (*c == '.') {
+            exponent = -(mark - c - 1);
+        } else {
+            digits[count++] = *c;
+        }
+    }
+
+    const char *c = mark + 1;
+    bool below = (c < end && *c == '-');
+    c += (c < end && (*c == '-' || *c == '+'));
+    if (c == end || end - c > 6) {
+        return 1;
+    }
+
+    int64_t shift = 0;
+    for (; c < end; ++c) {
+        shift = shift * 10 + (*c - '0');
+    }
+    exponent += below ? -shift : shift;
+
+    // zero has no fixed point form with a positive exponent, it is rescaled to 0
+    if (count == 1 && digits[0] == '0' && exponent > 0) {
+        exponent = 0;
+    }
+
+    // sign, digits, a leading '0.', and zeros padding either side
+    int64_t pad = (exponent < 0) ? -exponent : exponent;
+    if (count + pad + 3 > NATIVE_TEXT_MAX) {
+        return 1;
+    }
+
+    int pos = 0;
+    if (negative) {
+        out[pos++] = '-';
+    }
+
+    if (exponent >= 0) {
+        memcpy(&out[pos], digits, count);
+        pos += count;
+        memset(&out[pos], '0', exponent);
+        pos += exponent;
+    } else {
+        int64_t point = count + exponent;
+
+        if (point <= 0) {
+            out[pos++] = '0';
+            out[pos++] = '.';
+            memset(&out[pos], '0', -point);
+            pos += -point;
+            memcpy(&out[pos], digits, count);
+            pos += count;
+        } else {
+            memcpy(&out[pos], digits, point);
+            pos += point;
+            out[pos++] = '.';
+            memcpy(&out[pos], &digits[point], count - point);
+            pos += count - point;
+        }
+    }
+
+    *len = pos;
+    return 0;
+}
+
+
+// the text str(obj) gives, rendered into out for the types native_str covers, else the utf8
+// of a str and that str (or NULL when obj is one) left in *repr for the caller to release
+static const char *value_text(PyObject *obj, char *out, Py_ssize_t *len, PyObject **repr)
+{
+    *repr = NULL;
+
+    if (PyUnicode_CheckExact(obj)) {
+        return PyUnicode_AsUTF8AndSize(obj, len);
+    }
+
+    int ret = native_str(obj, out, len);
+    if (ret <= 0) {
+        return ret ? NULL : out;
+    }
+
+    *repr = PyObject_Str(obj);
+    if (EXPECT(!*repr, 0)) {
+        return NULL;
+    }
+
+    const char *text = PyUnicode_AsUTF8AndSize(*repr, len);
+    if (EXPECT(!text, 0)) {
+        Py_CLEAR(*repr);
+    }
+
+    return text;
+}
+
+
+static int append_text(const char *text, Py_ssize_t len, uint8_t *data, int *pos, int size)
+{
+    if (EXPECT(len > size - *pos, 0)) {
+        return checksum_overflow();
+    }
+
+    memcpy(&data[*pos], text, len);
+    *pos += len;
+
+    return 0;
+}
+
+
+static int kraken_string_builder(PyObject *pydata, uint8_t *data, int *pos, int size)
+{
+    char scratch[NATIVE_TEXT_MAX];
+    Py_ssize_t len;
+    PyObject *repr;
+
+    const char *string = value_text(pydata, scratch, &len, &repr);
+    if (EXPECT(!string, 0)) {
+        return -1;
+    }
+
+    bool leading_zero = true;
+    int ret = 0;
+
+    for (Py_ssize_t i = 0; i < len && string[i]; ++i) {
+        char c = string[i];
+
+        if (c == '.') {
+            continue;
+        }
+        if (c == 'E' || c == 'e') {
+            break;
+        }
+        if (c != '0' && leading_zero) {
+            leading_zero = false;
+        }
+        if (c == '0' && leading_zero) {
+            continue;
+        }
+        if (EXPECT(*pos >= size, 0)) {
+            ret = checksum_overflow();
+            break;
+        }
+        data[(*pos)++] = c;
+    }
+
+    Py_XDECREF(repr);
+
+    return ret;
+}
+
+
+typedef struct {
+    SortedDict *side;
+    PyObject *keys;
+    PyObject *contents;
+    // fixed key books hand over their values directly, and their prices as ticks
+    // that are only boxed for the levels that have to be rendered
+    PyObject *values;
+    int64_t *ticks;
+    Py_ssize_t levels;
+    bool clipped;
+} side_snapshot;
+
+
+static int snapshot_side(SortedDict *side, Py_ssize_t limit, side_snapshot *snap)
+{
+    Py_ssize_t levels = SortedDict_len(side);
+    Py_ssize_t cached = SortedDict_cached_len(side);
+
+    if (levels > cached) {
+        levels = cached;
+    }
+
+    snap->clipped = limit >= 0 && levels > limit;
+    if (snap->clipped) {
+        levels = limit;
+    }
+
+    // copy only the window the checksum needs
+    snap->side = side;
+    snap->keys = NULL;
+    snap->contents = NULL;
+    snap->values = NULL;
+    snap->ticks = NULL;
+    snap->levels = 0;
+
+    if (side->key_type == KEY_FIXED) {
+        snap->ticks = PyMem_New(int64_t, levels ? levels : 1);
+        if (EXPECT(!snap->ticks, 0)) {
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        snap->values = SortedDict_value_window(side, levels, snap->ticks);
+        if (EXPECT(!snap->values, 0)) {
+            PyMem_Free(snap->ticks);
+            snap->ticks = NULL;
+            return -1;
+        }
+    } else {
+        snap->keys = SortedDict_key_window(side, levels);
+        if (EXPECT(!snap->keys, 0)) {
+            return -1;
+        }
+        snap->contents = Py_NewRef(side->data);
+    }
+
+    snap->levels = levels;
+
+    return 0;
+}
+
+
+static void release_side(side_snapshot *snap)
+{
+    Py_CLEAR(snap->contents);
+    Py_CLEAR(snap->values);
+    Py_CLEAR(snap->keys);
+    PyMem_Free(snap->ticks);
+    snap->ticks = NULL;
+}
+
+
+// a price and size to render: a level, or an order inside an expanded one. a fixed
+// key level leaves its price NULL until it is rendered
+typedef struct {
+    PyObject *field;
+    PyObject *amount;
+    SortedDict *fixed;      // the side to box the tick with
+    int64_t tick;
+    bool level;
+} side_entry;
+
+
+static void release_entry(side_entry *entry)
+{
+    Py_CLEAR(entry->field);
+    Py_CLEAR(entry->amount);
+}
+
+
+static int snapshot_level(const side_snapshot *snap, Py_ssize_t index, side_entry *entry)
+{
+    entry->field = NULL;
+    entry->fixed = NULL;
+    entry->tick = 0;
+    entry->level = true;
+
+    if (snap->ticks) {
+        entry->fixed = snap->side;
+        entry->tick = snap->ticks[index];
+        entry->amount = Py_NewRef(PyTuple_GET_ITEM(snap->values, index));
+        return 0;
+    }
+
+    PyObject *key = Py_NewRef(PyTuple_GET_ITEM(snap->keys, index));
+    PyObject *value = PyDict_GetItemWithError(snap->contents, key);
+
+    if (EXPECT(!value, 0)) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetObject(PyExc_KeyError, key);
+        }
+        Py_DECREF(key);
+        return -1;
+    }
+
+    entry->field = key;
+    entry->amount = Py_NewRef(value);
+
+    return 0;
+}
+
+
+/* Render caching */
+
+// a checksum being rendered into the book's buffer
+typedef struct {
+    uint8_t *data;
+    const uint8_t *previous;
+    int pos;
+    int size;
+    string_builder_t builder;
+    // every level so far was copied to where it sat in the last checksum
+    bool same;
+    uint32_t crc;
+    int length;
+} render_target;
+
+
+static void render_begin(const Orderbook *ob, render_target *target, string_builder_t builder)
+{
+    Orderbook *book = (Orderbook *)ob;
+
+    for (int side = BID; side <= ASK; ++side) {
+        RenderCache *cache = &book->renders[side];
+
+        render_release(cache->fresh, &cache->fresh_len);
+        cache->next = 0;
+    }
+
+    target->data = book->checksum_buffer;
+    target->previous = book->checksum_previous;
+    target->pos = 0;
+    target->size = book->checksum_len;
+    target->builder = builder;
+    target->same = true;
+}
+
+
+// ret true - the first 'length' bytes rendered came out exactly as last time, and
+// have the crc they had then
+static bool render_reuse(const Orderbook *ob, render_target *target, int length)
+{
+    target->length = length;
+    if (target->same && length == ob->checksum_crc_len) {
+        target->crc = ob->checksum_crc;
+        return true;
+    }
+
+    return false;
+}
+
+
+// the crc of the first 'length' bytes rendered
+static void render_hash(const Orderbook *ob, render_target *target, int length)
+{
+    if (!render_reuse(ob, target, length)) {
+        target->crc = crc32_orderbook(target->data, length);
+    }
+}
+
+
+static PyObject *render_checksum(const Orderbook *ob, render_target *target, int length)
+{
+    render_hash(ob, target, length);
+
+    return PyLong_FromUnsignedLong(target->crc);
+}
+
+
+// keep the levels just rendered for the next checksum, or drop them when it failed
+static void render_end(const Orderbook *ob, const render_target *target, bool keep)
+{
+    Orderbook *book = (Orderbook *)ob;
+
+    for (int side = BID; side <= ASK; ++side) {
+        RenderCache *cache = &book->renders[side];
+
+        if (!keep) {
+            render_release(cache->fresh, &cache->fresh_len);
+            continue;
+        }
+
+        render_release(cache->held, &cache->held_len);
+
+        LevelRender *held = cache->held;
+        cache->held = cache->fresh;
+        cache->held_len = cache->fresh_len;
+        cache->fresh = held;
+        cache->fresh_len = 0;
+    }
+
+    if (keep) {
+        uint8_t *previous = book->checksum_previous;
+        book->checksum_previous = book->checksum_buffer;
+        book->checksum_buffer = previous;
+        // until render_remember, the crc held is not of the text kept
+        book->checksum_crc_len = -1;
+    }
+}
+
+
+// keep the crc of the text kept by render_end, for the next checksum to reuse
+static void render_remember(const Orderbook *ob, const render_target *target)
+{
+    Orderbook *book = (Orderbook *)ob;
+
+    book->checksum_crc = target->crc;
+    book->checksum_crc_len = target->length;
+}
+
+
+// the text of these only depends on a value the object cannot change
+static bool render_stable(PyObject *obj)
+{
+    if (PyUnicode_CheckExact(obj) || PyLong_CheckExact(obj) || PyFloat_CheckExact(obj)) {
+        return true;
+    }
+
+    return decimal_exact(obj);
+}
+
+
+// the level's text from the last checksum. levels only move a few places between
+// checksums, when one above them is added or deleted, so only a short run is searched
+static const LevelRender *render_lookup(RenderCache *cache, const side_entry *entry)
+{
+    Py_ssize_t end = cache->next + 3;
+
+    if (end > cache->held_len) {
+        end = cache->held_len;
+    }
+
+    for (Py_ssize_t k = cache->next; k < end; ++k) {
+        const LevelRender *render = &cache->held[k];
+
+        if (render->size == entry->amount && (entry->fixed ? render->price == entry->fixed->fixed.tick && render->tick == entry->tick : render->price == entry->field)) {
+            cache->next = k + 1;
+            return render;
+        }
+    }
+
+    return NULL;
+}
+
+
+static int render_byte(render_target *target, uint8_t byte)
+{
+    if (EXPECT(target->pos >= target->size, 0)) {
+        return checksum_overflow();
+    }
+
+    target->data[target->pos++] = byte;
+
+    return 0;
+}
+
+
+static int render_copy(render_target *target, int at, int len)
+{
+    if (EXPECT(len > target->size - target->pos, 0)) {
+        return checksum_overflow();
+    }
+
+    memcpy(&target->data[target->pos], &target->previous[at], len);
+    target->pos += len;
+
+    return 0;
+}
+
+
+// render the price, then the size, each followed by the separator unless it is 0
+static int render_entry(render_target *target, RenderCache *cache, side_entry *entry, char separator, bool negate_amount)
+{
+    const LevelRender *hit = (entry->level && cache) ? render_lookup(cache, entry) : NULL;
+    LevelRender render = {0};
+
+    render.price_at = target->pos;
+    target->same = target->same && hit && hit->price_at == render.price_at;
+    if (hit) {
+        if (EXPECT(render_copy(target, hit->price_at, hit->price_len), 0)) {
+            return -1;
+        }
+    } else {
+        if (!entry->field && EXPECT(!(entry->field = SortedDict_box_tick(entry->fixed, entry->tick)), 0)) {
+            return -1;
+        }
+        if (EXPECT(target->builder(entry->field, target->data, &target->pos, target->size), 0)) {
+            return -1;
+        }
+    }
+    render.price_len = target->pos - render.price_at;
+
+    if (separator && EXPECT(render_byte(target, separator), 0)) {
+        return -1;
+    }
+    if (negate_amount && EXPECT(render_byte(target, '-'), 0)) {
+        return -1;
+    }
+
+    render.size_at = target->pos;
+    if (hit) {
+        if (EXPECT(render_copy(target, hit->size_at, hit->size_len), 0)) {
+            return -1;
+        }
+    } else if (EXPECT(target->builder(entry->amount, target->data, &target->pos, target->size), 0)) {
+        return -1;
+    }
+    render.size_len = target->pos - render.size_at;
+
+    if (separator && EXPECT(render_byte(target, separator), 0)) {
+        return -1;
+    }
+
+    if (!entry->level || !cache || cache->fresh_len >= cache->cap) {
+        return 0;
+    }
+
+    if (!hit && !(render_stable(entry->amount) && (entry->fixed || render_stable(entry->field)))) {
+        return 0;
+    }
+
+    render.price = Py_NewRef(entry->fixed ? entry->fixed->fixed.tick : entry->field);
+    render.size = Py_NewRef(entry->amount);
+    render.tick = entry->tick;
+    cache->fresh[cache->fresh_len++] = render;
+
+    return 0;
+}
+
+
+static int str_string_builder(PyObject *pydata, uint8_t *data, int *pos, int size)
+{
+    char scratch[NATIVE_TEXT_MAX];
+    Py_ssize_t len;
+    PyObject *repr;
+
+    const char *string = value_text(pydata, scratch, &len, &repr);
+    if (EXPECT(!string, 0)) {
+        return -1;
+    }
+
+    int ret = append_text(string, len, data, pos, size);
+
+    Py_XDECREF(repr);
+
+    return ret;
+}
+
+
+static int formatf_string_builder(PyObject *pydata, uint8_t *data, int *pos, int size)
+{
+    OrderBookModuleState* st = get_order_book_state(NULL);
+
+    PyObject* repr = PyObject_CallFunctionObjArgs(st->format, pydata, st->formatf, NULL);
+    if (EXPECT(!repr, 0)) {
+        return -1;
+    }
+
+    Py_ssize_t len;
+    const char *string = PyUnicode_AsUTF8AndSize(repr, &len);
+    int ret = string ? append_text(string, len, data, pos, size) : -1;
+
+    Py_DECREF(repr);
+    return ret;
+}
+
+
+// replace the str() of pydata rendered from start on with format(pydata, 'f'), worked out
+// from that text for Decimals
+static int formatf_rendered(PyObject *pydata, uint8_t *data, int start, int *pos, int size)
+{
+    char scratch[NATIVE_TEXT_MAX];
+    Py_ssize_t len;
+
+    bool native = decimal_exact(pydata) && !decimal_formatf((const char *)&data[start], *pos - start, scratch, &len);
+    *pos = start;
+
+    return native ? append_text(scratch, len, data, pos, size) : formatf_string_builder(pydata, data, pos, size);
+}
+
+
+static int okx_string_builder(PyObject *pydata, uint8_t *data, int *pos, int size)
+{
+    int startpos = *pos;
+    if (EXPECT(str_string_builder(pydata, data, pos, size), 0)) {
+        return -1;
+    }
+
+    // default 'str' formatting is wrong when the value is in scientific notation
+    if (EXPECT((long)memchr(&data[startpos], (char) 'E', *pos - startpos), (long)0)) {
+        return formatf_rendered(pydata, data, startpos, pos, size);
+    }
+
+    return 0;
+}
+
+
+static int bitfinex_string_builder(PyObject *pydata, uint8_t *data, int *pos, int size)
+{
+    int startpos = *pos;
+    if (EXPECT(str_string_builder(pydata, data, pos, size), 0)) {
+        return -1;
+    }
+
+    uint8_t *exponent = memchr(&data[startpos], 'E', *pos - startpos);
+    if (EXPECT(exponent != NULL, 0)) {
+        if (exponent + 1 < &data[*pos] && exponent[1] == '-') {
+            *exponent = 'e';
+        } else {
+            return formatf_rendered(pydata, data, startpos, pos, size);
+        }
+    }
+
+    return 0;
 }
 
 
 typedef struct {
-    PyObject *keys;
-    PyObject *contents;
-    Py_ssize_t levels;
-} side_snapshot;
+    const side_snapshot *snap;
+    PyObject *orders;
+    PyObject *amounts;
+    Py_ssize_t level;
+    Py_ssize_t order;
+    bool expand_orders;
+} side_cursor;
 
 
-static int snapshot_side(SortedDict *side, Py_ssize_t limit, side_snapshot *snap)
+static void cursor_init(side_cursor *cursor, const side_snapshot *snap, bool expand_orders)
 {
-    Py_ssize_t levels = SortedDict_len(side);
-    Py_ssize_t cached = side->k_len;
+    cursor->snap = snap;
+    cursor->orders = NULL;
+    cursor->amounts = NULL;
+    cursor->level = 0;
+    cursor->order = 0;
+    cursor->expand_orders = expand_orders;
+}
 
-    if (levels > cached) {
-        levels = cached;
+
+static void cursor_close_level(side_cursor *cursor)
+{
+    Py_CLEAR(cursor->orders);
+    Py_CLEAR(cursor->amounts);
+}
+
+
+// orders resting at one price are checksummed by ascending id, which is not the
+// order the level holds them in - a dict keeps them in the order they arrived
+static int cursor_open_level(side_cursor *cursor, PyObject *level)
+{
+    PyObject *orders = PyDict_Keys(level);
+    if (EXPECT(!orders, 0)) {
+        return -1;
     }
 
-    if (limit >= 0 && levels > limit) {
-        levels = limit;
+    if (EXPECT(PyList_Sort(orders) < 0, 0)) {
+        Py_DECREF(orders);
+        return -1;
     }
 
-    // copy only the window the checksum needs
-    snap->keys = SortedDict_key_window(side, levels);
-    if (EXPECT(!snap->keys, 0)) {
-        snap->contents = NULL;
-        snap->levels = 0;
+    cursor->orders = orders;
+    cursor->amounts = Py_NewRef(level);
+    cursor->order = 0;
+
+    return 0;
+}
+
+
+static int cursor_next(side_cursor *cursor, side_entry *entry)
+{
+    while (true) {
+        if (cursor->orders) {
+            if (cursor->order < PyList_GET_SIZE(cursor->orders)) {
+                PyObject *id = PyList_GET_ITEM(cursor->orders, cursor->order++);
+                PyObject *value = PyDict_GetItemWithError(cursor->amounts, id);
+
+                if (EXPECT(!value, 0)) {
+                    if (!PyErr_Occurred()) {
+                        PyErr_SetObject(PyExc_KeyError, id);
+                    }
+                    return -1;
+                }
+
+                entry->field = Py_NewRef(id);
+                entry->amount = Py_NewRef(value);
+                entry->fixed = NULL;
+                entry->level = false;
+
+                return 1;
+            }
+
+            cursor_close_level(cursor);
+        }
+
+        if (cursor->level >= cursor->snap->levels) {
+            return 0;
+        }
+
+        if (EXPECT(snapshot_level(cursor->snap, cursor->level++, entry), 0)) {
+            return -1;
+        }
+
+        if (!cursor->expand_orders || !PyDict_Check(entry->amount)) {
+            return 1;
+        }
+
+        int ret = cursor_open_level(cursor, entry->amount);
+        release_entry(entry);
+
+        if (EXPECT(ret, 0)) {
+            return -1;
+        }
+    }
+}
+
+
+static int append_entry(side_cursor *cursor, render_target *target, RenderCache *cache, char separator, bool negate_amount)
+{
+    side_entry entry;
+
+    int ret = cursor_next(cursor, &entry);
+    if (ret != 1) {
+        return ret;
+    }
+
+    ret = render_entry(target, cache, &entry, separator, negate_amount) ? -1 : 1;
+    release_entry(&entry);
+
+    return ret;
+}
+
+
+/* Checksum formats */
+
+// kraken style digits of the text rendered from start on: no point, leading zeros or exponent
+static void strip_rendered(uint8_t *data, int start, int *pos)
+{
+    bool leading_zero = true;
+    int out = start;
+
+    for (int i = start; i < *pos; ++i) {
+        uint8_t c = data[i];
+
+        if (c == '.') {
+            continue;
+        }
+        if (c == 'E' || c == 'e') {
+            break;
+        }
+        if (c == '0' && leading_zero) {
+            continue;
+        }
+        leading_zero = false;
+        data[out++] = c;
+    }
+
+    *pos = out;
+}
+
+
+static int strip_fixed_string_builder(PyObject *pydata, uint8_t *data, int *pos, int size)
+{
+    int start = *pos;
+    if (EXPECT(okx_string_builder(pydata, data, pos, size), 0)) {
         return -1;
     }
 
-    snap->contents = Py_NewRef(side->data);
-    snap->levels = levels;
+    strip_rendered(data, start, pos);
+    return 0;
+}
+
+
+static int strip_lower_string_builder(PyObject *pydata, uint8_t *data, int *pos, int size)
+{
+    int start = *pos;
+    if (EXPECT(bitfinex_string_builder(pydata, data, pos, size), 0)) {
+        return -1;
+    }
 
+    strip_rendered(data, start, pos);
     return 0;
 }
 
 
-static void release_side(side_snapshot *snap)
+// the builder for each [strip][exponent] pair, chosen once when a format is made
+static const string_builder_t format_builders[2][3] = {
+    {str_string_builder, okx_string_builder, bitfinex_string_builder},
+    {kraken_string_builder, strip_fixed_string_builder, strip_lower_string_builder},
+};
+
+
+static const ChecksumFormat builtin_formats[] = {
+    {"KRAKEN", 10, 2048, LAYOUT_ASKS_BIDS, 0, false, true, EXPONENT_KEEP, false, kraken_string_builder},
+    {"OKX", 25, 4096, LAYOUT_INTERLEAVED, ':', false, false, EXPONENT_FIXED, false, okx_string_builder},
+    {"BITGET", 25, 4096, LAYOUT_INTERLEAVED, ':', false, false, EXPONENT_KEEP, false, str_string_builder},
+    {"BITFINEX", 25, 4096, LAYOUT_INTERLEAVED, ':', true, false, EXPONENT_LOWER, true, bitfinex_string_builder},
+};
+
+#define BUILTIN_FORMATS ((int)(sizeof(builtin_formats) / sizeof(builtin_formats[0])))
+#define FORMAT_NAME_MAX 64
+// render buffer a price and size pair, what the built in formats allow
+#define FORMAT_PAIR_BYTES 82
+#define FORMAT_DEPTH_MAX 1000
+
+// book encodings give a built in format by its index, then these
+#define FORMAT_TAG_NONE 4
+#define FORMAT_TAG_NAMED 5
+
+
+// formats added from python, never freed as books point at them
+static ChecksumFormat **registered_formats = NULL;
+static Py_ssize_t registered_len = 0;
+
+
+static const ChecksumFormat *registered_format(const char *name, Py_ssize_t len)
 {
-    Py_CLEAR(snap->contents);
-    Py_CLEAR(snap->keys);
+    for (Py_ssize_t i = 0; i < registered_len; ++i) {
+        const char *candidate = registered_formats[i]->name;
+
+        if ((Py_ssize_t)strlen(candidate) == len && memcmp(candidate, name, len) == 0) {
+            return registered_formats[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static const ChecksumFormat *builtin_format(const char *name, Py_ssize_t len)
+{
+    // the built in names keep the prefix matching they have always had
+    if (strncmp(name, "KRAKEN", len) == 0) {
+        return &builtin_formats[0];
+    }
+    if (len > 2 && (strncmp(name, "OKX", 3) == 0 || strncmp(name, "OKCO", 4) == 0)) {
+        return &builtin_formats[1];
+    }
+    if (strncmp(name, "BITGET", len) == 0) {
+        return &builtin_formats[2];
+    }
+    if (strncmp(name, "BITFINEX", len) == 0) {
+        return &builtin_formats[3];
+    }
+
+    return NULL;
+}
+
+
+static const ChecksumFormat *checksum_format_find(const char *name, Py_ssize_t len)
+{
+    const ChecksumFormat *format = builtin_format(name, len);
+
+    return format ? format : registered_format(name, len);
+}
+
+
+static int encode_checksum_format(const ChecksumFormat *format, CodecWriter *w)
+{
+    if (!format) {
+        return codec_put_u8(w, FORMAT_TAG_NONE);
+    }
+
+    if (format >= builtin_formats && format < builtin_formats + BUILTIN_FORMATS) {
+        return codec_put_u8(w, (uint8_t)(format - builtin_formats));
+    }
+
+    size_t len = strlen(format->name);
+    return codec_put_u8(w, FORMAT_TAG_NAMED) || codec_put_varint(w, len) || codec_put(w, format->name, len);
 }
 
 
-static int snapshot_level(const side_snapshot *snap, Py_ssize_t index, PyObject **price, PyObject **amount)
-{
-    PyObject *key = Py_NewRef(PyTuple_GET_ITEM(snap->keys, index));
-    PyObject *value = PyDict_GetItemWithError(snap->contents, key);
+// a registered format has to be registered again, under the same name, in the process decoding it
+static int decode_checksum_format(CodecReader *r, const ChecksumFormat **format)
+{
+    uint8_t tag;
+    uint64_t len;
+    char name[FORMAT_NAME_MAX];
+
+    if (codec_get_u8(r, &tag)) {
+        return -1;
+    }
+
+    if (tag < BUILTIN_FORMATS || tag == FORMAT_TAG_NONE) {
+        *format = (tag == FORMAT_TAG_NONE) ? NULL : &builtin_formats[tag];
+        return 0;
+    }
+
+    if (tag != FORMAT_TAG_NAMED || codec_get_varint(r, &len) || len > FORMAT_NAME_MAX) {
+        return PyErr_Occurred() ? -1 : codec_corrupt();
+    }
 
-    if (EXPECT(!value, 0)) {
-        if (!PyErr_Occurred()) {
-            PyErr_SetObject(PyExc_KeyError, key);
-        }
-        Py_DECREF(key);
+    if (codec_get(r, name, (Py_ssize_t)len)) {
         return -1;
     }
 
-    *price = key;
-    *amount = Py_NewRef(value);
+    *format = registered_format(name, (Py_ssize_t)len);
+    if (!*format) {
+        PyErr_Format(PyExc_ValueError, "checksum format '%.*s' is not registered", (int)len, name);
+        return -1;
+    }
 
     return 0;
 }
 
 
-static int kraken_populate_side(const side_snapshot *snap, uint8_t *data, int *pos, int size)
+// the index of arg in the NULL terminated choices
+static int choose(const char *arg, const char *const *choices, int *out, const char *error)
 {
-    for(Py_ssize_t i = 0; i < snap->levels; ++i) {
-        PyObject *price = NULL;
-        PyObject *amount = NULL;
-
-        if (EXPECT(snapshot_level(snap, i, &price, &amount), 0)) {
-            return -1;
-        }
-
-        int ret = kraken_string_builder(price, data, pos, size);
-        if (EXPECT(ret == 0, 1)) {
-            ret = kraken_string_builder(amount, data, pos, size);
-        }
-
-        Py_DECREF(amount);
-        Py_DECREF(price);
-
-        if (EXPECT(ret, 0)) {
-            return -1;
+    for (int i = 0; choices[i]; ++i) {
+        if (strcmp(arg, choices[i]) == 0) {
+            *out = i;
+            return 0;
         }
     }
 
-    return 0;
+    PyErr_SetString(PyExc_ValueError, error);
+    return -1;
 }
 
 
-static PyObject* kraken_checksum(const Orderbook *ob)
+PyObject *Orderbook_register_checksum_format(PyObject *module, PyObject *args, PyObject *kwargs)
 {
-    if (EXPECT(ob->max_depth && ob->max_depth < 10, 0)) {
-        PyErr_SetString(PyExc_ValueError, "Max depth is less than usual number of levels for Kraken checksum");
+    static char *kwlist[] = {"name", "depth", "layout", "separator", "ask_sign", "strip", "exponent", "orders", NULL};
+    static const char *const layouts[] = {"interleaved", "asks_bids", "bids_asks", NULL};
+    static const char *const exponents[] = {"keep", "fixed", "lower", NULL};
+    const char *name;
+    Py_ssize_t name_len;
+    Py_ssize_t depth;
+    const char *layout_arg = "interleaved";
+    const char *separator = ":";
+    Py_ssize_t separator_len = 1;
+    int ask_sign = 0;
+    int strip = 0;
+    const char *exponent_arg = "keep";
+    int orders = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#n|$ss#ppsp", kwlist, &name, &name_len, &depth, &layout_arg, &separator, &separator_len, &ask_sign, &strip, &exponent_arg, &orders)) {
         return NULL;
     }
 
-    // 10 is the kraken defined number of price/size pairs to use from each side
-    side_snapshot asks, bids;
-    if (EXPECT(snapshot_side(ob->asks, 10, &asks), 0)) {
+    int layout, exponent;
+    if (choose(layout_arg, layouts, &layout, "layout must be one of interleaved, asks_bids or bids_asks") ||
+        choose(exponent_arg, exponents, &exponent, "exponent must be one of keep, fixed or lower")) {
         return NULL;
     }
 
-    if (EXPECT(snapshot_side(ob->bids, 10, &bids), 0)) {
-        release_side(&asks);
+    if (name_len < 1 || name_len > FORMAT_NAME_MAX || (Py_ssize_t)strlen(name) != name_len) {
+        PyErr_Format(PyExc_ValueError, "name must be 1 to %d characters", FORMAT_NAME_MAX);
         return NULL;
     }
 
-    PyObject *ret = NULL;
-    int pos = 0;
+    if (depth < 1 || depth > FORMAT_DEPTH_MAX) {
+        PyErr_Format(PyExc_ValueError, "depth must be between 1 and %d", FORMAT_DEPTH_MAX);
+        return NULL;
+    }
 
-    if (EXPECT(kraken_populate_side(&asks, ob->checksum_buffer, &pos, ob->checksum_len), 0)) {
-        goto done;
+    if (separator_len > 1 || (separator_len && (separator[0] & 0x80))) {
+        PyErr_SetString(PyExc_ValueError, "separator must be empty or one ascii character");
+        return NULL;
     }
 
-    if (EXPECT(kraken_populate_side(&bids, ob->checksum_buffer, &pos, ob->checksum_len), 0)) {
-        goto done;
+    if (checksum_format_find(name, name_len)) {
+        PyErr_Format(PyExc_ValueError, "'%s' already names a checksum format", name);
+        return NULL;
     }
 
-    ret = PyLong_FromUnsignedLong(crc32_orderbook(ob->checksum_buffer, pos));
+    ChecksumFormat **formats = PyMem_Resize(registered_formats, ChecksumFormat *, registered_len + 1);
+    if (!formats) {
+        return PyErr_NoMemory();
+    }
+    registered_formats = formats;
+
+    ChecksumFormat *format = PyMem_Malloc(sizeof(ChecksumFormat));
+    char *owned = PyMem_Malloc(name_len + 1);
+    if (!format || !owned) {
+        PyMem_Free(format);
+        PyMem_Free(owned);
+        return PyErr_NoMemory();
+    }
+
+    memcpy(owned, name, name_len + 1);
+    *format = (ChecksumFormat) {
+        .name = owned,
+        .depth = (uint32_t)depth,
+        .buffer_len = (uint32_t)(depth * 2 * FORMAT_PAIR_BYTES < 2048 ? 2048 : depth * 2 * FORMAT_PAIR_BYTES),
+        .layout = layout,
+        .separator = separator_len ? separator[0] : 0,
+        .ask_sign = ask_sign,
+        .strip = strip,
+        .exponent = exponent,
+        .orders = orders,
+        .builder = format_builders[strip][exponent],
+    };
+    registered_formats[registered_len++] = format;
+
+    Py_RETURN_NONE;
+}
 
-done:
-    release_side(&bids);
-    release_side(&asks);
 
-    return ret;
-}
+// lay out the two sides' entries, noting each side that ran out of levels
+typedef int (*layout_fn)(render_target *target, RenderCache *caches, side_cursor *cursors, const ChecksumFormat *format, bool *exhausted);
 
 
-// append the utf8 straight from the unicode object's cached utf8 view
-static int append_str(PyObject *repr, uint8_t *data, int *pos, int size)
+// bid, ask, bid, ask ...
+static int layout_interleaved(render_target *target, RenderCache *caches, side_cursor *cursors, const ChecksumFormat *format, bool *exhausted)
 {
-    Py_ssize_t len;
-    const char *string = PyUnicode_AsUTF8AndSize(repr, &len);
-    if (EXPECT(!string, 0)) {
-        return -1;
-    }
+    int bid = 1;
+    int ask = 1;
 
-    if (EXPECT(len > size - *pos, 0)) {
-        return checksum_overflow();
+    for (uint32_t i = 0; i < format->depth; ++i) {
+        if (EXPECT((bid = append_entry(&cursors[BID], target, &caches[BID], format->separator, false)) < 0, 0)) {
+            return -1;
+        }
+
+        if (EXPECT((ask = append_entry(&cursors[ASK], target, &caches[ASK], format->separator, format->ask_sign)) < 0, 0)) {
+            return -1;
+        }
     }
 
-    memcpy(&data[*pos], string, len);
-    *pos += len;
+    exhausted[BID] = (bid == 0);
+    exhausted[ASK] = (ask == 0);
 
     return 0;
 }
 
 
-static int str_string_builder(PyObject *pydata, uint8_t *data, int *pos, int size)
+// every entry of one side, then every entry of the other
+static int layout_sides(render_target *target, RenderCache *caches, side_cursor *cursors, const ChecksumFormat *format, bool *exhausted)
 {
-    PyObject *repr = PyObject_Str(pydata);
-    if (EXPECT(!repr, 0)) {
-        return -1;
-    }
+    const int order[2][2] = {{ASK, BID}, {BID, ASK}};
+    const int *sides = order[format->layout == LAYOUT_BIDS_ASKS];
 
-    int ret = append_str(repr, data, pos, size);
+    for (int s = 0; s < 2; ++s) {
+        int side = sides[s];
+        bool negate = (side == ASK) && format->ask_sign;
+        int ret = 1;
 
-    Py_DECREF(repr);
+        for (uint32_t i = 0; i < format->depth && ret == 1; ++i) {
+            ret = append_entry(&cursors[side], target, &caches[side], format->separator, negate);
+        }
 
-    return ret;
+        if (EXPECT(ret < 0, 0)) {
+            return -1;
+        }
+        exhausted[side] = (ret == 0);
+    }
+
+    return 0;
 }
 
 
-static int formatf_string_builder(PyObject *pydata, uint8_t *data, int *pos, int size)
-{
-    OrderBookModuleState* st = get_order_book_state(NULL);
+static const layout_fn format_layouts[] = {layout_interleaved, layout_sides, layout_sides};
 
-    PyObject* repr = PyObject_CallFunctionObjArgs(st->format, pydata, st->formatf, NULL);
-    if (EXPECT(!repr, 0)) {
+
+// render the book into the target, and report the length to hash
+static int render_book(const Orderbook *ob, render_target *target, int *length)
+{
+    const ChecksumFormat *format = ob->checksum;
+    Orderbook *book = (Orderbook *)ob;
+    side_snapshot snaps[2];
+    // a level of orders can be empty, so an expanded side may need more than depth levels
+    Py_ssize_t limit = format->depth;
+
+again:
+    if (EXPECT(snapshot_side(ob->bids, limit, &snaps[BID]), 0)) {
+        return -1;
+    }
+    if (EXPECT(snapshot_side(ob->asks, limit, &snaps[ASK]), 0)) {
+        release_side(&snaps[BID]);
         return -1;
     }
 
-    int ret = append_str(repr, data, pos, size);
+    side_cursor cursors[2];
+    cursor_init(&cursors[BID], &snaps[BID], format->orders);
+    cursor_init(&cursors[ASK], &snaps[ASK], format->orders);
+
+    bool exhausted[2];
+    int ret = format_layouts[format->layout](target, book->renders, cursors, format, exhausted);
+    bool retry = ret == 0 && format->orders && limit >= 0 && ((exhausted[BID] && snaps[BID].clipped) || (exhausted[ASK] && snaps[ASK].clipped));
+
+    for (int side = BID; side <= ASK; ++side) {
+        cursor_close_level(&cursors[side]);
+        release_side(&snaps[side]);
+    }
+
+    if (retry) {
+        render_begin(ob, target, target->builder);
+        limit = -1;
+        goto again;
+    }
+
+    // the separator after the last entry is not part of the text
+    *length = (format->separator && target->pos > 0) ? target->pos - 1 : target->pos;
 
-    Py_DECREF(repr);
     return ret;
 }
 
 
-static int okx_string_builder(PyObject *pydata, uint8_t *data, int *pos, int size)
+// render the book's checksum text, leaving the length to hash. a failed render is
+// already undone
+static int checksum_render(const Orderbook *ob, render_target *target, int *length)
 {
-    int startpos = *pos;
-    if (EXPECT(str_string_builder(pydata, data, pos, size), 0)) {
+    const ChecksumFormat *format = ob->checksum;
+
+    if (EXPECT(ob->max_depth && ob->max_depth < format->depth, 0)) {
+        PyErr_SetString(PyExc_ValueError, "Max depth is less than minimum number of levels for checksum");
         return -1;
     }
 
-    // default 'str' formatting is wrong when the value is in scientific notation
-    if (EXPECT((long)memchr(&data[startpos], (char) 'E', *pos - startpos), (long)0)) {
-        *pos = startpos;
-        if (EXPECT(formatf_string_builder(pydata, data, pos, size), 0)) {
-            return -1;
-        }
+    render_begin(ob, target, format->builder);
+
+    if (EXPECT(render_book(ob, target, length), 0)) {
+        render_end(ob, target, false);
+        return -1;
     }
 
     return 0;
 }
 
 
-static int bitfinex_string_builder(PyObject *pydata, uint8_t *data, int *pos, int size)
+static PyObject* calculate_checksum(const Orderbook *ob)
 {
-    int startpos = *pos;
-    if (EXPECT(str_string_builder(pydata, data, pos, size), 0)) {
-        return -1;
+    render_target target;
+    int length;
+
+    if (EXPECT(checksum_render(ob, &target, &length), 0)) {
+        return NULL;
     }
 
-    uint8_t *exponent = memchr(&data[startpos], 'E', *pos - startpos);
-    if (EXPECT(exponent != NULL, 0)) {
-        if (exponent + 1 < &data[*pos] && exponent[1] == '-') {
-            *exponent = 'e';
-        } else {
-            *pos = startpos;
-            if (EXPECT(formatf_string_builder(pydata, data, pos, size), 0)) {
-                return -1;
-            }
-        }
+    PyObject *ret = render_checksum(ob, &target, length);
+    render_end(ob, &target, ret != NULL);
+    if (EXPECT(ret != NULL, 1)) {
+        render_remember(ob, &target);
     }
 
-    return 0;
+    return ret;
 }
 
 
-typedef struct {
-    const side_snapshot *snap;
-    PyObject *orders;
-    PyObject *amounts;
-    Py_ssize_t level;
-    Py_ssize_t order;
-    bool expand_orders;
-} side_cursor;
+/* Checksum verification */
 
+// a helper thread is only started for at least this many bytes of text to hash
+#define VERIFY_THREAD_BYTES (1 << 18)
+#define VERIFY_THREADS_MAX 16
 
-static void cursor_init(side_cursor *cursor, const side_snapshot *snap, bool expand_orders)
-{
-    cursor->snap = snap;
-    cursor->orders = NULL;
-    cursor->amounts = NULL;
-    cursor->level = 0;
-    cursor->order = 0;
-    cursor->expand_orders = expand_orders;
-}
 
+typedef struct {
+    Orderbook *book;
+    render_target target;
+    int cost;               // bytes to hash, 0 when the crc of the text is already known
+    uint32_t expected;
+    Py_ssize_t first;       // the job that rendered this book, -1 before it is rendered
+} verify_job;
 
-static void cursor_close_level(side_cursor *cursor)
-{
-    Py_CLEAR(cursor->orders);
-    Py_CLEAR(cursor->amounts);
-}
 
+typedef struct {
+    verify_job *jobs;
+    Py_ssize_t start;
+    Py_ssize_t stop;
+} verify_share;
 
-// orders resting at one price are checksummed by ascending id, which is not the
-// order the level holds them in - a dict keeps them in the order they arrived
-static int cursor_open_level(side_cursor *cursor, PyObject *level)
+
+// an exchange's checksum as the crc it stands for. some send it as a signed 32 bit int
+static int verify_expected(PyObject *obj, uint32_t *expected)
 {
-    PyObject *orders = PyDict_Keys(level);
-    if (EXPECT(!orders, 0)) {
-        return -1;
-    }
+    long long value = PyLong_AsLongLong(obj);
 
-    if (EXPECT(PyList_Sort(orders) < 0, 0)) {
-        Py_DECREF(orders);
+    if (EXPECT(value == -1 && PyErr_Occurred(), 0)) {
+        if (PyErr_ExceptionMatches(PyExc_OverflowError)) {
+            goto range;
+        }
         return -1;
     }
 
-    cursor->orders = orders;
-    cursor->amounts = Py_NewRef(level);
-    cursor->order = 0;
+    if (EXPECT(value < INT32_MIN || value > UINT32_MAX, 0)) {
+        goto range;
+    }
 
+    *expected = (uint32_t)value;
     return 0;
+
+range:
+    PyErr_Clear();
+    PyErr_SetString(PyExc_ValueError, "expected checksum must fit in 32 bits");
+    return -1;
 }
 
 
-static int cursor_next(side_cursor *cursor, PyObject **field, PyObject **amount)
+// hash the text of a run of jobs. touches no python objects, so runs without the GIL
+static void *verify_hash(void *arg)
 {
-    while (true) {
-        if (cursor->orders) {
-            if (cursor->order < PyList_GET_SIZE(cursor->orders)) {
-                PyObject *id = PyList_GET_ITEM(cursor->orders, cursor->order++);
-                PyObject *value = PyDict_GetItemWithError(cursor->amounts, id);
-
-                if (EXPECT(!value, 0)) {
-                    if (!PyErr_Occurred()) {
-                        PyErr_SetObject(PyExc_KeyError, id);
-                    }
-                    return -1;
-                }
-
-                *field = Py_NewRef(id);
-                *amount = Py_NewRef(value);
+    verify_share *share = arg;
 
-                return 1;
-            }
+    for (Py_ssize_t i = share->start; i < share->stop; ++i) {
+        verify_job *job = &share->jobs[i];
 
-            cursor_close_level(cursor);
+        if (job->cost) {
+            job->target.crc = crc32_orderbook(job->target.data, job->cost);
         }
+    }
 
-        if (cursor->level >= cursor->snap->levels) {
-            return 0;
-        }
+    return NULL;
+}
 
-        PyObject *price = NULL;
-        PyObject *value = NULL;
 
-        if (EXPECT(snapshot_level(cursor->snap, cursor->level++, &price, &value), 0)) {
-            return -1;
+// hash every job, splitting them between up to 'threads' threads by the text each has to
+// hash. shares a helper cannot be started for are hashed on this thread
+static void verify_hash_all(verify_job *jobs, Py_ssize_t count, verify_share *shares, pthread_t *helpers, int threads, Py_ssize_t bytes)
+{
+    Py_ssize_t per = bytes / threads + 1;
+    Py_ssize_t start = 0;
+    Py_ssize_t taken = 0;
+    int used = 0;
+
+    for (int t = 0; t < threads && start < count; ++t) {
+        Py_ssize_t stop = start;
+        Py_ssize_t limit = (t == threads - 1) ? bytes : taken + per;
+
+        while (stop < count && (taken < limit || stop == start)) {
+            taken += jobs[stop].cost;
+            ++stop;
         }
 
-        if (!cursor->expand_orders || !PyDict_Check(value)) {
-            *field = price;
-            *amount = value;
+        shares[used++] = (verify_share) {.jobs = jobs, .start = start, .stop = stop};
+        start = stop;
+    }
+    if (start < count) {
+        shares[used - 1].stop = count;
+    }
 
-            return 1;
-        }
+    // the first share is this thread's
+    bool started[VERIFY_THREADS_MAX] = {false};
+    for (int t = 1; t < used; ++t) {
+        started[t] = pthread_create(&helpers[t], NULL, verify_hash, &shares[t]) == 0;
+    }
 
-        int ret = cursor_open_level(cursor, value);
-        Py_DECREF(value);
-        Py_DECREF(price);
+    verify_hash(&shares[0]);
 
-        if (EXPECT(ret, 0)) {
-            return -1;
+    for (int t = 1; t < used; ++t) {
+        if (started[t]) {
+            pthread_join(helpers[t], NULL);
+        } else {
+            verify_hash(&shares[t]);
         }
     }
 }
 
 
-static int append_entry(side_cursor *cursor, uint8_t *data, int *pos, int size, char separator, string_builder_t string_builder, bool negate_amount)
+// render each book with the GIL held, then hash them all with it released. each book's
+// render is kept as soon as it is done, while its levels are still in cache, and it stays
+// marked as checksumming until its crc is in, so nothing can change the text
+static PyObject *verify_books(PyObject *pairs, int threads)
 {
-    PyObject *field = NULL;
-    PyObject *amount = NULL;
-
-    int ret = cursor_next(cursor, &field, &amount);
-    if (ret != 1) {
-        return ret;
+    PyObject *items = PySequence_Fast(pairs, "verify_checksums expects an iterable of (book, expected) pairs");
+    if (!items) {
+        return NULL;
     }
 
-    ret = -1;
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(items);
+    verify_job *jobs = PyMem_Calloc(count ? count : 1, sizeof(verify_job));
+    PyObject *ret = NULL;
+    Py_ssize_t held = 0;    // jobs holding a ref to their book
+    Py_ssize_t bytes = 0;
+    bool hashed = false;
 
-    if (EXPECT(string_builder(field, data, pos, size), 0)) {
-        goto done;
-    }
-    if (EXPECT(*pos >= size, 0)) {
-        checksum_overflow();
-        goto done;
+    if (!jobs) {
+        Py_DECREF(items);
+        return PyErr_NoMemory();
     }
-    data[(*pos)++] = separator;
 
-    if (negate_amount) {
-        if (EXPECT(*pos >= size, 0)) {
-            checksum_overflow();
+    for (Py_ssize_t i = 0; i < count; ++i) {
+        PyObject *pair = PySequence_Fast_GET_ITEM(items, i);
+        verify_job *job = &jobs[i];
+
+        if (EXPECT(!PyTuple_Check(pair) || PyTuple_GET_SIZE(pair) != 2 || !PyObject_TypeCheck(PyTuple_GET_ITEM(pair, 0), &OrderbookType), 0)) {
+            PyErr_SetString(PyExc_TypeError, "verify_checksums expects (OrderBook, int) pairs");
             goto done;
         }
-        data[(*pos)++] = '-';
-    }
 
-    if (EXPECT(string_builder(amount, data, pos, size), 0)) {
-        goto done;
-    }
-    if (EXPECT(*pos >= size, 0)) {
-        checksum_overflow();
-        goto done;
-    }
-    data[(*pos)++] = separator;
+        job->book = (Orderbook *)Py_NewRef(PyTuple_GET_ITEM(pair, 0));
+        job->first = -1;
+        held = i + 1;
 
-    ret = 1;
+        if (EXPECT(verify_expected(PyTuple_GET_ITEM(pair, 1), &job->expected), 0)) {
+            goto done;
+        }
 
-done:
-    Py_DECREF(amount);
-    Py_DECREF(field);
+        // a book listed again shares the checksum rendered for it the first time
+        if (job->book->checksumming) {
+            for (Py_ssize_t j = 0; j < i; ++j) {
+                if (jobs[j].book == job->book) {
+                    job->first = j;
+                    break;
+                }
+            }
+            if (job->first >= 0) {
+                continue;
+            }
+        }
 
-    return ret;
-}
+        if (EXPECT(checksum_ready(job->book), 0)) {
+            goto done;
+        }
 
+        int length;
 
-// build the interleaved string, and report the length to hash
-static int build_alternating(const Orderbook *ob, const uint32_t depth, char separator, string_builder_t string_builder, bool signed_asks, bool expand_orders, int *length)
-{
-    side_snapshot bids, asks;
-    if (EXPECT(snapshot_side(ob->bids, -1, &bids), 0)) {
-        return -1;
+        job->book->checksumming = true;
+        if (EXPECT(checksum_render(job->book, &job->target, &length), 0)) {
+            job->book->checksumming = false;
+            goto done;
+        }
+
+        job->first = i;
+        if (!render_reuse(job->book, &job->target, length)) {
+            job->cost = length;
+            bytes += length;
+        }
+        render_end(job->book, &job->target, true);
     }
-    if (EXPECT(snapshot_side(ob->asks, -1, &asks), 0)) {
-        release_side(&bids);
-        return -1;
+
+    int helpers = threads - 1;
+    if (helpers > bytes / VERIFY_THREAD_BYTES) {
+        helpers = (int)(bytes / VERIFY_THREAD_BYTES);
     }
 
-    side_cursor bid_cursor, ask_cursor;
-    cursor_init(&bid_cursor, &bids, expand_orders);
-    cursor_init(&ask_cursor, &asks, expand_orders);
+    verify_share shares[VERIFY_THREADS_MAX];
+    pthread_t handles[VERIFY_THREADS_MAX];
 
-    int ret = -1;
-    int pos = 0;
-    int buffer_len = ob->checksum_len;
+    // when every book's text is as it was there is nothing to hash
+    if (bytes) {
+        Py_BEGIN_ALLOW_THREADS
+        verify_hash_all(jobs, count, shares, handles, helpers + 1, bytes);
+        Py_END_ALLOW_THREADS
+    }
+    hashed = true;
 
-    for(uint32_t i = 0; i < depth; ++i) {
-        if (EXPECT(append_entry(&bid_cursor, ob->checksum_buffer, &pos, buffer_len, separator, string_builder, false) < 0, 0)) {
-            goto done;
+    ret = PyList_New(0);
+    for (Py_ssize_t i = 0; ret && i < count; ++i) {
+        verify_job *job = &jobs[i];
+        uint32_t crc = jobs[job->first].target.crc;
+
+        if (crc == job->expected) {
+            continue;
         }
 
-        if (EXPECT(append_entry(&ask_cursor, ob->checksum_buffer, &pos, buffer_len, separator, string_builder, signed_asks) < 0, 0)) {
-            goto done;
+        PyObject *actual = PyLong_FromUnsignedLong(crc);
+        PyObject *mismatch = actual ? PyTuple_Pack(2, (PyObject *)job->book, actual) : NULL;
+
+        if (!mismatch || PyList_Append(ret, mismatch)) {
+            Py_CLEAR(ret);
         }
+        Py_XDECREF(mismatch);
+        Py_XDECREF(actual);
     }
 
-    *length = (pos > 0) ? pos - 1 : 0;
-    ret = 0;
-
 done:
-    cursor_close_level(&ask_cursor);
-    cursor_close_level(&bid_cursor);
-    release_side(&asks);
-    release_side(&bids);
+    // the crcs of a batch that hashed are kept even when building the result failed
+    for (Py_ssize_t i = 0; i < held; ++i) {
+        verify_job *job = &jobs[i];
+
+        if (job->first == i) {
+            if (hashed) {
+                render_remember(job->book, &job->target);
+            }
+            job->book->checksumming = false;
+        }
+        Py_DECREF(job->book);
+    }
+
+    PyMem_Free(jobs);
+    Py_DECREF(items);
 
     return ret;
 }
 
 
-static PyObject* alternating_checksum(const Orderbook *ob, const uint32_t depth, char separator, string_builder_t string_builder, bool signed_asks)
+PyObject* Orderbook_verify(const Orderbook *self, PyObject *expected)
 {
-    if (EXPECT(ob->max_depth && ob->max_depth < depth, 0)) {
-        PyErr_SetString(PyExc_ValueError, "Max depth is less than minimum number of levels for checksum");
-        return NULL;
-    }
+    uint32_t value;
 
-    int length;
-    if (EXPECT(build_alternating(ob, depth, separator, string_builder, signed_asks, false, &length), 0)) {
+    if (EXPECT(verify_expected(expected, &value) || checksum_ready(self), 0)) {
         return NULL;
     }
 
-    return PyLong_FromUnsignedLong(crc32_orderbook(ob->checksum_buffer, length));
-}
-
+    Orderbook *book = (Orderbook *)self;
+    render_target target;
+    int length;
 
-static bool bitfinex_rerender_needed(uint8_t *data, int length)
-{
-    uint8_t *end = data + length;
+    book->checksumming = true;
+    int failed = checksum_render(self, &target, &length);
+    if (EXPECT(!failed, 1)) {
+        render_hash(self, &target, length);
+        render_end(self, &target, true);
+        render_remember(self, &target);
+    }
+    book->checksumming = false;
 
-    for (uint8_t *at = data; (at = memchr(at, 'E', end - at)); at++) {
-        if (at + 1 >= end || at[1] != '-') {
-            return true;
-        }
-        *at = 'e';
+    if (EXPECT(failed, 0)) {
+        return NULL;
     }
 
-    return false;
+    return PyBool_FromLong(target.crc == value);
 }
 
 
-static PyObject* bitfinex_checksum(const Orderbook *ob)
+PyObject *Orderbook_verify_checksums(PyObject *module, PyObject *args, PyObject *kwargs)
 {
-    if (EXPECT(ob->max_depth && ob->max_depth < 25, 0)) {
-        PyErr_SetString(PyExc_ValueError, "Max depth is less than minimum number of levels for checksum");
-        return NULL;
-    }
+    static char *kwlist[] = {"pairs", "threads", NULL};
+    PyObject *pairs;
+    int threads = 1;
 
-    int length;
-    if (EXPECT(build_alternating(ob, 25, ':', str_string_builder, true, true, &length), 0)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$i", kwlist, &pairs, &threads)) {
         return NULL;
     }
 
-    if (EXPECT(bitfinex_rerender_needed(ob->checksum_buffer, length), 0)) {
-        if (EXPECT(build_alternating(ob, 25, ':', bitfinex_string_builder, true, true, &length), 0)) {
-            return NULL;
-        }
+    if (threads < 1 || threads > VERIFY_THREADS_MAX) {
+        PyErr_Format(PyExc_ValueError, "threads must be between 1 and %d", VERIFY_THREADS_MAX);
+        return NULL;
     }
 
-    return PyLong_FromUnsignedLong(crc32_orderbook(ob->checksum_buffer, length));
-}
-
-
-static PyObject* calculate_checksum(const Orderbook *ob)
-{
-    switch (ob->checksum) {
-        case KRAKEN:
-            return kraken_checksum(ob);
-        case OKX:
-            return alternating_checksum(ob, 25, ':', okx_string_builder, false);
-        case BITGET:
-            return alternating_checksum(ob, 25, ':', str_string_builder, false);
-        case BITFINEX:
-            return bitfinex_checksum(ob);
-        default:
-            return NULL;
-    }
+    return verify_books(pairs, threads);
 }
@@ -17,23 +17,75 @@ associated with this software.
 #include "sorteddict.h"
 
 
-enum Checksums {
-    CHECKSUM_PROCESSING_ERROR = -1,
-    KRAKEN,
-    OKX,
-    BITGET,
-    BITFINEX,
-    INVALID_CHECKSUM_FORMAT
+enum ChecksumLayout {
+    LAYOUT_INTERLEAVED,     // bid, ask, bid, ask ...
+    LAYOUT_ASKS_BIDS,       // every ask, then every bid
+    LAYOUT_BIDS_ASKS
 };
 
+
+enum ChecksumExponent {
+    EXPONENT_KEEP,          // str() as it is
+    EXPONENT_FIXED,         // format(x, 'f') for values str() writes with an exponent
+    EXPONENT_LOWER          // 'e-' for negative exponents, format(x, 'f') for positive ones
+};
+
+
+typedef int (*string_builder_t)(PyObject *pydata, uint8_t *data, int *pos, int size);
+
+
+// how a format lays out the top of a book before its crc32. the built in formats and
+// those added with register_checksum_format live for the life of the process
+typedef struct {
+    const char *name;
+    uint32_t depth;             // levels a side, or orders when they are expanded
+    uint32_t buffer_len;
+    enum ChecksumLayout layout;
+    char separator;             // written after every price and size, 0 for none
+    bool ask_sign;              // ask sizes are written negative
+    bool strip;                 // only the digits: no point, leading zeros or exponent
+    enum ChecksumExponent exponent;
+    bool orders;                // levels of {order id: size} dicts checksum each order
+    string_builder_t builder;   // resolved from strip and exponent
+} ChecksumFormat;
+
+
+// where a level's text sat in the last checksum rendered. a level still holding the
+// same price and size objects copies it from there rather than rendering them again
+typedef struct {
+    PyObject *price;        // a fixed key side's tick size, its levels match on the tick count
+    PyObject *size;
+    int64_t tick;
+    int price_at;
+    int price_len;
+    int size_at;
+    int size_len;
+} LevelRender;
+
+
+// the rendered levels of one side, in book order
+typedef struct {
+    LevelRender *held;      // from the last checksum
+    LevelRender *fresh;     // from the checksum being rendered
+    Py_ssize_t held_len;
+    Py_ssize_t fresh_len;
+    Py_ssize_t cap;
+    Py_ssize_t next;        // where the search of held for the next level starts
+} RenderCache;
+
+
 typedef struct {
     PyObject_HEAD
     SortedDict *bids;
     SortedDict *asks;
     uint32_t max_depth;
     uint8_t *checksum_buffer;
+    uint8_t *checksum_previous;     // the last checksum's text, which renders point into
     uint32_t checksum_len;
-    enum Checksums checksum;
+    RenderCache renders[2];         // indexed by side_e
+    uint32_t checksum_crc;          // of the last checksum's text, which was checksum_crc_len bytes
+    int checksum_crc_len;
+    const ChecksumFormat *checksum;     // NULL for none
     bool truncate;
     // see __init__ in orderbook.c
     bool checksumming;
@@ -48,6 +100,27 @@ int Orderbook_clear(Orderbook *self);
 
 PyObject* Orderbook_todict(const Orderbook *self, PyObject *unused, PyObject *kwargs);
 PyObject* Orderbook_checksum(const Orderbook *self, PyObject *Py_UNUSED(ignored));
+PyObject* Orderbook_verify(const Orderbook *self, PyObject *expected);
+PyObject* Orderbook_apply(const Orderbook *self, PyObject *args, PyObject *kwargs);
+PyObject* Orderbook_reconcile(const Orderbook *self, PyObject *args, PyObject *kwargs);
+PyObject* Orderbook_load_snapshot(const Orderbook *self, PyObject *args, PyObject *kwargs);
+PyObject* Orderbook_observe(const Orderbook *self, PyObject *args, PyObject *kwargs);
+PyObject* Orderbook_unobserve(const Orderbook *self, PyObject *callback);
+PyObject* Orderbook_journal(const Orderbook *self, PyObject *Py_UNUSED(ignored));
+PyObject* Orderbook_replay(const Orderbook *self, PyObject *journal);
+PyObject* Orderbook_batch(const Orderbook *self, PyObject *args, PyObject *kwargs);
+PyObject* Orderbook_toarrays(const Orderbook *self, PyObject *args, PyObject *kwargs);
+PyObject* Orderbook_snapshot(const Orderbook *self, PyObject *Py_UNUSED(ignored));
+PyObject *Orderbook_register_checksum_format(PyObject *module, PyObject *args, PyObject *kwargs);
+PyObject *Orderbook_verify_checksums(PyObject *module, PyObject *args, PyObject *kwargs);
+PyObject* Orderbook_tobytes(const Orderbook *self, PyObject *Py_UNUSED(ignored));
+PyObject* Orderbook_frombytes(PyTypeObject *type, PyObject *data);
+PyObject* Orderbook_reduce(const Orderbook *self, PyObject *Py_UNUSED(ignored));
+PyObject* Orderbook_save(const Orderbook *self, PyObject *args, PyObject *kwargs);
+PyObject* Orderbook_load(PyTypeObject *type, PyObject *arg);
+PyObject* Orderbook_version(const Orderbook *self, void *Py_UNUSED(closure));
+PyObject* Orderbook_encode_delta(const Orderbook *self, PyObject *args, PyObject *kwargs);
+PyObject* Orderbook_apply_delta(const Orderbook *self, PyObject *blob);
 
 
 Py_ssize_t Orderbook_len(const Orderbook *self);
@@ -69,10 +142,35 @@ static PyMemberDef Orderbook_members[] = {
 };
 
 
+// Orderbook properties
+static PyGetSetDef Orderbook_getset[] = {
+    {"version", (getter) Orderbook_version, NULL, "(bids, asks) level change counts, deltas are taken since one", NULL},
+    {NULL}
+};
+
+
 // Orderbook class methods
 static PyMethodDef Orderbook_methods[] = {
     {"to_dict", (PyCFunction) Orderbook_todict, METH_VARARGS | METH_KEYWORDS, "return a python dictionary with bids and asks"},
+    {"to_arrays", (PyCFunction) Orderbook_toarrays, METH_VARARGS | METH_KEYWORDS, "return the prices and sizes of the top levels of both sides as typed buffers"},
     {"checksum", (PyCFunction) Orderbook_checksum, METH_NOARGS, "calculate checksum using top N levels"},
+    {"verify", (PyCFunction) Orderbook_verify, METH_O, "return whether the checksum of the book is the expected one, without building it as an int"},
+    {"snapshot", (PyCFunction) Orderbook_snapshot, METH_NOARGS, "return a read only copy of both sides as they are now, sharing storage until the book next changes"},
+    {"to_bytes", (PyCFunction) Orderbook_tobytes, METH_NOARGS, "return a compact binary encoding of the book, its sides and its settings"},
+    {"from_bytes", (PyCFunction) Orderbook_frombytes, METH_O | METH_CLASS, "build a book from the output of to_bytes"},
+    {"save", (PyCFunction) Orderbook_save, METH_VARARGS | METH_KEYWORDS, "write the book to a file, replacing it in one rename, with an optional feed sequence number"},
+    {"load", (PyCFunction) Orderbook_load, METH_O | METH_CLASS, "return (book, sequence) from a file written by save, after checking its integrity"},
+    {"encode_delta", (PyCFunction) Orderbook_encode_delta, METH_VARARGS | METH_KEYWORDS, "return a binary delta of both sides since a version pair, or of every level for None"},
+    {"apply_delta", (PyCFunction) Orderbook_apply_delta, METH_O, "apply a delta from encode_delta, returning the source version pair it brings the book to"},
+    {"__reduce__", (PyCFunction) Orderbook_reduce, METH_NOARGS, "pickle support, via to_bytes"},
+    {"apply", (PyCFunction) Orderbook_apply, METH_VARARGS | METH_KEYWORDS, "apply (side, price, size) deltas in one call, optionally returning the checksum"},
+    {"reconcile", (PyCFunction) Orderbook_reconcile, METH_VARARGS | METH_KEYWORDS, "bring either side to a snapshot dict by changing only the differences"},
+    {"load_snapshot", (PyCFunction) Orderbook_load_snapshot, METH_VARARGS | METH_KEYWORDS, "replace either side with [price, size, ...] levels of strings as exchanges send them, parsed as decimal, float or fixed point ticks"},
+    {"observe", (PyCFunction) Orderbook_observe, METH_VARARGS | METH_KEYWORDS, "call callback(side, levels) with the top depth levels of a side whenever they change"},
+    {"unobserve", (PyCFunction) Orderbook_unobserve, METH_O, "stop calling a callback registered with observe"},
+    {"journal", (PyCFunction) Orderbook_journal, METH_NOARGS, "return the journaled level changes of both sides in time order, as (side, op, price, size, version, time_ns) tuples"},
+    {"replay", (PyCFunction) Orderbook_replay, METH_O, "apply the entries of a journal in order"},
+    {"batch", (PyCFunction) Orderbook_batch, METH_VARARGS | METH_KEYWORDS, "return a context manager that defers max_depth truncation and observers until it exits, optionally checksumming the book then"},
     {NULL}
 };
 
@@ -99,6 +197,7 @@ static PyTypeObject OrderbookType = {
     .tp_traverse = (traverseproc) Orderbook_traverse,
     .tp_clear = (inquiry) Orderbook_clear,
     .tp_members = Orderbook_members,
+    .tp_getset = Orderbook_getset,
     .tp_methods = Orderbook_methods,
     .tp_as_mapping = &Orderbook_mapping,
     .tp_setattro = (setattrofunc) Orderbook_setattr,
@@ -118,13 +217,21 @@ static void order_book_free(PyObject *m);
 static OrderBookModuleState* get_order_book_state(PyObject *m);
 
 
+// Module functions
+static PyMethodDef order_book_methods[] = {
+    {"register_checksum_format", (PyCFunction) Orderbook_register_checksum_format, METH_VARARGS | METH_KEYWORDS, "add a checksum format books can name in checksum_format, described by its depth, layout, separator and how values are written"},
+    {"verify_checksums", (PyCFunction) Orderbook_verify_checksums, METH_VARARGS | METH_KEYWORDS, "check (book, expected) pairs, hashing with the GIL released, and return (book, checksum) for each one that does not match"},
+    {NULL}
+};
+
+
 // Module specific definitions and initilization
 static PyModuleDef orderbookmodule = {
     PyModuleDef_HEAD_INIT,
     .m_name = "order_book",
     .m_doc = "Orderbook data structure",
     .m_size = sizeof(OrderBookModuleState),
-    .m_methods = NULL,
+    .m_methods = order_book_methods,
     .m_slots = NULL,
     .m_traverse = order_book_traverse,
     .m_clear = order_book_clear,
@@ -134,6 +241,9 @@ static PyModuleDef orderbookmodule = {
 
 // Checksum Definitions
 static PyObject* calculate_checksum(const Orderbook *ob);
+static const ChecksumFormat *checksum_format_find(const char *name, Py_ssize_t len);
+static int encode_checksum_format(const ChecksumFormat *format, CodecWriter *w);
+static int decode_checksum_format(CodecReader *r, const ChecksumFormat **format);
 
 
 #endif
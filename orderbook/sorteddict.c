@@ -4,1184 +4,5190 @@ Copyright (C) 2020-2026  Bryant Moscon - bmoscon@gmail.com
 Please see the LICENSE file for the terms and conditions
 associated with this software.
 */
+#include <math.h>
+#include <time.h>
+
 #include "sorteddict.h"
 #include "utils.h"
 
 
 static int truncate_to_depth(SortedDict *self);
+static int store_level(SortedDict *self, PyObject *key, PyObject *value, bool trim);
 static PyObject *SortedDict_iter_new(SortedDict *self, bool pairs);
+static PyObject *iter_over(SortedDict *self, PyObject *snapshot, Py_ssize_t start, Py_ssize_t len, bool pairs);
 
 
-/* Sorted Dictionary */
-void SortedDict_flush_pending(SortedDict *self)
+/* Depth cache */
+// a change at position rank, for the observers
+static inline void observe_touch(SortedDict *self, Py_ssize_t rank)
 {
-    for (uint16_t i = 0; i < self->pend_count; ++i) {
-        Py_CLEAR(self->pend[i].key);
-    }
+    Observers *o = &self->observers;
 
-    self->pend_count = 0;
-    self->version++;
+    if (o->list) {
+        o->ranked++;
+        if (rank < o->touched) {
+            o->touched = rank;
+        }
+    }
 }
 
 
-void SortedDict_drop_key_cache(SortedDict *self)
+// a write at position rank. one write since the cache last synced is repaired in
+// place, a cache that fell further behind is rebuilt on its next read
+static void prefix_touch(SortedDict *self, Py_ssize_t rank)
 {
-    PyObject **arr = self->karr;
-    Py_ssize_t len = self->k_len;
+    DepthCache *c = &self->prefix;
 
-    self->karr = NULL;
-    self->k_len = 0;
-    Py_CLEAR(self->keys_tuple);
+    observe_touch(self, rank);
 
-    if (arr) {
-        for (Py_ssize_t i = 0; i < len; ++i) {
-            Py_XDECREF(arr[i]);
-        }
-        PyMem_Free(arr);
+    if (c->version + 1 == self->version) {
+        c->version = self->version;
+    }
+
+    if (rank < c->valid) {
+        c->valid = rank;
     }
 }
 
 
-// install a freshly built key array, releasing the previous one afterwards
-static void karr_install(SortedDict *self, PyObject **arr, Py_ssize_t len)
+static void prefix_release(DepthCache *c)
 {
-    PyObject **prev = self->karr;
-    Py_ssize_t prev_len = self->k_len;
+    PyMem_Free(c->prices);
+    PyMem_Free(c->sizes);
+    PyMem_Free(c->notional);
+    memset(c, 0, sizeof(DepthCache));
+}
 
-    self->karr = arr;
-    self->k_len = len;
-    Py_CLEAR(self->keys_tuple);
 
-    if (prev) {
-        for (Py_ssize_t i = 0; i < prev_len; ++i) {
-            Py_XDECREF(prev[i]);
-        }
-        PyMem_Free(prev);
+/* Snapshots */
+static int check_writable(const SortedDict *self)
+{
+    if (EXPECT(self->frozen, 0)) {
+        PyErr_SetString(PyExc_TypeError, "cannot modify a snapshot");
+        return -1;
     }
+
+    return 0;
 }
 
 
-// borrowed ref to an immutable tuple snapshot of the key cache, cached until the key set changes
-static PyObject *karr_materialize(SortedDict *self)
+// true when the side holds its tree or fixed storage alone, and so may visit it for the gc.
+// shared storage holds one ref per key, visiting it from every holder would over count
+static inline bool storage_exclusive(const SortedDict *self)
 {
-    if (self->keys_tuple) {
-        return self->keys_tuple;
-    }
+    return !self->shares || *self->shares == 1;
+}
 
-    PyObject *t = PyTuple_New(self->k_len);
-    if (EXPECT(!t, 0)) {
-        return NULL;
+
+// give up this side's claim on its storage without releasing it, when others still hold it
+static void storage_forget(SortedDict *self)
+{
+    Py_ssize_t *shares = self->shares;
+
+    if (!shares) {
+        return;
     }
 
-    for (Py_ssize_t i = 0; i < self->k_len; ++i) {
-        PyTuple_SET_ITEM(t, i, Py_NewRef(self->karr[i]));
+    self->shares = NULL;
+    if (*shares == 1) {
+        PyMem_Free(shares);
+        return;
     }
 
-    self->keys_tuple = t;
-    return t;
+    (*shares)--;
+    memset(&self->tree, 0, sizeof(KeyTree));
+    memset(&self->fixed.ladder, 0, sizeof(Ladder));
+    self->fixed.keys = NULL;
+    self->fixed.values = NULL;
+    self->fixed.len = 0;
+    self->fixed.cap = 0;
 }
 
 
-// a new tuple of the first 'want' cached keys (or fewer), for consumers that only need the top of the book
-PyObject *SortedDict_key_window(SortedDict *self, Py_ssize_t want)
+// make everything the side is about to write private: a copy of shared storage holds
+// its own refs, the original stays with the snapshots. nothing here can reenter
+static int storage_own(SortedDict *self)
 {
-    Py_ssize_t n = (self->k_len < want) ? self->k_len : want;
-    PyObject *t = PyTuple_New(n);
+    if (self->data_shared) {
+        if (Py_REFCNT(self->data) > 1) {
+            PyObject *copy = PyDict_Copy(self->data);
+            if (EXPECT(!copy, 0)) {
+                return -1;
+            }
+            Py_SETREF(self->data, copy);
+        }
+        self->data_shared = false;
+    }
 
-    if (EXPECT(!t, 0)) {
-        return NULL;
+    if (!self->shares) {
+        return 0;
     }
 
-    for (Py_ssize_t i = 0; i < n; ++i) {
-        PyTuple_SET_ITEM(t, i, Py_NewRef(self->karr[i]));
+    if (*self->shares == 1) {
+        PyMem_Free(self->shares);
+        self->shares = NULL;
+        return 0;
     }
 
-    return t;
+    FixedKeys *fk = &self->fixed;
+    KeyTree tree;
+    Ladder ladder;
+    int64_t *keys = PyMem_New(int64_t, fk->len ? fk->len : 1);
+    PyObject **values = PyMem_New(PyObject *, fk->len ? fk->len : 1);
+
+    if (EXPECT(!keys || !values, 0)) {
+        PyMem_Free(keys);
+        PyMem_Free(values);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    if (EXPECT(keytree_clone(&self->tree, &tree), 0)) {
+        PyMem_Free(keys);
+        PyMem_Free(values);
+        return -1;
+    }
+
+    if (EXPECT(ladder_clone(&fk->ladder, &ladder), 0)) {
+        keytree_release(&tree);
+        PyMem_Free(keys);
+        PyMem_Free(values);
+        return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < fk->len; ++i) {
+        keys[i] = fk->keys[i];
+        values[i] = Py_NewRef(fk->values[i]);
+    }
+
+    self->tree = tree;
+    fk->ladder = ladder;
+    fk->keys = keys;
+    fk->values = values;
+    fk->cap = fk->len ? fk->len : 1;
+
+    (*self->shares)--;
+    self->shares = NULL;
+
+    return 0;
 }
 
 
-static void escalate_to_dirty(SortedDict *self)
+/* Delta log */
+// forget every logged change. the ring is detached before any key is released, a
+// finalizer that writes to the side starts a fresh one
+static void delta_drop(SortedDict *self)
 {
-    SortedDict_flush_pending(self);
-    self->dirty = true;
+    DeltaLog *log = &self->log;
+    DeltaEntry *entries = log->entries;
+    Py_ssize_t first = log->head - log->count + log->cap;
+    Py_ssize_t count = log->count;
+
+    log->entries = NULL;
+    log->head = 0;
+    log->count = 0;
+
+    if (self->key_type == KEY_OBJECT) {
+        for (Py_ssize_t i = 0; i < count; ++i) {
+            Py_DECREF(entries[(first + i) % log->cap].key);
+        }
+    }
+
+    PyMem_Free(entries);
 }
 
 
-// append to the changes log, if full set dirty bit to force a sort on next read
-static void log_append(SortedDict *self, uint8_t op, PyObject *key)
+// the contents were replaced wholesale, no logged change leads up to them
+static void delta_reset(SortedDict *self)
 {
-    if (self->pend_count == SD_PENDING_MAX) {
-        escalate_to_dirty(self);
+    self->changes++;
+    delta_drop(self);
+}
+
+
+// count a level change, logging it when the side keeps a log. out of memory only
+// shortens the log, which makes deltas from before the change full resends
+static void delta_log(SortedDict *self, DeltaEntry entry)
+{
+    DeltaLog *log = &self->log;
+
+    self->changes++;
+    if (!log->cap) {
         return;
     }
 
-    self->pend[self->pend_count].key = Py_NewRef(key);
-    self->pend[self->pend_count].op = op;
-    self->pend_count++;
-    self->version++;
-}
+    if (EXPECT(!log->entries, 0)) {
+        log->entries = PyMem_New(DeltaEntry, log->cap);
+        if (!log->entries) {
+            return;
+        }
+    }
 
+    DeltaEntry dropped = log->entries[log->head];
+    bool full = (log->count == log->cap);
 
-void SortedDict_dealloc(SortedDict *self)
-{
-    PyObject_GC_UnTrack(self);
-    for (uint16_t i = 0; i < self->pend_count; ++i) {
-        Py_CLEAR(self->pend[i].key);
+    if (self->key_type == KEY_OBJECT) {
+        Py_INCREF(entry.key);
     }
+    log->entries[log->head] = entry;
+    log->head = (log->head + 1) % log->cap;
 
-    self->pend_count = 0;
-    SortedDict_drop_key_cache(self);
-    Py_CLEAR(self->data);
-    Py_TYPE(self)->tp_free((PyObject *) self);
+    if (!full) {
+        log->count++;
+    } else if (self->key_type == KEY_OBJECT) {
+        Py_DECREF(dropped.key);
+    }
 }
 
 
-int SortedDict_traverse(SortedDict *self, visitproc visit, void *arg)
+static inline void delta_log_key(SortedDict *self, PyObject *key)
 {
-    Py_VISIT(self->data);
-    Py_VISIT(self->keys_tuple);
+    delta_log(self, (DeltaEntry){.key = key});
+}
+
+
+static inline void delta_log_tick(SortedDict *self, int64_t tick)
+{
+    delta_log(self, (DeltaEntry){.tick = tick});
+}
 
-    for (Py_ssize_t i = 0; i < self->k_len; ++i) {
-        Py_VISIT(self->karr[i]);
+
+// a delta log or journal size, which must be a non negative int
+int SortedDict_parse_count(PyObject *size, const char *name, Py_ssize_t *cap)
+{
+    *cap = PyLong_AsSsize_t(size);
+    if (*cap == -1 && PyErr_Occurred()) {
+        return -1;
     }
 
-    for (uint16_t i = 0; i < self->pend_count; ++i) {
-        Py_VISIT(self->pend[i].key);
+    if (*cap < 0) {
+        PyErr_Format(PyExc_ValueError, "%s must not be negative", name);
+        return -1;
     }
 
     return 0;
 }
 
 
-int SortedDict_clear(SortedDict *self)
+// how many level changes to keep for deltas, 0 turns the log off
+int SortedDict_set_delta_log(SortedDict *self, PyObject *size)
 {
-    SortedDict_flush_pending(self);
-    SortedDict_drop_key_cache(self);
+    Py_ssize_t cap;
+    if (SortedDict_parse_count(size, "delta_log", &cap)) {
+        return -1;
+    }
 
-    // the two sides are emptied rather than dropped which is enough to break any cycle
-    if (self->data) {
-        PyDict_Clear(self->data);
+    if (cap != self->log.cap) {
+        delta_drop(self);
+        self->log.cap = cap;
     }
-    self->dirty = true;
 
     return 0;
 }
 
 
-PyObject *SortedDict_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+/* Journal */
+static uint64_t journal_seq;
+
+
+// forget every journaled change. detached before any ref is released, like the delta log
+static void journal_drop(SortedDict *self)
 {
-    SortedDict *self;
-    self = (SortedDict *) type->tp_alloc(type, 0);
-    if (self != NULL) {
-        self->data = PyDict_New();
-        if (!self->data) {
-            Py_DECREF(self);
-            return NULL;
-        }
+    Journal *journal = &self->journal;
+    JournalEntry *entries = journal->entries;
+    Py_ssize_t first = journal->head - journal->count + journal->cap;
+    Py_ssize_t count = journal->count;
 
-        self->ordering = INVALID_ORDERING;
-        self->karr = NULL;
-        self->k_len = 0;
-        self->keys_tuple = NULL;
-        self->dirty = false;
-        self->depth = 0;
-        self->truncate = false;
-        self->pend_count = 0;
-        self->version = 0;
+    journal->entries = NULL;
+    journal->head = 0;
+    journal->count = 0;
+
+    for (Py_ssize_t i = 0; i < count; ++i) {
+        JournalEntry *entry = &entries[(first + i) % journal->cap];
+        if (self->key_type == KEY_OBJECT) {
+            Py_XDECREF(entry->level.key);
+        }
+        Py_XDECREF(entry->value);
     }
 
-    return (PyObject *) self;
+    PyMem_Free(entries);
 }
 
 
-int SortedDict_init(SortedDict *self, PyObject *args, PyObject *kwds)
+// append a change made just now, after delta_log counted it. out of memory only shortens the journal
+static void journal_record(SortedDict *self, DeltaEntry level, PyObject *value, enum JournalOp op)
 {
-    PyObject *dict = NULL;
+    Journal *journal = &self->journal;
 
-    if (PyTuple_Size(args) > 1) {
-        PyErr_SetString(PyExc_TypeError, "function takes at most 1 argument");
-        return -1;
+    if (EXPECT(!journal->entries, 0)) {
+        journal->entries = PyMem_New(JournalEntry, journal->cap);
+        if (!journal->entries) {
+            return;
+        }
     }
 
-    if (PyTuple_Size(args) == 1) {
-        dict = PyTuple_GetItem(args, 0);
-        if (!dict) {
-            return -1;
-        }
+    struct timespec now = {0};
+    if (journal->timed) {
+        clock_gettime(CLOCK_REALTIME, &now);
+    }
 
-        if (!PyDict_Check(dict)) {
-            PyErr_SetString(PyExc_TypeError, "function accepts only dictionaries as an argument");
-            return -1;
-        }
+    JournalEntry dropped = journal->entries[journal->head];
+    bool full = (journal->count == journal->cap);
 
-        PyObject *copy = PyDict_Copy(dict);
-        if (EXPECT(!copy, 0)) {
-            return -1;
-        }
+    if (self->key_type == KEY_OBJECT) {
+        Py_XINCREF(level.key);
+    }
+    journal->entries[journal->head] = (JournalEntry){
+        .level = level,
+        .value = Py_XNewRef(value),
+        .version = self->changes,
+        .time = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+        .seq = ++journal_seq,
+        .op = op,
+    };
+    journal->head = (journal->head + 1) % journal->cap;
+
+    if (!full) {
+        journal->count++;
+        return;
+    }
 
-        Py_XSETREF(self->data, copy);
-        // the cached keys and pending log describe the old data
-        SortedDict_drop_key_cache(self);
-        escalate_to_dirty(self);
+    if (self->key_type == KEY_OBJECT) {
+        Py_XDECREF(dropped.level.key);
     }
+    Py_XDECREF(dropped.value);
+}
 
 
-    if (kwds && PyDict_Check(kwds) && PyDict_Size(kwds) > 0) {
-        // borrowed refs, getItemString returns NULL when not found
-        PyObject *max_depth = PyDict_GetItemString(kwds, "max_depth");
-        PyObject *truncate = PyDict_GetItemString(kwds, "truncate");
-        PyObject *ordering_arg = PyDict_GetItemString(kwds, "ordering");
+static inline void journal_key(SortedDict *self, PyObject *key, PyObject *value, enum JournalOp op)
+{
+    if (self->journal.cap) {
+        journal_record(self, (DeltaEntry){.key = key}, value, op);
+    }
+}
 
-        if (max_depth) {
-            if (PyLong_Check(max_depth)) {
-                self->depth = PyLong_AsLong(max_depth);
-                if (self->depth == -1 && PyErr_Occurred()) {
-                    return -1;
-                }
 
-                if (self->depth < 1) {
-                    PyErr_SetString(PyExc_ValueError, "max_depth must be greater than 0");
-                    return -1;
-                }
+static inline void journal_tick(SortedDict *self, int64_t tick, PyObject *value, enum JournalOp op)
+{
+    if (self->journal.cap) {
+        journal_record(self, (DeltaEntry){.tick = tick}, value, op);
+    }
+}
 
-            } else {
-                PyErr_SetString(PyExc_ValueError, "max_depth must be an integer");
-                return -1;
-            }
-        }
 
-        if (truncate) {
-            if (PyBool_Check(truncate)) {
-                if (PyObject_IsTrue(truncate)) {
-                    self->truncate = true;
-                } else {
-                    self->truncate = false;
-                }
-            } else {
-                PyErr_SetString(PyExc_ValueError, "truncate must be a boolean");
-                return -1;
-            }
-        }
+// the side was replaced with the contents of dict, which the entry keeps a copy of.
+// without the copy the journal cannot explain what follows, so it starts over
+static void journal_reset(SortedDict *self, PyObject *dict)
+{
+    if (!self->journal.cap) {
+        return;
+    }
 
-        if (ordering_arg) {
-            if (!PyUnicode_Check(ordering_arg)) {
-                PyErr_SetString(PyExc_ValueError, "ordering must be a string");
-                return -1;
-            }
+    PyObject *copy = PyDict_Copy(dict);
+    if (EXPECT(!copy, 0)) {
+        PyErr_Clear();
+        journal_drop(self);
+        return;
+    }
 
-            const char *value = PyUnicode_AsUTF8(ordering_arg);
-            if (!value) {
-                return -1;
-            }
+    journal_record(self, (DeltaEntry){.key = NULL}, copy, JOURNAL_RESET);
+    Py_DECREF(copy);
+}
 
-            if (strcmp(value, "DESC") == 0) {
-                self->ordering = DESCENDING;
-            } else if (strcmp(value, "ASC") == 0) {
-                self->ordering = ASCENDING;
-            } else {
-                PyErr_SetString(PyExc_ValueError, "ordering must be one of ASC or DESC");
-                return -1;
-            }
-        } else {
-            // default is ascending
-            self->ordering = ASCENDING;
-        }
+
+// how many level changes to journal, 0 turns the journal off. timed is a bool, NULL keeps the setting
+int SortedDict_set_journal(SortedDict *self, PyObject *size, PyObject *timed)
+{
+    int stamp = timed ? PyObject_IsTrue(timed) : self->journal.timed;
+    if (stamp < 0) {
+        return -1;
     }
 
-    if (self->truncate && self->data) {
-        if (EXPECT(truncate_to_depth(self), 0)) {
-            return -1;
-        }
+    Py_ssize_t cap = self->journal.cap;
+    if (size && SortedDict_parse_count(size, "journal", &cap)) {
+        return -1;
+    }
+
+    if (cap != self->journal.cap) {
+        journal_drop(self);
+        self->journal.cap = cap;
     }
+    self->journal.timed = stamp;
 
     return 0;
 }
 
 
-// bisect over the live key array. every compare can reenter and swap the
-// array out from under us, so the version is checked after each one.
-// ret >= 0 position, -1 exception, -2 the book mutated mid-search
-static Py_ssize_t keys_bisect(SortedDict *self, uint64_t version, PyObject *key)
+/* Fixed point keys */
+// a number as a count of 10^-scale units
+// ret 0 - success, 1 - not representable at this scale, -1 - exception
+int SortedDict_fixed_units(PyObject *obj, int scale, int64_t *out)
 {
-    Py_ssize_t lo = 0;
-    Py_ssize_t hi = self->k_len;
-    int op = (self->ordering == DESCENDING) ? Py_GT : Py_LT;
+    int64_t units;
 
-    while (lo < hi) {
-        Py_ssize_t mid = lo + ((hi - lo) >> 1);
-        PyObject *probe = Py_NewRef(self->karr[mid]);
-        int before = PyObject_RichCompareBool(probe, key, op);
-        Py_DECREF(probe);
+    if (PyLong_Check(obj)) {
+        int overflow;
+        long long value = PyLong_AsLongLongAndOverflow(obj, &overflow);
+        if (EXPECT(value == -1 && PyErr_Occurred(), 0)) {
+            return -1;
+        }
+
+        if (overflow || __builtin_mul_overflow((int64_t)value, fixed_pow10(scale), &units)) {
+            return 1;
+        }
+    } else if (PyFloat_Check(obj)) {
+        double value = PyFloat_AS_DOUBLE(obj);
+        double pow = (double)fixed_pow10(scale);
+        double scaled = value * pow;
+        if (!isfinite(scaled) || fabs(scaled) >= 9.2e18) {
+            return 1;
+        }
+
+        // binary floats land next to the grid, not on it. the allowance is absolute so it
+        // does not grow with the price, and a float written as a grid value is the closest
+        // double to it however large it is
+        double rounded = nearbyint(scaled);
+        if (fabs(scaled - rounded) > 1e-6 && rounded / pow != value) {
+            return 1;
+        }
 
-        if (EXPECT(before < 0, 0)) {
+        units = (int64_t)rounded;
+    } else {
+        PyObject *repr = PyUnicode_Check(obj) ? Py_NewRef(obj) : PyObject_Str(obj);
+        if (EXPECT(!repr, 0)) {
             return -1;
         }
 
-        if (EXPECT(self->version != version, 0)) {
-            return -2;
+        Py_ssize_t len;
+        const char *string = PyUnicode_AsUTF8AndSize(repr, &len);
+        if (EXPECT(!string, 0)) {
+            Py_DECREF(repr);
+            return -1;
         }
 
-        if (before) {
-            lo = mid + 1;
-        } else {
-            hi = mid;
+        int64_t mantissa;
+        int exponent;
+        int ret = parse_decimal(string, len, &mantissa, &exponent);
+        if (ret == 0) {
+            ret = decimal_to_fixed(mantissa, exponent, scale, &units);
+        }
+
+        Py_DECREF(repr);
+        if (ret) {
+            return 1;
         }
     }
 
-    return lo;
+    *out = units;
+    return 0;
 }
 
 
-static int full_sort(SortedDict *self)
+// price to a book ordered tick count
+// ret 0 - success, 1 - price not representable at this tick size, -1 - exception
+static int fixed_key(const SortedDict *self, PyObject *obj, int64_t *out)
 {
-    for (int attempt = 0; ; ++attempt) {
-        uint64_t version = self->version;
+    const FixedKeys *fk = &self->fixed;
+    int64_t units;
 
-        PyObject *keys = PyDict_Keys(self->data);
-        if (EXPECT(!keys, 0)) {
-            return 1;
-        }
+    int ret = SortedDict_fixed_units(obj, fk->scale, &units);
+    if (ret) {
+        return ret;
+    }
 
-        if (EXPECT(PyList_Sort(keys) < 0, 0)) {
-            Py_DECREF(keys);
-            return 1;
-        }
-
-        if (self->ordering == DESCENDING) {
-            if (EXPECT(PyList_Reverse(keys) < 0, 0)) {
-                Py_DECREF(keys);
-                return 1;
-            }
-        }
+    if (units % fk->units) {
+        return 1;
+    }
 
-        PyObject *tuple = PySequence_Tuple(keys);
-        Py_DECREF(keys);
-        if (EXPECT(!tuple, 0)) {
-            return 1;
-        }
+    *out = (self->ordering == DESCENDING) ? -(units / fk->units) : units / fk->units;
+    return 0;
+}
 
-        Py_ssize_t n = PyTuple_GET_SIZE(tuple);
-        PyObject **arr = PyMem_New(PyObject *, n > 0 ? n : 1);
-        if (EXPECT(!arr, 0)) {
-            Py_DECREF(tuple);
-            PyErr_NoMemory();
-            return 1;
-        }
 
-        memcpy(arr, PySequence_Fast_ITEMS(tuple), n * sizeof(PyObject *));
-        for (Py_ssize_t i = 0; i < n; ++i) {
-            Py_INCREF(arr[i]);
-        }
+// a count of 10^-scale units as the type a tick was given in: int, float or Decimal
+PyObject *SortedDict_box_units(PyObject *box, int64_t units, int scale)
+{
+    if (box == (PyObject *)&PyLong_Type) {
+        return PyLong_FromLongLong(units);
+    }
 
-        if (EXPECT(self->version == version, 1)) {
-            karr_install(self, arr, n);
-            Py_XSETREF(self->keys_tuple, tuple);
-            self->dirty = false;
-            return 0;
-        }
+    if (box == (PyObject *)&PyFloat_Type) {
+        return PyFloat_FromDouble((double)units / (double)fixed_pow10(scale));
+    }
 
-        if (attempt == 3) {
-            // a comparator keeps mutating the book, so leave dirty
-            karr_install(self, arr, n);
-            Py_XSETREF(self->keys_tuple, tuple);
-            return 0;
-        }
+    char buffer[FIXED_RENDER_MAX];
+    int len = render_fixed(units, scale, buffer);
 
-        for (Py_ssize_t i = 0; i < n; ++i) {
-            Py_DECREF(arr[i]);
-        }
-        PyMem_Free(arr);
-        Py_DECREF(tuple);
+    PyObject *repr = PyUnicode_FromStringAndSize(buffer, len);
+    if (EXPECT(!repr, 0)) {
+        return NULL;
     }
+
+    PyObject *ret = PyObject_CallOneArg(box, repr);
+    Py_DECREF(repr);
+
+    return ret;
 }
 
 
-// ret 0  - key cache is up to date
-// ret 1  - full sort needed
-// ret -1 - exception
-static int apply_pending(SortedDict *self)
+static PyObject *fixed_box(const SortedDict *self, int64_t key)
 {
-    uint64_t version = self->version;
-    PendingEntry pend[SD_PENDING_MAX];
-    Py_ssize_t count = self->pend_count;
+    const FixedKeys *fk = &self->fixed;
+    // cannot overflow, the price was range checked on the way in
+    int64_t units = ((self->ordering == DESCENDING) ? -key : key) * fk->units;
+
+    return SortedDict_box_units(fk->box, units, fk->scale);
+}
 
-    memcpy(pend, self->pend, count * sizeof(PendingEntry));
-    self->pend_count = 0;
 
-    // the book may be mutated by any comparison or hash below so hold the ref.
-    // the key array needs no hold: every python call is followed by a version
-    // check before the array is touched again
-    PyObject *data = Py_NewRef(self->data);
-    PyObject *inserts = NULL;
-    PyObject *deletes = NULL;
-    Py_ssize_t ins_pos[SD_PENDING_MAX];
-    Py_ssize_t del_pos[SD_PENDING_MAX];
-    // only place status can be set to -1, so any exception/error will trigger this ret value
-    int status = -1;
-
-    inserts = PyList_New(0);
-    deletes = PyList_New(0);
-    if (EXPECT(!inserts || !deletes, 0)) {
-        goto done;
+// lower bound of key, the keys are always held ascending
+static Py_ssize_t fixed_search(const FixedKeys *fk, int64_t key)
+{
+    Py_ssize_t lo = 0;
+    Py_ssize_t hi = fk->len;
+
+    // levels added behind the worst one are appends, found without a search
+    if (hi && fk->keys[hi - 1] < key) {
+        return hi;
     }
 
-    if (count == 1) {
-        if (EXPECT(PyList_Append(pend[0].op == PENDING_INSERT ? inserts : deletes, pend[0].key) < 0, 0)) {
-            goto done;
-        }
-    } else {
-        PyObject *seen = PyDict_New();
-        if (EXPECT(!seen, 0)) {
-            goto done;
+    while (lo < hi) {
+        Py_ssize_t mid = lo + ((hi - lo) >> 1);
+
+        if (fk->keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
+    }
 
-        int failed = 0;
-        for (Py_ssize_t i = 0; i < count && !failed; ++i) {
-            PyObject *packed = PyDict_GetItemWithError(seen, pend[i].key);
-            long state;
+    return lo;
+}
 
-            if (packed) {
-                state = PyLong_AsLong(packed) ^ 1;
-            } else if (EXPECT(PyErr_Occurred() != NULL, 0)) {
-                failed = 1;
-                break;
-            } else {
-                state = ((long)pend[i].op << 1) | 1;
-            }
 
-            packed = PyLong_FromLong(state);
-            if (EXPECT(!packed, 0)) {
-                failed = 1;
-                break;
-            }
+static int fixed_reserve(FixedKeys *fk, Py_ssize_t need)
+{
+    if (need <= fk->cap) {
+        return 0;
+    }
 
-            failed = PyDict_SetItem(seen, pend[i].key, packed) < 0;
-            Py_DECREF(packed);
-        }
+    Py_ssize_t cap = fk->cap ? fk->cap : 16;
+    while (cap < need) {
+        cap *= 2;
+    }
 
-        if (!failed) {
-            PyObject *key;
-            PyObject *packed;
-            Py_ssize_t pos = 0;
+    int64_t *keys = PyMem_Realloc(fk->keys, cap * sizeof(int64_t));
+    if (EXPECT(!keys, 0)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    fk->keys = keys;
 
-            while (PyDict_Next(seen, &pos, &key, &packed)) {
-                long state = PyLong_AsLong(packed);
+    PyObject **values = PyMem_Realloc(fk->values, cap * sizeof(PyObject *));
+    if (EXPECT(!values, 0)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    fk->values = values;
+    fk->cap = cap;
 
-                if ((state & 1) == 0) {
-                    continue;
-                }
+    return 0;
+}
 
-                if (EXPECT(PyList_Append((state >> 1) == PENDING_INSERT ? inserts : deletes, key) < 0, 0)) {
-                    failed = 1;
-                    break;
-                }
-            }
-        }
 
-        Py_DECREF(seen);
-        if (EXPECT(failed, 0)) {
-            goto done;
-        }
-    }
+// detach the arrays before releasing the values, finalizers can reenter.
+// only the sorted arrays, the ladder is released on its own
+static void fixed_release(FixedKeys *fk)
+{
+    int64_t *keys = fk->keys;
+    PyObject **values = fk->values;
+    Py_ssize_t len = fk->len;
 
-    Py_ssize_t num_ins = PyList_GET_SIZE(inserts);
-    Py_ssize_t num_del = PyList_GET_SIZE(deletes);
+    fk->keys = NULL;
+    fk->values = NULL;
+    fk->len = 0;
+    fk->cap = 0;
 
-    if (num_ins == 0 && num_del == 0) {
-        if (EXPECT(self->version == version && self->pend_count == 0 && !self->dirty, 1)) {
-            status = 0;
-        } else {
-            status = 1;
-        }
-        goto done;
+    for (Py_ssize_t i = 0; i < len; ++i) {
+        Py_DECREF(values[i]);
     }
 
-    if (EXPECT(PyList_Sort(inserts) < 0, 0)) {
-        goto done;
-    }
-    if (self->ordering == DESCENDING) {
-        if (EXPECT(PyList_Reverse(inserts) < 0, 0)) {
-            goto done;
-        }
-    }
+    PyMem_Free(values);
+    PyMem_Free(keys);
+}
 
-    if (EXPECT(self->version != version, 0)) {
-        status = 1;
-        goto done;
-    }
 
-    Py_ssize_t old_size = self->k_len;
+// levels held, the ladder plus the sorted arrays behind it
+static inline Py_ssize_t fixed_count(const SortedDict *self)
+{
+    return self->fixed.ladder.len + self->fixed.len;
+}
 
-    for (Py_ssize_t i = 0; i < num_del; ++i) {
-        Py_ssize_t at = keys_bisect(self, version, PyList_GET_ITEM(deletes, i));
-        if (EXPECT(at < 0, 0)) {
-            status = (at == -2) ? 1 : -1;
-            goto done;
-        }
 
-        if (EXPECT(at == old_size, 0)) {
-            status = 1;
-            goto done;
-        }
+// the stored value ref for tick k, NULL when no level rests there
+static PyObject **fixed_lookup(const SortedDict *self, int64_t k)
+{
+    const FixedKeys *fk = &self->fixed;
+    Py_ssize_t slot = ladder_slot(&fk->ladder, k);
 
-        PyObject *probe = Py_NewRef(self->karr[at]);
-        int eq = PyObject_RichCompareBool(probe, PyList_GET_ITEM(deletes, i), Py_EQ);
-        Py_DECREF(probe);
-        if (EXPECT(eq < 0, 0)) {
-            goto done;
-        }
-        if (EXPECT(self->version != version || !eq, 0)) {
-            status = 1;
-            goto done;
-        }
+    if (slot >= 0) {
+        return fk->ladder.slots[slot] ? &fk->ladder.slots[slot] : NULL;
+    }
+
+    Py_ssize_t at = fixed_search(fk, k);
+    return (at < fk->len && fk->keys[at] == k) ? &fk->values[at] : NULL;
+}
+
+
+// cursor over the levels in book order for fixed_next, positioned at 'rank'
+static Py_ssize_t fixed_seek(const SortedDict *self, Py_ssize_t rank)
+{
+    const Ladder *ladder = &self->fixed.ladder;
 
-        del_pos[i] = at;
+    if (rank < ladder->len) {
+        return ladder_seek(ladder, rank);
     }
 
-    for (Py_ssize_t i = 1; i < num_del; ++i) {
-        Py_ssize_t value = del_pos[i];
-        Py_ssize_t j = i;
-        while (j > 0 && del_pos[j - 1] > value) {
-            del_pos[j] = del_pos[j - 1];
-            j--;
+    return ladder->band + rank - ladder->len;
+}
+
+
+// borrowed value of the level at the cursor and its tick, advancing the cursor. NULL past the last level
+static PyObject *fixed_next(const SortedDict *self, Py_ssize_t *at, int64_t *key)
+{
+    const FixedKeys *fk = &self->fixed;
+    const Ladder *ladder = &fk->ladder;
+    Py_ssize_t pos = *at;
+
+    if (pos < ladder->band) {
+        pos = ladder_next(ladder, pos);
+        if (pos < ladder->band) {
+            *key = ladder->base + pos;
+            *at = pos + 1;
+            return ladder->slots[pos];
         }
-        del_pos[j] = value;
     }
 
-    for (Py_ssize_t i = 0; i < num_ins; ++i) {
-        Py_ssize_t at = keys_bisect(self, version, PyList_GET_ITEM(inserts, i));
-        if (EXPECT(at < 0, 0)) {
-            status = (at == -2) ? 1 : -1;
-            goto done;
-        }
+    pos -= ladder->band;
+    if (pos >= fk->len) {
+        return NULL;
+    }
 
-        if (at < old_size) {
-            PyObject *probe = Py_NewRef(self->karr[at]);
-            int eq = PyObject_RichCompareBool(probe, PyList_GET_ITEM(inserts, i), Py_EQ);
-            Py_DECREF(probe);
-            if (EXPECT(eq < 0, 0)) {
-                goto done;
-            }
-            if (EXPECT(self->version != version || eq, 0)) {
-                status = 1;
-                goto done;
-            }
+    *key = fk->keys[pos];
+    *at = ladder->band + pos + 1;
+    return fk->values[pos];
+}
+
+
+// levels whose book ordered tick is below 'bound'
+static Py_ssize_t fixed_rank(const SortedDict *self, int64_t bound)
+{
+    const FixedKeys *fk = &self->fixed;
+    const Ladder *ladder = &fk->ladder;
+    Py_ssize_t rank = fixed_search(fk, bound);
+
+    if (ladder->band) {
+        int64_t offset;
+        Py_ssize_t slot;
+
+        if (__builtin_sub_overflow(bound, ladder->base, &offset)) {
+            slot = (bound > 0) ? ladder->band : 0;
+        } else {
+            slot = (offset < 0) ? 0 : (offset > ladder->band) ? ladder->band : (Py_ssize_t)offset;
         }
 
-        ins_pos[i] = at;
+        rank += ladder_rank(ladder, slot);
     }
 
-    Py_ssize_t new_size = old_size - num_del + num_ins;
+    return rank;
+}
 
-    if (EXPECT(self->version != version || self->pend_count != 0 || self->dirty, 0) || EXPECT(new_size != PyDict_GET_SIZE(data), 0)) {
-        status = 1;
-        goto done;
+
+// the first ascending tick priced at or above obj (ge) and the first above it (gt).
+// a price off the tick grid falls between two ticks, placed by its float value
+static int fixed_bounds(const SortedDict *self, PyObject *obj, int64_t *ge, int64_t *gt)
+{
+    const FixedKeys *fk = &self->fixed;
+    int64_t k;
+
+    int conv = fixed_key(self, obj, &k);
+    if (EXPECT(conv < 0, 0)) {
+        return -1;
     }
 
-    for (Py_ssize_t i = 1; i < num_del; ++i) {
-        if (EXPECT(del_pos[i] <= del_pos[i - 1], 0)) {
-            status = 1;
-            goto done;
-        }
+    if (conv == 0) {
+        *ge = (self->ordering == DESCENDING) ? -k : k;
+        *gt = *ge + 1;
+        return 0;
     }
 
-    for (Py_ssize_t i = 1; i < num_ins; ++i) {
-        if (EXPECT(ins_pos[i] < ins_pos[i - 1], 0)) {
-            status = 1;
-            goto done;
-        }
+    PyObject *number = PyUnicode_Check(obj) ? PyFloat_FromString(obj) : PyNumber_Float(obj);
+    if (EXPECT(!number, 0)) {
+        return -1;
     }
 
-    // merge by moving surviving pointers into a fresh array. survivors
-    // transfer their reference, so there is no refcount traffic and
-    // no O(N) tuple to build and destroy
-    {
-        PyObject **scratch = PyMem_New(PyObject *, new_size > 0 ? new_size : 1);
-        if (EXPECT(!scratch, 0)) {
-            PyErr_NoMemory();
-            goto done;
-        }
+    double price = PyFloat_AS_DOUBLE(number);
+    Py_DECREF(number);
 
-        PyObject *dropped[SD_PENDING_MAX];
-        Py_ssize_t ri = 0;
-        Py_ssize_t ii = 0;
-        Py_ssize_t di = 0;
-        Py_ssize_t oi = 0;
+    if (EXPECT(isnan(price), 0)) {
+        PyErr_SetString(PyExc_ValueError, "price must not be NaN");
+        return -1;
+    }
 
-        // copy the untouched runs between change positions with memcpy
-        while (1) {
-            Py_ssize_t next_ins = (ii < num_ins) ? ins_pos[ii] : old_size;
-            Py_ssize_t next_del = (di < num_del) ? del_pos[di] : old_size;
-            Py_ssize_t stop = (next_ins < next_del) ? next_ins : next_del;
+    // every tick a level can rest on is inside this range
+    double tick = (double)fk->units / (double)fixed_pow10(fk->scale);
+    int64_t t = (int64_t)fmax(-9.2e18, fmin(9.2e18, ceil(price / tick)));
 
-            if (stop > oi) {
-                memcpy(scratch + ri, self->karr + oi, (stop - oi) * sizeof(PyObject *));
-                ri += stop - oi;
-                oi = stop;
-            }
+    // the estimate is off by at most a rounding step, settle it against the tick prices
+    for (int i = 0; i < 2 && (double)(t - 1) * tick >= price; ++i) {
+        t--;
+    }
+    for (int i = 0; i < 2 && (double)t * tick < price; ++i) {
+        t++;
+    }
 
-            if (ii < num_ins && ins_pos[ii] == oi) {
-                scratch[ri++] = Py_NewRef(PyList_GET_ITEM(inserts, ii));
-                ii++;
-                continue;
-            }
+    *ge = t;
+    *gt = ((double)t * tick > price) ? t : t + 1;
+    return 0;
+}
 
-            if (di < num_del && del_pos[di] == oi) {
-                dropped[di] = self->karr[oi];
-                di++;
-                oi++;
-                continue;
-            }
 
-            break;
-        }
+// move the ladder so 'anchor' sits a quarter of the way into the band, then
+// re-partition every level between the slots and the sorted arrays behind them.
+// the only allocation is up front, so a failure leaves the book untouched
+static int ladder_recenter(SortedDict *self, int64_t anchor)
+{
+    FixedKeys *fk = &self->fixed;
+    Ladder *ladder = &fk->ladder;
 
-        if (EXPECT(ri != new_size, 0)) {
-            // should be unreachable given the checks above
-            for (Py_ssize_t i = 0; i < ii; ++i) {
-                Py_DECREF(PyList_GET_ITEM(inserts, i));
-            }
+    if (EXPECT(fixed_reserve(fk, fixed_count(self)), 0)) {
+        return -1;
+    }
 
-            PyMem_Free(scratch);
-            status = 1;
-            goto done;
-        }
+    // every slot sorts before the arrays, so the slots drain into the front of them.
+    // refs move without any decref, nothing in here can reenter
+    Py_ssize_t drained = ladder->len;
+    memmove(fk->keys + drained, fk->keys, fk->len * sizeof(int64_t));
+    memmove(fk->values + drained, fk->values, fk->len * sizeof(PyObject *));
 
-        PyObject **prev = self->karr;
-        self->karr = scratch;
-        self->k_len = new_size;
-        Py_CLEAR(self->keys_tuple);
-        PyMem_Free(prev);
+    Py_ssize_t n = 0;
+    for (Py_ssize_t slot = ladder_next(ladder, 0); slot < ladder->band; slot = ladder_next(ladder, slot + 1)) {
+        fk->keys[n] = ladder->base + slot;
+        fk->values[n++] = ladder_take(ladder, slot);
+    }
+    n += fk->len;
 
-        for (Py_ssize_t i = 0; i < num_del; ++i) {
-            Py_DECREF(dropped[i]);
-        }
+    if (n && fk->keys[0] < anchor) {
+        anchor = fk->keys[0];
     }
-    status = 0;
 
-done:
-    if (status != 0) {
-        // both paths need the dirty bit set
-        escalate_to_dirty(self);
+    if (__builtin_sub_overflow(anchor, ladder->band / 4, &ladder->base)) {
+        ladder->base = anchor;
     }
 
-    Py_XDECREF(inserts);
-    Py_XDECREF(deletes);
-    Py_DECREF(data);
+    fk->len = 0;
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        Py_ssize_t slot = ladder_slot(ladder, fk->keys[i]);
 
-    for (Py_ssize_t i = 0; i < count; ++i) {
-        Py_DECREF(pend[i].key);
+        if (slot >= 0) {
+            ladder_put(ladder, slot, fk->values[i]);
+        } else {
+            fk->keys[fk->len] = fk->keys[i];
+            fk->values[fk->len++] = fk->values[i];
+        }
     }
 
-    return status;
+    return 0;
 }
 
 
-/* internal helper function to update keys */
-inline int update_keys(SortedDict *self) {
-    if (!self->dirty && self->karr) {
-        if (self->pend_count == 0) {
-            return 0;
-        }
+typedef struct {
+    int64_t key;
+    Py_ssize_t order;
+} FixedLoadEntry;
 
-        int applied = apply_pending(self);
-        if (applied == 0) {
-            return 0;
-        }
 
-        if (applied < 0) {
-            return 1;
-        }
+static int fixed_load_cmp(const void *a, const void *b)
+{
+    const FixedLoadEntry *x = a;
+    const FixedLoadEntry *y = b;
+
+    if (x->key != y->key) {
+        return (x->key < y->key) ? -1 : 1;
     }
 
-    return full_sort(self);
+    return (x->order < y->order) ? -1 : (x->order > y->order);
 }
 
 
-static PyObject *build_items(SortedDict *self)
+// install converted levels in place of the side's, entries[i].order indexing values. entries
+// already strictly ascending skip the sort. the values are borrowed
+static int fixed_install(SortedDict *self, FixedLoadEntry *entries, Py_ssize_t n, PyObject *const *values, bool sorted)
 {
-    if (EXPECT(update_keys(self), 0)) {
-        return NULL;
+    FixedKeys fresh = {0};
+    PyObject **rungs = NULL;
+    Py_ssize_t rung_count = 0;
+    int ret = -1;
+
+    if (!sorted) {
+        qsort(entries, n, sizeof(FixedLoadEntry), fixed_load_cmp);
     }
 
-    PyObject *keys = karr_materialize(self);
-    if (EXPECT(!keys, 0)) {
-        return NULL;
+    if (EXPECT(fixed_reserve(&fresh, n), 0)) {
+        goto done;
     }
 
-    Py_INCREF(keys);
-    PyObject *data = Py_NewRef(self->data);
+    // the old ladder levels are released along with the old arrays
+    Ladder *ladder = &self->fixed.ladder;
+    rungs = PyMem_New(PyObject *, ladder->len > 0 ? ladder->len : 1);
+    if (EXPECT(!rungs, 0)) {
+        PyErr_NoMemory();
+        goto done;
+    }
 
-    Py_ssize_t len = PyTuple_GET_SIZE(keys);
-    if ((self->depth > 0) && (self->depth < len)) {
-        len = self->depth;
+    // distinct objects can land on the same tick, the last one given wins
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        if (i + 1 < n && entries[i + 1].key == entries[i].key) {
+            continue;
+        }
+
+        fresh.keys[fresh.len] = entries[i].key;
+        fresh.values[fresh.len] = Py_NewRef(values[entries[i].order]);
+        fresh.len++;
     }
 
-    PyObject *ret = PyList_New(len);
-    if (EXPECT(!ret, 0)) {
-        goto error;
+    for (Py_ssize_t slot = ladder_next(ladder, 0); slot < ladder->band; slot = ladder_next(ladder, slot + 1)) {
+        rungs[rung_count++] = ladder_take(ladder, slot);
     }
 
-    for (Py_ssize_t i = 0; i < len; ++i) {
-        PyObject *key = PyTuple_GET_ITEM(keys, i);
-        PyObject *value = PyDict_GetItemWithError(data, key);
+    FixedKeys previous = self->fixed;
+    self->fixed.keys = fresh.keys;
+    self->fixed.values = fresh.values;
+    self->fixed.len = fresh.len;
+    self->fixed.cap = fresh.cap;
+    fresh = previous;
 
-        if (EXPECT(!value, 0)) {
-            if (!PyErr_Occurred()) {
-                PyErr_SetObject(PyExc_KeyError, key);
-            }
-            Py_DECREF(ret);
-            goto error;
-        }
+    self->version++;
+    Py_CLEAR(self->keys_tuple);
 
-        PyObject *entry = PyTuple_New(2);
-        if (EXPECT(!entry, 0)) {
-            Py_DECREF(ret);
-            goto error;
-        }
+    // a ladder is filled by centering it on the best level. the arrays were sized
+    // for every level and the ladder is empty, so this cannot fail
+    if (ladder->band && self->fixed.len) {
+        ladder_recenter(self, self->fixed.keys[0]);
+    }
+    ret = 0;
 
-        PyTuple_SET_ITEM(entry, 0, Py_NewRef(key));
-        PyTuple_SET_ITEM(entry, 1, Py_NewRef(value));
-        PyList_SET_ITEM(ret, i, entry);
+done:
+    fixed_release(&fresh);
+    for (Py_ssize_t i = 0; i < rung_count; ++i) {
+        Py_DECREF(rungs[i]);
     }
+    PyMem_Free(rungs);
 
-    Py_DECREF(keys);
-    Py_DECREF(data);
     return ret;
-
-error:
-    Py_DECREF(keys);
-    Py_DECREF(data);
-    return NULL;
 }
 
 
-PyObject* SortedDict_keys(SortedDict *self, PyObject *Py_UNUSED(ignored))
+// convert and sort a whole dict, installed only once every key converted
+static int fixed_load(SortedDict *self, PyObject *dict)
 {
-    if (EXPECT(update_keys(self), 0)) {
-        return NULL;
+    // a key's __str__ could mutate the source, so work from a snapshot of it
+    PyObject *items = PyDict_Items(dict);
+    if (EXPECT(!items, 0)) {
+        return -1;
     }
 
-    PyObject *ret = karr_materialize(self);
-    if (EXPECT(!ret, 0)) {
-        return NULL;
+    Py_ssize_t n = PyList_GET_SIZE(items);
+    FixedLoadEntry *entries = PyMem_New(FixedLoadEntry, n > 0 ? n : 1);
+    PyObject **values = entries ? PyMem_New(PyObject *, n > 0 ? n : 1) : NULL;
+    int ret = -1;
+
+    if (EXPECT(!values, 0)) {
+        PyErr_NoMemory();
+        goto done;
     }
 
-    if (self->depth) {
-        return PySequence_GetSlice(ret, 0, self->depth);
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        PyObject *item = PyList_GET_ITEM(items, i);
+        int conv = fixed_key(self, PyTuple_GET_ITEM(item, 0), &entries[i].key);
+        if (EXPECT(conv, 0)) {
+            if (conv > 0) {
+                PyErr_SetString(PyExc_ValueError, "price cannot be represented at this tick size");
+            }
+            goto done;
+        }
+        entries[i].order = i;
+        values[i] = PyTuple_GET_ITEM(item, 1);
     }
 
-    return Py_NewRef(ret);
+    ret = fixed_install(self, entries, n, values, false);
+
+done:
+    PyMem_Free(values);
+    PyMem_Free(entries);
+    Py_DECREF(items);
+
+    return ret;
 }
 
 
-// answer index(0) from the clean cache plus the pending log without merging
-static int peek_best(SortedDict *self, PyObject **out)
+static int fixed_truncate(SortedDict *self)
 {
-    uint64_t version = self->version;
-    PyObject *data = Py_NewRef(self->data);
-    PyObject *best = NULL;
-    Py_ssize_t count = self->pend_count;
-    int status = 1;
-    bool have_deletes = false;
-
-    for (Py_ssize_t p = 0; p < count; ++p) {
-        if (self->pend[p].op == PENDING_DELETE) {
-            have_deletes = true;
-            break;
-        }
+    FixedKeys *fk = &self->fixed;
+    Ladder *ladder = &fk->ladder;
+
+    if (!self->depth || fixed_count(self) <= self->depth) {
+        return 0;
+    }
+
+    if (EXPECT(storage_own(self), 0)) {
+        return -1;
+    }
+
+    Py_ssize_t count = fixed_count(self) - self->depth;
+    PyObject **evicted = PyMem_New(PyObject *, count);
+    if (EXPECT(!evicted, 0)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    Py_ssize_t n = 0;
+    if (ladder->len > self->depth) {
+        for (Py_ssize_t slot = ladder_seek(ladder, self->depth); slot < ladder->band; slot = ladder_next(ladder, slot + 1)) {
+            delta_log_tick(self, ladder->base + slot);
+            journal_tick(self, ladder->base + slot, NULL, JOURNAL_DELETE);
+            evicted[n++] = ladder_take(ladder, slot);
+        }
+    }
+
+    Py_ssize_t keep = self->depth - ladder->len;
+    for (Py_ssize_t i = keep; i < fk->len; ++i) {
+        delta_log_tick(self, fk->keys[i]);
+        journal_tick(self, fk->keys[i], NULL, JOURNAL_DELETE);
+    }
+    memcpy(evicted + n, fk->values + keep, (fk->len - keep) * sizeof(PyObject *));
+    fk->len = keep;
+    self->version++;
+    Py_CLEAR(self->keys_tuple);
+    prefix_touch(self, self->depth);
+
+    for (Py_ssize_t i = 0; i < count; ++i) {
+        Py_DECREF(evicted[i]);
+    }
+
+    PyMem_Free(evicted);
+    return 0;
+}
+
+
+// unlink the level at tick k and hand its value to the caller, NULL when there is none
+static PyObject *fixed_remove(SortedDict *self, int64_t k)
+{
+    FixedKeys *fk = &self->fixed;
+    Py_ssize_t slot = ladder_slot(&fk->ladder, k);
+
+    if (slot >= 0) {
+        return fk->ladder.slots[slot] ? ladder_take(&fk->ladder, slot) : NULL;
+    }
+
+    Py_ssize_t at = fixed_search(fk, k);
+    if (at == fk->len || fk->keys[at] != k) {
+        return NULL;
+    }
+
+    PyObject *dropped = fk->values[at];
+    memmove(fk->keys + at, fk->keys + at + 1, (fk->len - at - 1) * sizeof(int64_t));
+    memmove(fk->values + at, fk->values + at + 1, (fk->len - at - 1) * sizeof(PyObject *));
+    fk->len--;
+
+    return dropped;
+}
+
+
+// add a level at a tick that holds none
+static int fixed_insert(SortedDict *self, int64_t k, PyObject *value)
+{
+    FixedKeys *fk = &self->fixed;
+    Ladder *ladder = &fk->ladder;
+
+    if (ladder->band) {
+        Py_ssize_t slot = ladder_slot(ladder, k);
+
+        if (slot < 0) {
+            // off the band: re-center when k is the new best or the best has
+            // drifted into the back half, otherwise k goes behind the band
+            bool empty = (fixed_count(self) == 0);
+            int64_t best = ladder->len ? ladder->base + ladder->best : (empty ? k : fk->keys[0]);
+
+            if (empty || k < best || ladder->best > ladder->band / 2) {
+                if (EXPECT(ladder_recenter(self, (k < best) ? k : best), 0)) {
+                    return -1;
+                }
+                slot = ladder_slot(ladder, k);
+            }
+        }
+
+        if (slot >= 0) {
+            ladder_put(ladder, slot, Py_NewRef(value));
+            return 0;
+        }
+    }
+
+    if (EXPECT(fixed_reserve(fk, fk->len + 1), 0)) {
+        return -1;
+    }
+
+    Py_ssize_t at = fixed_search(fk, k);
+    memmove(fk->keys + at + 1, fk->keys + at, (fk->len - at) * sizeof(int64_t));
+    memmove(fk->values + at + 1, fk->values + at, (fk->len - at) * sizeof(PyObject *));
+    fk->keys[at] = k;
+    fk->values[at] = Py_NewRef(value);
+    fk->len++;
+
+    return 0;
+}
+
+
+static int fixed_setitem(SortedDict *self, PyObject *key, PyObject *value, bool trim)
+{
+    FixedKeys *fk = &self->fixed;
+    int64_t k;
+
+    int conv = fixed_key(self, key, &k);
+    if (EXPECT(conv < 0, 0)) {
+        return -1;
+    }
+
+    if (!value) {
+        PyObject *dropped = conv ? NULL : fixed_remove(self, k);
+        if (EXPECT(!dropped, 0)) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return -1;
+        }
+
+        delta_log_tick(self, k);
+        journal_tick(self, k, NULL, JOURNAL_DELETE);
+        self->version++;
+        Py_CLEAR(self->keys_tuple);
+        prefix_touch(self, fixed_rank(self, k));
+
+        // the market moved off the ladder, follow it. with the ladder empty nothing is allocated
+        if (fk->ladder.band && !fk->ladder.len && fk->len) {
+            ladder_recenter(self, fk->keys[0]);
+        }
+
+        Py_DECREF(dropped);
+        return 0;
+    }
+
+    if (EXPECT(conv, 0)) {
+        PyErr_SetString(PyExc_ValueError, "price cannot be represented at this tick size");
+        return -1;
+    }
+
+    PyObject **stored = fixed_lookup(self, k);
+    if (stored) {
+        // in place value update, the key set did not change
+        if (self->prefix.valid || self->observers.list) {
+            prefix_touch(self, fixed_rank(self, k));
+        }
+        delta_log_tick(self, k);
+        journal_tick(self, k, value, JOURNAL_UPDATE);
+        Py_SETREF(*stored, Py_NewRef(value));
+        return 0;
+    }
+
+    if (EXPECT(fixed_insert(self, k, value), 0)) {
+        return -1;
+    }
+
+    delta_log_tick(self, k);
+    journal_tick(self, k, value, JOURNAL_INSERT);
+    self->version++;
+    Py_CLEAR(self->keys_tuple);
+    prefix_touch(self, fixed_rank(self, k));
+
+    if (trim && self->truncate) {
+        return fixed_truncate(self);
+    }
+
+    return 0;
+}
+
+
+// key_type plus the ladder options, a ladder implies fixed keys. slots is 0 without a ladder
+int SortedDict_parse_key_type(PyObject *arg, PyObject *ladder, PyObject *band, enum KeyType *type, Py_ssize_t *slots)
+{
+    *slots = 0;
+
+    if (ladder && ladder != Py_None) {
+        if (!PyBool_Check(ladder)) {
+            PyErr_SetString(PyExc_ValueError, "ladder must be a boolean");
+            return -1;
+        }
+
+        if (ladder == Py_True) {
+            *slots = LADDER_DEFAULT_BAND;
+        }
+    }
+
+    if (band && band != Py_None) {
+        if (!*slots) {
+            PyErr_SetString(PyExc_ValueError, "band is only valid with ladder=True");
+            return -1;
+        }
+
+        if (!PyLong_Check(band)) {
+            PyErr_SetString(PyExc_ValueError, "band must be an integer");
+            return -1;
+        }
+
+        *slots = PyLong_AsSsize_t(band);
+        if (*slots == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+
+        if (*slots < 1 || *slots > LADDER_MAX_BAND) {
+            PyErr_SetString(PyExc_ValueError, "band must be between 1 and 16777216");
+            return -1;
+        }
+    }
+
+    if (!arg || arg == Py_None) {
+        *type = *slots ? KEY_FIXED : KEY_OBJECT;
+        return 0;
+    }
+
+    if (!PyUnicode_Check(arg)) {
+        PyErr_SetString(PyExc_ValueError, "key_type must be a string");
+        return -1;
+    }
+
+    const char *value = PyUnicode_AsUTF8(arg);
+    if (!value) {
+        return -1;
+    }
+
+    if (strcmp(value, "object") == 0) {
+        *type = KEY_OBJECT;
+    } else if (strcmp(value, "fixed") == 0) {
+        *type = KEY_FIXED;
+    } else {
+        PyErr_SetString(PyExc_ValueError, "key_type must be one of object or fixed");
+        return -1;
+    }
+
+    if (*type == KEY_OBJECT && *slots) {
+        PyErr_SetString(PyExc_ValueError, "a ladder requires key_type fixed");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static bool has_contents(const SortedDict *self)
+{
+    return (self->key_type == KEY_FIXED) ? fixed_count(self) > 0 : PyDict_GET_SIZE(self->data) > 0;
+}
+
+
+// a tick size as a count of 10^-scale units, with the type its multiples box back into
+int SortedDict_parse_tick(PyObject *tick, int *scale, int64_t *units, PyObject **box)
+{
+    PyObject *type;
+    int64_t mantissa;
+    int exponent;
+
+    if (PyBool_Check(tick)) {
+        PyErr_SetString(PyExc_ValueError, "tick must be a number");
+        return -1;
+    } else if (PyLong_Check(tick)) {
+        type = Py_NewRef((PyObject *)&PyLong_Type);
+    } else if (PyFloat_Check(tick)) {
+        type = Py_NewRef((PyObject *)&PyFloat_Type);
+    } else {
+        PyObject *decimal = PyImport_ImportModule("decimal");
+        if (!decimal) {
+            return -1;
+        }
+
+        type = PyObject_GetAttrString(decimal, "Decimal");
+        Py_DECREF(decimal);
+        if (!type) {
+            return -1;
+        }
+    }
+
+    PyObject *repr = PyObject_Str(tick);
+    if (!repr) {
+        Py_DECREF(type);
+        return -1;
+    }
+
+    Py_ssize_t len;
+    const char *string = PyUnicode_AsUTF8AndSize(repr, &len);
+    if (!string) {
+        Py_DECREF(repr);
+        Py_DECREF(type);
+        return -1;
+    }
+
+    int parsed = parse_decimal(string, len, &mantissa, &exponent);
+    Py_DECREF(repr);
+
+    *scale = (exponent < 0) ? -exponent : 0;
+
+    if (parsed || mantissa <= 0 || *scale > FIXED_MAX_SCALE || decimal_to_fixed(mantissa, exponent, *scale, units)) {
+        Py_DECREF(type);
+        PyErr_SetString(PyExc_ValueError, "tick must be a positive number with at most 18 decimal places");
+        return -1;
+    }
+
+    *box = type;
+    return 0;
+}
+
+
+// the checks SortedDict_set_key_type and SortedDict_set_intern make, without changing
+// anything, so a caller setting several things can check them all first
+int SortedDict_check_key_type(const SortedDict *self, enum KeyType type, PyObject *tick, Py_ssize_t band, PyObject *intern)
+{
+    if (check_writable(self)) {
+        return -1;
+    }
+
+    if (tick == Py_None) {
+        tick = NULL;
+    }
+
+    if (intern == Py_None) {
+        intern = NULL;
+    }
+
+    if (intern && !PyCallable_Check(intern)) {
+        PyErr_SetString(PyExc_TypeError, "intern must be callable");
+        return -1;
+    }
+
+    if (type == KEY_OBJECT) {
+        if (tick) {
+            PyErr_SetString(PyExc_ValueError, "tick is only valid with key_type fixed");
+            return -1;
+        }
+
+        if (self->key_type == KEY_FIXED && has_contents(self)) {
+            PyErr_SetString(PyExc_ValueError, "cannot change the key type of a non-empty book");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    if (!tick) {
+        PyErr_SetString(PyExc_ValueError, "key_type fixed requires a tick");
+        return -1;
+    }
+
+    if (intern) {
+        PyErr_SetString(PyExc_ValueError, "intern is only valid with key_type object");
+        return -1;
+    }
+
+    PyObject *box;
+    int scale;
+    int64_t units;
+
+    if (SortedDict_parse_tick(tick, &scale, &units, &box)) {
+        return -1;
+    }
+
+    Py_ssize_t slots = (band + 63) / 64 * 64;
+    bool changed = self->key_type != KEY_FIXED || self->fixed.scale != scale || self->fixed.units != units || self->fixed.box != box || self->fixed.ladder.band != slots;
+    Py_DECREF(box);
+
+    if (changed && has_contents(self)) {
+        PyErr_SetString(PyExc_ValueError, "cannot change the key type of a non-empty book");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int SortedDict_set_key_type(SortedDict *self, enum KeyType type, PyObject *tick, Py_ssize_t band)
+{
+    if (check_writable(self)) {
+        return -1;
+    }
+
+    if (tick == Py_None) {
+        tick = NULL;
+    }
+
+    if (type == KEY_OBJECT) {
+        if (tick) {
+            PyErr_SetString(PyExc_ValueError, "tick is only valid with key_type fixed");
+            return -1;
+        }
+
+        if (self->key_type == KEY_FIXED) {
+            if (has_contents(self)) {
+                PyErr_SetString(PyExc_ValueError, "cannot change the key type of a non-empty book");
+                return -1;
+            }
+
+            if (storage_own(self)) {
+                return -1;
+            }
+
+            delta_reset(self);
+            journal_drop(self);
+            fixed_release(&self->fixed);
+            ladder_release(&self->fixed.ladder);
+            Py_CLEAR(self->fixed.tick);
+            Py_CLEAR(self->fixed.box);
+            self->key_type = KEY_OBJECT;
+        }
+
+        return 0;
+    }
+
+    if (!tick) {
+        PyErr_SetString(PyExc_ValueError, "key_type fixed requires a tick");
+        return -1;
+    }
+
+    PyObject *box;
+    int scale;
+    int64_t units;
+
+    if (SortedDict_parse_tick(tick, &scale, &units, &box)) {
+        return -1;
+    }
+
+    // band is rounded up to whole bitmap words by the ladder
+    Py_ssize_t slots = (band + 63) / 64 * 64;
+    if (self->key_type != KEY_FIXED || self->fixed.scale != scale || self->fixed.units != units || self->fixed.box != box || self->fixed.ladder.band != slots) {
+        if (has_contents(self)) {
+            Py_DECREF(box);
+            PyErr_SetString(PyExc_ValueError, "cannot change the key type of a non-empty book");
+            return -1;
+        }
+    }
+
+    if (self->intern) {
+        Py_DECREF(box);
+        PyErr_SetString(PyExc_ValueError, "intern is only valid with key_type object");
+        return -1;
+    }
+
+    if ((self->fixed.ladder.band != slots || self->key_type == KEY_OBJECT) && storage_own(self)) {
+        Py_DECREF(box);
+        return -1;
+    }
+
+    if (self->fixed.ladder.band != slots) {
+        ladder_release(&self->fixed.ladder);
+        if (slots && ladder_alloc(&self->fixed.ladder, slots)) {
+            Py_DECREF(box);
+            return -1;
+        }
+    }
+
+    // logged ticks mean nothing under another tick
+    if (self->key_type == KEY_OBJECT || self->fixed.scale != scale || self->fixed.units != units) {
+        delta_reset(self);
+        journal_drop(self);
+    }
+
+    if (self->key_type == KEY_OBJECT) {
+        SortedDict_drop_key_cache(self);
+        self->version++;
+        self->dirty = false;
+    }
+
+    self->key_type = KEY_FIXED;
+    self->fixed.scale = scale;
+    self->fixed.units = units;
+    Py_XSETREF(self->fixed.tick, Py_NewRef(tick));
+    Py_XSETREF(self->fixed.box, box);
+
+    return 0;
+}
+
+
+/* Price interning */
+// the factory str prices are built into keys with, None turns interning off
+int SortedDict_set_intern(SortedDict *self, PyObject *factory)
+{
+    if (check_writable(self)) {
+        return -1;
+    }
+
+    if (factory == Py_None) {
+        factory = NULL;
+    }
+
+    if (factory && !PyCallable_Check(factory)) {
+        PyErr_SetString(PyExc_TypeError, "intern must be callable");
+        return -1;
+    }
+
+    if (factory && self->key_type == KEY_FIXED) {
+        PyErr_SetString(PyExc_ValueError, "intern is only valid with key_type object");
+        return -1;
+    }
+
+    if (factory && !self->pool) {
+        self->pool = PyDict_New();
+        if (EXPECT(!self->pool, 0)) {
+            return -1;
+        }
+    }
+
+    if (factory != self->intern) {
+        Py_XSETREF(self->intern, Py_XNewRef(factory));
+        if (self->pool) {
+            PyDict_Clear(self->pool);
+        }
+    }
+
+    return 0;
+}
+
+
+// new ref to the pooled key for a str price, NULL without error when it has none
+static PyObject *intern_lookup(const SortedDict *self, PyObject *price)
+{
+    if (!self->intern || !PyUnicode_CheckExact(price)) {
+        return NULL;
+    }
+
+    return Py_XNewRef(PyDict_GetItemWithError(self->pool, price));
+}
+
+
+// new ref to the key a price stands for. str prices are built with the factory when
+// interning is on, and added to the pool when add is set
+static PyObject *intern_key(const SortedDict *self, PyObject *price, bool add)
+{
+    if (!self->intern || !PyUnicode_CheckExact(price)) {
+        return Py_NewRef(price);
+    }
+
+    PyObject *key = intern_lookup(self, price);
+    if (key || PyErr_Occurred()) {
+        return key;
+    }
+
+    key = PyObject_CallOneArg(self->intern, price);
+    if (EXPECT(!key || !add, 0)) {
+        return key;
+    }
+
+    if (EXPECT(PyDict_SetItem(self->pool, price, key), 0)) {
+        Py_CLEAR(key);
+    }
+
+    return key;
+}
+
+
+// price was built into key for a level now in the book, later writes of it can reuse the key
+static int intern_remember(const SortedDict *self, PyObject *price, PyObject *key)
+{
+    if (!self->intern || !PyUnicode_CheckExact(price) || price == key) {
+        return 0;
+    }
+
+    return PyDict_SetItem(self->pool, price, key);
+}
+
+
+// keep the pool bounded by the book: once it holds twice the levels, drop the prices
+// that have left the book. failing to trim is not an error, the pool only caches
+static void intern_trim(SortedDict *self)
+{
+    if (!self->intern || PyDict_GET_SIZE(self->pool) < 2 * PyDict_GET_SIZE(self->data) + 64) {
+        return;
+    }
+
+    PyObject *fresh = PyDict_New();
+    if (EXPECT(!fresh, 0)) {
+        PyErr_Clear();
+        return;
+    }
+
+    // swap first, a key's __eq__ could reenter and write the pool
+    PyObject *previous = self->pool;
+    self->pool = fresh;
+
+    Py_ssize_t pos = 0;
+    PyObject *price;
+    PyObject *key;
+    while (PyDict_Next(previous, &pos, &price, &key)) {
+        int live = PyDict_Contains(self->data, key);
+        if (EXPECT(live < 0 || (live && PyDict_SetItem(self->pool, price, key)), 0)) {
+            PyErr_Clear();
+            break;
+        }
+    }
+
+    Py_DECREF(previous);
+}
+
+
+/* Sorted Dictionary */
+void SortedDict_drop_key_cache(SortedDict *self)
+{
+    Py_CLEAR(self->keys_tuple);
+    keytree_release(&self->tree);
+}
+
+
+// borrowed ref to an immutable tuple snapshot of the sorted keys, cached until the key set changes
+static PyObject *keys_materialize(SortedDict *self)
+{
+    if (self->keys_tuple) {
+        return self->keys_tuple;
+    }
+
+    PyObject *t = SortedDict_key_window(self, SortedDict_cached_len(self));
+    if (EXPECT(!t, 0)) {
+        return NULL;
+    }
+
+    self->keys_tuple = t;
+    return t;
+}
+
+
+Py_ssize_t SortedDict_cached_len(const SortedDict *self)
+{
+    return (self->key_type == KEY_FIXED) ? fixed_count(self) : self->tree.size;
+}
+
+
+// a new tuple of up to 'want' cached keys from position start on
+static PyObject *key_slice(SortedDict *self, Py_ssize_t start, Py_ssize_t want)
+{
+    Py_ssize_t len = SortedDict_cached_len(self) - start;
+    Py_ssize_t n = (len < want) ? len : want;
+    PyObject *t = PyTuple_New((n > 0) ? n : 0);
+
+    if (EXPECT(!t, 0)) {
+        return NULL;
+    }
+
+    if (self->key_type == KEY_OBJECT) {
+        PyObject **items = PySequence_Fast_ITEMS(t);
+
+        keytree_copy(&self->tree, start, n, items);
+        for (Py_ssize_t i = 0; i < n; ++i) {
+            Py_INCREF(items[i]);
+        }
+
+        return t;
+    }
+
+    // boxing only builds numbers, nothing here can reenter the book
+    Py_ssize_t at = (n > 0) ? fixed_seek(self, start) : 0;
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        // n is within the levels held, so there is always a next one
+        int64_t tick = 0;
+        fixed_next(self, &at, &tick);
+
+        PyObject *key = fixed_box(self, tick);
+        if (EXPECT(!key, 0)) {
+            Py_DECREF(t);
+            return NULL;
+        }
+
+        PyTuple_SET_ITEM(t, i, key);
+    }
+
+    return t;
+}
+
+
+// a new tuple of the first 'want' cached keys (or fewer), for consumers that only need the top of the book
+PyObject *SortedDict_key_window(SortedDict *self, Py_ssize_t want)
+{
+    return key_slice(self, 0, want);
+}
+
+
+// the values of a fixed key book's first 'want' levels, and their ticks when 'ticks' is
+// given. object keyed books look values up in data
+PyObject *SortedDict_value_window(SortedDict *self, Py_ssize_t want, int64_t *ticks)
+{
+    Py_ssize_t len = fixed_count(self);
+    Py_ssize_t n = (len < want) ? len : want;
+    PyObject *t = PyTuple_New(n);
+
+    if (EXPECT(!t, 0)) {
+        return NULL;
+    }
+
+    Py_ssize_t at = 0;
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        int64_t tick;
+        PyTuple_SET_ITEM(t, i, Py_NewRef(fixed_next(self, &at, &tick)));
+        if (ticks) {
+            ticks[i] = tick;
+        }
+    }
+
+    return t;
+}
+
+
+// new ref to the price a fixed key book's tick stands for
+PyObject *SortedDict_box_tick(SortedDict *self, int64_t tick)
+{
+    return fixed_box(self, tick);
+}
+
+
+// the tree can no longer follow the dict, the next read re-sorts from scratch
+static void escalate_to_dirty(SortedDict *self)
+{
+    self->dirty = true;
+    self->version++;
+    SortedDict_drop_key_cache(self);
+}
+
+
+void SortedDict_dealloc(SortedDict *self)
+{
+    PyObject_GC_UnTrack(self);
+    storage_forget(self);
+    delta_drop(self);
+    journal_drop(self);
+    SortedDict_drop_key_cache(self);
+    fixed_release(&self->fixed);
+    ladder_release(&self->fixed.ladder);
+    prefix_release(&self->prefix);
+    Py_CLEAR(self->observers.list);
+    Py_CLEAR(self->observers.top);
+    Py_CLEAR(self->intern);
+    Py_CLEAR(self->pool);
+    Py_CLEAR(self->fixed.tick);
+    Py_CLEAR(self->fixed.box);
+    Py_CLEAR(self->data);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+
+int SortedDict_traverse(SortedDict *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->data);
+    Py_VISIT(self->keys_tuple);
+
+    if (storage_exclusive(self)) {
+        for (Py_ssize_t i = 0; i < self->tree.count; ++i) {
+            const KeyLeaf *leaf = self->tree.leaves[i];
+            for (Py_ssize_t j = 0; j < leaf->len; ++j) {
+                Py_VISIT(leaf->keys[j]);
+            }
+        }
+
+        Py_ssize_t at = 0;
+        int64_t tick;
+        for (PyObject *value = fixed_next(self, &at, &tick); value; value = fixed_next(self, &at, &tick)) {
+            Py_VISIT(value);
+        }
+    }
+    if (self->key_type == KEY_OBJECT) {
+        const DeltaLog *log = &self->log;
+        for (Py_ssize_t i = 0; i < log->count; ++i) {
+            Py_VISIT(log->entries[(log->head - log->count + log->cap + i) % log->cap].key);
+        }
+    }
+    const Journal *journal = &self->journal;
+    for (Py_ssize_t i = 0; i < journal->count; ++i) {
+        const JournalEntry *entry = &journal->entries[(journal->head - journal->count + journal->cap + i) % journal->cap];
+        if (self->key_type == KEY_OBJECT) {
+            Py_VISIT(entry->level.key);
+        }
+        Py_VISIT(entry->value);
+    }
+    Py_VISIT(self->fixed.tick);
+    Py_VISIT(self->fixed.box);
+    Py_VISIT(self->intern);
+    Py_VISIT(self->pool);
+    Py_VISIT(self->observers.list);
+    Py_VISIT(self->observers.top);
+
+    return 0;
+}
+
+
+int SortedDict_clear(SortedDict *self)
+{
+    self->version++;
+    storage_forget(self);
+    delta_reset(self);
+    journal_drop(self);
+    SortedDict_drop_key_cache(self);
+    fixed_release(&self->fixed);
+    ladder_release(&self->fixed.ladder);
+
+    // the two sides are emptied rather than dropped which is enough to break any cycle.
+    // a dict shared with a snapshot is the snapshot's too, the refs are enough there
+    if (self->data && !self->data_shared) {
+        PyDict_Clear(self->data);
+    }
+    if (self->pool) {
+        PyDict_Clear(self->pool);
+    }
+    // callbacks are the likeliest cycle, a bound method of an object holding the book
+    Py_CLEAR(self->observers.list);
+    Py_CLEAR(self->observers.top);
+    self->dirty = true;
+
+    return 0;
+}
+
+
+PyObject *SortedDict_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    SortedDict *self;
+    self = (SortedDict *) type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->data = PyDict_New();
+        if (!self->data) {
+            Py_DECREF(self);
+            return NULL;
+        }
+
+        self->ordering = INVALID_ORDERING;
+        self->key_type = KEY_OBJECT;
+        memset(&self->fixed, 0, sizeof(FixedKeys));
+        memset(&self->tree, 0, sizeof(KeyTree));
+        memset(&self->prefix, 0, sizeof(DepthCache));
+        self->intern = NULL;
+        self->pool = NULL;
+        self->shares = NULL;
+        self->data_shared = false;
+        self->frozen = false;
+        memset(&self->log, 0, sizeof(DeltaLog));
+        memset(&self->observers, 0, sizeof(Observers));
+        memset(&self->journal, 0, sizeof(Journal));
+        self->journal.timed = true;
+        self->batching = 0;
+        self->changes = 0;
+        self->applied = 0;
+        self->keys_tuple = NULL;
+        self->dirty = false;
+        self->depth = 0;
+        self->truncate = false;
+        self->version = 0;
+    }
+
+    return (PyObject *) self;
+}
+
+
+int SortedDict_init(SortedDict *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *dict = NULL;
+
+    if (check_writable(self)) {
+        return -1;
+    }
+
+    if (PyTuple_Size(args) > 1) {
+        PyErr_SetString(PyExc_TypeError, "function takes at most 1 argument");
+        return -1;
+    }
+
+    if (PyTuple_Size(args) == 1) {
+        dict = PyTuple_GetItem(args, 0);
+        if (!dict) {
+            return -1;
+        }
+
+        if (!PyDict_Check(dict)) {
+            PyErr_SetString(PyExc_TypeError, "function accepts only dictionaries as an argument");
+            return -1;
+        }
+    }
+
+    if (kwds && PyDict_Check(kwds) && PyDict_Size(kwds) > 0) {
+        // borrowed refs, getItemString returns NULL when not found
+        PyObject *max_depth = PyDict_GetItemString(kwds, "max_depth");
+        PyObject *truncate = PyDict_GetItemString(kwds, "truncate");
+        PyObject *ordering_arg = PyDict_GetItemString(kwds, "ordering");
+        PyObject *key_type_arg = PyDict_GetItemString(kwds, "key_type");
+        PyObject *tick = PyDict_GetItemString(kwds, "tick");
+        PyObject *ladder = PyDict_GetItemString(kwds, "ladder");
+        PyObject *band = PyDict_GetItemString(kwds, "band");
+        PyObject *intern = PyDict_GetItemString(kwds, "intern");
+        PyObject *delta_log = PyDict_GetItemString(kwds, "delta_log");
+        PyObject *journal = PyDict_GetItemString(kwds, "journal");
+        PyObject *journal_time = PyDict_GetItemString(kwds, "journal_time");
+
+        if (max_depth) {
+            if (PyLong_Check(max_depth)) {
+                self->depth = PyLong_AsLong(max_depth);
+                if (self->depth == -1 && PyErr_Occurred()) {
+                    return -1;
+                }
+
+                if (self->depth < 1) {
+                    PyErr_SetString(PyExc_ValueError, "max_depth must be greater than 0");
+                    return -1;
+                }
+
+            } else {
+                PyErr_SetString(PyExc_ValueError, "max_depth must be an integer");
+                return -1;
+            }
+        }
+
+        if (truncate) {
+            if (PyBool_Check(truncate)) {
+                if (PyObject_IsTrue(truncate)) {
+                    self->truncate = true;
+                } else {
+                    self->truncate = false;
+                }
+            } else {
+                PyErr_SetString(PyExc_ValueError, "truncate must be a boolean");
+                return -1;
+            }
+        }
+
+        if (ordering_arg) {
+            if (!PyUnicode_Check(ordering_arg)) {
+                PyErr_SetString(PyExc_ValueError, "ordering must be a string");
+                return -1;
+            }
+
+            const char *value = PyUnicode_AsUTF8(ordering_arg);
+            if (!value) {
+                return -1;
+            }
+
+            if (strcmp(value, "DESC") == 0) {
+                self->ordering = DESCENDING;
+            } else if (strcmp(value, "ASC") == 0) {
+                self->ordering = ASCENDING;
+            } else {
+                PyErr_SetString(PyExc_ValueError, "ordering must be one of ASC or DESC");
+                return -1;
+            }
+        } else {
+            // default is ascending
+            self->ordering = ASCENDING;
+        }
+
+        if (delta_log && SortedDict_set_delta_log(self, delta_log)) {
+            return -1;
+        }
+
+        if ((journal || journal_time) && SortedDict_set_journal(self, journal, journal_time)) {
+            return -1;
+        }
+
+        // before the key type, so turning interning off and switching to fixed keys works in one call
+        if (intern && SortedDict_set_intern(self, intern)) {
+            return -1;
+        }
+
+        if (key_type_arg || tick || ladder || band) {
+            enum KeyType key_type;
+            Py_ssize_t slots;
+            if (SortedDict_parse_key_type(key_type_arg, ladder, band, &key_type, &slots)) {
+                return -1;
+            }
+
+            // the new contents replace the old, so they do not block a change of key type
+            if (dict) {
+                PyObject *empty = PyDict_New();
+                int ret = empty ? SortedDict_replace(self, empty) : -1;
+
+                Py_XDECREF(empty);
+                if (EXPECT(ret, 0)) {
+                    return -1;
+                }
+            }
+
+            if (SortedDict_set_key_type(self, key_type, tick, slots)) {
+                return -1;
+            }
+        }
+    }
+
+    if (dict) {
+        if (EXPECT(SortedDict_replace(self, dict), 0)) {
+            return -1;
+        }
+    }
+
+    if (self->truncate && self->data) {
+        if (EXPECT(truncate_to_depth(self), 0)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+// a copy of dict with its str prices interned
+static PyObject *intern_copy(SortedDict *self, PyObject *dict)
+{
+    PyObject *items = PyDict_Items(dict);
+    PyObject *copy = items ? PyDict_New() : NULL;
+    if (EXPECT(!copy, 0)) {
+        Py_XDECREF(items);
+        return NULL;
+    }
+
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(items); ++i) {
+        PyObject *item = PyList_GET_ITEM(items, i);
+        PyObject *key = intern_key(self, PyTuple_GET_ITEM(item, 0), true);
+        int failed = !key || PyDict_SetItem(copy, key, PyTuple_GET_ITEM(item, 1));
+
+        Py_XDECREF(key);
+        if (EXPECT(failed, 0)) {
+            Py_DECREF(copy);
+            Py_DECREF(items);
+            return NULL;
+        }
+    }
+
+    Py_DECREF(items);
+    return copy;
+}
+
+
+// swap in new contents for the side. object keyed books copy the dict and re-sort
+// lazily on the next read, fixed key books convert and sort the keys up front
+int SortedDict_replace(SortedDict *self, PyObject *dict)
+{
+    if (check_writable(self) || storage_own(self)) {
+        return -1;
+    }
+
+    delta_reset(self);
+    if (self->key_type == KEY_FIXED) {
+        if (fixed_load(self, dict)) {
+            return -1;
+        }
+
+        journal_reset(self, dict);
+        return 0;
+    }
+
+    PyObject *copy = self->intern ? intern_copy(self, dict) : PyDict_Copy(dict);
+    if (EXPECT(!copy, 0)) {
+        return -1;
+    }
+
+    PyObject *previous = self->data;
+
+    self->data = copy;
+    // mark before dropping previous - finalizers can reenter
+    escalate_to_dirty(self);
+    journal_reset(self, dict);
+
+    Py_DECREF(previous);
+    intern_trim(self);
+    return 0;
+}
+
+
+// rebuild the tree from a full sort of the dict's keys. only needed after the
+// contents were replaced wholesale or an incremental update could not be applied
+static int full_sort(SortedDict *self)
+{
+    if (EXPECT(storage_own(self), 0)) {
+        return 1;
+    }
+
+    for (int attempt = 0; ; ++attempt) {
+        uint64_t version = self->version;
+
+        PyObject *keys = PyDict_Keys(self->data);
+        if (EXPECT(!keys, 0)) {
+            return 1;
+        }
+
+        if (EXPECT(PyList_Sort(keys) < 0, 0)) {
+            Py_DECREF(keys);
+            return 1;
+        }
+
+        if (self->ordering == DESCENDING) {
+            if (EXPECT(PyList_Reverse(keys) < 0, 0)) {
+                Py_DECREF(keys);
+                return 1;
+            }
+        }
+
+        PyObject *tuple = PySequence_Tuple(keys);
+        Py_DECREF(keys);
+        if (EXPECT(!tuple, 0)) {
+            return 1;
+        }
+
+        if (EXPECT(self->version == version || attempt == 3, 1)) {
+            // past the last attempt a comparator keeps mutating the book, so leave dirty
+            if (EXPECT(keytree_load(&self->tree, PySequence_Fast_ITEMS(tuple), PyTuple_GET_SIZE(tuple)), 0)) {
+                Py_DECREF(tuple);
+                return 1;
+            }
+
+            Py_XSETREF(self->keys_tuple, tuple);
+            self->dirty = (self->version != version);
+            return 0;
+        }
+
+        Py_DECREF(tuple);
+    }
+}
+
+
+/* internal helper function to update keys */
+inline int update_keys(SortedDict *self) {
+    // fixed keys are sorted on every write, object keys on every write unless dirty
+    if (self->key_type == KEY_FIXED || !self->dirty) {
+        return 0;
+    }
+
+    return full_sort(self);
+}
+
+
+// new ref to a tuple of the keys visible under max_depth (or more). a depth
+// limited book copies just its window rather than snapshotting the whole side
+static PyObject *visible_keys(SortedDict *self)
+{
+    if (self->depth > 0 && self->depth < SortedDict_cached_len(self) && !self->keys_tuple) {
+        return SortedDict_key_window(self, self->depth);
+    }
+
+    return Py_XNewRef(keys_materialize(self));
+}
+
+
+// place a key that was just added to the dict. a failed compare or a compare that
+// mutated the book leaves the insert standing and the tree to be rebuilt on read,
+// so keys that do not order still raise from the read rather than the write
+static void tree_insert(SortedDict *self, PyObject *key)
+{
+    KeyPos pos;
+    int op = (self->ordering == DESCENDING) ? Py_GT : Py_LT;
+
+    self->version++;
+    Py_CLEAR(self->keys_tuple);
+
+    Py_ssize_t at = keytree_bisect(&self->tree, key, op, &self->version, &pos);
+    if (EXPECT(at < 0 || keytree_insert(&self->tree, pos, key), 0)) {
+        PyErr_Clear();
+        escalate_to_dirty(self);
+        return;
+    }
+
+    prefix_touch(self, at);
+}
+
+
+// drop a key that was just deleted from the dict
+static void tree_delete(SortedDict *self, PyObject *key)
+{
+    KeyPos pos;
+    int op = (self->ordering == DESCENDING) ? Py_GT : Py_LT;
+
+    self->version++;
+    Py_CLEAR(self->keys_tuple);
+    uint64_t version = self->version;
+
+    Py_ssize_t at = keytree_bisect(&self->tree, key, op, &self->version, &pos);
+    if (EXPECT(at < 0 || at == self->tree.size, 0)) {
+        PyErr_Clear();
+        escalate_to_dirty(self);
+        return;
+    }
+
+    PyObject *found = self->tree.leaves[pos.leaf]->keys[pos.offset];
+    if (found != key) {
+        Py_INCREF(found);
+        int eq = PyObject_RichCompareBool(found, key, Py_EQ);
+        Py_DECREF(found);
+
+        if (EXPECT(eq <= 0 || self->version != version, 0)) {
+            PyErr_Clear();
+            escalate_to_dirty(self);
+            return;
+        }
+    }
+
+    // unlinked before the release, the key's finalizer may reenter
+    PyObject *dropped = keytree_remove(&self->tree, pos);
+    prefix_touch(self, at);
+    Py_DECREF(dropped);
+}
+
+
+static PyObject *build_items(SortedDict *self)
+{
+    if (EXPECT(update_keys(self), 0)) {
+        return NULL;
+    }
+
+    PyObject *keys = visible_keys(self);
+    if (EXPECT(!keys, 0)) {
+        return NULL;
+    }
+
+    PyObject *data = Py_NewRef(self->data);
+
+    Py_ssize_t len = PyTuple_GET_SIZE(keys);
+    if ((self->depth > 0) && (self->depth < len)) {
+        len = self->depth;
+    }
+
+    PyObject *ret = PyList_New(len);
+    if (EXPECT(!ret, 0)) {
+        goto error;
+    }
+
+    Py_ssize_t at = 0;
+    for (Py_ssize_t i = 0; i < len; ++i) {
+        PyObject *key = PyTuple_GET_ITEM(keys, i);
+        int64_t tick;
+        PyObject *value = (self->key_type == KEY_FIXED) ? fixed_next(self, &at, &tick) : PyDict_GetItemWithError(data, key);
+
+        if (EXPECT(!value, 0)) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetObject(PyExc_KeyError, key);
+            }
+            Py_DECREF(ret);
+            goto error;
+        }
+
+        PyObject *entry = PyTuple_New(2);
+        if (EXPECT(!entry, 0)) {
+            Py_DECREF(ret);
+            goto error;
+        }
+
+        PyTuple_SET_ITEM(entry, 0, Py_NewRef(key));
+        PyTuple_SET_ITEM(entry, 1, Py_NewRef(value));
+        PyList_SET_ITEM(ret, i, entry);
+    }
+
+    Py_DECREF(keys);
+    Py_DECREF(data);
+    return ret;
+
+error:
+    Py_DECREF(keys);
+    Py_DECREF(data);
+    return NULL;
+}
+
+
+PyObject* SortedDict_keys(SortedDict *self, PyObject *Py_UNUSED(ignored))
+{
+    if (EXPECT(update_keys(self), 0)) {
+        return NULL;
+    }
+
+    PyObject *ret = visible_keys(self);
+    if (EXPECT(!ret, 0)) {
+        return NULL;
+    }
+
+    if (self->depth && self->depth < PyTuple_GET_SIZE(ret)) {
+        Py_SETREF(ret, PySequence_GetSlice(ret, 0, self->depth));
+    }
+
+    return ret;
+}
+
+
+PyObject* SortedDict_index(SortedDict *self, PyObject *index)
+{
+    long i = PyLong_AsLong(index);
+    if (EXPECT(PyErr_Occurred() != NULL, 0)) {
+        return NULL;
+    }
+
+    if (EXPECT(update_keys(self), 0)) {
+        return NULL;
+    }
+
+    // validate against max_depth
+    Py_ssize_t len = SortedDict_cached_len(self);
+    if ((self->depth > 0) && (self->depth < len)) {
+        len = self->depth;
+    }
+
+    // negative indexing
+    if (i < 0) {
+        i += len;
+    }
+
+    if (EXPECT(i < 0 || i >= len, 0)) {
+        PyErr_SetString(PyExc_IndexError, "index out of range");
+        return NULL;
+    }
+
+    if (self->key_type == KEY_FIXED) {
+        Py_ssize_t at = fixed_seek(self, i);
+        int64_t tick;
+        PyObject *value = Py_NewRef(fixed_next(self, &at, &tick));
+        PyObject *key = fixed_box(self, tick);
+        if (EXPECT(!key, 0)) {
+            Py_DECREF(value);
+            return NULL;
+        }
+
+        PyObject *ret = PyTuple_Pack(2, key, value);
+        Py_DECREF(key);
+        Py_DECREF(value);
+
+        return ret;
+    }
+
+    PyObject *key = Py_NewRef(keytree_at(&self->tree, i));
+
+    // borrowed reference
+    PyObject *value = PyDict_GetItemWithError(self->data, key);
+    if (EXPECT(!value, 0)) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetObject(PyExc_KeyError, key);
+        }
+        Py_DECREF(key);
+        return NULL;
+    }
+
+    PyObject *ret = PyTuple_New(2);
+    if (EXPECT(!ret, 0)) {
+        Py_DECREF(key);
+        return NULL;
+    }
+
+    PyTuple_SET_ITEM(ret, 0, key);
+    PyTuple_SET_ITEM(ret, 1, Py_NewRef(value));
+
+    return ret;
+}
+
+
+/* Price queries */
+// levels visible under max_depth
+static inline Py_ssize_t visible_len(const SortedDict *self)
+{
+    Py_ssize_t len = SortedDict_cached_len(self);
+    return (self->depth > 0 && self->depth < len) ? self->depth : len;
+}
+
+
+// levels ahead of price in book order, also counting a level at price when right is set.
+// the keys must be current
+static int price_rank(SortedDict *self, PyObject *price, bool right, Py_ssize_t *rank)
+{
+    if (self->key_type == KEY_FIXED) {
+        int64_t ge, gt;
+        if (fixed_bounds(self, price, &ge, &gt)) {
+            return -1;
+        }
+
+        // descending sides hold negated ticks, so the better levels are the higher ticks
+        int64_t bound = (self->ordering == DESCENDING) ? 1 - (right ? ge : gt) : (right ? gt : ge);
+        *rank = fixed_rank(self, bound);
+        return 0;
+    }
+
+    PyObject *key = intern_key(self, price, false);
+    if (EXPECT(!key, 0)) {
+        return -1;
+    }
+
+    KeyPos pos;
+    int op = (self->ordering == DESCENDING) ? (right ? Py_GE : Py_GT) : (right ? Py_LE : Py_LT);
+
+    Py_ssize_t at = keytree_bisect(&self->tree, key, op, &self->version, &pos);
+    Py_DECREF(key);
+    if (EXPECT(at == -2, 0)) {
+        PyErr_SetString(PyExc_RuntimeError, "SortedDict changed size during search");
+    }
+
+    if (EXPECT(at < 0, 0)) {
+        return -1;
+    }
+
+    *rank = at;
+    return 0;
+}
+
+
+// the positions [start, stop) of the visible levels priced between lo and hi, either bound may be None
+static int price_window(SortedDict *self, PyObject *lo, PyObject *hi, Py_ssize_t *start, Py_ssize_t *stop)
+{
+    if (EXPECT(update_keys(self), 0)) {
+        return -1;
+    }
+
+    uint64_t version = self->version;
+    PyObject *first = (self->ordering == DESCENDING) ? hi : lo;
+    PyObject *last = (self->ordering == DESCENDING) ? lo : hi;
+
+    *start = 0;
+    *stop = SortedDict_cached_len(self);
+
+    if (first != Py_None && price_rank(self, first, false, start)) {
+        return -1;
+    }
+
+    if (last != Py_None && price_rank(self, last, true, stop)) {
+        return -1;
+    }
+
+    if (EXPECT(self->version != version, 0)) {
+        PyErr_SetString(PyExc_RuntimeError, "SortedDict changed size during search");
+        return -1;
+    }
+
+    Py_ssize_t len = visible_len(self);
+    *stop = (*stop < len) ? *stop : len;
+    *start = (*start < *stop) ? *start : *stop;
+
+    return 0;
+}
+
+
+PyObject* SortedDict_bisect(SortedDict *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"price", "right", NULL};
+    PyObject *price;
+    int right = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|p", kwlist, &price, &right)) {
+        return NULL;
+    }
+
+    if (EXPECT(update_keys(self), 0)) {
+        return NULL;
+    }
+
+    Py_ssize_t rank;
+    if (price_rank(self, price, right, &rank)) {
+        return NULL;
+    }
+
+    Py_ssize_t len = visible_len(self);
+    return PyLong_FromSsize_t((rank < len) ? rank : len);
+}
+
+
+PyObject* SortedDict_rank(SortedDict *self, PyObject *price)
+{
+    int found = SortedDict_contains(self, price);
+    if (EXPECT(found < 0, 0)) {
+        return NULL;
+    }
+
+    Py_ssize_t rank = 0;
+    if (found) {
+        if (EXPECT(update_keys(self) || price_rank(self, price, false, &rank), 0)) {
+            return NULL;
+        }
+    }
+
+    // levels past max_depth are not visible to index() either
+    if (!found || rank >= visible_len(self)) {
+        PyErr_SetObject(PyExc_KeyError, price);
+        return NULL;
+    }
+
+    return PyLong_FromSsize_t(rank);
+}
+
+
+PyObject* SortedDict_range(SortedDict *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *it = SortedDict_irange(self, args, kwargs);
+    if (EXPECT(!it, 0)) {
+        return NULL;
+    }
+
+    PyObject *ret = PySequence_List(it);
+    Py_DECREF(it);
+
+    return ret;
+}
+
+
+PyObject* SortedDict_irange(SortedDict *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"lo", "hi", NULL};
+    PyObject *lo = Py_None;
+    PyObject *hi = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO", kwlist, &lo, &hi)) {
+        return NULL;
+    }
+
+    Py_ssize_t start;
+    Py_ssize_t stop;
+    if (price_window(self, lo, hi, &start, &stop)) {
+        return NULL;
+    }
+
+    PyObject *snapshot = key_slice(self, start, stop - start);
+    if (EXPECT(!snapshot, 0)) {
+        return NULL;
+    }
+
+    return iter_over(self, snapshot, start, stop - start, true);
+}
+
+
+static int convert_item(PyObject **obj, PyObject *from, PyObject *to)
+{
+    if (from) {
+        int is_instance = PyObject_IsInstance(*obj, from);
+        if (EXPECT(is_instance < 0, 0)) {
+            return -1;
+        }
+
+        if (!is_instance) {
+            return 0;
+        }
+    }
+
+    PyObject *converted = PyObject_CallFunctionObjArgs(to, *obj, NULL);
+    if (EXPECT(!converted, 0)) {
+        return -1;
+    }
+
+    Py_SETREF(*obj, converted);
+    return 0;
+}
+
+
+PyObject* SortedDict_todict_impl(SortedDict *self, PyObject *from, PyObject *to)
+{
+    if (EXPECT(update_keys(self), 0)) {
+        return NULL;
+    }
+
+    // the book may be mutated by a key hash or a conversion callback below,
+    // hold both so the snapshot stays intact
+    PyObject *keys = visible_keys(self);
+    if (EXPECT(!keys, 0)) {
+        return NULL;
+    }
+    PyObject *data = Py_NewRef(self->data);
+    PyObject *values = NULL;
+    PyObject *ret = NULL;
+
+    Py_ssize_t len = PyTuple_GET_SIZE(keys);
+    if ((self->depth > 0) && (self->depth < len)) {
+        len = self->depth;
+    }
+
+    if (to || self->key_type == KEY_FIXED) {
+        // conversion runs arbitrary Python that may mutate the book so take the value
+        // snapshot before converting anything. fixed key books have no dict to look in
+        values = PyList_New(len);
+        if (EXPECT(!values, 0)) {
+            goto error;
+        }
+
+        Py_ssize_t at = 0;
+        for (Py_ssize_t i = 0; i < len; ++i) {
+            int64_t tick;
+            PyObject *value = (self->key_type == KEY_FIXED) ? fixed_next(self, &at, &tick) : PyDict_GetItemWithError(data, PyTuple_GET_ITEM(keys, i));
+
+            if (EXPECT(!value, 0)) {
+                if (!PyErr_Occurred()) {
+                    PyErr_SetObject(PyExc_KeyError, PyTuple_GET_ITEM(keys, i));
+                }
+                goto error;
+            }
+
+            PyList_SET_ITEM(values, i, Py_NewRef(value));
+        }
+    }
+
+    ret = PyDict_New();
+    if (EXPECT(!ret, 0)) {
+        goto error;
+    }
+
+    for (Py_ssize_t i = 0; i < len; ++i) {
+        // borrowed from the held keys tuple, which outlives every call below
+        PyObject *key = PyTuple_GET_ITEM(keys, i);
+        PyObject *value;
+        bool failed;
+
+        if (values) {
+            Py_INCREF(key);
+            value = Py_NewRef(PyList_GET_ITEM(values, i));
+            failed = to && (convert_item(&key, from, to) || convert_item(&value, from, to));
+
+            if (!failed) {
+                failed = PyDict_SetItem(ret, key, value) < 0;
+            }
+
+            Py_DECREF(key);
+            Py_DECREF(value);
+        } else {
+            value = PyDict_GetItemWithError(data, key);
+            if (EXPECT(!value, 0)) {
+                if (!PyErr_Occurred()) {
+                    PyErr_SetObject(PyExc_KeyError, key);
+                }
+                goto error;
+            }
+
+            // the insert hashes the key, which can drop the book's value ref
+            Py_INCREF(value);
+            failed = PyDict_SetItem(ret, key, value) < 0;
+            Py_DECREF(value);
+        }
+
+        if (EXPECT(failed, 0)) {
+            goto error;
+        }
+    }
+
+    Py_XDECREF(values);
+    Py_DECREF(keys);
+    Py_DECREF(data);
+    return ret;
+
+error:
+    Py_XDECREF(ret);
+    Py_XDECREF(values);
+    Py_DECREF(keys);
+    Py_DECREF(data);
+    return NULL;
+}
+
+
+PyObject* SortedDict_todict(SortedDict *self, PyObject *unused, PyObject *kwargs)
+{
+    static char *kwlist[] = {"from_type", "to_type", NULL};
+    PyObject *from = NULL;
+    PyObject *to = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(unused, kwargs, "|$OO", kwlist, &from, &to)) {
+        return NULL;
+    }
+
+    return SortedDict_todict_impl(self, from, to);
+}
+
+
+PyObject* SortedDict_tolist(SortedDict *self, PyObject *Py_UNUSED(ignored))
+{
+    return build_items(self);
+}
+
+
+/* Typed buffers */
+// 'd' for float64, 'f' for float32, 0 when the dtype is not supported
+static char dtype_format(const char *dtype)
+{
+    if (strcmp(dtype, "float64") == 0) {
+        return 'd';
+    }
+
+    if (strcmp(dtype, "float32") == 0) {
+        return 'f';
+    }
+
+    PyErr_SetString(PyExc_ValueError, "dtype must be one of float64 or float32");
+    return 0;
+}
+
+
+static inline void store_number(char *buffer, char format, Py_ssize_t i, double value)
+{
+    if (format == 'd') {
+        ((double *)buffer)[i] = value;
+    } else {
+        ((float *)buffer)[i] = (float)value;
+    }
+}
+
+
+/*
+write the prices and sizes of n levels from position start straight into typed buffers.
+every level is taken with a strong ref before any conversion runs, a __float__
+could mutate the book
+*/
+static int fill_levels(SortedDict *self, Py_ssize_t start, Py_ssize_t n, char format, char *prices, char *sizes)
+{
+    PyObject **keys = PyMem_New(PyObject *, n > 0 ? n : 1);
+    PyObject **values = PyMem_New(PyObject *, n > 0 ? n : 1);
+    Py_ssize_t held = 0;
+    int ret = -1;
+
+    if (EXPECT(!keys || !values, 0)) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    if (self->key_type == KEY_FIXED) {
+        // prices never leave native form
+        double scale = (double)fixed_pow10(self->fixed.scale);
+        Py_ssize_t at = (n > 0) ? fixed_seek(self, start) : 0;
+
+        for (; held < n; ++held) {
+            int64_t tick;
+            values[held] = Py_NewRef(fixed_next(self, &at, &tick));
+            keys[held] = NULL;
+
+            int64_t units = ((self->ordering == DESCENDING) ? -tick : tick) * self->fixed.units;
+            store_number(prices, format, held, (double)units / scale);
+        }
+    } else {
+        keytree_copy(&self->tree, start, n, keys);
+        for (Py_ssize_t i = 0; i < n; ++i) {
+            Py_INCREF(keys[i]);
+        }
+
+        for (; held < n; ++held) {
+            PyObject *value = PyDict_GetItemWithError(self->data, keys[held]);
+            if (EXPECT(!value, 0)) {
+                if (!PyErr_Occurred()) {
+                    PyErr_SetObject(PyExc_KeyError, keys[held]);
+                }
+                goto done;
+            }
+            values[held] = Py_NewRef(value);
+        }
+    }
+
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        if (keys[i]) {
+            double price = PyFloat_AsDouble(keys[i]);
+            if (EXPECT(price == -1.0 && PyErr_Occurred(), 0)) {
+                goto done;
+            }
+            store_number(prices, format, i, price);
+        }
+
+        double size = PyFloat_AsDouble(values[i]);
+        if (EXPECT(size == -1.0 && PyErr_Occurred(), 0)) {
+            goto done;
+        }
+        store_number(sizes, format, i, size);
+    }
+
+    ret = 0;
+
+done:
+    // keys are held for every level up front, values only up to where collection stopped
+    for (Py_ssize_t i = 0; i < held; ++i) {
+        Py_DECREF(values[i]);
+    }
+
+    if (self->key_type == KEY_OBJECT && keys && values) {
+        for (Py_ssize_t i = 0; i < n; ++i) {
+            Py_DECREF(keys[i]);
+        }
+    }
+
+    PyMem_Free(keys);
+    PyMem_Free(values);
+    return ret;
+}
+
+
+// a writable flat memoryview of n items over a fresh bytearray
+static PyObject *typed_buffer(Py_ssize_t n, char format, char **data)
+{
+    Py_ssize_t itemsize = (format == 'd') ? sizeof(double) : sizeof(float);
+    PyObject *bytes = PyByteArray_FromStringAndSize(NULL, n * itemsize);
+    if (EXPECT(!bytes, 0)) {
+        return NULL;
+    }
+
+    *data = PyByteArray_AS_STRING(bytes);
+
+    PyObject *view = PyMemoryView_FromObject(bytes);
+    Py_DECREF(bytes);
+    if (EXPECT(!view, 0)) {
+        return NULL;
+    }
+
+    const char spec[2] = {format, '\0'};
+    PyObject *ret = PyObject_CallMethod(view, "cast", "s", spec);
+    Py_DECREF(view);
+
+    return ret;
+}
+
+
+// borrow a caller's buffer to fill. it must be writable, contiguous and of the requested type
+static int out_buffer(PyObject *obj, char format, Py_buffer *view)
+{
+    if (PyObject_GetBuffer(obj, view, PyBUF_WRITABLE | PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0) {
+        return -1;
+    }
+
+    const char *spec = view->format ? view->format : "B";
+    // native byte order prefixes are accepted
+    if (*spec == '@' || *spec == '=') {
+        spec++;
+    }
+
+    if (spec[0] != format || spec[1] != '\0') {
+        PyBuffer_Release(view);
+        PyErr_SetString(PyExc_TypeError, "out buffers must match the requested dtype");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+prices and sizes of the first depth levels (all visible levels when depth < 0) as
+flat memoryviews of float64 or float32, ready for numpy.asarray without a copy.
+with out given as a pair of writable buffers those are filled instead, as many
+levels as fit, and the count written is returned
+*/
+PyObject *SortedDict_arrays(SortedDict *self, Py_ssize_t depth, const char *dtype, PyObject *out)
+{
+    char format = dtype_format(dtype);
+    if (!format) {
+        return NULL;
+    }
+
+    if (EXPECT(update_keys(self), 0)) {
+        return NULL;
+    }
+
+    Py_ssize_t n = SortedDict_cached_len(self);
+    if (self->depth > 0 && self->depth < n) {
+        n = self->depth;
+    }
+
+    if (depth >= 0 && depth < n) {
+        n = depth;
+    }
+
+    if (out && out != Py_None) {
+        if (EXPECT(!PyTuple_Check(out) || PyTuple_GET_SIZE(out) != 2, 0)) {
+            PyErr_SetString(PyExc_TypeError, "out must be a tuple of two buffers");
+            return NULL;
+        }
+
+        Py_buffer prices;
+        Py_buffer sizes;
+
+        if (out_buffer(PyTuple_GET_ITEM(out, 0), format, &prices)) {
+            return NULL;
+        }
+
+        if (out_buffer(PyTuple_GET_ITEM(out, 1), format, &sizes)) {
+            PyBuffer_Release(&prices);
+            return NULL;
+        }
+
+        Py_ssize_t fit = ((prices.len < sizes.len) ? prices.len : sizes.len) / prices.itemsize;
+        if (fit < n) {
+            n = fit;
+        }
+
+        int failed = fill_levels(self, 0, n, format, prices.buf, sizes.buf);
+        PyBuffer_Release(&prices);
+        PyBuffer_Release(&sizes);
+
+        return failed ? NULL : PyLong_FromSsize_t(n);
+    }
+
+    char *price_data;
+    char *size_data;
+    PyObject *prices = typed_buffer(n, format, &price_data);
+    PyObject *sizes = prices ? typed_buffer(n, format, &size_data) : NULL;
+
+    if (EXPECT(!sizes || fill_levels(self, 0, n, format, price_data, size_data), 0)) {
+        Py_XDECREF(prices);
+        Py_XDECREF(sizes);
+        return NULL;
+    }
+
+    PyObject *ret = PyTuple_Pack(2, prices, sizes);
+    Py_DECREF(prices);
+    Py_DECREF(sizes);
+
+    return ret;
+}
+
+
+PyObject* SortedDict_toarrays(SortedDict *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"depth", "dtype", "out", NULL};
+    PyObject *depth_arg = Py_None;
+    const char *dtype = "float64";
+    PyObject *out = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|Os$O", kwlist, &depth_arg, &dtype, &out)) {
+        return NULL;
+    }
+
+    Py_ssize_t depth = -1;
+    if (depth_arg != Py_None) {
+        depth = PyLong_AsSsize_t(depth_arg);
+        if (depth == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+
+        if (depth < 0) {
+            PyErr_SetString(PyExc_ValueError, "depth must not be negative");
+            return NULL;
+        }
+    }
+
+    return SortedDict_arrays(self, depth, dtype, out);
+}
+
+
+/* Depth queries */
+// make the running totals cover the first 'need' levels, the keys must be current.
+// levels are converted into scratch space and only installed if no conversion wrote
+// to the book, a __float__ can reenter and even run another depth query
+static int depth_extend(SortedDict *self, Py_ssize_t need)
+{
+    DepthCache *c = &self->prefix;
+
+    if (c->version != self->version) {
+        c->valid = 0;
+        c->version = self->version;
+    }
+
+    if (need <= c->valid) {
+        return 0;
+    }
+
+    Py_ssize_t from = c->valid;
+    Py_ssize_t n = need - from;
+    double *scratch = PyMem_New(double, 2 * n);
+    if (EXPECT(!scratch, 0)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    if (EXPECT(fill_levels(self, from, n, 'd', (char *)scratch, (char *)(scratch + n)), 0)) {
+        PyMem_Free(scratch);
+        return -1;
+    }
+
+    if (EXPECT(c->valid != from || c->version != self->version, 0)) {
+        PyMem_Free(scratch);
+        PyErr_SetString(PyExc_RuntimeError, "SortedDict changed during depth query");
+        return -1;
+    }
+
+    if (need > c->cap) {
+        Py_ssize_t cap = c->cap ? c->cap : 64;
+        while (cap < need) {
+            cap *= 2;
+        }
+
+        double *arrays[3] = {c->prices, c->sizes, c->notional};
+        for (int i = 0; i < 3; ++i) {
+            double *grown = PyMem_Realloc(arrays[i], cap * sizeof(double));
+            if (EXPECT(!grown, 0)) {
+                // the arrays that did grow are kept, the cache only trusts cap
+                c->prices = arrays[0];
+                c->sizes = arrays[1];
+                c->notional = arrays[2];
+                PyMem_Free(scratch);
+                PyErr_NoMemory();
+                return -1;
+            }
+            arrays[i] = grown;
+        }
+
+        c->prices = arrays[0];
+        c->sizes = arrays[1];
+        c->notional = arrays[2];
+        c->cap = cap;
+    }
+
+    double size = from ? c->sizes[from - 1] : 0.0;
+    double notional = from ? c->notional[from - 1] : 0.0;
+
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        double price = scratch[i];
+        double level = scratch[n + i];
+
+        size += level;
+        notional += price * level;
+        c->prices[from + i] = price;
+        c->sizes[from + i] = size;
+        c->notional[from + i] = notional;
+    }
+
+    c->valid = need;
+    PyMem_Free(scratch);
+
+    return 0;
+}
+
+
+// the first visible level whose running size reaches qty, the visible length when
+// none does. the cache grows by doubling so a fill near the top reads few levels
+static int depth_reach(SortedDict *self, double qty, Py_ssize_t *index)
+{
+    const DepthCache *c = &self->prefix;
+    Py_ssize_t len = visible_len(self);
+    Py_ssize_t need = 16;
+
+    // the totals are floats, sizes that add up to qty exactly in decimal can land a rounding step short
+    qty -= qty * 1e-12;
+
+    for (;; need *= 2) {
+        if (need > len) {
+            need = len;
+        }
+
+        if (depth_extend(self, need)) {
+            return -1;
+        }
+
+        if (need == len || c->sizes[need - 1] >= qty) {
+            break;
+        }
+    }
+
+    // sizes are not negative, so the running totals are sorted
+    Py_ssize_t lo = 0;
+    Py_ssize_t hi = need;
+    while (lo < hi) {
+        Py_ssize_t mid = lo + ((hi - lo) >> 1);
+
+        if (c->sizes[mid] < qty) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    *index = lo;
+    return 0;
+}
+
+
+static int parse_qty(PyObject *obj, double *qty)
+{
+    *qty = PyFloat_AsDouble(obj);
+    if (EXPECT(*qty == -1.0 && PyErr_Occurred(), 0)) {
+        return -1;
+    }
+
+    if (EXPECT(!(*qty > 0.0), 0)) {
+        PyErr_SetString(PyExc_ValueError, "quantity must be greater than 0");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+PyObject* SortedDict_cumulative(SortedDict *self, PyObject *args)
+{
+    PyObject *depth_arg = Py_None;
+
+    if (!PyArg_ParseTuple(args, "|O", &depth_arg)) {
+        return NULL;
+    }
+
+    if (EXPECT(update_keys(self), 0)) {
+        return NULL;
+    }
+
+    Py_ssize_t n = visible_len(self);
+    if (depth_arg != Py_None) {
+        Py_ssize_t depth = PyLong_AsSsize_t(depth_arg);
+        if (depth == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+
+        if (depth < 0) {
+            PyErr_SetString(PyExc_ValueError, "depth must not be negative");
+            return NULL;
+        }
+
+        n = (depth < n) ? depth : n;
+    }
+
+    if (depth_extend(self, n)) {
+        return NULL;
+    }
+
+    return PyFloat_FromDouble(n ? self->prefix.sizes[n - 1] : 0.0);
+}
+
+
+PyObject* SortedDict_size_to_price(SortedDict *self, PyObject *price)
+{
+    if (EXPECT(update_keys(self), 0)) {
+        return NULL;
+    }
+
+    Py_ssize_t n;
+    if (price_rank(self, price, true, &n)) {
+        return NULL;
+    }
+
+    Py_ssize_t len = visible_len(self);
+    n = (n < len) ? n : len;
+
+    if (depth_extend(self, n)) {
+        return NULL;
+    }
+
+    return PyFloat_FromDouble(n ? self->prefix.sizes[n - 1] : 0.0);
+}
+
+
+PyObject* SortedDict_price_for_size(SortedDict *self, PyObject *qty)
+{
+    double want;
+    Py_ssize_t i;
+
+    if (parse_qty(qty, &want) || update_keys(self) || depth_reach(self, want, &i)) {
+        return NULL;
+    }
+
+    if (i == visible_len(self)) {
+        Py_RETURN_NONE;
+    }
+
+    if (self->key_type == KEY_FIXED) {
+        Py_ssize_t at = fixed_seek(self, i);
+        int64_t tick;
+        if (EXPECT(!fixed_next(self, &at, &tick), 0)) {
+            Py_RETURN_NONE;
+        }
+
+        return fixed_box(self, tick);
+    }
+
+    return Py_NewRef(keytree_at(&self->tree, i));
+}
+
+
+PyObject* SortedDict_vwap(SortedDict *self, PyObject *qty)
+{
+    double want;
+    Py_ssize_t i;
+
+    if (parse_qty(qty, &want) || update_keys(self) || depth_reach(self, want, &i)) {
+        return NULL;
+    }
+
+    if (i == visible_len(self)) {
+        Py_RETURN_NONE;
+    }
+
+    // whole levels ahead of i, then the rest of the quantity at level i's price
+    const DepthCache *c = &self->prefix;
+    double filled = i ? c->sizes[i - 1] : 0.0;
+    double notional = i ? c->notional[i - 1] : 0.0;
+
+    return PyFloat_FromDouble((notional + (want - filled) * c->prices[i]) / want);
+}
+
+
+static int truncate_to_depth(SortedDict *self)
+{
+    if (!self->depth) {
+        return 0;
+    }
+
+    if (self->key_type == KEY_FIXED) {
+        return fixed_truncate(self);
+    }
+
+    if (EXPECT(update_keys(self), 0)) {
+        return -1;
+    }
+
+    Py_ssize_t size = self->tree.size;
+    if (size <= self->depth) {
+        return 0;
+    }
+
+    if (EXPECT(storage_own(self), 0)) {
+        return -1;
+    }
+
+    // evictions only come off the tail: cut the tree first so it matches the
+    // book we are about to have, the evicted refs hold the keys for the deletes
+    Py_ssize_t count = size - self->depth;
+    PyObject **evicted = PyMem_New(PyObject *, count);
+    if (EXPECT(!evicted, 0)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    keytree_truncate(&self->tree, self->depth, evicted);
+    for (Py_ssize_t i = 0; i < count; ++i) {
+        delta_log_key(self, evicted[i]);
+        journal_key(self, evicted[i], NULL, JOURNAL_DELETE);
+    }
+    self->version++;
+    Py_CLEAR(self->keys_tuple);
+    prefix_touch(self, self->depth);
+
+    uint64_t version = self->version;
+    int ret = 0;
+
+    for (Py_ssize_t i = 0; i < count && ret == 0; ++i) {
+        ret = PyDict_DelItem(self->data, evicted[i]);
+    }
+
+    for (Py_ssize_t i = 0; i < count; ++i) {
+        Py_DECREF(evicted[i]);
+    }
+    PyMem_Free(evicted);
+
+    if (EXPECT(ret, 0)) {
+        escalate_to_dirty(self);
+        return -1;
+    }
+
+    if (EXPECT(self->version != version, 0)) {
+        // a re-entrant mutation interleaved with the eviction, recompute
+        escalate_to_dirty(self);
+        return update_keys(self) ? -1 : 0;
+    }
+
+    return 0;
+}
+
+
+PyObject* SortedDict_truncate(SortedDict *self, PyObject *Py_UNUSED(ignored))
+{
+    if (EXPECT(check_writable(self) || truncate_to_depth(self) || SortedDict_notify(self), 0)) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+// a frozen side sharing this side's storage. O(1) past sorting a dirty side: the side
+// copies what it shares on its next write, and a snapshot of a snapshot is itself
+PyObject* SortedDict_snapshot(SortedDict *self, PyObject *Py_UNUSED(ignored))
+{
+    if (self->frozen) {
+        return Py_NewRef(self);
+    }
+
+    if (EXPECT(update_keys(self), 0)) {
+        return NULL;
+    }
+
+    if (!self->shares) {
+        self->shares = PyMem_New(Py_ssize_t, 1);
+        if (EXPECT(!self->shares, 0)) {
+            return PyErr_NoMemory();
+        }
+        *self->shares = 1;
+    }
+
+    SortedDict *snap = (SortedDict *)SortedDict_new(Py_TYPE(self), NULL, NULL);
+    if (EXPECT(!snap, 0)) {
+        return NULL;
+    }
+
+    Py_SETREF(snap->data, Py_NewRef(self->data));
+    snap->tree = self->tree;
+    snap->fixed = self->fixed;
+    Py_XINCREF(snap->fixed.tick);
+    Py_XINCREF(snap->fixed.box);
+    snap->keys_tuple = Py_XNewRef(self->keys_tuple);
+    snap->intern = Py_XNewRef(self->intern);
+    snap->pool = Py_XNewRef(self->pool);
+    snap->version = self->version;
+    snap->changes = self->changes;
+    snap->ordering = self->ordering;
+    snap->key_type = self->key_type;
+    snap->depth = self->depth;
+    snap->truncate = self->truncate;
+    snap->shares = self->shares;
+    snap->frozen = true;
+
+    (*self->shares)++;
+    self->data_shared = true;
+
+    return (PyObject *)snap;
+}
+
+
+/* Serialization */
+// settings, then every held level in book order. object keys are written as they are,
+// fixed keys as zigzag varint deltas between successive book ordered ticks
+int SortedDict_encode(SortedDict *self, CodecWriter *w)
+{
+    if (EXPECT(update_keys(self), 0)) {
+        return -1;
+    }
+
+    if (codec_put_u8(w, (uint8_t)self->ordering) ||
+        codec_put_u8(w, (uint8_t)self->key_type) ||
+        codec_put_u8(w, self->truncate) ||
+        codec_put_varint(w, (uint64_t)(self->depth > 0 ? self->depth : 0)) ||
+        codec_put_value(w, self->intern ? self->intern : Py_None)) {
+        return -1;
+    }
+
+    // encoding a value can run python (pickle), so work from copies of the keys and values
+    Py_ssize_t n = SortedDict_cached_len(self);
+    PyObject *keys = NULL;
+    PyObject *values = NULL;
+    PyObject *data = Py_NewRef(self->data);
+    int64_t *ticks = NULL;
+    int ret = -1;
+
+    if (self->key_type == KEY_OBJECT) {
+        keys = key_slice(self, 0, n);
+        if (EXPECT(!keys, 0)) {
+            goto done;
+        }
+    } else {
+        ticks = PyMem_New(int64_t, n > 0 ? n : 1);
+        values = PyTuple_New(n);
+        if (EXPECT(!ticks || !values, 0)) {
+            if (!ticks) {
+                PyErr_NoMemory();
+            }
+            goto done;
+        }
+
+        Py_ssize_t at = 0;
+        for (Py_ssize_t i = 0; i < n; ++i) {
+            PyTuple_SET_ITEM(values, i, Py_NewRef(fixed_next(self, &at, &ticks[i])));
+        }
+
+        if (codec_put_value(w, self->fixed.tick) || codec_put_varint(w, (uint64_t)self->fixed.ladder.band)) {
+            goto done;
+        }
+    }
+
+    if (codec_put_varint(w, (uint64_t)n)) {
+        goto done;
+    }
+
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        PyObject *value;
+
+        if (self->key_type == KEY_OBJECT) {
+            PyObject *key = PyTuple_GET_ITEM(keys, i);
+
+            value = PyDict_GetItemWithError(data, key);
+            if (EXPECT(!value, 0)) {
+                if (!PyErr_Occurred()) {
+                    PyErr_SetObject(PyExc_KeyError, key);
+                }
+                goto done;
+            }
+
+            if (codec_put_value(w, key)) {
+                goto done;
+            }
+        } else {
+            uint64_t delta = i ? (uint64_t)(ticks[i] - ticks[i - 1]) : codec_zigzag(ticks[0]);
+
+            if (codec_put_varint(w, delta)) {
+                goto done;
+            }
+            value = PyTuple_GET_ITEM(values, i);
+        }
+
+        Py_INCREF(value);
+        int failed = codec_put_value(w, value);
+        Py_DECREF(value);
+        if (failed) {
+            goto done;
+        }
+    }
+    ret = 0;
+
+done:
+    PyMem_Free(ticks);
+    Py_XDECREF(keys);
+    Py_XDECREF(values);
+    Py_DECREF(data);
+
+    return ret;
+}
+
+
+// the levels of an object keyed side. keys that arrive in book order are loaded into
+// the tree as they are, anything else is left for a full sort on the next read
+static int decode_object_levels(SortedDict *self, CodecReader *r, Py_ssize_t n)
+{
+    PyObject **keys = PyMem_New(PyObject *, n > 0 ? n : 1);
+    PyObject *data = keys ? PyDict_New() : NULL;
+    Py_ssize_t count = 0;
+    int op = (self->ordering == DESCENDING) ? Py_GT : Py_LT;
+    bool ordered = true;
+    int ret = -1;
+
+    if (EXPECT(!data, 0)) {
+        if (!keys) {
+            PyErr_NoMemory();
+        }
+        goto done;
+    }
+
+    for (; count < n; ++count) {
+        PyObject *key = codec_get_value(r);
+        if (EXPECT(!key, 0)) {
+            goto done;
+        }
+        keys[count] = key;
+
+        PyObject *value = codec_get_value(r);
+        if (EXPECT(!value, 0)) {
+            count++;
+            goto done;
+        }
+
+        int failed = PyDict_SetItem(data, key, value);
+        Py_DECREF(value);
+        if (EXPECT(failed, 0)) {
+            count++;
+            goto done;
+        }
+
+        if (ordered && count) {
+            int cmp = PyObject_RichCompareBool(keys[count - 1], key, op);
+            if (EXPECT(cmp < 0, 0)) {
+                PyErr_Clear();
+            }
+            ordered = (cmp > 0);
+        }
+    }
+
+    Py_SETREF(self->data, data);
+    data = NULL;
+
+    if (ordered && PyDict_GET_SIZE(self->data) == n) {
+        if (EXPECT(keytree_load(&self->tree, keys, n), 0)) {
+            escalate_to_dirty(self);
+            goto done;
+        }
+        self->dirty = false;
+        self->version++;
+    } else {
+        escalate_to_dirty(self);
+    }
+    ret = 0;
+
+done:
+    for (Py_ssize_t i = 0; i < count; ++i) {
+        Py_DECREF(keys[i]);
+    }
+    PyMem_Free(keys);
+    Py_XDECREF(data);
+
+    return ret;
+}
+
+
+// the levels of a fixed key side, installed straight into the arrays and the ladder
+static int decode_fixed_levels(SortedDict *self, CodecReader *r, Py_ssize_t n)
+{
+    FixedKeys *fk = &self->fixed;
+    int64_t tick = 0;
+
+    if (EXPECT(fixed_reserve(fk, n), 0)) {
+        return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        uint64_t delta;
+        int64_t units;
+
+        if (codec_get_varint(r, &delta)) {
+            return -1;
+        }
+
+        // ticks strictly increase, and have to box back into a price without overflow
+        if (i == 0) {
+            tick = codec_unzigzag(delta);
+        } else if (delta == 0 || delta > INT64_MAX || __builtin_add_overflow(tick, (int64_t)delta, &tick)) {
+            return codec_corrupt();
+        }
+
+        if (tick == INT64_MIN || __builtin_mul_overflow(tick < 0 ? -tick : tick, fk->units, &units)) {
+            return codec_corrupt();
+        }
+
+        PyObject *value = codec_get_value(r);
+        if (EXPECT(!value, 0)) {
+            return -1;
+        }
+
+        fk->keys[fk->len] = tick;
+        fk->values[fk->len++] = value;
+    }
+
+    self->version++;
+    Py_CLEAR(self->keys_tuple);
+
+    // sized for every level with the ladder empty, cannot fail
+    if (fk->ladder.band && fk->len) {
+        ladder_recenter(self, fk->keys[0]);
+    }
+
+    return 0;
+}
+
+
+// install levels already sorted by price tick into an empty fixed key side, as a history
+// file holds them. nothing is sorted or compared. the values are borrowed
+int SortedDict_load_ticks(PyObject *dict, const int64_t *ticks, PyObject *const *values, Py_ssize_t n)
+{
+    SortedDict *self = (SortedDict *)dict;
+    FixedKeys *fk = &self->fixed;
+
+    if (EXPECT(self->key_type != KEY_FIXED || has_contents(self), 0)) {
+        PyErr_SetString(PyExc_ValueError, "ticks can only be loaded into an empty fixed key side");
+        return -1;
+    }
+
+    if (check_writable(self) || storage_own(self) || fixed_reserve(fk, n)) {
+        return -1;
+    }
+
+    // book order is descending price on a DESC side, which holds negated ticks
+    bool descending = (self->ordering == DESCENDING);
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        Py_ssize_t from = descending ? n - 1 - i : i;
+        fk->keys[i] = descending ? -ticks[from] : ticks[from];
+        fk->values[i] = Py_NewRef(values[from]);
+    }
+    fk->len = n;
+
+    delta_reset(self);
+    self->version++;
+    Py_CLEAR(self->keys_tuple);
+
+    // sized for every level with the ladder empty, cannot fail
+    if (fk->ladder.band && fk->len) {
+        ladder_recenter(self, fk->keys[0]);
+    }
+
+    return 0;
+}
+
+
+// restore an encoded side into a freshly created, empty one
+int SortedDict_decode(SortedDict *self, CodecReader *r)
+{
+    uint8_t ordering, key_type, truncate;
+    uint64_t depth;
+    Py_ssize_t n;
+
+    if (codec_get_u8(r, &ordering) || codec_get_u8(r, &key_type) || codec_get_u8(r, &truncate) || codec_get_varint(r, &depth)) {
+        return -1;
+    }
+
+    if (EXPECT(ordering > DESCENDING || key_type > KEY_FIXED || truncate > 1 || depth > INT_MAX, 0)) {
+        return codec_corrupt();
+    }
+
+    self->ordering = ordering;
+
+    PyObject *intern = codec_get_value(r);
+    if (EXPECT(!intern, 0)) {
+        return -1;
+    }
+
+    int failed = SortedDict_set_intern(self, intern);
+    Py_DECREF(intern);
+    if (failed) {
+        return -1;
+    }
+
+    if (key_type == KEY_FIXED) {
+        uint64_t band;
+        PyObject *tick = codec_get_value(r);
+
+        if (EXPECT(!tick, 0)) {
+            return -1;
+        }
+
+        if (codec_get_varint(r, &band) || (band > LADDER_MAX_BAND && codec_corrupt())) {
+            Py_DECREF(tick);
+            return -1;
+        }
+
+        failed = SortedDict_set_key_type(self, KEY_FIXED, tick, (Py_ssize_t)band);
+        Py_DECREF(tick);
+        if (failed) {
+            return -1;
+        }
+    }
+
+    if (codec_get_count(r, &n)) {
+        return -1;
+    }
+
+    if ((key_type == KEY_FIXED) ? decode_fixed_levels(self, r, n) : decode_object_levels(self, r, n)) {
+        return -1;
+    }
+    delta_reset(self);
+
+    self->depth = (int)depth;
+    self->truncate = truncate;
+
+    return self->truncate ? truncate_to_depth(self) : 0;
+}
+
+
+PyObject* SortedDict_tobytes(SortedDict *self, PyObject *Py_UNUSED(ignored))
+{
+    CodecWriter w = {0};
+
+    if (codec_put(&w, CODEC_MAGIC_SIDE, CODEC_MAGIC_LEN) || SortedDict_encode(self, &w)) {
+        codec_writer_release(&w);
+        return NULL;
+    }
+
+    return codec_writer_bytes(&w);
+}
+
+
+PyObject* SortedDict_frombytes(PyTypeObject *type, PyObject *data)
+{
+    Py_buffer view;
+
+    if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE)) {
+        return NULL;
+    }
+
+    CodecReader r = {view.buf, view.len, 0};
+    SortedDict *self = (SortedDict *)SortedDict_new(type, NULL, NULL);
+
+    if (self && (codec_expect(&r, CODEC_MAGIC_SIDE) || SortedDict_decode(self, &r) || codec_finish(&r))) {
+        Py_CLEAR(self);
+    }
+
+    PyBuffer_Release(&view);
+    return (PyObject *)self;
+}
+
+
+// pickles as the binary encoding, restored through from_bytes
+PyObject* SortedDict_reduce(SortedDict *self, PyObject *Py_UNUSED(ignored))
+{
+    PyObject *blob = SortedDict_tobytes(self, NULL);
+    PyObject *restore = blob ? PyObject_GetAttrString((PyObject *)Py_TYPE(self), "from_bytes") : NULL;
+    PyObject *ret = restore ? Py_BuildValue("(O(O))", restore, blob) : NULL;
+
+    Py_XDECREF(restore);
+    Py_XDECREF(blob);
+    return ret;
+}
+
+
+/* Deltas */
+// (key, value) for a level that is held, (key,) for one that is not
+static PyObject *delta_level(PyObject *key, PyObject *value)
+{
+    return value ? PyTuple_Pack(2, key, value) : PyTuple_Pack(1, key);
+}
+
+
+static int ticks_cmp(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+// every level the side holds
+static PyObject *delta_all_levels(SortedDict *self)
+{
+    Py_ssize_t n = SortedDict_cached_len(self);
+    PyObject *keys = key_slice(self, 0, n);
+    PyObject *levels = keys ? PyList_New(n) : NULL;
+
+    if (EXPECT(!levels, 0)) {
+        Py_XDECREF(keys);
+        return NULL;
+    }
+
+    Py_ssize_t at = 0;
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        PyObject *key = PyTuple_GET_ITEM(keys, i);
+        int64_t tick;
+        PyObject *value = (self->key_type == KEY_FIXED) ? fixed_next(self, &at, &tick) : PyDict_GetItemWithError(self->data, key);
+        PyObject *level = value ? delta_level(key, value) : NULL;
+
+        if (EXPECT(!level, 0)) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetObject(PyExc_KeyError, key);
+            }
+            Py_DECREF(keys);
+            Py_DECREF(levels);
+            return NULL;
+        }
+        PyList_SET_ITEM(levels, i, level);
+    }
+
+    Py_DECREF(keys);
+    return levels;
+}
+
+
+// the distinct levels behind the newest n logged changes, as they are now
+static PyObject *delta_logged_levels(SortedDict *self, Py_ssize_t n)
+{
+    const DeltaLog *log = &self->log;
+    PyObject *levels = PyList_New(0);
+
+    if (EXPECT(!levels, 0)) {
+        return NULL;
+    }
+
+    if (self->key_type == KEY_FIXED) {
+        int64_t *ticks = PyMem_New(int64_t, n > 0 ? n : 1);
+        if (EXPECT(!ticks, 0)) {
+            Py_DECREF(levels);
+            return PyErr_NoMemory();
+        }
+
+        for (Py_ssize_t i = 0; i < n; ++i) {
+            ticks[i] = log->entries[(log->head - 1 - i + log->cap) % log->cap].tick;
+        }
+        qsort(ticks, n, sizeof(int64_t), ticks_cmp);
+
+        // boxing only builds numbers, nothing here can reenter the book
+        for (Py_ssize_t i = 0; i < n; ++i) {
+            if (i && ticks[i] == ticks[i - 1]) {
+                continue;
+            }
+
+            PyObject **stored = fixed_lookup(self, ticks[i]);
+            PyObject *key = fixed_box(self, ticks[i]);
+            PyObject *level = key ? delta_level(key, stored ? *stored : NULL) : NULL;
+            int failed = !level || PyList_Append(levels, level);
+
+            Py_XDECREF(key);
+            Py_XDECREF(level);
+            if (EXPECT(failed, 0)) {
+                PyMem_Free(ticks);
+                Py_DECREF(levels);
+                return NULL;
+            }
+        }
+
+        PyMem_Free(ticks);
+        return levels;
+    }
+
+    // hashing a key can run python, so copy the logged keys out before deduping them through a dict
+    PyObject *logged = PyTuple_New(n);
+    PyObject *seen = logged ? PyDict_New() : NULL;
+    PyObject *keys = NULL;
+    if (EXPECT(!seen, 0)) {
+        goto error;
+    }
+
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        PyTuple_SET_ITEM(logged, i, Py_NewRef(log->entries[(log->head - 1 - i + log->cap) % log->cap].key));
+    }
+
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        if (EXPECT(PyDict_SetItem(seen, PyTuple_GET_ITEM(logged, i), Py_None), 0)) {
+            goto error;
+        }
+    }
+
+    keys = PyDict_Keys(seen);
+    if (EXPECT(!keys, 0)) {
+        goto error;
+    }
+
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(keys); ++i) {
+        PyObject *key = PyList_GET_ITEM(keys, i);
+        PyObject *value = PyDict_GetItemWithError(self->data, key);
+        if (EXPECT(!value && PyErr_Occurred(), 0)) {
+            goto error;
+        }
+
+        PyObject *level = delta_level(key, value);
+        int failed = !level || PyList_Append(levels, level);
+        Py_XDECREF(level);
+        if (EXPECT(failed, 0)) {
+            goto error;
+        }
+    }
+
+    Py_DECREF(logged);
+    Py_DECREF(seen);
+    Py_DECREF(keys);
+    return levels;
+
+error:
+    Py_XDECREF(logged);
+    Py_XDECREF(seen);
+    Py_XDECREF(keys);
+    Py_DECREF(levels);
+    return NULL;
+}
+
+
+// the levels changed since a version, each with its value now or marked removed.
+// since None, or a version older than the log reaches, is a reset carrying every level
+int SortedDict_encode_delta(SortedDict *self, PyObject *since, CodecWriter *w)
+{
+    uint64_t from = 0;
+    bool reset = true;
+
+    if (since != Py_None) {
+        from = PyLong_AsUnsignedLongLong(since);
+        if (from == (uint64_t)-1 && PyErr_Occurred()) {
+            return -1;
+        }
+
+        if (from > self->changes) {
+            PyErr_Format(PyExc_ValueError, "version %llu is ahead of the side, at %llu", (unsigned long long)from, (unsigned long long)self->changes);
+            return -1;
+        }
+
+        reset = from < self->changes - (uint64_t)self->log.count;
+    }
+
+    if (EXPECT(update_keys(self), 0)) {
+        return -1;
+    }
+
+    // encoding a value can run python (pickle), so the levels are gathered up front
+    PyObject *levels = reset ? delta_all_levels(self) : delta_logged_levels(self, (Py_ssize_t)(self->changes - from));
+    if (EXPECT(!levels, 0)) {
+        return -1;
+    }
+
+    int failed = codec_put_u8(w, reset) ||
+                 codec_put_varint(w, from) ||
+                 codec_put_varint(w, self->changes) ||
+                 codec_put_varint(w, (uint64_t)PyList_GET_SIZE(levels));
+
+    for (Py_ssize_t i = 0; !failed && i < PyList_GET_SIZE(levels); ++i) {
+        PyObject *level = PyList_GET_ITEM(levels, i);
+        bool held = PyTuple_GET_SIZE(level) == 2;
+
+        failed = codec_put_value(w, PyTuple_GET_ITEM(level, 0)) ||
+                 codec_put_u8(w, held ? 's' : 'r') ||
+                 (held && codec_put_value(w, PyTuple_GET_ITEM(level, 1)));
+    }
+
+    Py_DECREF(levels);
+    return failed ? -1 : 0;
+}
+
+
+int SortedDict_read_delta(CodecReader *r, SideDelta *delta)
+{
+    uint8_t reset;
+    Py_ssize_t n;
+
+    delta->levels = NULL;
+    if (codec_get_u8(r, &reset) || codec_get_varint(r, &delta->from) || codec_get_varint(r, &delta->to) || codec_get_count(r, &n)) {
+        return -1;
+    }
+
+    if (EXPECT(reset > 1 || (!reset && delta->from > delta->to), 0)) {
+        return codec_corrupt();
+    }
+    delta->reset = reset;
+
+    delta->levels = PyList_New(n);
+    if (EXPECT(!delta->levels, 0)) {
+        return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        uint8_t op;
+        PyObject *key = codec_get_value(r);
+        PyObject *value = NULL;
+
+        if (!key || codec_get_u8(r, &op) || (op != 's' && op != 'r' && codec_corrupt()) || (op == 's' && !(value = codec_get_value(r)))) {
+            Py_XDECREF(key);
+            Py_CLEAR(delta->levels);
+            return -1;
+        }
+
+        PyObject *level = delta_level(key, value);
+        Py_DECREF(key);
+        Py_XDECREF(value);
+        if (EXPECT(!level, 0)) {
+            Py_CLEAR(delta->levels);
+            return -1;
+        }
+        PyList_SET_ITEM(delta->levels, i, level);
+    }
+
+    return 0;
+}
+
+
+// a delta has to pick up where the last one applied here left off, unless it is a reset
+int SortedDict_check_delta(const SortedDict *self, const SideDelta *delta)
+{
+    if (check_writable(self)) {
+        return -1;
+    }
+
+    if (!delta->reset && delta->from != self->applied) {
+        PyErr_Format(PyExc_ValueError, "delta starts at version %llu, the side was last synced to %llu", (unsigned long long)delta->from, (unsigned long long)self->applied);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int SortedDict_install_delta(SortedDict *self, SideDelta *delta)
+{
+    PyObject *levels = delta->levels;
+    int ret = -1;
+
+    if (delta->reset) {
+        PyObject *dict = PyDict_New();
+        if (EXPECT(!dict, 0)) {
+            return -1;
+        }
+
+        for (Py_ssize_t i = 0; i < PyList_GET_SIZE(levels); ++i) {
+            PyObject *level = PyList_GET_ITEM(levels, i);
+            if (PyTuple_GET_SIZE(level) == 2 && PyDict_SetItem(dict, PyTuple_GET_ITEM(level, 0), PyTuple_GET_ITEM(level, 1))) {
+                Py_DECREF(dict);
+                return -1;
+            }
+        }
+
+        ret = SortedDict_replace(self, dict);
+        Py_DECREF(dict);
+    } else {
+        ret = 0;
+        for (Py_ssize_t i = 0; i < PyList_GET_SIZE(levels) && ret == 0; ++i) {
+            PyObject *level = PyList_GET_ITEM(levels, i);
+            PyObject *key = PyTuple_GET_ITEM(level, 0);
+
+            if (PyTuple_GET_SIZE(level) == 2) {
+                ret = store_level(self, key, PyTuple_GET_ITEM(level, 1), false);
+            } else if (store_level(self, key, NULL, false)) {
+                // this side may have truncated it already
+                if (PyErr_ExceptionMatches(PyExc_KeyError)) {
+                    PyErr_Clear();
+                } else {
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    if (ret == 0) {
+        self->applied = delta->to;
+    }
+
+    // whatever was applied is truncated, failure or not
+    if (self->truncate) {
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        if (truncate_to_depth(self)) {
+            if (type) {
+                PyErr_Clear();
+            } else {
+                ret = -1;
+            }
+        }
+        if (type) {
+            PyErr_Restore(type, value, traceback);
+        }
+    }
+
+    return ret;
+}
+
+
+PyObject* SortedDict_delta_since(SortedDict *self, PyObject *since)
+{
+    CodecWriter w = {0};
+
+    if (codec_put(&w, CODEC_MAGIC_DELTA_SIDE, CODEC_MAGIC_LEN) || SortedDict_encode_delta(self, since, &w)) {
+        codec_writer_release(&w);
+        return NULL;
+    }
+
+    return codec_writer_bytes(&w);
+}
+
+
+PyObject* SortedDict_apply_delta(SortedDict *self, PyObject *blob)
+{
+    Py_buffer view;
+    SideDelta delta = {0};
+
+    if (PyObject_GetBuffer(blob, &view, PyBUF_SIMPLE)) {
+        return NULL;
+    }
+
+    CodecReader r = {view.buf, view.len, 0};
+    int failed = codec_expect(&r, CODEC_MAGIC_DELTA_SIDE) ||
+                 SortedDict_read_delta(&r, &delta) ||
+                 codec_finish(&r) ||
+                 SortedDict_check_delta(self, &delta) ||
+                 SortedDict_install_delta(self, &delta) ||
+                 SortedDict_notify(self);
+
+    Py_XDECREF(delta.levels);
+    PyBuffer_Release(&view);
+
+    return failed ? NULL : PyLong_FromUnsignedLongLong(self->applied);
+}
+
+
+/* Sorted Dictionary Mapping Functions */
+Py_ssize_t SortedDict_len(const SortedDict *self)
+{
+    Py_ssize_t len = (self->key_type == KEY_FIXED) ? fixed_count(self) : PyDict_GET_SIZE(self->data);
+    if (self->depth && self->depth < len) {
+        return self->depth;
+    }
+
+    return len;
+}
+
+PyObject *SortedDict_getitem(SortedDict *self, PyObject *key)
+{
+    if (self->key_type == KEY_FIXED) {
+        int64_t k;
+        int conv = fixed_key(self, key, &k);
+        if (EXPECT(conv < 0, 0)) {
+            return NULL;
+        }
+
+        PyObject **stored = conv ? NULL : fixed_lookup(self, k);
+        if (EXPECT(!stored, 0)) {
+            PyErr_SetString(PyExc_KeyError, "key does not exist");
+            return NULL;
+        }
+
+        return Py_NewRef(*stored);
+    }
+
+    PyObject *interned = intern_key(self, key, false);
+    if (EXPECT(!interned, 0)) {
+        return NULL;
+    }
+
+    PyObject *ret = Py_XNewRef(PyDict_GetItemWithError(self->data, interned));
+    Py_DECREF(interned);
+
+    if (EXPECT(!ret && !PyErr_Occurred(), 0)) {
+        PyErr_SetString(PyExc_KeyError, "key does not exist");
+    }
+
+    return ret;
+}
+
+// an object keyed level's value was replaced in place, find it if the cache or the observers cover it
+static void prefix_level_changed(SortedDict *self, PyObject *key)
+{
+    DepthCache *c = &self->prefix;
+    bool cached = c->valid && c->version == self->version;
+    Py_ssize_t reach = cached ? c->valid : 0;
+
+    if (self->observers.list && !self->dirty && self->observers.depth > reach) {
+        reach = (self->observers.depth < self->tree.size) ? self->observers.depth : self->tree.size;
+    }
+
+    if (!reach) {
+        return;
+    }
+
+    // most updates land behind the cached levels, one compare rules those out
+    int op = (self->ordering == DESCENDING) ? Py_GT : Py_LT;
+    PyObject *last = Py_NewRef(keytree_at(&self->tree, reach - 1));
+    int behind = PyObject_RichCompareBool(last, key, op);
+    Py_DECREF(last);
+
+    if (behind > 0) {
+        observe_touch(self, reach);
+        return;
+    }
+
+    KeyPos pos;
+    Py_ssize_t at = (behind == 0) ? keytree_bisect(&self->tree, key, op, &self->version, &pos) : -1;
+    if (EXPECT(at < 0, 0)) {
+        PyErr_Clear();
+        c->valid = 0;
+        return;
+    }
+
+    if (cached) {
+        prefix_touch(self, at);
+    } else {
+        observe_touch(self, at);
+    }
+}
+
+
+// set or delete one level of an object keyed book. trim applies max_depth truncation after an insert,
+// batches leave it off and truncate once at the end
+static int store_object_level(SortedDict *self, PyObject *key, PyObject *value, bool trim)
+{
+    uint64_t version = self->version;
+
+    if (value) {
+        Py_ssize_t before = PyDict_GET_SIZE(self->data);
+        int ret = PyDict_SetItem(self->data, key, value);
+
+        if (EXPECT(ret == -1, 0)) {
+            return ret;
+        }
+        delta_log_key(self, key);
+        journal_key(self, key, value, (PyDict_GET_SIZE(self->data) == before) ? JOURNAL_UPDATE : JOURNAL_INSERT);
+
+        if (PyDict_GET_SIZE(self->data) == before && self->version == version) {
+            // in place value update, the key set did not change
+            prefix_level_changed(self, key);
+            return ret;
+        }
+
+        if (self->dirty) {
+            self->version++;
+        } else if (PyDict_GET_SIZE(self->data) == before + 1 && self->version == version) {
+            tree_insert(self, key);
+        } else {
+            escalate_to_dirty(self);
+        }
+
+        if (EXPECT(trim && self->truncate && truncate_to_depth(self), 0)) {
+            return -1;
+        }
+
+        return ret;
+    } else {
+        // setitem also called for del (value will be null for deletes)
+        int ret = PyDict_DelItem(self->data, key);
+        if (ret != 0) {
+            // a failed delete leaves the tree untouched
+            return ret;
+        }
+        delta_log_key(self, key);
+        journal_key(self, key, NULL, JOURNAL_DELETE);
+
+        if (self->dirty) {
+            self->version++;
+        } else if (self->version == version) {
+            tree_delete(self, key);
+        } else {
+            escalate_to_dirty(self);
+        }
+
+        return ret;
+    }
+}
+
+
+static int store_level(SortedDict *self, PyObject *key, PyObject *value, bool trim)
+{
+    if (check_writable(self) || storage_own(self)) {
+        return -1;
+    }
+
+    if (self->key_type == KEY_FIXED) {
+        return fixed_setitem(self, key, value, trim);
+    }
+
+    if (!self->intern) {
+        return store_object_level(self, key, value, trim);
+    }
+
+    PyObject *interned = intern_key(self, key, value != NULL);
+    if (EXPECT(!interned, 0)) {
+        return -1;
+    }
+
+    int ret = store_object_level(self, interned, value, trim);
+    Py_DECREF(interned);
+
+    if (ret == 0) {
+        intern_trim(self);
+    }
+
+    return ret;
+}
+
+
+int SortedDict_setitem(SortedDict *self, PyObject *key, PyObject *value)
+{
+    // an open batch() truncates once when it closes, as apply() does
+    if (store_level(self, key, value, !self->batching)) {
+        return -1;
+    }
+
+    return SortedDict_notify(self);
+}
+
+
+// a size that removes the level: numeric zero, or a decimal string of zero as feeds send them
+static int size_is_zero(PyObject *size)
+{
+    if (PyUnicode_Check(size)) {
+        Py_ssize_t len;
+        const char *string = PyUnicode_AsUTF8AndSize(size, &len);
+        if (EXPECT(!string, 0)) {
+            return -1;
+        }
+
+        int64_t mantissa;
+        int exponent;
+        if (EXPECT(parse_decimal(string, len, &mantissa, &exponent) == 0, 1)) {
+            return mantissa == 0;
+        }
+
+        // text the fast parser does not take, such as surrounding spaces or underscores,
+        // is whatever Decimal makes of it. text that is not a number is not zero
+        PyObject *decimal = codec_decimal_type();
+        PyObject *value = decimal ? PyObject_CallOneArg(decimal, size) : NULL;
+        if (!value) {
+            if (!decimal || !PyErr_ExceptionMatches(PyExc_ArithmeticError)) {
+                return -1;
+            }
+            PyErr_Clear();
+            return 0;
+        }
+
+        int truth = PyObject_IsTrue(value);
+        Py_DECREF(value);
+        return (truth < 0) ? -1 : !truth;
+    }
+
+    int truth = PyObject_IsTrue(size);
+    return (truth < 0) ? -1 : !truth;
+}
+
+
+// apply one level from a delta: a zero size deletes the level, deleting a level that is not there is a no-op
+int SortedDict_apply_level(SortedDict *self, PyObject *key, PyObject *size)
+{
+    int zero = size_is_zero(size);
+    if (EXPECT(zero < 0, 0)) {
+        return -1;
+    }
+
+    if (!zero) {
+        return store_level(self, key, size, false);
+    }
+
+    if (EXPECT(store_level(self, key, NULL, false), 0)) {
+        if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
+            return -1;
+        }
+        PyErr_Clear();
+    }
+
+    return 0;
+}
+
+
+// the max_depth truncation a batch deferred, then the observers hear of the batch as a whole.
+// inside an open batch() both wait for it to close
+int SortedDict_apply_done(SortedDict *self)
+{
+    if (self->batching) {
+        return 0;
+    }
+
+    if (self->truncate && truncate_to_depth(self)) {
+        return -1;
     }
 
-    Py_ssize_t old_size = self->k_len;
-    if (!have_deletes) {
-        if (old_size) {
-            best = Py_NewRef(self->karr[0]);
+    return SortedDict_notify(self);
+}
+
+
+// (price, size) pairs from a mapping or an iterable, or parallel price and size sequences
+int SortedDict_apply(SortedDict *self, PyObject *levels, PyObject *sizes)
+{
+    PyObject *items = NULL;
+    PyObject *prices = NULL;
+    PyObject *amounts = NULL;
+    int ret = -1;
+
+    if (sizes) {
+        prices = PySequence_Fast(levels, "prices must be a sequence");
+        amounts = prices ? PySequence_Fast(sizes, "sizes must be a sequence") : NULL;
+        if (EXPECT(!amounts, 0)) {
+            goto done;
+        }
+
+        if (EXPECT(PySequence_Fast_GET_SIZE(prices) != PySequence_Fast_GET_SIZE(amounts), 0)) {
+            PyErr_SetString(PyExc_ValueError, "prices and sizes must be the same length");
+            goto done;
+        }
+
+        for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(prices) && i < PySequence_Fast_GET_SIZE(amounts); ++i) {
+            // the level can reenter and resize the sequence, so hold the refs across it
+            PyObject *price = Py_NewRef(PySequence_Fast_GET_ITEM(prices, i));
+            PyObject *size = Py_NewRef(PySequence_Fast_GET_ITEM(amounts, i));
+            int failed = SortedDict_apply_level(self, price, size);
+
+            Py_DECREF(price);
+            Py_DECREF(size);
+            if (EXPECT(failed, 0)) {
+                goto done;
+            }
         }
     } else {
-        Py_ssize_t limit = (count + 1 < old_size) ? count + 1 : old_size;
-        for (Py_ssize_t j = 0; j < limit; ++j) {
-            PyObject *cand = Py_NewRef(self->karr[j]);
-            int in = PyDict_Contains(data, cand);
-
-            if (EXPECT(in < 0, 0)) {
-                Py_DECREF(cand);
-                status = -1;
+        items = PyDict_Check(levels) ? PyDict_Items(levels) : PySequence_Fast(levels, "levels must be a mapping or an iterable of (price, size) pairs");
+        if (EXPECT(!items, 0)) {
+            goto done;
+        }
+
+        for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(items); ++i) {
+            PyObject *level = PySequence_Fast(PySequence_Fast_GET_ITEM(items, i), "each level must be a (price, size) pair");
+            if (EXPECT(!level, 0)) {
+                goto done;
+            }
+
+            // exchanges often send extra fields after the size, those are ignored
+            if (EXPECT(PySequence_Fast_GET_SIZE(level) < 2, 0)) {
+                Py_DECREF(level);
+                PyErr_SetString(PyExc_ValueError, "each level must be a (price, size) pair");
+                goto done;
+            }
+
+            PyObject *price = Py_NewRef(PySequence_Fast_GET_ITEM(level, 0));
+            PyObject *size = Py_NewRef(PySequence_Fast_GET_ITEM(level, 1));
+            int failed = SortedDict_apply_level(self, price, size);
+
+            Py_DECREF(price);
+            Py_DECREF(size);
+            Py_DECREF(level);
+            if (EXPECT(failed, 0)) {
+                goto done;
+            }
+        }
+    }
+
+    ret = 0;
+
+done:
+    Py_XDECREF(items);
+    Py_XDECREF(prices);
+    Py_XDECREF(amounts);
+
+    if (EXPECT(ret, 0)) {
+        // whatever was applied before the failure is kept, and still truncated
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        if (SortedDict_apply_done(self)) {
+            PyErr_Clear();
+        }
+        PyErr_Restore(type, value, traceback);
+
+        return ret;
+    }
+
+    return SortedDict_apply_done(self);
+}
+
+
+PyObject* SortedDict_update(SortedDict *self, PyObject *args)
+{
+    PyObject *levels;
+    PyObject *sizes = NULL;
+
+    if (!PyArg_ParseTuple(args, "O|O", &levels, &sizes)) {
+        return NULL;
+    }
+
+    if (EXPECT(SortedDict_apply(self, levels, sizes), 0)) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+/* Reconciliation */
+// equal is not enough for a value to be unchanged: Decimal('1.0') == Decimal('1.00'),
+// but the two render differently in a checksum. builtins compare, anything else by str()
+static int same_value(PyObject *a, PyObject *b)
+{
+    if (a == b) {
+        return 1;
+    }
+
+    if (Py_TYPE(a) != Py_TYPE(b)) {
+        return 0;
+    }
+
+    if (PyUnicode_CheckExact(a) || PyLong_CheckExact(a) || PyFloat_CheckExact(a)) {
+        return PyObject_RichCompareBool(a, b, Py_EQ);
+    }
+
+    PyObject *x = PyObject_Str(a);
+    PyObject *y = x ? PyObject_Str(b) : NULL;
+    int ret = y ? PyUnicode_Compare(x, y) == 0 : -1;
+
+    if (ret < 0 || PyErr_Occurred()) {
+        ret = -1;
+    }
+    Py_XDECREF(x);
+    Py_XDECREF(y);
+
+    return ret;
+}
+
+
+// set one level of a reconcile, reporting it as added or changed. unchanged levels are skipped
+static int reconcile_level(SortedDict *self, PyObject *key, PyObject *stored, PyObject *value, PyObject *added, PyObject *changed)
+{
+    if (stored) {
+        int same = same_value(stored, value);
+        if (same) {
+            return (same < 0) ? -1 : 0;
+        }
+    }
+
+    if (PyList_Append(stored ? changed : added, key)) {
+        return -1;
+    }
+
+    return store_level(self, key, value, false);
+}
+
+
+// removals first, then the levels that are new or changed. the held keys are
+// collected before any write, a write can reenter through a key's __eq__
+static int reconcile_object(SortedDict *self, PyObject *items, PyObject *added, PyObject *changed, PyObject *removed)
+{
+    PyObject *wanted = PyDict_New();
+    PyObject *held = NULL;
+    PyObject *pairs = NULL;
+    int ret = -1;
+
+    if (EXPECT(!wanted, 0)) {
+        return -1;
+    }
+
+    // keyed by the key each price stands for, holding the snapshot's (price, size). prices
+    // only go into the intern pool once their level is in the book
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(items); ++i) {
+        PyObject *item = PyList_GET_ITEM(items, i);
+        PyObject *key = intern_key(self, PyTuple_GET_ITEM(item, 0), false);
+        int failed = !key || PyDict_SetItem(wanted, key, item);
+
+        Py_XDECREF(key);
+        if (EXPECT(failed, 0)) {
+            goto done;
+        }
+    }
+
+    // removals are reported in book order
+    held = update_keys(self) ? NULL : Py_XNewRef(keys_materialize(self));
+    if (EXPECT(!held, 0)) {
+        goto done;
+    }
+
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(held); ++i) {
+        PyObject *key = PyTuple_GET_ITEM(held, i);
+        int present = PyDict_Contains(wanted, key);
+
+        if (EXPECT(present < 0 || (!present && PyList_Append(removed, key)), 0)) {
+            goto done;
+        }
+    }
+
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(removed); ++i) {
+        if (store_level(self, PyList_GET_ITEM(removed, i), NULL, false)) {
+            if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
+                goto done;
+            }
+            PyErr_Clear();
+        }
+    }
+
+    pairs = PyDict_Items(wanted);
+    if (EXPECT(!pairs, 0)) {
+        goto done;
+    }
+
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(pairs); ++i) {
+        PyObject *item = PyList_GET_ITEM(pairs, i);
+        PyObject *key = PyTuple_GET_ITEM(item, 0);
+        PyObject *stored = Py_XNewRef(PyDict_GetItemWithError(self->data, key));
+
+        if (EXPECT(!stored && PyErr_Occurred(), 0)) {
+            goto done;
+        }
+
+        PyObject *level = PyTuple_GET_ITEM(item, 1);
+        int failed = reconcile_level(self, key, stored, PyTuple_GET_ITEM(level, 1), added, changed) ||
+                     intern_remember(self, PyTuple_GET_ITEM(level, 0), key);
+        Py_XDECREF(stored);
+        if (EXPECT(failed, 0)) {
+            goto done;
+        }
+    }
+    ret = 0;
+
+done:
+    Py_DECREF(wanted);
+    Py_XDECREF(held);
+    Py_XDECREF(pairs);
+
+    return ret;
+}
+
+
+// every price is converted before anything changes, then each held level is
+// searched for in the sorted ticks to find the ones the snapshot dropped
+static int reconcile_fixed(SortedDict *self, PyObject *items, PyObject *added, PyObject *changed, PyObject *removed)
+{
+    Py_ssize_t n = PyList_GET_SIZE(items);
+    FixedLoadEntry *entries = PyMem_New(FixedLoadEntry, n > 0 ? n : 1);
+    int ret = -1;
+
+    if (EXPECT(!entries, 0)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        int conv = fixed_key(self, PyTuple_GET_ITEM(PyList_GET_ITEM(items, i), 0), &entries[i].key);
+        if (EXPECT(conv, 0)) {
+            if (conv > 0) {
+                PyErr_SetString(PyExc_ValueError, "price cannot be represented at this tick size");
+            }
+            goto done;
+        }
+        entries[i].order = i;
+    }
+
+    qsort(entries, n, sizeof(FixedLoadEntry), fixed_load_cmp);
+
+    // boxing only builds numbers, nothing here can reenter the book
+    Py_ssize_t at = 0;
+    int64_t tick;
+    for (PyObject *value = fixed_next(self, &at, &tick); value; value = fixed_next(self, &at, &tick)) {
+        Py_ssize_t lo = 0;
+        Py_ssize_t hi = n;
+        while (lo < hi) {
+            Py_ssize_t mid = lo + (hi - lo) / 2;
+            if (entries[mid].key < tick) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        if (lo == n || entries[lo].key != tick) {
+            PyObject *key = fixed_box(self, tick);
+            int failed = !key || PyList_Append(removed, key);
+
+            Py_XDECREF(key);
+            if (EXPECT(failed, 0)) {
                 goto done;
             }
+        }
+    }
+
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(removed); ++i) {
+        if (store_level(self, PyList_GET_ITEM(removed, i), NULL, false)) {
+            goto done;
+        }
+    }
+
+    // distinct prices can land on the same tick, the last one in the dict wins
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        if (i + 1 < n && entries[i + 1].key == entries[i].key) {
+            continue;
+        }
+
+        PyObject *item = PyList_GET_ITEM(items, entries[i].order);
+        PyObject **slot = fixed_lookup(self, entries[i].key);
+        PyObject *stored = slot ? Py_NewRef(*slot) : NULL;
+        int failed = reconcile_level(self, PyTuple_GET_ITEM(item, 0), stored, PyTuple_GET_ITEM(item, 1), added, changed);
+
+        Py_XDECREF(stored);
+        if (EXPECT(failed, 0)) {
+            goto done;
+        }
+    }
+    ret = 0;
+
+done:
+    PyMem_Free(entries);
+    return ret;
+}
+
+
+// bring the side to exactly the levels of a snapshot through ordinary writes, so a
+// snapshot that mostly matches the book costs a lookup per level rather than a reload
+// and full re-sort. returns the prices (added, changed, removed)
+PyObject* SortedDict_reconcile(SortedDict *self, PyObject *dict)
+{
+    if (EXPECT(!PyDict_Check(dict), 0)) {
+        PyErr_SetString(PyExc_TypeError, "snapshot must be a dict");
+        return NULL;
+    }
+
+    if (check_writable(self)) {
+        return NULL;
+    }
+
+    // a key's __eq__ could mutate the source, so work from a snapshot of it
+    PyObject *items = PyDict_Items(dict);
+    PyObject *added = items ? PyList_New(0) : NULL;
+    PyObject *changed = added ? PyList_New(0) : NULL;
+    PyObject *removed = changed ? PyList_New(0) : NULL;
+    PyObject *ret = NULL;
+
+    if (EXPECT(!removed, 0)) {
+        goto done;
+    }
+
+    int failed = (self->key_type == KEY_FIXED) ? reconcile_fixed(self, items, added, changed, removed) : reconcile_object(self, items, added, changed, removed);
+
+    // whatever was applied is truncated, failure or not
+    if (EXPECT(failed, 0)) {
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        if (SortedDict_apply_done(self)) {
+            PyErr_Clear();
+        }
+        PyErr_Restore(type, value, traceback);
+        goto done;
+    }
+
+    if (EXPECT(SortedDict_apply_done(self), 0)) {
+        goto done;
+    }
+
+    ret = PyTuple_Pack(3, added, changed, removed);
+
+done:
+    Py_XDECREF(items);
+    Py_XDECREF(added);
+    Py_XDECREF(changed);
+    Py_XDECREF(removed);
+
+    return ret;
+}
+
+
+/* Snapshot loading */
+int SortedDict_parse_mode(const char *name, enum SnapshotParse *mode)
+{
+    if (strcmp(name, "decimal") == 0) {
+        *mode = PARSE_DECIMAL;
+    } else if (strcmp(name, "float") == 0) {
+        *mode = PARSE_FLOAT;
+    } else if (strcmp(name, "fixed") == 0) {
+        *mode = PARSE_FIXED;
+    } else {
+        PyErr_SetString(PyExc_ValueError, "parse must be 'decimal', 'float' or 'fixed'");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// new ref to a number as the parse mode builds it. numbers already of that type pass through
+static PyObject *snapshot_number(PyObject *obj, enum SnapshotParse mode)
+{
+    if (mode == PARSE_FLOAT) {
+        if (PyFloat_CheckExact(obj)) {
+            return Py_NewRef(obj);
+        }
+        return PyUnicode_Check(obj) ? PyFloat_FromString(obj) : PyNumber_Float(obj);
+    }
+
+    PyObject *decimal = codec_decimal_type();
+    if (EXPECT(!decimal, 0)) {
+        return NULL;
+    }
+
+    if (Py_IS_TYPE(obj, (PyTypeObject *)decimal)) {
+        return Py_NewRef(obj);
+    }
+    return PyObject_CallOneArg(decimal, obj);
+}
+
+
+// new refs to the price and the parsed size of a [price, size, ...] level, anything past the
+// size ignored. returns 1 without error for a zero size, which leaves the level out
+static int snapshot_level(PyObject *level, enum SnapshotParse mode, PyObject **price, PyObject **size)
+{
+    if (EXPECT(!PyList_Check(level) && !PyTuple_Check(level), 0)) {
+        PyErr_SetString(PyExc_TypeError, "snapshot levels must be [price, size, ...] lists or tuples");
+        return -1;
+    }
+
+    if (EXPECT(PySequence_Fast_GET_SIZE(level) < 2, 0)) {
+        PyErr_SetString(PyExc_ValueError, "snapshot levels must hold a price and a size");
+        return -1;
+    }
+
+    // parsing can run python code that empties a list level, hold both first
+    PyObject *p = Py_NewRef(PySequence_Fast_GET_ITEM(level, 0));
+    PyObject *s = Py_NewRef(PySequence_Fast_GET_ITEM(level, 1));
+
+    *size = snapshot_number(s, (mode == PARSE_FIXED) ? PARSE_DECIMAL : mode);
+    Py_DECREF(s);
+
+    int zero = *size ? PyObject_Not(*size) : -1;
+    if (zero) {
+        Py_DECREF(p);
+        Py_CLEAR(*size);
+        return zero;
+    }
+
+    *price = p;
+    return 0;
+}
+
 
-            if (EXPECT(self->version != version, 0)) {
-                Py_DECREF(cand);
+static int snapshot_object(SortedDict *self, PyObject *levels, enum SnapshotParse mode)
+{
+    Py_ssize_t n = PyTuple_GET_SIZE(levels);
+    PyObject **keys = PyMem_New(PyObject *, n > 0 ? n : 1);
+    // the price each key was built from, pooled once the levels are in the book
+    PyObject **prices = (keys && self->intern) ? PyMem_New(PyObject *, n > 0 ? n : 1) : NULL;
+    PyObject *data = (keys && (prices || !self->intern)) ? PyDict_New() : NULL;
+    Py_ssize_t count = 0;
+    int op = (self->ordering == DESCENDING) ? Py_GT : Py_LT;
+    bool ordered = true;
+    int ret = -1;
+
+    if (EXPECT(!data, 0)) {
+        if (!keys || (self->intern && !prices)) {
+            PyErr_NoMemory();
+        }
+        goto done;
+    }
+
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        PyObject *price;
+        PyObject *value;
+        int skip = snapshot_level(PyTuple_GET_ITEM(levels, i), mode, &price, &value);
+        if (skip) {
+            if (EXPECT(skip < 0, 0)) {
                 goto done;
             }
+            continue;
+        }
+
+        // interned str prices come from the pool as they would through a write
+        PyObject *key = (self->intern && PyUnicode_CheckExact(price)) ? intern_key(self, price, false) : snapshot_number(price, mode);
+        int failed = !key || PyDict_SetItem(data, key, value);
+
+        Py_DECREF(value);
+        if (EXPECT(failed, 0)) {
+            Py_DECREF(price);
+            Py_XDECREF(key);
+            goto done;
+        }
+        if (prices) {
+            prices[count] = price;
+        } else {
+            Py_DECREF(price);
+        }
+        keys[count++] = key;
+
+        if (ordered && count > 1) {
+            PyObject *prev = keys[count - 2];
+            int cmp;
+
+            if (PyFloat_CheckExact(prev) && PyFloat_CheckExact(key)) {
+                double a = PyFloat_AS_DOUBLE(prev);
+                double b = PyFloat_AS_DOUBLE(key);
+                cmp = (op == Py_GT) ? (a > b) : (a < b);
+            } else {
+                cmp = PyObject_RichCompareBool(prev, key, op);
+                if (EXPECT(cmp < 0, 0)) {
+                    PyErr_Clear();
+                }
+            }
+            ordered = (cmp > 0);
+        }
+    }
+
+    if (EXPECT(storage_own(self), 0)) {
+        goto done;
+    }
+
+    delta_reset(self);
+    PyObject *previous = self->data;
+    self->data = data;
+    data = NULL;
+
+    // levels that came in book order are the tree as they are, anything else is sorted on
+    // the next read. a tree that cannot be built is left to that sort too
+    if (ordered && PyDict_GET_SIZE(self->data) == count && keytree_load(&self->tree, keys, count) == 0) {
+        self->dirty = false;
+        self->version++;
+        Py_CLEAR(self->keys_tuple);
+    } else {
+        PyErr_Clear();
+        escalate_to_dirty(self);
+    }
+    journal_reset(self, self->data);
 
-            if (in) {
-                best = cand;
-                break;
-            }
+    Py_DECREF(previous);
 
-            Py_DECREF(cand);
+    // the pool only caches, a price that cannot go in is built again on its next write
+    for (Py_ssize_t i = 0; prices && i < count; ++i) {
+        if (EXPECT(intern_remember(self, prices[i], keys[i]), 0)) {
+            PyErr_Clear();
+            break;
         }
     }
+    intern_trim(self);
+    ret = 0;
 
-    // a pending insert can beat the best surviving old key
-    for (Py_ssize_t p = 0; p < count; ++p) {
-        if (self->pend[p].op != PENDING_INSERT) {
-            continue;
+done:
+    for (Py_ssize_t i = 0; i < count; ++i) {
+        Py_DECREF(keys[i]);
+        if (prices) {
+            Py_DECREF(prices[i]);
         }
+    }
+    PyMem_Free(keys);
+    PyMem_Free(prices);
+    Py_XDECREF(data);
 
-        PyObject *cand = Py_NewRef(self->pend[p].key);
-        if (have_deletes) {
-            int in = PyDict_Contains(data, cand);
+    return ret;
+}
 
-            if (EXPECT(in < 0, 0)) {
-                Py_DECREF(cand);
-                status = -1;
-                goto done;
-            }
 
-            if (EXPECT(self->version != version, 0)) {
-                Py_DECREF(cand);
-                goto done;
-            }
+// prices go straight to ticks, no price object is built for them
+static int snapshot_fixed(SortedDict *self, PyObject *levels, enum SnapshotParse mode)
+{
+    Py_ssize_t n = PyTuple_GET_SIZE(levels);
+    FixedLoadEntry *entries = PyMem_New(FixedLoadEntry, n > 0 ? n : 1);
+    PyObject **values = entries ? PyMem_New(PyObject *, n > 0 ? n : 1) : NULL;
+    // the journal restarts from the contents, only built when it is on
+    PyObject *contents = NULL;
+    Py_ssize_t count = 0;
+    bool sorted = true;
+    int ret = -1;
+
+    if (EXPECT(!values, 0)) {
+        PyErr_NoMemory();
+        goto done;
+    }
 
-            if (!in) {
-                Py_DECREF(cand);
-                continue;
-            }
-        }
+    if (self->journal.cap && EXPECT(!(contents = PyDict_New()), 0)) {
+        goto done;
+    }
 
-        if (!best) {
-            best = cand;
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        PyObject *price;
+        PyObject *value;
+        int skip = snapshot_level(PyTuple_GET_ITEM(levels, i), mode, &price, &value);
+        if (skip) {
+            if (EXPECT(skip < 0, 0)) {
+                goto done;
+            }
             continue;
         }
 
-        int better = PyObject_RichCompareBool(cand, best, self->ordering == DESCENDING ? Py_GT : Py_LT);
-        if (EXPECT(better < 0, 0)) {
-            Py_DECREF(cand);
-            status = -1;
+        FixedLoadEntry *entry = &entries[count];
+        int conv = fixed_key(self, price, &entry->key);
+        Py_DECREF(price);
+        if (EXPECT(conv, 0)) {
+            if (conv > 0) {
+                PyErr_SetString(PyExc_ValueError, "price cannot be represented at this tick size");
+            }
+            Py_DECREF(value);
             goto done;
         }
+        entry->order = count;
+        values[count++] = value;
 
-        if (EXPECT(self->version != version, 0)) {
-            Py_DECREF(cand);
-            goto done;
-        }
+        // a DESC side holds negated ticks, so best first is ascending either way
+        sorted = sorted && (count == 1 || entry->key > entry[-1].key);
 
-        if (better) {
-            Py_SETREF(best, cand);
-        } else {
-            Py_DECREF(cand);
+        if (contents) {
+            PyObject *key = fixed_box(self, entry->key);
+            int failed = !key || PyDict_SetItem(contents, key, value);
+
+            Py_XDECREF(key);
+            if (EXPECT(failed, 0)) {
+                goto done;
+            }
         }
     }
 
-    if (!best) {
+    if (EXPECT(storage_own(self), 0)) {
         goto done;
     }
 
-    PyObject *value = PyDict_GetItemWithError(data, best);
-    if (EXPECT(!value, 0)) {
-        status = PyErr_Occurred() ? -1 : 1;
+    delta_reset(self);
+    if (EXPECT(fixed_install(self, entries, count, values, sorted), 0)) {
         goto done;
     }
 
-    Py_INCREF(value);
-    if (EXPECT(self->version != version, 0)) {
-        Py_DECREF(value);
-        goto done;
+    if (contents) {
+        journal_reset(self, contents);
     }
+    ret = 0;
 
-    PyObject *ret = PyTuple_New(2);
-    if (EXPECT(!ret, 0)) {
-        Py_DECREF(value);
-        status = -1;
-        goto done;
+done:
+    for (Py_ssize_t i = 0; i < count; ++i) {
+        Py_DECREF(values[i]);
     }
+    PyMem_Free(values);
+    PyMem_Free(entries);
+    Py_XDECREF(contents);
 
-    PyTuple_SET_ITEM(ret, 0, Py_NewRef(best));
-    PyTuple_SET_ITEM(ret, 1, value);
-    *out = ret;
-    status = 0;
-
-done:
-    Py_XDECREF(best);
-    Py_DECREF(data);
-    return status;
+    return ret;
 }
 
 
-PyObject* SortedDict_index(SortedDict *self, PyObject *index)
+// replace the side with [price, size, ...] levels as exchanges send them, parsing prices and
+// sizes here rather than as python objects first. exchanges send levels best first, which
+// is detected and installed without a sort. levels with a zero size are left out. nothing
+// changes unless every level parses. truncation and observers wait for SortedDict_apply_done
+int SortedDict_load_levels(SortedDict *self, PyObject *levels, enum SnapshotParse mode)
 {
-    long i = PyLong_AsLong(index);
-    if (EXPECT(PyErr_Occurred() != NULL, 0)) {
-        return NULL;
+    if (EXPECT(mode == PARSE_FIXED && self->key_type != KEY_FIXED, 0)) {
+        PyErr_SetString(PyExc_ValueError, "parse='fixed' needs a key_type='fixed' book");
+        return -1;
     }
 
-    if (i == 0 && !self->dirty && self->karr && self->pend_count) {
-        PyObject *ret = NULL;
-        int status = peek_best(self, &ret);
-        if (status <= 0) {
-            return ret;  // NULL with the exception set when status < 0
-        }
-        // status 1: fall through to the merge
+    if (check_writable(self)) {
+        return -1;
     }
 
-    if (EXPECT(update_keys(self), 0)) {
-        return NULL;
+    // parsing can run python code, so work from a copy of the list
+    PyObject *snapshot = PySequence_Tuple(levels);
+    if (EXPECT(!snapshot, 0)) {
+        return -1;
     }
 
-    // validate against max_depth
-    Py_ssize_t len = self->k_len;
-    if ((self->depth > 0) && (self->depth < len)) {
-        len = self->depth;
-    }
+    int ret = (self->key_type == KEY_FIXED) ? snapshot_fixed(self, snapshot, mode) : snapshot_object(self, snapshot, mode);
 
-    // negative indexing
-    if (i < 0) {
-        i += len;
-    }
+    Py_DECREF(snapshot);
+    return ret;
+}
 
-    if (EXPECT(i < 0 || i >= len, 0)) {
-        PyErr_SetString(PyExc_IndexError, "index out of range");
-        return NULL;
-    }
 
-    PyObject *key = Py_NewRef(self->karr[i]);
+PyObject* SortedDict_load_snapshot(SortedDict *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"levels", "parse", NULL};
+    PyObject *levels;
+    const char *parse = "decimal";
+    enum SnapshotParse mode;
 
-    // borrowed reference
-    PyObject *value = PyDict_GetItemWithError(self->data, key);
-    if (EXPECT(!value, 0)) {
-        if (!PyErr_Occurred()) {
-            PyErr_SetObject(PyExc_KeyError, key);
-        }
-        Py_DECREF(key);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$s", kwlist, &levels, &parse)) {
         return NULL;
     }
 
-    PyObject *ret = PyTuple_New(2);
-    if (EXPECT(!ret, 0)) {
-        Py_DECREF(key);
+    if (SortedDict_parse_mode(parse, &mode) || SortedDict_load_levels(self, levels, mode) || SortedDict_apply_done(self)) {
         return NULL;
     }
 
-    PyTuple_SET_ITEM(ret, 0, key);
-    PyTuple_SET_ITEM(ret, 1, Py_NewRef(value));
-
-    return ret;
+    Py_RETURN_NONE;
 }
 
 
-static int convert_item(PyObject **obj, PyObject *from, PyObject *to)
+/* Observers */
+// the first 'depth' visible levels as a tuple of (price, size) pairs
+static PyObject *observe_levels(SortedDict *self, Py_ssize_t depth)
 {
-    if (from) {
-        int is_instance = PyObject_IsInstance(*obj, from);
-        if (EXPECT(is_instance < 0, 0)) {
-            return -1;
-        }
+    if (EXPECT(update_keys(self), 0)) {
+        return NULL;
+    }
 
-        if (!is_instance) {
-            return 0;
-        }
+    Py_ssize_t len = SortedDict_len(self);
+    PyObject *keys = SortedDict_key_window(self, (len < depth) ? len : depth);
+    PyObject *values = (keys && self->key_type == KEY_FIXED) ? SortedDict_value_window(self, PyTuple_GET_SIZE(keys), NULL) : NULL;
+    PyObject *levels = keys ? PyTuple_New(PyTuple_GET_SIZE(keys)) : NULL;
+
+    if (EXPECT(!levels || (self->key_type == KEY_FIXED && !values), 0)) {
+        goto fail;
     }
 
-    PyObject *converted = PyObject_CallFunctionObjArgs(to, *obj, NULL);
-    if (EXPECT(!converted, 0)) {
-        return -1;
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(keys); ++i) {
+        PyObject *key = PyTuple_GET_ITEM(keys, i);
+        PyObject *value = values ? PyTuple_GET_ITEM(values, i) : PyDict_GetItemWithError(self->data, key);
+        PyObject *level = value ? PyTuple_Pack(2, key, value) : NULL;
+
+        if (EXPECT(!level, 0)) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetObject(PyExc_KeyError, key);
+            }
+            goto fail;
+        }
+        PyTuple_SET_ITEM(levels, i, level);
     }
 
-    Py_SETREF(*obj, converted);
-    return 0;
+    Py_DECREF(keys);
+    Py_XDECREF(values);
+    return levels;
+
+fail:
+    Py_XDECREF(keys);
+    Py_XDECREF(values);
+    Py_XDECREF(levels);
+    return NULL;
 }
 
 
-PyObject* SortedDict_todict_impl(SortedDict *self, PyObject *from, PyObject *to)
+// 1 when the first 'depth' levels of two reports differ, -1 on error
+static int levels_differ(PyObject *before, PyObject *after, Py_ssize_t depth)
 {
-    if (EXPECT(update_keys(self), 0)) {
-        return NULL;
-    }
+    Py_ssize_t n = PyTuple_GET_SIZE(after);
 
-    // the book may be mutated by a key hash or a conversion callback below,
-    // hold both so the snapshot stays intact
-    PyObject *keys = karr_materialize(self);
-    if (EXPECT(!keys, 0)) {
-        return NULL;
+    if (n > depth) {
+        n = depth;
     }
-    Py_INCREF(keys);
-    PyObject *data = Py_NewRef(self->data);
-    PyObject *values = NULL;
-    PyObject *ret = NULL;
 
-    Py_ssize_t len = PyTuple_GET_SIZE(keys);
-    if ((self->depth > 0) && (self->depth < len)) {
-        len = self->depth;
+    if (((PyTuple_GET_SIZE(before) < depth) ? PyTuple_GET_SIZE(before) : depth) != n) {
+        return 1;
     }
 
-    if (to) {
-        // conversion runs arbitrary Python that may mutate the book so take the value
-        // snapshot before converting anything
-        values = PyList_New(len);
-        if (EXPECT(!values, 0)) {
-            goto error;
-        }
-
-        for (Py_ssize_t i = 0; i < len; ++i) {
-            PyObject *value = PyDict_GetItemWithError(data, PyTuple_GET_ITEM(keys, i));
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        PyObject *x = PyTuple_GET_ITEM(before, i);
+        PyObject *y = PyTuple_GET_ITEM(after, i);
+        PyObject *key = PyTuple_GET_ITEM(x, 0);
 
-            if (EXPECT(!value, 0)) {
-                if (!PyErr_Occurred()) {
-                    PyErr_SetObject(PyExc_KeyError, PyTuple_GET_ITEM(keys, i));
-                }
-                goto error;
-            }
+        int same = (key == PyTuple_GET_ITEM(y, 0)) ? 1 : PyObject_RichCompareBool(key, PyTuple_GET_ITEM(y, 0), Py_EQ);
+        if (same > 0) {
+            same = same_value(PyTuple_GET_ITEM(x, 1), PyTuple_GET_ITEM(y, 1));
+        }
 
-            PyList_SET_ITEM(values, i, Py_NewRef(value));
+        if (same <= 0) {
+            return (same < 0) ? -1 : 1;
         }
     }
 
-    ret = PyDict_New();
-    if (EXPECT(!ret, 0)) {
-        goto error;
-    }
+    return 0;
+}
 
-    for (Py_ssize_t i = 0; i < len; ++i) {
-        // borrowed from the held keys tuple, which outlives every call below
-        PyObject *key = PyTuple_GET_ITEM(keys, i);
-        PyObject *value;
-        bool failed;
 
-        if (to) {
-            Py_INCREF(key);
-            value = Py_NewRef(PyList_GET_ITEM(values, i));
-            failed = convert_item(&key, from, to) || convert_item(&value, from, to);
+// start counting writes again from the levels as they are now
+static int observe_reset(SortedDict *self)
+{
+    Observers *o = &self->observers;
+    PyObject *top = observe_levels(self, o->depth);
 
-            if (!failed) {
-                failed = PyDict_SetItem(ret, key, value) < 0;
-            }
+    if (EXPECT(!top, 0)) {
+        return -1;
+    }
 
-            Py_DECREF(key);
-            Py_DECREF(value);
-        } else {
-            value = PyDict_GetItemWithError(data, key);
-            if (EXPECT(!value, 0)) {
-                if (!PyErr_Occurred()) {
-                    PyErr_SetObject(PyExc_KeyError, key);
-                }
-                goto error;
-            }
+    Py_XSETREF(o->top, top);
+    o->seen = self->changes;
+    o->touched = PY_SSIZE_T_MAX;
+    o->ranked = 0;
 
-            // the insert hashes the key, which can drop the book's value ref
-            Py_INCREF(value);
-            failed = PyDict_SetItem(ret, key, value) < 0;
-            Py_DECREF(value);
-        }
+    return 0;
+}
 
-        if (EXPECT(failed, 0)) {
-            goto error;
-        }
+
+int SortedDict_add_observer(SortedDict *self, PyObject *callback, Py_ssize_t depth, PyObject *tag)
+{
+    Observers *o = &self->observers;
+
+    if (check_writable(self)) {
+        return -1;
     }
 
-    Py_XDECREF(values);
-    Py_DECREF(keys);
-    Py_DECREF(data);
-    return ret;
+    if (EXPECT(!PyCallable_Check(callback), 0)) {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable");
+        return -1;
+    }
 
-error:
-    Py_XDECREF(ret);
-    Py_XDECREF(values);
-    Py_DECREF(keys);
-    Py_DECREF(data);
-    return NULL;
-}
+    if (EXPECT(depth < 1, 0)) {
+        PyErr_SetString(PyExc_ValueError, "depth must be at least 1");
+        return -1;
+    }
 
+    if (!o->list) {
+        o->list = PyList_New(0);
+        if (EXPECT(!o->list, 0)) {
+            return -1;
+        }
+    }
 
-PyObject* SortedDict_todict(SortedDict *self, PyObject *unused, PyObject *kwargs)
-{
-    static char *kwlist[] = {"from_type", "to_type", NULL};
-    PyObject *from = NULL;
-    PyObject *to = NULL;
+    PyObject *entry = Py_BuildValue("(OnO)", callback, depth, tag ? tag : Py_None);
+    int failed = !entry || PyList_Append(o->list, entry);
+    Py_XDECREF(entry);
+    if (EXPECT(failed, 0)) {
+        return -1;
+    }
 
-    if (!PyArg_ParseTupleAndKeywords(unused, kwargs, "|$OO", kwlist, &from, &to)) {
-        return NULL;
+    if (depth > o->depth) {
+        o->depth = depth;
     }
 
-    return SortedDict_todict_impl(self, from, to);
+    // the new observer hears of changes from here on
+    return observe_reset(self);
 }
 
 
-PyObject* SortedDict_tolist(SortedDict *self, PyObject *Py_UNUSED(ignored))
+// drop every registration of callback, ValueError when there is none
+int SortedDict_remove_observer(SortedDict *self, PyObject *callback)
 {
-    return build_items(self);
-}
+    Observers *o = &self->observers;
+    PyObject *kept = PyList_New(0);
+    Py_ssize_t depth = 0;
+    bool found = false;
 
+    if (EXPECT(!kept, 0)) {
+        return -1;
+    }
 
-static int truncate_to_depth(SortedDict *self)
-{
-    if (!self->depth) {
-        return 0;
+    for (Py_ssize_t i = 0; o->list && i < PyList_GET_SIZE(o->list); ++i) {
+        PyObject *entry = PyList_GET_ITEM(o->list, i);
+        int match = PyObject_RichCompareBool(PyTuple_GET_ITEM(entry, 0), callback, Py_EQ);
+
+        if (EXPECT(match < 0 || (!match && PyList_Append(kept, entry)), 0)) {
+            Py_DECREF(kept);
+            return -1;
+        }
+
+        if (match) {
+            found = true;
+        } else if (PyLong_AsSsize_t(PyTuple_GET_ITEM(entry, 1)) > depth) {
+            depth = PyLong_AsSsize_t(PyTuple_GET_ITEM(entry, 1));
+        }
     }
 
-    if (EXPECT(update_keys(self), 0)) {
+    if (!found) {
+        Py_DECREF(kept);
+        PyErr_SetString(PyExc_ValueError, "callback is not observing this side");
         return -1;
     }
 
-    Py_ssize_t size = self->k_len;
-    if (size <= self->depth) {
-        return 0;
+    if (!PyList_GET_SIZE(kept)) {
+        Py_CLEAR(kept);
+        Py_CLEAR(o->top);
     }
+    Py_XSETREF(o->list, kept);
+    o->depth = depth;
 
-    uint64_t version = self->version;
-    // hold an immutable snapshot for the delete loop
-    PyObject *keys = karr_materialize(self);
-    if (EXPECT(!keys, 0)) {
-        escalate_to_dirty(self);
-        return -1;
+    return o->list ? observe_reset(self) : 0;
+}
+
+
+// report the levels to the observers they changed for
+static int observe_report(SortedDict *self)
+{
+    Observers *o = &self->observers;
+    // no top when the levels could not be read at registration
+    PyObject *before = o->top ? Py_NewRef(o->top) : PyTuple_New(0);
+    // a callback can register or drop observers, call the ones there were
+    PyObject *list = Py_NewRef(o->list);
+    int ret = -1;
+
+    if (EXPECT(!before || observe_reset(self), 0)) {
+        goto done;
     }
-    Py_INCREF(keys);
 
-    for (Py_ssize_t i = self->depth; i < size; ++i) {
-        if (EXPECT(PyDict_DelItem(self->data, PyTuple_GET_ITEM(keys, i)) == -1, 0)) {
-            escalate_to_dirty(self);
-            Py_DECREF(keys);
-            return -1;
+    PyObject *after = o->top;
+    Py_INCREF(after);
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(list); ++i) {
+        PyObject *entry = PyList_GET_ITEM(list, i);
+        Py_ssize_t depth = PyLong_AsSsize_t(PyTuple_GET_ITEM(entry, 1));
+
+        int differ = levels_differ(before, after, depth);
+        if (differ <= 0) {
+            if (differ < 0) {
+                Py_DECREF(after);
+                goto done;
+            }
+            continue;
+        }
+
+        PyObject *levels = PyTuple_GetSlice(after, 0, depth);
+        PyObject *tag = PyTuple_GET_ITEM(entry, 2);
+        PyObject *result = !levels ? NULL :
+                           (tag == Py_None) ? PyObject_CallOneArg(PyTuple_GET_ITEM(entry, 0), levels) :
+                           PyObject_CallFunctionObjArgs(PyTuple_GET_ITEM(entry, 0), tag, levels, NULL);
+
+        Py_XDECREF(levels);
+        if (EXPECT(!result, 0)) {
+            Py_DECREF(after);
+            goto done;
         }
+        Py_DECREF(result);
     }
+    Py_DECREF(after);
+    ret = 0;
 
-    if (EXPECT(self->version == version, 1)) {
-        // evictions only come off the tail: shrink in place. the evicted
-        // refs are released only after the array is consistent
-        PyObject **evicted = PyMem_New(PyObject *, size - self->depth);
-        if (EXPECT(!evicted, 0)) {
-            Py_DECREF(keys);
-            escalate_to_dirty(self);
-            PyErr_NoMemory();
-            return -1;
-        }
+done:
+    Py_XDECREF(before);
+    Py_DECREF(list);
+    return ret;
+}
 
-        for (Py_ssize_t i = self->depth; i < size; ++i) {
-            evicted[i - self->depth] = self->karr[i];
-        }
 
-        self->k_len = self->depth;
-        Py_CLEAR(self->keys_tuple);
+// called once a write or a batch of writes is complete. every change since the last
+// report that ranked behind the watched levels cannot have moved them, which ends most
+// calls at the first test. writes the callbacks make are reported once they return
+int SortedDict_notify(SortedDict *self)
+{
+    Observers *o = &self->observers;
+
+    if (!o->list || o->busy || self->batching) {
+        return 0;
+    }
 
-        for (Py_ssize_t i = 0; i < size - self->depth; ++i) {
-            Py_DECREF(evicted[i]);
+    int ret = 0;
+    o->busy = true;
+    while (ret == 0 && o->list && self->changes != o->seen) {
+        if (self->changes - o->seen == (uint64_t)o->ranked && o->touched >= o->depth) {
+            o->seen = self->changes;
+            o->touched = PY_SSIZE_T_MAX;
+            o->ranked = 0;
+            break;
         }
 
-        PyMem_Free(evicted);
-        Py_DECREF(keys);
-        return 0;
+        ret = observe_report(self);
     }
+    o->busy = false;
 
-    // a re-entrant mutation interleaved with the eviction, recompute
-    Py_DECREF(keys);
-    escalate_to_dirty(self);
-    return update_keys(self) ? -1 : 0;
+    return ret;
 }
 
 
-PyObject* SortedDict_truncate(SortedDict *self, PyObject *Py_UNUSED(ignored))
+PyObject* SortedDict_observe(SortedDict *self, PyObject *args, PyObject *kwargs)
 {
-    if (EXPECT(truncate_to_depth(self), 0)) {
+    static char *kwlist[] = {"callback", "depth", NULL};
+    PyObject *callback;
+    Py_ssize_t depth = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|n", kwlist, &callback, &depth)) {
+        return NULL;
+    }
+
+    if (SortedDict_add_observer(self, callback, depth, NULL)) {
         return NULL;
     }
 
@@ -1189,97 +5195,177 @@ PyObject* SortedDict_truncate(SortedDict *self, PyObject *Py_UNUSED(ignored))
 }
 
 
-/* Sorted Dictionary Mapping Functions */
-Py_ssize_t SortedDict_len(const SortedDict *self)
+PyObject* SortedDict_unobserve(SortedDict *self, PyObject *callback)
 {
-    Py_ssize_t len = PyDict_GET_SIZE(self->data);
-    if (self->depth && self->depth < len) {
-        return self->depth;
+    if (SortedDict_remove_observer(self, callback)) {
+        return NULL;
     }
 
-    return len;
+    Py_RETURN_NONE;
 }
 
-PyObject *SortedDict_getitem(SortedDict *self, PyObject *key)
+
+/* Journal replay */
+static const char *journal_ops[] = {"insert", "update", "delete", "reset"};
+
+
+// the journal oldest first as (op, price, size, version, time_ns) tuples, each led
+// by side when it is given. a reset has no price and its size is the new contents
+PyObject *SortedDict_journal_entries(SortedDict *self, PyObject *side)
 {
-    PyObject *ret = PyDict_GetItemWithError(self->data, key);
-    if (ret) {
-        Py_INCREF(ret);
-        return ret;
+    const Journal *journal = &self->journal;
+    PyObject *list = PyList_New(journal->count);
+
+    if (EXPECT(!list, 0)) {
+        return NULL;
     }
 
-    if (EXPECT(!PyErr_Occurred(), 0)) {
-        PyErr_SetString(PyExc_KeyError, "key does not exist");
+    // boxing and copying cannot reenter the side, the ring stays put
+    for (Py_ssize_t i = 0; i < journal->count; ++i) {
+        const JournalEntry *entry = &journal->entries[(journal->head - journal->count + journal->cap + i) % journal->cap];
+        PyObject *price = (entry->op == JOURNAL_RESET) ? Py_NewRef(Py_None) :
+                          (self->key_type == KEY_FIXED) ? fixed_box(self, entry->level.tick) :
+                          Py_NewRef(entry->level.key);
+        // the caller gets its own copy of reset contents, the journal's must not change
+        PyObject *size = (entry->op == JOURNAL_RESET) ? PyDict_Copy(entry->value) : Py_NewRef(entry->value ? entry->value : Py_None);
+        PyObject *tuple = NULL;
+
+        if (EXPECT(price && size, 1)) {
+            tuple = side ? Py_BuildValue("(OsOOKL)", side, journal_ops[entry->op], price, size, (unsigned long long)entry->version, (long long)entry->time) :
+                           Py_BuildValue("(sOOKL)", journal_ops[entry->op], price, size, (unsigned long long)entry->version, (long long)entry->time);
+        }
+
+        Py_XDECREF(price);
+        Py_XDECREF(size);
+        if (EXPECT(!tuple, 0)) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, tuple);
     }
 
-    return ret;
+    return list;
 }
 
-int SortedDict_setitem(SortedDict *self, PyObject *key, PyObject *value)
-{
-    bool cache_live = (!self->dirty && self->karr != NULL);
-    uint64_t version = self->version;
 
-    if (EXPECT(cache_live && self->pend_count == SD_PENDING_MAX, 0)) {
-        if (apply_pending(self) != 0 && PyErr_Occurred()) {
-            PyErr_Clear();
-        }
-        cache_live = (!self->dirty && self->karr != NULL);
-        version = self->version;
+// apply one journal entry, read from position skip on. the version and time are not checked,
+// a journal replays onto any side. deleting a level that is not there is a no-op
+int SortedDict_replay_entry(SortedDict *self, PyObject *entry, Py_ssize_t skip)
+{
+    if (EXPECT(!PyTuple_Check(entry) || PyTuple_GET_SIZE(entry) < skip + 3, 0)) {
+        PyErr_SetString(PyExc_ValueError, "journal entries must be tuples from journal()");
+        return -1;
     }
 
-    if (value) {
-        Py_ssize_t before = PyDict_GET_SIZE(self->data);
-        int ret = PyDict_SetItem(self->data, key, value);
+    PyObject *op = PyTuple_GET_ITEM(entry, skip);
+    PyObject *price = PyTuple_GET_ITEM(entry, skip + 1);
+    PyObject *size = PyTuple_GET_ITEM(entry, skip + 2);
+    const char *name = PyUnicode_Check(op) ? PyUnicode_AsUTF8(op) : NULL;
 
-        if (EXPECT(ret == -1, 0)) {
-            return ret;
+    if (EXPECT(!name, 0)) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "journal op must be a str");
         }
+        return -1;
+    }
 
-        if (PyDict_GET_SIZE(self->data) == before && self->version == version) {
-            // in place value update, the key set did not change
-            return ret;
-        }
+    if (strcmp(name, "insert") == 0 || strcmp(name, "update") == 0) {
+        return store_level(self, price, size, false);
+    }
 
-        if (!cache_live) {
-            self->dirty = true;
-            self->version++;
-        } else if (PyDict_GET_SIZE(self->data) == before + 1 && self->version == version) {
-            log_append(self, PENDING_INSERT, key);
-        } else {
-            escalate_to_dirty(self);
+    if (strcmp(name, "delete") == 0) {
+        if (EXPECT(store_level(self, price, NULL, false), 0)) {
+            if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
+                return -1;
+            }
+            PyErr_Clear();
         }
+        return 0;
+    }
 
-        if (EXPECT(self->truncate && truncate_to_depth(self), 0)) {
+    if (strcmp(name, "reset") == 0) {
+        if (EXPECT(!PyDict_Check(size), 0)) {
+            PyErr_SetString(PyExc_ValueError, "a journal reset must carry a dict");
             return -1;
         }
+        return SortedDict_replace(self, size);
+    }
 
-        return ret;
-    } else {
-        // setitem also called for del (value will be null for deletes)
-        int ret = PyDict_DelItem(self->data, key);
-        if (ret != 0) {
-            // a failed delete leaves the cache and log untouched
-            return ret;
-        }
+    PyErr_Format(PyExc_ValueError, "unknown journal op '%s'", name);
+    return -1;
+}
 
-        if (!cache_live) {
-            self->dirty = true;
-            self->version++;
-        } else if (self->version == version) {
-            log_append(self, PENDING_DELETE, key);
-        } else {
-            escalate_to_dirty(self);
+
+// sequence number of the entry journal_entries returns at index
+uint64_t SortedDict_journal_seq(const SortedDict *self, Py_ssize_t index)
+{
+    const Journal *journal = &self->journal;
+    return journal->entries[(journal->head - journal->count + journal->cap + index) % journal->cap].seq;
+}
+
+
+PyObject* SortedDict_journal(SortedDict *self, PyObject *Py_UNUSED(ignored))
+{
+    return SortedDict_journal_entries(self, NULL);
+}
+
+
+PyObject* SortedDict_replay(SortedDict *self, PyObject *journal)
+{
+    // observers run during the replay could change a list, work from a copy
+    PyObject *entries = PySequence_Tuple(journal);
+    if (EXPECT(!entries, 0)) {
+        return NULL;
+    }
+
+    int failed = 0;
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(entries) && !failed; ++i) {
+        failed = SortedDict_replay_entry(self, PyTuple_GET_ITEM(entries, i), 0);
+    }
+    Py_DECREF(entries);
+
+    // whatever was applied is truncated, failure or not
+    if (EXPECT(failed, 0)) {
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        if (SortedDict_apply_done(self)) {
+            PyErr_Clear();
         }
+        PyErr_Restore(type, value, traceback);
+        return NULL;
+    }
 
-        return ret;
+    if (EXPECT(SortedDict_apply_done(self), 0)) {
+        return NULL;
     }
+
+    Py_RETURN_NONE;
 }
 
+
 /* Seq Functions */
 int SortedDict_contains(const SortedDict *self, PyObject *value)
 {
-    return PyDict_Contains(self->data, value);
+    if (self->key_type == KEY_FIXED) {
+        int64_t k;
+        int conv = fixed_key(self, value, &k);
+        if (conv) {
+            // a price off the tick grid cannot be in the book
+            return (conv < 0) ? -1 : 0;
+        }
+
+        return fixed_lookup(self, k) != NULL;
+    }
+
+    PyObject *interned = intern_key(self, value, false);
+    if (EXPECT(!interned, 0)) {
+        return -1;
+    }
+
+    int ret = PyDict_Contains(self->data, interned);
+    Py_DECREF(interned);
+
+    return ret;
 }
 
 /* side iterator */
@@ -1288,6 +5374,8 @@ static void SortedDictIter_dealloc(SortedDictIter *self)
     PyObject_GC_UnTrack(self);
     Py_CLEAR(self->keys);
     Py_CLEAR(self->data);
+    Py_CLEAR(self->book);
+    PyMem_Free(self->ticks);
     PyObject_GC_Del(self);
 }
 
@@ -1296,6 +5384,7 @@ static int SortedDictIter_traverse(SortedDictIter *self, visitproc visit, void *
 {
     Py_VISIT(self->keys);
     Py_VISIT(self->data);
+    Py_VISIT(self->book);
 
     return 0;
 }
@@ -1305,6 +5394,7 @@ static int SortedDictIter_clear(SortedDictIter *self)
 {
     Py_CLEAR(self->keys);
     Py_CLEAR(self->data);
+    Py_CLEAR(self->book);
 
     return 0;
 }
@@ -1323,7 +5413,14 @@ static PyObject *SortedDictIter_next(SortedDictIter *self)
         return Py_NewRef(key);
     }
 
-    PyObject *value = PyDict_GetItemWithError(self->data, key);
+    PyObject *value;
+    if (self->book) {
+        PyObject **stored = fixed_lookup(self->book, self->ticks[self->index]);
+        value = stored ? *stored : NULL;
+    } else {
+        value = PyDict_GetItemWithError(self->data, key);
+    }
+
     if (EXPECT(!value, 0)) {
         if (!PyErr_Occurred()) {
             // the level was deleted mid iteration so raise
@@ -1361,39 +5458,63 @@ PyTypeObject SortedDictIterType = {
 };
 
 
-static PyObject *SortedDict_iter_new(SortedDict *self, bool pairs)
+// iterator over the levels from position start on, snapshot holds their keys.
+// steals the snapshot ref
+static PyObject *iter_over(SortedDict *self, PyObject *snapshot, Py_ssize_t start, Py_ssize_t len, bool pairs)
 {
-    if (EXPECT(update_keys(self), 0)) {
-        return NULL;
-    }
-
-    PyObject *snapshot = karr_materialize(self);
-    if (EXPECT(!snapshot, 0)) {
-        return NULL;
-    }
-
     SortedDictIter *it = PyObject_GC_New(SortedDictIter, &SortedDictIterType);
     if (EXPECT(!it, 0)) {
+        Py_DECREF(snapshot);
         return NULL;
     }
 
-    it->keys = Py_NewRef(snapshot);
+    it->keys = snapshot;
     it->data = Py_NewRef(self->data);
+    it->book = NULL;
+    it->ticks = NULL;
     it->index = 0;
     it->pairs = pairs;
+    it->len = len;
 
-    Py_ssize_t len = PyTuple_GET_SIZE(it->keys);
-    if ((self->depth > 0) && (self->depth < len)) {
-        len = self->depth;
-    }
+    if (self->key_type == KEY_FIXED && pairs) {
+        it->ticks = PyMem_New(int64_t, len > 0 ? len : 1);
+        if (EXPECT(!it->ticks, 0)) {
+            Py_DECREF(it);
+            return PyErr_NoMemory();
+        }
 
-    it->len = len;
+        Py_ssize_t at = fixed_seek(self, start);
+        for (Py_ssize_t i = 0; i < len; ++i) {
+            fixed_next(self, &at, &it->ticks[i]);
+        }
+        it->book = (SortedDict *)Py_NewRef(self);
+    }
 
     PyObject_GC_Track(it);
     return (PyObject *)it;
 }
 
 
+static PyObject *SortedDict_iter_new(SortedDict *self, bool pairs)
+{
+    if (EXPECT(update_keys(self), 0)) {
+        return NULL;
+    }
+
+    PyObject *snapshot = visible_keys(self);
+    if (EXPECT(!snapshot, 0)) {
+        return NULL;
+    }
+
+    Py_ssize_t len = PyTuple_GET_SIZE(snapshot);
+    if ((self->depth > 0) && (self->depth < len)) {
+        len = self->depth;
+    }
+
+    return iter_over(self, snapshot, 0, len, pairs);
+}
+
+
 PyObject *SortedDict_getiter(SortedDict *self)
 {
     return SortedDict_iter_new(self, false);
@@ -1404,3 +5525,181 @@ PyObject* SortedDict_items(SortedDict *self, PyObject *Py_UNUSED(ignored))
 {
     return SortedDict_iter_new(self, true);
 }
+
+
+/* Batches */
+// close the batch on its sides, the last batch out runs the upkeep they deferred. every
+// side is closed even when an earlier one fails
+static int batch_close(SortedDictBatch *self)
+{
+    PyObject *type = NULL, *value = NULL, *traceback = NULL;
+
+    if (!self->open) {
+        return 0;
+    }
+    self->open = false;
+
+    for (int i = 0; i < 2 && self->sides[i]; ++i) {
+        SortedDict *side = self->sides[i];
+
+        // the other side runs with no exception pending, the first error is the one kept
+        if (--side->batching == 0 && SortedDict_apply_done(side)) {
+            if (type) {
+                PyErr_Clear();
+            } else {
+                PyErr_Fetch(&type, &value, &traceback);
+            }
+        }
+    }
+
+    if (type) {
+        PyErr_Restore(type, value, traceback);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void SortedDictBatch_dealloc(SortedDictBatch *self)
+{
+    PyObject_GC_UnTrack(self);
+
+    // never exited, the sides cannot be left deferring their upkeep
+    if (batch_close(self)) {
+        PyErr_WriteUnraisable((PyObject *)self);
+    }
+
+    Py_CLEAR(self->owner);
+    Py_CLEAR(self->sides[0]);
+    Py_CLEAR(self->sides[1]);
+    Py_CLEAR(self->checksum);
+    PyObject_GC_Del(self);
+}
+
+
+static int SortedDictBatch_traverse(SortedDictBatch *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->owner);
+    Py_VISIT(self->sides[0]);
+    Py_VISIT(self->sides[1]);
+    Py_VISIT(self->checksum);
+
+    return 0;
+}
+
+
+static int SortedDictBatch_clear(SortedDictBatch *self)
+{
+    if (batch_close(self)) {
+        PyErr_WriteUnraisable((PyObject *)self);
+    }
+
+    Py_CLEAR(self->owner);
+    Py_CLEAR(self->sides[0]);
+    Py_CLEAR(self->sides[1]);
+    Py_CLEAR(self->checksum);
+
+    return 0;
+}
+
+
+static PyObject *SortedDictBatch_enter(SortedDictBatch *self, PyObject *Py_UNUSED(ignored))
+{
+    if (self->open || !self->owner) {
+        PyErr_SetString(PyExc_RuntimeError, "batch is already open");
+        return NULL;
+    }
+
+    for (int i = 0; i < 2 && self->sides[i]; ++i) {
+        self->sides[i]->batching++;
+    }
+    self->open = true;
+
+    return Py_NewRef(self);
+}
+
+
+// the upkeep runs whether or not the block raised, whatever it wrote is kept. an error
+// from the block takes precedence over one from the upkeep
+static PyObject *SortedDictBatch_exit(SortedDictBatch *self, PyObject *args)
+{
+    PyObject *type = PyTuple_Check(args) && PyTuple_GET_SIZE(args) ? PyTuple_GET_ITEM(args, 0) : Py_None;
+    bool raised = type != Py_None;
+
+    if (!self->open) {
+        PyErr_SetString(PyExc_RuntimeError, "batch is not open");
+        return NULL;
+    }
+
+    if (batch_close(self)) {
+        if (!raised) {
+            return NULL;
+        }
+        PyErr_Clear();
+    }
+
+    if (self->want_checksum && !raised) {
+        PyObject *checksum = PyObject_CallMethod(self->owner, "checksum", NULL);
+        if (EXPECT(!checksum, 0)) {
+            return NULL;
+        }
+        Py_XSETREF(self->checksum, checksum);
+    }
+
+    Py_RETURN_FALSE;
+}
+
+
+static PyMethodDef SortedDictBatch_methods[] = {
+    {"__enter__", (PyCFunction) SortedDictBatch_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) SortedDictBatch_exit, METH_VARARGS, NULL},
+    {NULL}
+};
+
+
+static PyMemberDef SortedDictBatch_members[] = {
+    {"checksum", T_OBJECT, offsetof(SortedDictBatch, checksum), READONLY, "the book's checksum as the batch closed, when asked for"},
+    {NULL}
+};
+
+
+PyTypeObject SortedDictBatchType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "order_book.batch",
+    .tp_doc = "context manager deferring max_depth truncation and observers until it exits",
+    .tp_basicsize = sizeof(SortedDictBatch),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_dealloc = (destructor) SortedDictBatch_dealloc,
+    .tp_traverse = (traverseproc) SortedDictBatch_traverse,
+    .tp_clear = (inquiry) SortedDictBatch_clear,
+    .tp_methods = SortedDictBatch_methods,
+    .tp_members = SortedDictBatch_members,
+};
+
+
+// a batch over one side, or both sides of a book. checksum asks for owner.checksum() on a clean exit
+PyObject *SortedDict_batch_new(PyObject *owner, SortedDict *first, SortedDict *second, bool checksum)
+{
+    SortedDictBatch *batch = PyObject_GC_New(SortedDictBatch, &SortedDictBatchType);
+    if (EXPECT(!batch, 0)) {
+        return NULL;
+    }
+
+    batch->owner = Py_NewRef(owner);
+    batch->sides[0] = (SortedDict *)Py_NewRef(first);
+    batch->sides[1] = (SortedDict *)Py_XNewRef(second);
+    batch->checksum = NULL;
+    batch->want_checksum = checksum;
+    batch->open = false;
+
+    PyObject_GC_Track(batch);
+    return (PyObject *)batch;
+}
+
+
+PyObject* SortedDict_batch(SortedDict *self, PyObject *Py_UNUSED(ignored))
+{
+    return SortedDict_batch_new((PyObject *)self, self, NULL, false);
+}
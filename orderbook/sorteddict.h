@@ -15,6 +15,11 @@ associated with this software.
 #include "Python.h"
 #include "structmember.h"
 
+#include "codec.h"
+#include "keytree.h"
+#include "ladder.h"
+#include "ticks.h"
+
 
 enum Ordering {
     ASCENDING,
@@ -23,36 +28,145 @@ enum Ordering {
 };
 
 
-// pending key changes tracked. once the limit is hit, full sort of the cache
-#define SD_PENDING_MAX 64
+// how keys are held. objects are compared with python rich compare, fixed keys
+// are converted to int64 tick counts on the way in and boxed back when read
+enum KeyType {
+    KEY_OBJECT,
+    KEY_FIXED
+};
+
 
-// changes to the keys are either inserts or deletes
-enum PendingOp {
-    PENDING_INSERT,
-    PENDING_DELETE
+// how load_snapshot builds the numbers of [price, size] string levels
+enum SnapshotParse {
+    PARSE_DECIMAL,
+    PARSE_FLOAT,
+    PARSE_FIXED
 };
 
+
+// native storage for KEY_FIXED. keys are kept in book order as plain integers:
+// DESCENDING sides hold negated tick counts so both sides search ascending.
+// a ladder side holds the levels inside its band in the ladder, the sorted
+// arrays then only hold the levels behind the band
+typedef struct {
+    int64_t *keys;
+    PyObject **values;   // owned refs, parallel to keys
+    Py_ssize_t len;
+    Ladder ladder;
+    Py_ssize_t cap;
+    int64_t units;       // tick size, in units of 10^-scale
+    int scale;
+    PyObject *tick;      // the tick as given, kept for comparisons on re-init
+    PyObject *box;       // the type keys are boxed back into: int, float or Decimal
+} FixedKeys;
+
+
+// running totals over the first 'valid' levels for the depth queries, built lazily
+// from the top. a write lowers 'valid' to the first level it touched, and a cache
+// that missed a write (version moved on without it) is rebuilt from scratch
+typedef struct {
+    double *prices;
+    double *sizes;      // size resting at this level or better
+    double *notional;   // price * size at this level or better
+    Py_ssize_t valid;
+    Py_ssize_t cap;
+    uint64_t version;
+} DepthCache;
+
+
+// the keys of the most recent level changes, for deltas. entries sit in a ring, the
+// newest just behind head, and each is one change: the newest is change number
+// 'changes' and the oldest 'changes - count + 1'. a fixed key side logs ticks
+typedef union {
+    PyObject *key;   // owned ref
+    int64_t tick;
+} DeltaEntry;
+
+
+typedef struct {
+    DeltaEntry *entries;   // allocated on the first change logged
+    Py_ssize_t cap;        // 0 when logging is off
+    Py_ssize_t head;
+    Py_ssize_t count;
+} DeltaLog;
+
+
+// the last level changes in full, for replaying what led up to a bad book. entries sit
+// in a ring like the delta log's. a reset entry holds a copy of contents the side was
+// replaced with wholesale, where other entries hold the new size, NULL for a delete
+enum JournalOp {JOURNAL_INSERT, JOURNAL_UPDATE, JOURNAL_DELETE, JOURNAL_RESET};
+
 typedef struct {
-    PyObject *key;   // strong ref
+    DeltaEntry level;   // unused for a reset
+    PyObject *value;    // owned ref
+    uint64_t version;   // the side's version after the change
+    int64_t time;       // wall clock ns, 0 when the journal is untimed
+    uint64_t seq;       // process wide, orders the entries of different sides
     uint8_t op;
-} PendingEntry;
+} JournalEntry;
+
+
+typedef struct {
+    JournalEntry *entries;   // allocated on the first change journaled
+    Py_ssize_t cap;          // 0 when the journal is off
+    Py_ssize_t head;
+    Py_ssize_t count;
+    bool timed;              // reading the clock is most of an entry's cost
+} Journal;
+
+
+// callbacks told when the top levels change. writes report the rank they landed at,
+// so when every change since the last report ranked behind the deepest watched level
+// the top cannot have moved and nothing is compared
+typedef struct {
+    PyObject *list;      // (callback, depth, tag) tuples, NULL when nothing observes the side
+    PyObject *top;       // the watched (price, size) levels as last reported
+    Py_ssize_t depth;    // deepest level any observer watches
+    Py_ssize_t touched;  // best rank written since the last report
+    Py_ssize_t ranked;   // changes since the last report that reported a rank
+    uint64_t seen;       // changes as of the last report
+    bool busy;           // callbacks running, their writes are reported once they return
+} Observers;
+
 
 typedef struct {
     PyObject_HEAD
     PyObject *data;
-    // the sorted key cache: a plain array of owned refs. merges move pointers between arrays
-    PyObject **karr;
-    Py_ssize_t k_len;
-    // consumers that need immutable snapshot get this lazily built tuple of karr, cached until the key set changes
+    // the sorted keys of an object keyed book, updated in place on every insert and delete
+    KeyTree tree;
+    // consumers that need immutable snapshot get this lazily built tuple of the tree, cached until the key set changes
     PyObject *keys_tuple;
     uint64_t version;
     enum Ordering ordering;
+    enum KeyType key_type;
     int depth;
-    uint16_t pend_count;
     bool truncate;
-    // set when only a full re-sort can rebuild the cache. changes that are pended are should not toggle
+    // set when only a full re-sort can rebuild the tree: replaced contents, keys that do
+    // not compare, or a comparison that mutated the book mid insert
     bool dirty;
-    PendingEntry pend[SD_PENDING_MAX];
+    FixedKeys fixed;
+    DepthCache prefix;
+    // builds keys from str prices, NULL when interning is off. the pool maps each str
+    // price seen to the key built from it, so repeats reuse one hashed key object
+    PyObject *intern;
+    PyObject *pool;
+    // the tree or the fixed arrays and ladder can be shared with snapshots: shares counts
+    // the sides holding them, NULL when this side is the only one. data_shared marks a
+    // dict a snapshot also holds. a side copies whatever it shares before its next write
+    Py_ssize_t *shares;
+    bool data_shared;
+    // snapshots are read only
+    bool frozen;
+    // every level change counts, where version only moves with the key set. changes older
+    // than the log reaches, or before contents were replaced wholesale, need a full resend
+    uint64_t changes;
+    DeltaLog log;
+    // the source side's version as of the last delta applied here
+    uint64_t applied;
+    Observers observers;
+    Journal journal;
+    // open batches, max_depth truncation and observers wait for the last to close
+    uint32_t batching;
 } SortedDict;
 
 
@@ -61,6 +175,9 @@ typedef struct {
     PyObject_HEAD
     PyObject *keys;
     PyObject *data;
+    // fixed key books: the live side plus the tick counts the key snapshot was boxed from
+    SortedDict *book;
+    int64_t *ticks;
     Py_ssize_t index;
     Py_ssize_t len;    // obeys max_depth
     bool pairs;
@@ -69,6 +186,19 @@ typedef struct {
 extern PyTypeObject SortedDictIterType;
 
 
+// context manager deferring the upkeep of one side or both sides of a book
+typedef struct {
+    PyObject_HEAD
+    PyObject *owner;            // the book or side batched, checksummed on exit
+    SortedDict *sides[2];       // second is NULL for a single side
+    PyObject *checksum;         // set on a clean exit when asked for
+    bool want_checksum;
+    bool open;
+} SortedDictBatch;
+
+extern PyTypeObject SortedDictBatchType;
+
+
 void SortedDict_dealloc(SortedDict *self);
 PyObject *SortedDict_new(PyTypeObject *type, PyObject *args, PyObject *kwds);
 int SortedDict_init(SortedDict *self, PyObject *args, PyObject *kwds);
@@ -83,6 +213,30 @@ PyObject* SortedDict_todict_impl(SortedDict *self, PyObject *from, PyObject *to)
 PyObject* SortedDict_tolist(SortedDict *self, PyObject *Py_UNUSED(ignored));
 PyObject* SortedDict_items(SortedDict *self, PyObject *Py_UNUSED(ignored));
 PyObject* SortedDict_truncate(SortedDict *self, PyObject *Py_UNUSED(ignored));
+PyObject* SortedDict_update(SortedDict *self, PyObject *args);
+PyObject* SortedDict_toarrays(SortedDict *self, PyObject *args, PyObject *kwargs);
+PyObject* SortedDict_bisect(SortedDict *self, PyObject *args, PyObject *kwargs);
+PyObject* SortedDict_rank(SortedDict *self, PyObject *price);
+PyObject* SortedDict_range(SortedDict *self, PyObject *args, PyObject *kwargs);
+PyObject* SortedDict_irange(SortedDict *self, PyObject *args, PyObject *kwargs);
+PyObject* SortedDict_snapshot(SortedDict *self, PyObject *Py_UNUSED(ignored));
+PyObject* SortedDict_tobytes(SortedDict *self, PyObject *Py_UNUSED(ignored));
+PyObject* SortedDict_frombytes(PyTypeObject *type, PyObject *data);
+PyObject* SortedDict_reduce(SortedDict *self, PyObject *Py_UNUSED(ignored));
+PyObject* SortedDict_delta_since(SortedDict *self, PyObject *since);
+PyObject* SortedDict_apply_delta(SortedDict *self, PyObject *blob);
+PyObject* SortedDict_reconcile(SortedDict *self, PyObject *dict);
+PyObject* SortedDict_load_snapshot(SortedDict *self, PyObject *args, PyObject *kwargs);
+PyObject* SortedDict_observe(SortedDict *self, PyObject *args, PyObject *kwargs);
+PyObject* SortedDict_unobserve(SortedDict *self, PyObject *callback);
+PyObject* SortedDict_journal(SortedDict *self, PyObject *Py_UNUSED(ignored));
+PyObject* SortedDict_replay(SortedDict *self, PyObject *journal);
+PyObject* SortedDict_batch(SortedDict *self, PyObject *Py_UNUSED(ignored));
+PyObject *SortedDict_batch_new(PyObject *owner, SortedDict *first, SortedDict *second, bool checksum);
+PyObject* SortedDict_cumulative(SortedDict *self, PyObject *args);
+PyObject* SortedDict_size_to_price(SortedDict *self, PyObject *price);
+PyObject* SortedDict_price_for_size(SortedDict *self, PyObject *qty);
+PyObject* SortedDict_vwap(SortedDict *self, PyObject *qty);
 
 Py_ssize_t SortedDict_len(const SortedDict *self);
 PyObject *SortedDict_getitem(SortedDict *self, PyObject *key);
@@ -99,6 +253,13 @@ static PyMemberDef SortedDict_members[] = {
     {"__ordering", T_INT, offsetof(SortedDict, ordering), 0, "ordering flag"},
     {"__truncate", T_BOOL, offsetof(SortedDict, truncate), 0, "truncate flag"},
     {"__max_depth", T_INT, offsetof(SortedDict, depth), 0, "maximum depth"},
+    {"__key_type", T_INT, offsetof(SortedDict, key_type), READONLY, "key type flag"},
+    {"__tick", T_OBJECT, offsetof(SortedDict, fixed.tick), READONLY, "tick size of fixed keys"},
+    {"__band", T_PYSSIZET, offsetof(SortedDict, fixed.ladder.band), READONLY, "slots in the tick ladder"},
+    {"__intern", T_OBJECT, offsetof(SortedDict, intern), READONLY, "key factory for str prices"},
+    {"__delta_log", T_PYSSIZET, offsetof(SortedDict, log.cap), READONLY, "level changes kept for deltas"},
+    {"__journal", T_PYSSIZET, offsetof(SortedDict, journal.cap), READONLY, "level changes kept in the journal"},
+    {"version", T_ULONGLONG, offsetof(SortedDict, changes), READONLY, "count of level changes, deltas are taken since one"},
     {NULL}
 };
 
@@ -109,7 +270,30 @@ static PyMethodDef SortedDict_methods[] = {
     {"truncate", (PyCFunction) SortedDict_truncate, METH_NOARGS, "truncate to length max_depth"},
     {"to_dict", (PyCFunction) SortedDict_todict, METH_VARARGS | METH_KEYWORDS, "return a python dictionary, sorted by keys"},
     {"to_list", (PyCFunction) SortedDict_tolist, METH_NOARGS, "return a list of key, value tuples."},
+    {"to_arrays", (PyCFunction) SortedDict_toarrays, METH_VARARGS | METH_KEYWORDS, "return the prices and sizes of the top levels as typed buffers"},
     {"items", (PyCFunction) SortedDict_items, METH_NOARGS, "return an iterator over (key, value) pairs, sorted by key"},
+    {"bisect", (PyCFunction) SortedDict_bisect, METH_VARARGS | METH_KEYWORDS, "number of levels ahead of a price, counting a level at the price when right is set"},
+    {"rank", (PyCFunction) SortedDict_rank, METH_O, "index of the level at a price"},
+    {"range", (PyCFunction) SortedDict_range, METH_VARARGS | METH_KEYWORDS, "return a list of the (key, value) pairs priced between lo and hi, inclusive"},
+    {"irange", (PyCFunction) SortedDict_irange, METH_VARARGS | METH_KEYWORDS, "return an iterator over the (key, value) pairs priced between lo and hi, inclusive"},
+    {"snapshot", (PyCFunction) SortedDict_snapshot, METH_NOARGS, "return a read only view of the side as it is now, sharing its storage until the side next changes"},
+    {"to_bytes", (PyCFunction) SortedDict_tobytes, METH_NOARGS, "return a compact binary encoding of the side and its settings"},
+    {"from_bytes", (PyCFunction) SortedDict_frombytes, METH_O | METH_CLASS, "build a side from the output of to_bytes"},
+    {"__reduce__", (PyCFunction) SortedDict_reduce, METH_NOARGS, "pickle support, via to_bytes"},
+    {"delta_since", (PyCFunction) SortedDict_delta_since, METH_O, "return a binary delta of the levels changed since a version, or of every level for None"},
+    {"apply_delta", (PyCFunction) SortedDict_apply_delta, METH_O, "apply a delta from delta_since, returning the source version it brings the side to"},
+    {"cumulative", (PyCFunction) SortedDict_cumulative, METH_VARARGS, "total size resting in the first depth levels, all visible levels by default"},
+    {"size_to_price", (PyCFunction) SortedDict_size_to_price, METH_O, "total size resting at a price or better"},
+    {"price_for_size", (PyCFunction) SortedDict_price_for_size, METH_O, "price of the level that fills a quantity, None when the side is too thin"},
+    {"vwap", (PyCFunction) SortedDict_vwap, METH_O, "average fill price of a quantity, None when the side is too thin"},
+    {"update", (PyCFunction) SortedDict_update, METH_VARARGS, "apply (price, size) levels in one call, a zero size deletes the level"},
+    {"reconcile", (PyCFunction) SortedDict_reconcile, METH_O, "bring the side to the levels of a snapshot dict by changing only the differences, returning (added, changed, removed)"},
+    {"load_snapshot", (PyCFunction) SortedDict_load_snapshot, METH_VARARGS | METH_KEYWORDS, "replace the side with [price, size, ...] levels of strings, parsed as decimal, float or fixed point ticks"},
+    {"observe", (PyCFunction) SortedDict_observe, METH_VARARGS | METH_KEYWORDS, "call callback(levels) with the top depth levels whenever they change"},
+    {"unobserve", (PyCFunction) SortedDict_unobserve, METH_O, "stop calling a callback registered with observe"},
+    {"journal", (PyCFunction) SortedDict_journal, METH_NOARGS, "return the journaled level changes, oldest first, as (op, price, size, version, time_ns) tuples"},
+    {"replay", (PyCFunction) SortedDict_replay, METH_O, "apply the entries of a journal in order"},
+    {"batch", (PyCFunction) SortedDict_batch, METH_NOARGS, "return a context manager that defers max_depth truncation and observers until it exits"},
     {NULL}
 };
 
@@ -149,9 +333,46 @@ static PyTypeObject SortedDictType = {
 
 /* helpers */
 int update_keys(SortedDict *self);
-void SortedDict_flush_pending(SortedDict *self);
 void SortedDict_drop_key_cache(SortedDict *self);
 PyObject *SortedDict_key_window(SortedDict *self, Py_ssize_t want);
+PyObject *SortedDict_value_window(SortedDict *self, Py_ssize_t want, int64_t *ticks);
+PyObject *SortedDict_box_tick(SortedDict *self, int64_t tick);
+Py_ssize_t SortedDict_cached_len(const SortedDict *self);
+int SortedDict_parse_key_type(PyObject *arg, PyObject *ladder, PyObject *band, enum KeyType *type, Py_ssize_t *slots);
+int SortedDict_check_key_type(const SortedDict *self, enum KeyType type, PyObject *tick, Py_ssize_t band, PyObject *intern);
+int SortedDict_set_key_type(SortedDict *self, enum KeyType type, PyObject *tick, Py_ssize_t band);
+int SortedDict_set_intern(SortedDict *self, PyObject *factory);
+int SortedDict_parse_count(PyObject *size, const char *name, Py_ssize_t *cap);
+int SortedDict_replace(SortedDict *self, PyObject *dict);
+int SortedDict_apply(SortedDict *self, PyObject *levels, PyObject *sizes);
+int SortedDict_apply_level(SortedDict *self, PyObject *key, PyObject *size);
+int SortedDict_apply_done(SortedDict *self);
+int SortedDict_parse_mode(const char *name, enum SnapshotParse *mode);
+int SortedDict_load_levels(SortedDict *self, PyObject *levels, enum SnapshotParse mode);
+PyObject *SortedDict_arrays(SortedDict *self, Py_ssize_t depth, const char *dtype, PyObject *out);
+int SortedDict_encode(SortedDict *self, CodecWriter *w);
+int SortedDict_decode(SortedDict *self, CodecReader *r);
+int SortedDict_set_delta_log(SortedDict *self, PyObject *size);
+int SortedDict_add_observer(SortedDict *self, PyObject *callback, Py_ssize_t depth, PyObject *tag);
+int SortedDict_remove_observer(SortedDict *self, PyObject *callback);
+int SortedDict_notify(SortedDict *self);
+int SortedDict_set_journal(SortedDict *self, PyObject *size, PyObject *timed);
+PyObject *SortedDict_journal_entries(SortedDict *self, PyObject *side);
+uint64_t SortedDict_journal_seq(const SortedDict *self, Py_ssize_t index);
+int SortedDict_replay_entry(SortedDict *self, PyObject *entry, Py_ssize_t skip);
+
+// a side's part of a delta, read in full before any of it is applied
+typedef struct {
+    bool reset;
+    uint64_t from;
+    uint64_t to;
+    PyObject *levels;   // list of (key, value) to set and (key,) to remove
+} SideDelta;
+
+int SortedDict_encode_delta(SortedDict *self, PyObject *since, CodecWriter *w);
+int SortedDict_read_delta(CodecReader *r, SideDelta *delta);
+int SortedDict_check_delta(const SortedDict *self, const SideDelta *delta);
+int SortedDict_install_delta(SortedDict *self, SideDelta *delta);
 
 
 #endif
@@ -0,0 +1,27 @@
+/*
+Copyright (C) 2020-2026  Bryant Moscon - bmoscon@gmail.com
+
+Please see the LICENSE file for the terms and conditions
+associated with this software.
+*/
+#ifndef __TICKS__
+#define __TICKS__
+
+
+#include <stdint.h>
+
+#define PY_SSIZE_T_CLEAN
+#include "Python.h"
+
+
+/*
+fixed point tick helpers from sorteddict.c, apart from sorteddict.h so code that does
+not hold SortedDicts (history.c) can use them without the static type objects
+*/
+int SortedDict_parse_tick(PyObject *tick, int *scale, int64_t *units, PyObject **box);
+int SortedDict_fixed_units(PyObject *obj, int scale, int64_t *out);
+PyObject *SortedDict_box_units(PyObject *box, int64_t units, int scale);
+int SortedDict_load_ticks(PyObject *dict, const int64_t *ticks, PyObject *const *values, Py_ssize_t n);
+
+
+#endif
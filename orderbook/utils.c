@@ -26,6 +26,195 @@ enum side_e check_key(const char *key)
 }
 
 
+static const int64_t pow10_table[FIXED_MAX_SCALE + 1] = {
+    1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL, 100000000LL,
+    1000000000LL, 10000000000LL, 100000000000LL, 1000000000000LL, 10000000000000LL,
+    100000000000000LL, 1000000000000000LL, 10000000000000000LL, 100000000000000000LL,
+    1000000000000000000LL
+};
+
+
+int64_t fixed_pow10(int scale)
+{
+    return pow10_table[scale];
+}
+
+
+/*
+parse a plain or scientific notation decimal string (as produced by str() on int,
+float and Decimal) into mantissa * 10^exponent. trailing zeros are folded into
+the exponent so the mantissa is as small as possible
+  ret  0 - success
+  ret -1 - malformed (including inf/nan)
+  ret -2 - too many significant digits for an int64
+*/
+int parse_decimal(const char *s, size_t len, int64_t *mantissa, int *exponent)
+{
+    size_t i = 0;
+    bool negative = false;
+    bool digits = false;
+    bool dot = false;
+    uint64_t m = 0;
+    int zeros = 0;
+    int frac = 0;
+    int exp = 0;
+
+    if (i < len && (s[i] == '+' || s[i] == '-')) {
+        negative = (s[i] == '-');
+        i++;
+    }
+
+    for (; i < len; ++i) {
+        char c = s[i];
+
+        if (c == '.') {
+            if (dot) {
+                return -1;
+            }
+            dot = true;
+            continue;
+        }
+
+        if (c < '0' || c > '9') {
+            break;
+        }
+
+        digits = true;
+        if (dot) {
+            frac++;
+        }
+
+        if (c == '0') {
+            // zeros are held back until a significant digit shows they are not trailing
+            if (m) {
+                zeros++;
+            }
+            continue;
+        }
+
+        for (int z = 0; z <= zeros; ++z) {
+            if (__builtin_mul_overflow(m, 10, &m)) {
+                return -2;
+            }
+        }
+        zeros = 0;
+
+        if (__builtin_add_overflow(m, (uint64_t)(c - '0'), &m) || m > INT64_MAX) {
+            return -2;
+        }
+    }
+
+    if (!digits) {
+        return -1;
+    }
+
+    if (i < len) {
+        if (s[i] != 'e' && s[i] != 'E') {
+            return -1;
+        }
+        i++;
+
+        bool exp_negative = false;
+        if (i < len && (s[i] == '+' || s[i] == '-')) {
+            exp_negative = (s[i] == '-');
+            i++;
+        }
+
+        if (i == len) {
+            return -1;
+        }
+
+        for (; i < len; ++i) {
+            if (s[i] < '0' || s[i] > '9') {
+                return -1;
+            }
+
+            // anything this large is out of range for every scale anyway
+            if (exp < 100000) {
+                exp = exp * 10 + (s[i] - '0');
+            }
+        }
+
+        if (exp_negative) {
+            exp = -exp;
+        }
+    }
+
+    *mantissa = negative ? -(int64_t)m : (int64_t)m;
+    *exponent = (m == 0) ? 0 : exp + zeros - frac;
+
+    return 0;
+}
+
+
+/*
+mantissa * 10^exponent as an integer count of 10^-scale units
+  ret  0 - success
+  ret -1 - value has more precision than the scale allows
+  ret -2 - overflow
+*/
+int decimal_to_fixed(int64_t mantissa, int exponent, int scale, int64_t *out)
+{
+    if (mantissa == 0) {
+        *out = 0;
+        return 0;
+    }
+
+    int shift = exponent + scale;
+    if (shift < 0) {
+        return -1;
+    }
+
+    if (shift > FIXED_MAX_SCALE) {
+        return -2;
+    }
+
+    if (__builtin_mul_overflow(mantissa, pow10_table[shift], out)) {
+        return -2;
+    }
+
+    return 0;
+}
+
+
+// render a fixed point value with exactly 'scale' decimal places. out must hold FIXED_RENDER_MAX bytes
+int render_fixed(int64_t value, int scale, char *out)
+{
+    char digits[24];
+    int n = 0;
+    uint64_t v = (value < 0) ? -(uint64_t)value : (uint64_t)value;
+
+    do {
+        digits[n++] = '0' + (v % 10);
+        v /= 10;
+    } while (v);
+
+    // always at least one digit before the point
+    while (n <= scale) {
+        digits[n++] = '0';
+    }
+
+    int pos = 0;
+    if (value < 0) {
+        out[pos++] = '-';
+    }
+
+    while (n > scale) {
+        out[pos++] = digits[--n];
+    }
+
+    if (scale) {
+        out[pos++] = '.';
+        while (n) {
+            out[pos++] = digits[--n];
+        }
+    }
+
+    out[pos] = '\0';
+    return pos;
+}
+
+
 /*
 CRC checksums for
   * arm64 with CRC32 extension
@@ -108,8 +297,19 @@ uint32_t crc32_orderbook(const uint8_t *data, size_t len)
 // part of SSE4.1
 #include <immintrin.h>
 
+// byte at a time lookup for the inputs and tails too short to fold
+static uint32_t crc32_table[256];
+
 int crc32_orderbook_init(void)
 {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (uint32_t)-(int32_t)(crc & 1));
+        }
+        crc32_table[i] = crc;
+    }
+
     return (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) ? 0 : -1;
 }
 
@@ -206,10 +406,7 @@ uint32_t crc32_orderbook(const uint8_t *data, size_t len)
     }
 
     while (len--) {
-        crc ^= *data++;
-        for (int bit = 0; bit < 8; bit++) {
-            crc = (crc >> 1) ^ (0xEDB88320 & (uint32_t)-(int32_t)(crc & 1));
-        }
+        crc = (crc >> 8) ^ crc32_table[(crc ^ *data++) & 0xFF];
     }
 
     return ~crc;
@@ -9,6 +9,7 @@ associated with this software.
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #define EXPECT(EXPR, VAL) __builtin_expect((EXPR), (VAL))
 
@@ -24,4 +25,13 @@ enum side_e check_key(const char *key);
 int crc32_orderbook_init(void);
 uint32_t crc32_orderbook(const uint8_t *data, size_t len);
 
+// fixed point helpers for tick based keys
+#define FIXED_MAX_SCALE 18
+#define FIXED_RENDER_MAX 48
+
+int64_t fixed_pow10(int scale);
+int parse_decimal(const char *s, size_t len, int64_t *mantissa, int *exponent);
+int decimal_to_fixed(int64_t mantissa, int exponent, int scale, int64_t *out);
+int render_fixed(int64_t value, int scale, char *out);
+
 #endif
@@ -541,6 +541,31 @@ def snapshot_builders(levels):
     return build_c, build_sc, build_python
 
 
+def raw_builders(snap, tick):
+    '''building from [price, size, seq] strings as the exchange sends them'''
+    bids, asks = snap['bids'], snap['asks']
+
+    def build_setitem():
+        ob = OrderBook()
+        for p, s, _ in bids:
+            ob.bids[Decimal(p)] = Decimal(s)
+        for p, s, _ in asks:
+            ob.asks[Decimal(p)] = Decimal(s)
+        return ob.to_dict()
+
+    def build_load(parse, **kwargs):
+        def build():
+            ob = OrderBook(**kwargs)
+            ob.load_snapshot(bids, asks, parse=parse)
+            return ob.to_dict()
+        return build
+
+    return [('Decimal() + setitem', build_setitem),
+            ('load_snapshot', build_load('decimal')),
+            ('  parse="float"', build_load('float')),
+            ('  parse="fixed"', build_load('fixed', key_type='fixed', tick=tick))]
+
+
 def time_build(build, repeats=5):
     samples = []
     for _ in range(repeats):
@@ -675,6 +700,14 @@ def main():
             print(f'  {name:<18}{fmt_ns(ns):>12}{rel}')
         results['snapshot'] = {name: ns for name, ns in rows}
 
+        rows = [(name, time_build(build)) for name, build in raw_builders(l2_snap, tick)]
+        print(f'\nsnapshot: same, from the exchange\'s price and size strings')
+        base = rows[0][1]
+        for name, ns in rows:
+            rel = '' if ns == base else f'  ({base / ns:.1f}x faster)'
+            print(f'  {name:<22}{fmt_ns(ns):>12}{rel}')
+        results['snapshot_strings'] = {name.strip(): ns for name, ns in rows}
+
     if args.scenario in ('l2', 'all'):
         levels = l2_levels(l2_snap, args.depth)
         events = gen_l2_events(levels, args.ops, args.seed, tick)
@@ -9,7 +9,7 @@ from zlib import crc32
 
 import pytest
 
-from order_book import OrderBook
+from order_book import OrderBook, register_checksum_format, verify_checksums
 
 
 def test_minimum_depth_kraken():
@@ -55,6 +55,17 @@ def test_kraken_checksum():
 
     assert ob.checksum() == 974947235
 
+    # fixed point keys render at the tick's precision, which is what kraken sends
+    for ladder in (False, True):
+        fixed = OrderBook(max_depth=10, checksum_format='KRAKEN', key_type='fixed', tick=Decimal('0.00005'), ladder=ladder)
+        for a in asks:
+            fixed.asks[a[0]] = Decimal(a[1])
+
+        for b in bids:
+            fixed.bids[b[0]] = Decimal(b[1])
+
+        assert fixed.checksum() == 974947235
+
     # The following checksums are from recorded data
     ob = OrderBook(max_depth=11, checksum_format='KRAKEN')
 
@@ -999,3 +1010,150 @@ def test_okx_checksum_bad_format():
 
     with pytest.raises(ValueError):
         ob.checksum()
+
+
+@pytest.mark.parametrize("fmt", ['KRAKEN', 'OKX', 'BITGET', 'BITFINEX'])
+@pytest.mark.parametrize("kwargs", [{}, {'key_type': 'fixed', 'tick': Decimal('0.01')}, {'key_type': 'fixed', 'tick': Decimal('0.01'), 'ladder': True}])
+def test_checksum_after_updates(fmt, kwargs):
+    # levels unchanged since the last checksum reuse its text, which has to hash the same as a fresh book
+    def fresh():
+        book = OrderBook(checksum_format=fmt, **kwargs)
+        book.bids = ob.bids.to_dict()
+        book.asks = ob.asks.to_dict()
+        return book.checksum()
+
+    ob = OrderBook(checksum_format=fmt, **kwargs)
+    for i in range(40):
+        ob.bids[Decimal(1000 - i) / 10] = Decimal(i + 1) / 4
+        ob.asks[Decimal(1001 + i) / 10] = Decimal(i + 1) / 8
+    assert ob.checksum() == fresh()
+
+    updates = [
+        ('bids', Decimal('100.0'), Decimal('7.5')),
+        ('asks', Decimal('100.1'), None),
+        ('bids', Decimal('100.05'), 3),
+        ('asks', Decimal('100.3'), 0.125),
+        ('bids', Decimal('99.5'), '2.5'),
+        ('bids', Decimal('100.05'), None),
+        ('asks', Decimal('100.05'), Decimal('1E-7')),
+        ('bids', Decimal('98.0'), Decimal('5')),
+        # below the levels checksummed, so the text and its crc are unchanged
+        ('bids', Decimal('90.0'), Decimal('5')),
+        ('asks', Decimal('104.0'), None),
+    ]
+    for side, price, size in updates:
+        if size is None:
+            del ob[side][price]
+        else:
+            ob[side][price] = size
+        assert ob.checksum() == fresh()
+
+    # a failed checksum leaves the levels of the last good one to reuse
+    ob.bids[Decimal('99.8')] = Unprintable()
+    with pytest.raises(RuntimeError):
+        ob.checksum()
+    ob.bids[Decimal('99.8')] = Decimal('0.5')
+    assert ob.checksum() == fresh()
+
+
+@pytest.mark.parametrize('value', [
+    Decimal('0'), Decimal('-0'), Decimal('0E+2'), Decimal('-0E-3'), Decimal('1.50'), Decimal('1E-7'), Decimal('1.23E+5'),
+    Decimal('0.000001'), Decimal('-0.0000001'), Decimal('123456789E-3'), Decimal('9' * 40 + 'E-60'), Decimal('1' * 80),
+    Decimal('-1.5E+3'), Decimal('1E+80'), Decimal('1E-80'),
+    Decimal('NaN'), Decimal('-Infinity'), 0, -5, 2**63 - 1, -2**63, 2**64, 1.5, 1e-7, 1e22, -0.0, 0.1, 'abc', True,
+])
+def test_checksum_value_rendering(value):
+    # ints and floats are rendered without going through str(), and a Decimal's fixed point
+    # text is worked out from its str() instead of format(), to the same text
+    def kraken(x):
+        return str(x).replace('.', '').lstrip('0').split('E')[0].split('e')[0]
+
+    def okx(x):
+        return format(x, 'f') if 'E' in str(x) else str(x)
+
+    ob = OrderBook(checksum_format='KRAKEN')
+    ob.bids = {Decimal(1): value}
+    assert ob.checksum() == crc32(('1' + kraken(value)).encode())
+
+    for fmt, render in (('BITGET', str), ('OKX', okx)):
+        ob = OrderBook(checksum_format=fmt)
+        ob.bids = {Decimal(1): value}
+        assert ob.checksum() == crc32(f'1:{render(value)}'.encode())
+
+
+def test_register_checksum_format():
+    # the built in formats, described again
+    register_checksum_format('TEST_KRAKEN', 10, layout='asks_bids', separator='', strip=True)
+    register_checksum_format('TEST_OKX', 25, exponent='fixed')
+    register_checksum_format('TEST_BITFINEX', 25, ask_sign=True, exponent='lower', orders=True)
+
+    values = [Decimal('1.5'), Decimal('2E-7'), Decimal('3E+4'), Decimal('0.0400'), 7, 0.25]
+    for builtin in ('KRAKEN', 'OKX', 'BITFINEX'):
+        ob = OrderBook(checksum_format=builtin)
+        registered = OrderBook(checksum_format=f'TEST_{builtin}')
+        for i in range(30):
+            for book in (ob, registered):
+                book.bids[Decimal(100 - i)] = values[i % len(values)]
+                book.asks[Decimal(101 + i)] = values[(i + 1) % len(values)]
+        assert registered.checksum() == ob.checksum()
+
+    register_checksum_format('TEST_CUSTOM', 2, layout='bids_asks', separator='|', ask_sign=True, strip=True, exponent='fixed')
+    ob = OrderBook(checksum_format='TEST_CUSTOM')
+    ob.bids = {Decimal('10.5'): Decimal('1E+2'), Decimal('9'): Decimal('0.25'), Decimal('8'): Decimal(1)}
+    ob.asks = {Decimal('11'): Decimal('2E-3')}
+    assert ob.checksum() == crc32(b'105|100|9|25|11|-2')
+
+    copy = OrderBook.from_bytes(ob.to_bytes())
+    assert copy.checksum() == ob.checksum()
+
+    for kwargs in ({'name': 'TEST_CUSTOM'}, {'name': 'KRAK'}, {'name': ''}, {'depth': 0}, {'separator': '::'},
+                   {'layout': 'sideways'}, {'exponent': 'upper'}):
+        with pytest.raises(ValueError):
+            register_checksum_format(**{'name': 'TEST_BAD', 'depth': 5, **kwargs})
+
+    with pytest.raises(TypeError):
+        OrderBook(checksum_format='TEST_BAD')
+
+
+@pytest.mark.parametrize('threads', [1, 4])
+def test_verify_checksums(threads):
+    books = []
+    for fmt in ('KRAKEN', 'OKX', 'BITGET', 'BITFINEX'):
+        for n in range(3):
+            ob = OrderBook(checksum_format=fmt)
+            ob.bids = {Decimal(100 - i) - Decimal(n) / 100: Decimal(i + 1) / 4 for i in range(30)}
+            ob.asks = {Decimal(101 + i) + Decimal(n) / 100: Decimal(i + 1) / 8 for i in range(30)}
+            books.append(ob)
+    expected = [ob.checksum() for ob in books]
+
+    assert verify_checksums(list(zip(books, expected)), threads=threads) == []
+    assert all(ob.verify(crc) for ob, crc in zip(books, expected))
+    # exchanges that send a signed 32 bit checksum
+    assert all(ob.verify(crc - 2**32 if crc >= 2**31 else crc) for ob, crc in zip(books, expected))
+
+    books[4].bids[Decimal('99.5')] = Decimal('3')
+    actual = books[4].checksum()
+    assert verify_checksums([(books[4], expected[4]), (books[5], expected[5]), (books[4], actual)], threads=threads) == [(books[4], actual)]
+    assert not books[4].verify(expected[4])
+    assert verify_checksums(iter([])) == []
+
+    # a book that fails to render fails the batch, and the books before it still checksum
+    books[1].bids[Decimal('99.5')] = Decimal('7')
+    books[2].bids[Decimal('99.5')] = Unprintable()
+    with pytest.raises(RuntimeError):
+        verify_checksums([(books[1], 0), (books[2], 0)], threads=threads)
+    fresh = OrderBook(checksum_format='KRAKEN')
+    fresh.bids = books[1].bids.to_dict()
+    fresh.asks = books[1].asks.to_dict()
+    assert books[1].checksum() == fresh.checksum()
+
+    with pytest.raises(TypeError):
+        verify_checksums([books[0]])
+    with pytest.raises(TypeError):
+        verify_checksums([(books[0], '1')])
+    with pytest.raises(ValueError):
+        verify_checksums([(books[0], 2**32)])
+    with pytest.raises(ValueError):
+        verify_checksums([(OrderBook(), 0)])
+    with pytest.raises(ValueError):
+        verify_checksums([], threads=0)
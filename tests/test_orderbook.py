@@ -4,13 +4,15 @@ Copyright (C) 2020-2026  Bryant Moscon - bmoscon@gmail.com
 Please see the LICENSE file for the terms and conditions
 associated with this software.
 '''
+from array import array
 from decimal import Decimal
+import pickle
 import random
 
 import pytest
 import requests
 
-from order_book import OrderBook
+from order_book import HistoryReader, HistoryWriter, OrderBook
 
 
 def populate_orderbook():
@@ -77,6 +79,16 @@ def test_orderbook_init_errors():
     with pytest.raises(TypeError):
         OrderBook(max_depth='a')
 
+    # a bad argument leaves a book being re-initialized as it was
+    ob = OrderBook(max_depth=20, journal=4)
+    for kwargs in ({'checksum_format': 'NOPE'}, {'journal': -1}, {'delta_log': 'a'}, {'intern': 5}):
+        with pytest.raises((TypeError, ValueError)):
+            ob.__init__(max_depth=5, key_type='fixed', tick=Decimal('0.1'), **kwargs)
+    assert ob.max_depth == 20
+    ob.bids[Decimal('1.55')] = 1
+    assert ob.bids.keys() == (Decimal('1.55'),)
+    assert len(ob.journal()) == 1
+
 
 def test_orderbook_init():
     ob = OrderBook(max_depth=10)
@@ -296,3 +308,309 @@ def test_to_dict_conversion_failure():
     ob.asks = {2: 'x'}
     with pytest.raises(ValueError):
         ob.to_dict(to_type=int)
+
+
+def test_fixed_keys():
+    ob = OrderBook(key_type='fixed', tick=Decimal('0.5'))
+    ob.bids = {'100.5': 1, Decimal('101'): 2, 99: 3}
+    ob.asks[102] = 4
+    ob.asks['101.5'] = 5
+
+    assert ob.bids.keys() == (Decimal('101'), Decimal('100.5'), Decimal('99'))
+    assert ob.asks.index(0) == (Decimal('101.5'), 5)
+    assert ob.to_dict() == {'bid': {Decimal('101'): 2, Decimal('100.5'): 1, Decimal('99'): 3}, 'ask': {Decimal('101.5'): 5, Decimal('102'): 4}}
+    assert len(ob) == 5
+
+    with pytest.raises(ValueError):
+        ob.asks[Decimal('102.25')] = 1
+
+    with pytest.raises(ValueError):
+        OrderBook(key_type='fixed')
+
+
+def test_ladder():
+    ob = OrderBook(ladder=True, tick=Decimal('0.5'), band=64)
+    assert ob.bids.__band == 64
+    ob.bids = {'100.5': 1, Decimal('101'): 2, 99: 3}
+    ob.asks[102] = 4
+    ob.asks['101.5'] = 5
+    # far behind the band
+    ob.asks[5000] = 6
+
+    assert ob.bids.keys() == (Decimal('101'), Decimal('100.5'), Decimal('99'))
+    assert ob.asks.index(0) == (Decimal('101.5'), 5)
+    assert ob.asks.index(-1) == (Decimal('5000'), 6)
+    assert len(ob) == 6
+
+    with pytest.raises(ValueError):
+        OrderBook(ladder=True)
+
+    with pytest.raises(ValueError):
+        OrderBook(band=64, tick=1, key_type='fixed')
+
+
+def test_apply():
+    ob = OrderBook(max_depth=2, max_depth_strict=True)
+    assert ob.apply([('bid', 100, 1), ('bid', 99, 2), ('ask', 101, 3), ('asks', 102, 4), ('bids', 98, 5)]) is None
+    assert ob.to_dict() == {'bid': {100: 1, 99: 2}, 'ask': {101: 3, 102: 4}}
+
+    ob.apply(bids=[(100, 0), (97, 1)], asks={101: '0'})
+    assert ob.to_dict() == {'bid': {99: 2, 97: 1}, 'ask': {102: 4}}
+
+    # zero sizes as text, however they are written
+    for zero in ('0.' + '0' * 30, '0e-30', ' 0.0 ', '0_0', '-0'):
+        ob.apply([('ask', 101, '5')])
+        assert ob.asks[101] == '5'
+        ob.apply([('ask', 101, zero)])
+        assert 101 not in ob.asks
+    ob.apply([('ask', 101, 'not a size')])
+    assert ob.asks[101] == 'not a size'
+    del ob.asks[101]
+
+    with pytest.raises(ValueError):
+        ob.apply([('middle', 100, 1)])
+
+    with pytest.raises(ValueError):
+        ob.apply([('bid', 100)])
+
+    # no checksum format
+    with pytest.raises(ValueError):
+        ob.apply([], checksum=True)
+
+
+def test_apply_checksum():
+    ob = OrderBook(checksum_format='KRAKEN')
+    expected = OrderBook(checksum_format='KRAKEN')
+    levels = [('bid', Decimal('0.05005'), Decimal('0.00000500')), ('ask', Decimal('0.05010'), Decimal('1.00000000'))]
+
+    for side, price, size in levels:
+        expected[side][price] = size
+
+    assert ob.apply(levels, checksum=True) == expected.checksum()
+
+
+def test_to_arrays():
+    ob = OrderBook()
+    ob.bids = {100: 1, 99: 2, 98: 3}
+    ob.asks = {101: 4}
+
+    bid_prices, bid_sizes, ask_prices, ask_sizes = ob.to_arrays(2)
+    assert bid_prices.tolist() == [100.0, 99.0]
+    assert bid_sizes.tolist() == [1.0, 2.0]
+    assert ask_prices.tolist() == [101.0]
+    assert ask_sizes.tolist() == [4.0]
+
+    out = tuple(array('d', [0.0] * 2) for _ in range(4))
+    assert ob.to_arrays(out=out) == (2, 1)
+    assert list(out[0]) == [100.0, 99.0]
+    assert list(out[3]) == [4.0, 0.0]
+
+    with pytest.raises(TypeError):
+        ob.to_arrays(out=out[:2])
+
+
+def test_intern():
+    ob = OrderBook(intern=Decimal, checksum_format='KRAKEN')
+    ob.apply([('bid', '0.05005', '0.00000500'), ('ask', '0.05010', '1.00000000')])
+    ob.bids = {'0.05004': Decimal('2.5'), **ob.bids.to_dict()}
+
+    assert ob.bids.keys() == (Decimal('0.05005'), Decimal('0.05004'))
+    assert ob.asks.index(0) == (Decimal('0.05010'), '1.00000000')
+
+    expected = OrderBook(checksum_format='KRAKEN')
+    expected.bids = {Decimal('0.05005'): '0.00000500', Decimal('0.05004'): Decimal('2.5')}
+    expected.asks = {Decimal('0.05010'): '1.00000000'}
+    assert ob.checksum() == expected.checksum()
+
+
+def test_snapshot():
+    ob = OrderBook(checksum_format='KRAKEN')
+    ob.bids = {Decimal('0.05005'): Decimal('0.00000500'), Decimal('0.05004'): Decimal('2')}
+    ob.asks = {Decimal('0.05010'): Decimal('1.00000000')}
+    checksum = ob.checksum()
+
+    snap = ob.snapshot()
+    ob.apply([('bid', Decimal('0.05006'), Decimal('1')), ('ask', Decimal('0.05010'), 0)])
+
+    assert snap.checksum() == checksum
+    assert snap.bids.to_list() == [(Decimal('0.05005'), Decimal('0.00000500')), (Decimal('0.05004'), Decimal('2'))]
+    assert snap.asks.to_list() == [(Decimal('0.05010'), Decimal('1.00000000'))]
+    assert len(ob.asks) == 0
+
+    with pytest.raises(TypeError):
+        snap.apply([('bid', Decimal('0.05001'), Decimal('1'))])
+
+
+def test_to_bytes():
+    ob = OrderBook(max_depth=10, max_depth_strict=True, checksum_format='KRAKEN')
+    ob.bids = {Decimal('0.05005'): Decimal('0.00000500'), Decimal('0.05004'): Decimal('2')}
+    ob.asks = {Decimal('0.05010'): Decimal('1.00000000')}
+
+    for copy in (OrderBook.from_bytes(ob.to_bytes()), pickle.loads(pickle.dumps(ob)), pickle.loads(pickle.dumps(ob.snapshot()))):
+        assert copy.to_dict() == ob.to_dict()
+        assert copy.checksum() == ob.checksum()
+        assert copy.max_depth == 10
+
+    fixed = OrderBook(key_type='fixed', tick=Decimal('0.01'), ladder=True)
+    fixed.bids = {Decimal('99.99'): 1, Decimal('99.98'): 2}
+    copy = pickle.loads(pickle.dumps(fixed))
+    assert copy.bids.index(0) == (Decimal('99.99'), 1)
+    copy.bids[Decimal('100.01')] = 3
+    assert copy.bids.index(0) == (Decimal('100.01'), 3)
+
+    with pytest.raises(ValueError):
+        OrderBook.from_bytes(ob.bids.to_bytes())
+
+
+def test_save_load(tmp_path):
+    path = tmp_path / 'book.obk'
+    ob = OrderBook(checksum_format='KRAKEN', key_type='fixed', tick=Decimal('0.00001'))
+    ob.bids = {Decimal('0.05005'): Decimal('0.00000500'), Decimal('0.05004'): Decimal('2')}
+    ob.asks = {Decimal('0.05010'): Decimal('1.00000000')}
+
+    ob.save(path, sequence=1001)
+    book, sequence = OrderBook.load(path)
+    assert sequence == 1001
+    assert book.to_dict() == ob.to_dict()
+    assert book.checksum() == ob.checksum()
+
+    ob.save(str(path), fsync=True)
+    assert OrderBook.load(path)[1] is None
+
+    data = bytearray(path.read_bytes())
+    data[-1] ^= 1
+    path.write_bytes(data)
+    with pytest.raises(ValueError):
+        OrderBook.load(path)
+
+    with pytest.raises(FileNotFoundError):
+        OrderBook.load(tmp_path / 'missing')
+
+
+def test_delta():
+    source = OrderBook(checksum_format='KRAKEN', delta_log=1024)
+    replica = OrderBook(checksum_format='KRAKEN')
+    source.bids = {Decimal('0.05005'): Decimal('0.00000500')}
+    source.asks = {Decimal('0.05010'): Decimal('1.00000000')}
+
+    version = source.version
+    replica.apply_delta(source.encode_delta())
+    assert replica.checksum() == source.checksum()
+
+    source.apply([('bid', Decimal('0.05006'), Decimal('1')), ('ask', Decimal('0.05010'), 0), ('ask', Decimal('0.05011'), Decimal('2'))])
+    assert replica.apply_delta(source.encode_delta(version)) == source.version
+    assert replica.to_dict() == source.to_dict()
+    assert replica.checksum() == source.checksum()
+
+    with pytest.raises(ValueError):
+        replica.apply_delta(source.encode_delta(version)[:-1])
+
+
+def test_reconcile():
+    ob = OrderBook(checksum_format='KRAKEN')
+    ob.bids = {Decimal('0.05005'): Decimal('0.00000500'), Decimal('0.05004'): Decimal('1')}
+    ob.asks = {Decimal('0.05010'): Decimal('1.00000000')}
+
+    diff = ob.reconcile(bids={Decimal('0.05005'): Decimal('0.00000500'), Decimal('0.05003'): Decimal('2')})
+    assert diff == {'bid': ([Decimal('0.05003')], [], [Decimal('0.05004')])}
+
+    fresh = OrderBook(checksum_format='KRAKEN')
+    fresh.bids = {Decimal('0.05005'): Decimal('0.00000500'), Decimal('0.05003'): Decimal('2')}
+    fresh.asks = {Decimal('0.05010'): Decimal('1.00000000')}
+    assert ob.to_dict() == fresh.to_dict()
+    assert ob.checksum() == fresh.checksum()
+
+    assert ob.reconcile(bids={}, asks={})['ask'] == ([], [], [Decimal('0.05010')])
+    assert len(ob) == 0
+
+
+def test_observe():
+    ob = OrderBook(max_depth=10)
+    events = []
+    ob.observe(lambda side, levels: events.append((side, levels)))
+
+    ob.bids = {Decimal('0.05005'): Decimal('1'), Decimal('0.05004'): Decimal('2')}
+    ob.asks[Decimal('0.05010')] = Decimal('1')
+    ob.asks[Decimal('0.05011')] = Decimal('1')
+    ob.apply([('bid', Decimal('0.05004'), 0), ('bid', Decimal('0.05005'), Decimal('1.5'))])
+
+    assert events == [
+        ('bid', ((Decimal('0.05005'), Decimal('1')),)),
+        ('ask', ((Decimal('0.05010'), Decimal('1')),)),
+        ('bid', ((Decimal('0.05005'), Decimal('1.5')),)),
+    ]
+
+
+def test_journal():
+    ob = OrderBook(journal=16)
+    ob.bids = {Decimal('0.05005'): Decimal('1')}
+    ob.asks[Decimal('0.05010')] = Decimal('1')
+    ob.apply([('bid', Decimal('0.05005'), 0), ('ask', Decimal('0.05010'), Decimal('2'))])
+
+    journal = ob.journal()
+    assert [entry[:2] for entry in journal] == [('bid', 'reset'), ('ask', 'insert'), ('bid', 'delete'), ('ask', 'update')]
+
+    replica = OrderBook()
+    replica.replay(journal)
+    assert replica.to_dict() == ob.to_dict()
+
+
+def test_batch():
+    ob = OrderBook(max_depth=10, max_depth_strict=True, checksum_format='KRAKEN')
+    events = []
+    ob.observe(lambda side, levels: events.append(side))
+
+    with ob.batch(checksum=True) as batch:
+        for price in range(1, 21):
+            ob.bids[Decimal(price)] = Decimal('1')
+        ob.asks[Decimal('21')] = Decimal('1')
+        assert events == []
+
+    assert events == ['bid', 'ask']
+    assert len(ob.bids) == 10
+    assert batch.checksum == ob.checksum()
+
+    with pytest.raises(ValueError):
+        OrderBook().batch(checksum=True)
+
+
+def test_history(tmp_path):
+    path = tmp_path / 'book.obh'
+    with HistoryWriter(path, Decimal('0.01'), Decimal('0.001'), keyframe_interval=2) as writer:
+        writer.append(1, bids={'100.01': '1.5', '100.00': 2}, asks=[('100.02', '0.25')])
+        writer.append(2, bids={'100.01': 0})
+        writer.append(3, asks={'100.03': 1})
+        with pytest.raises(ValueError):
+            writer.append(3)
+        with pytest.raises(ValueError):
+            writer.append(4, bids={'100.005': 1})
+
+    with HistoryReader(path) as reader:
+        assert len(reader) == 3
+        assert (reader.first, reader.last) == (1, 3)
+
+        book = reader.book_at(2)
+        assert book.to_dict() == {'bid': {Decimal('100.00'): Decimal('2.000')}, 'ask': {Decimal('100.02'): Decimal('0.250')}}
+        assert list(reader.book_at(10).asks) == [Decimal('100.02'), Decimal('100.03')]
+        with pytest.raises(ValueError):
+            reader.book_at(0)
+
+        assert reader.read(2, 2) == [(2, [(Decimal('100.01'), Decimal('0.000'))], [])]
+
+    data = path.read_bytes()
+    path.write_bytes(data[:-1])
+    assert HistoryReader(path).last == 2
+
+
+def test_load_snapshot():
+    ob = OrderBook(max_depth=2, max_depth_strict=True)
+    ob.load_snapshot(bids=[['100.02', '1.5', 3], ['100.01', '2', 1], ['100.00', '1', 4]], asks=[['100.03', '0.25', 2]])
+    assert ob.to_dict() == {'bid': {Decimal('100.02'): Decimal('1.5'), Decimal('100.01'): Decimal('2')}, 'ask': {Decimal('100.03'): Decimal('0.25')}}
+
+    ob = OrderBook(key_type='fixed', tick='0.01')
+    ob.load_snapshot(asks=[['100.03', '0.25'], ['100.04', '1']], parse='fixed')
+    assert ob.asks.to_list() == [(Decimal('100.03'), Decimal('0.25')), (Decimal('100.04'), Decimal('1'))]
+    assert len(ob.bids) == 0
+
+    with pytest.raises(ValueError):
+        ob.load_snapshot(bids=[], parse='int')
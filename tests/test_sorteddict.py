@@ -4,7 +4,9 @@ Copyright (C) 2020-2026  Bryant Moscon - bmoscon@gmail.com
 Please see the LICENSE file for the terms and conditions
 associated with this software.
 '''
+from array import array
 from decimal import Decimal
+import pickle
 import random
 
 import pytest
@@ -510,3 +512,725 @@ def test_unhashable_key():
 
     with pytest.raises(TypeError):
         d[[1, 2]] = 3
+
+
+def test_fixed_keys():
+    d = SortedDict(ordering='DESC', key_type='fixed', tick=Decimal('0.01'))
+    d[Decimal('100.01')] = 'a'
+    d['99.5'] = 'b'
+    d[101] = 'c'
+    d[100.02] = 'd'
+
+    # keys come back boxed as the tick's type, at the tick's precision
+    assert d.keys() == (Decimal('101.00'), Decimal('100.02'), Decimal('100.01'), Decimal('99.50'))
+    assert d.index(0) == (Decimal('101'), 'c')
+    assert d.index(-1) == (Decimal('99.5'), 'b')
+    assert d[Decimal('99.50')] == 'b'
+    assert d.to_list() == list(d.items())
+    assert list(d.to_dict()) == list(d.keys())
+
+    assert 100.01 in d
+    assert Decimal('100.001') not in d
+    assert 'not a price' not in d
+
+    del d[101]
+    assert d.keys() == (Decimal('100.02'), Decimal('100.01'), Decimal('99.50'))
+
+    with pytest.raises(KeyError):
+        del d[101]
+
+    with pytest.raises(KeyError):
+        d[Decimal('100.005')]
+
+    with pytest.raises(ValueError):
+        d[Decimal('100.005')] = 'e'
+
+
+def test_fixed_keys_box_types():
+    d = SortedDict({5: 'a', 3: 'b', 10: 'c'}, key_type='fixed', tick=1)
+    assert d.keys() == (3, 5, 10)
+    assert all(type(k) is int for k in d)
+
+    d = SortedDict({0.3: 'a', 0.1: 'b', 0.2: 'c'}, key_type='fixed', tick=0.1)
+    assert d.keys() == (0.1, 0.2, 0.3)
+
+    d = SortedDict({'2.5': 'a', '1': 'b'}, key_type='fixed', tick='0.5')
+    assert d.keys() == (Decimal('1.0'), Decimal('2.5'))
+
+
+def test_fixed_keys_float_grid():
+    d = SortedDict(key_type='fixed', tick=Decimal('0.01'))
+    # float arithmetic lands next to the grid, and large prices are still exact doubles
+    d[0.1 + 0.2] = 'a'
+    d[123456789012.34] = 'b'
+    assert d.keys() == (Decimal('0.30'), Decimal('123456789012.34'))
+
+    # off the grid at any size
+    for price in (1.005, 65000.123, 10000000.001):
+        with pytest.raises(ValueError):
+            d[price] = 'c'
+
+
+def test_fixed_keys_depth():
+    d = SortedDict({i: i for i in range(100)}, key_type='fixed', tick=1, max_depth=10, truncate=True)
+    assert len(d) == 10
+    assert d.keys() == tuple(range(10))
+
+    d[-1] = -1
+    assert d.keys() == tuple(range(-1, 9))
+
+    with pytest.raises(KeyError):
+        d[9]
+
+
+def test_fixed_keys_iteration_mutation():
+    d = SortedDict({1: 'a', 2: 'b'}, key_type='fixed', tick=1)
+    it = d.items()
+    assert next(it) == (1, 'a')
+    d[2] = 'z'
+    assert next(it) == (2, 'z')
+
+    d = SortedDict({1: 'a', 2: 'b'}, key_type='fixed', tick=1)
+    it = d.items()
+    assert next(it) == (1, 'a')
+    del d[2]
+    with pytest.raises(KeyError):
+        next(it)
+
+
+def test_fixed_keys_invalid():
+    with pytest.raises(ValueError):
+        SortedDict(key_type='fixed')
+
+    with pytest.raises(ValueError):
+        SortedDict(key_type='fixed', tick=0)
+
+    with pytest.raises(ValueError):
+        SortedDict(key_type='fixed', tick='abc')
+
+    with pytest.raises(ValueError):
+        SortedDict(key_type='bogus', tick=1)
+
+    with pytest.raises(ValueError):
+        SortedDict(tick=1)
+
+    with pytest.raises(ValueError):
+        SortedDict({'1.5': 1}, key_type='fixed', tick=1)
+
+    with pytest.raises(ValueError):
+        SortedDict(key_type='fixed', tick=1)[2 ** 70] = 1
+
+    # a populated book cannot switch key types in place
+    d = SortedDict({1: 1})
+    with pytest.raises(ValueError):
+        d.__init__(key_type='fixed', tick=1)
+
+
+def test_write_bursts():
+    random.seed(7)
+    d = SortedDict(ordering='DESC')
+    ref = {}
+
+    for burst in (1, 10, 100, 1000, 5000):
+        for _ in range(burst):
+            key = random.randint(0, 3000) / 4
+            if key in ref and random.random() < 0.5:
+                del d[key]
+                del ref[key]
+            else:
+                d[key] = burst
+                ref[key] = burst
+
+        expected = sorted(ref, reverse=True)
+        assert d.keys() == tuple(expected)
+        assert d.index(0) == (expected[0], ref[expected[0]])
+        assert d.index(-1) == (expected[-1], ref[expected[-1]])
+        assert d.index(len(expected) // 2)[0] == expected[len(expected) // 2]
+        assert list(d) == expected
+
+
+def test_write_bursts_depth():
+    random.seed(11)
+    d = SortedDict(max_depth=25, truncate=True)
+
+    for _ in range(20000):
+        d[random.random()] = 1
+
+    keys = d.keys()
+    assert len(keys) == 25
+    assert list(keys) == sorted(keys)
+    assert d.index(24)[0] == keys[24]
+    assert list(d.to_dict()) == list(keys)
+
+
+def test_write_appends():
+    for ordering in ('ASC', 'DESC'):
+        d = SortedDict(ordering=ordering)
+        sign = 1 if ordering == 'ASC' else -1
+
+        # a book refilled from the back, then written all through
+        for i in range(2000):
+            d[sign * i] = i
+        for i in range(0, 2000, 3):
+            d[sign * (i + 0.5)] = i
+        for i in range(0, 2000, 7):
+            del d[sign * i]
+
+        expected = sorted({sign * i for i in range(2000) if i % 7} | {sign * (i + 0.5) for i in range(0, 2000, 3)}, reverse=sign < 0)
+        assert d.keys() == tuple(expected)
+        assert [d.rank(key) for key in expected[::97]] == list(range(0, len(expected), 97))
+
+
+def test_reentrant_compare():
+    d = SortedDict({i: i for i in range(300)})
+
+    class Meddler(int):
+        def __lt__(self, other):
+            if 50 in d:
+                del d[50]
+            return int(self) < int(other)
+
+        def __hash__(self):
+            return int.__hash__(self)
+
+    d[Meddler(1000)] = 1
+    assert d.keys() == tuple(i for i in range(300) if i != 50) + (1000,)
+    assert d.index(-1)[0] == 1000
+
+
+def test_ladder():
+    d = SortedDict(ladder=True, tick=Decimal('0.01'), band=100, ordering='DESC')
+    # rounded up to whole bitmap words
+    assert d.__band == 128
+    assert d.__key_type == 1
+
+    d['100.00'] = 1
+    d['99.99'] = 2
+    d['100.01'] = 3
+    assert d.keys() == (Decimal('100.01'), Decimal('100.00'), Decimal('99.99'))
+
+    # levels behind the band, then a move past the front that re-centers it
+    d['50.00'] = 4
+    d['150.00'] = 5
+    assert d.keys() == (Decimal('150.00'), Decimal('100.01'), Decimal('100.00'), Decimal('99.99'), Decimal('50.00'))
+    assert d.index(1) == (Decimal('100.01'), 3)
+    assert d[Decimal('99.99')] == 2
+    assert Decimal('50') in d
+    assert Decimal('50.005') not in d
+
+    # the market leaves the band entirely
+    for key in list(d)[:-1]:
+        del d[key]
+    d['49.99'] = 6
+    assert d.to_list() == [(Decimal('50.00'), 4), (Decimal('49.99'), 6)]
+
+    with pytest.raises(KeyError):
+        del d['75']
+
+    with pytest.raises(ValueError):
+        d['1.001'] = 1
+
+
+def test_ladder_random():
+    random.seed(3)
+    d = SortedDict(ladder=True, tick=1, band=64)
+    ref = {}
+    mid = 0
+
+    for _ in range(20000):
+        mid += random.randint(-3, 3)
+        key = mid + int(random.gauss(0, 50))
+        if key in ref and random.random() < 0.5:
+            del d[key]
+            del ref[key]
+        else:
+            d[key] = key
+            ref[key] = key
+
+    keys = sorted(ref)
+    assert d.keys() == tuple(keys)
+    assert [d.index(i)[0] for i in range(0, len(keys), 7)] == keys[::7]
+    assert SortedDict(ref, ladder=True, tick=1, band=64).keys() == tuple(keys)
+
+
+def test_ladder_depth():
+    d = SortedDict({i: i for i in range(200)}, ladder=True, tick=1, band=64, max_depth=10, truncate=True)
+    assert d.keys() == tuple(range(10))
+
+    d[-100] = -100
+    assert d.keys() == (-100,) + tuple(range(9))
+
+
+def test_ladder_invalid():
+    with pytest.raises(ValueError):
+        SortedDict(ladder=True)
+
+    with pytest.raises(ValueError):
+        SortedDict(ladder=True, tick=1, key_type='object')
+
+    with pytest.raises(ValueError):
+        SortedDict(ladder='yes', tick=1)
+
+    with pytest.raises(ValueError):
+        SortedDict(band=10, tick=1, key_type='fixed')
+
+    with pytest.raises(ValueError):
+        SortedDict(ladder=True, tick=1, band=0)
+
+    # a populated book cannot be switched to a ladder in place
+    d = SortedDict({1: 1}, key_type='fixed', tick=1)
+    with pytest.raises(ValueError):
+        d.__init__(ladder=True, tick=1)
+
+
+def test_update():
+    d = SortedDict(ordering='DESC')
+    d.update([(Decimal('100'), Decimal('1')), (Decimal('101'), Decimal('2')), (Decimal('99'), Decimal('3'))])
+    assert d.to_list() == [(Decimal('101'), Decimal('2')), (Decimal('100'), Decimal('1')), (Decimal('99'), Decimal('3'))]
+
+    # zero sizes delete, missing levels are ignored, extra fields are ignored
+    d.update([(Decimal('101'), 0, 'ts'), (Decimal('98'), '0.000'), (Decimal('100'), Decimal('5'))])
+    assert d.to_list() == [(Decimal('100'), Decimal('5')), (Decimal('99'), Decimal('3'))]
+
+    d.update({Decimal('99'): 0.0, Decimal('97'): 1})
+    assert d.to_list() == [(Decimal('100'), Decimal('5')), (Decimal('97'), 1)]
+
+    # parallel price and size sequences
+    d.update([1, 2, 3], [4, 5, 0])
+    assert d.to_dict() == {Decimal('100'): Decimal('5'), Decimal('97'): 1, 2: 5, 1: 4}
+
+    with pytest.raises(ValueError):
+        d.update([1, 2], [3])
+
+    with pytest.raises(ValueError):
+        d.update([(1,)])
+
+    with pytest.raises(TypeError):
+        d.update(5)
+
+
+def test_update_depth():
+    for kwargs in ({}, {'key_type': 'fixed', 'tick': 1}, {'ladder': True, 'tick': 1, 'band': 64}):
+        d = SortedDict(max_depth=3, truncate=True, **kwargs)
+        d.update([(i, 1) for i in range(10, 0, -1)])
+        assert d.keys() == (1, 2, 3)
+
+        # truncation happens once at the end, so a deep level can fill a gap opened later in the batch
+        d.update([(5, 1), (1, 0)])
+        assert d.keys() == (2, 3, 5)
+
+
+def test_to_arrays():
+    for kwargs in ({}, {'key_type': 'fixed', 'tick': Decimal('0.5')}):
+        d = SortedDict({Decimal('1.5'): Decimal('2'), 3: 4.5, 2: 1}, ordering='DESC', **kwargs)
+
+        prices, sizes = d.to_arrays()
+        assert prices.format == 'd' and sizes.format == 'd'
+        assert prices.tolist() == [3.0, 2.0, 1.5]
+        assert sizes.tolist() == [4.5, 1.0, 2.0]
+
+        prices, sizes = d.to_arrays(2, dtype='float32')
+        assert prices.format == 'f'
+        assert prices.tolist() == [3.0, 2.0]
+
+        # caller supplied buffers are filled with as many levels as fit
+        prices = array('d', [0.0] * 2)
+        sizes = array('d', [0.0] * 2)
+        assert d.to_arrays(out=(prices, sizes)) == 2
+        assert list(prices) == [3.0, 2.0]
+        assert list(sizes) == [4.5, 1.0]
+
+        with pytest.raises(TypeError):
+            d.to_arrays(out=(array('f', [0.0]), array('f', [0.0])))
+
+        with pytest.raises(ValueError):
+            d.to_arrays(dtype='int8')
+
+    assert SortedDict(max_depth=1).to_arrays()[0].tolist() == []
+    assert SortedDict({1: 1, 2: 2}, max_depth=1).to_arrays()[0].tolist() == [1.0]
+
+    with pytest.raises(TypeError):
+        SortedDict({1: 'a'}).to_arrays()
+
+
+def test_index_top_levels():
+    d = SortedDict({i: i for i in range(1000)}, ordering='DESC')
+    expected = list(range(999, -1, -1))
+
+    # consume the book from the top, so the leading levels are reshaped on every step
+    while expected:
+        top = [d.index(i)[0] for i in range(min(5, len(expected)))]
+        assert top == expected[:5]
+
+        key = expected.pop(0)
+        del d[key]
+        if isinstance(key, int) and key % 7 == 0 and key > 0:
+            d[key - 0.5] = 1
+            expected.insert(0, key - 0.5)
+
+
+def test_price_queries():
+    for kwargs in ({}, {'key_type': 'fixed', 'tick': '0.5'}, {'ladder': True, 'tick': '0.5', 'band': 64}):
+        asc = SortedDict({i / 2: i for i in range(20)}, **kwargs)
+        desc = SortedDict({i / 2: i for i in range(20)}, ordering='DESC', **kwargs)
+
+        assert asc.bisect(3.0) == 6
+        assert asc.bisect(3.0, right=True) == 7
+        assert asc.bisect(3.2) == 7
+        assert asc.bisect(-1) == 0
+        assert asc.bisect(100) == 20
+        assert desc.bisect(3.0) == 13
+        assert desc.bisect(3.0, right=True) == 14
+        assert desc.bisect(3.2) == 13
+
+        assert asc.rank(3.0) == 6
+        assert desc.rank(3.0) == 13
+        with pytest.raises(KeyError):
+            asc.rank(3.2)
+
+        assert asc.range(2, 3.2) == [(2.0, 4), (2.5, 5), (3.0, 6)]
+        assert desc.range(2, 3.2) == [(3.0, 6), (2.5, 5), (2.0, 4)]
+        assert list(desc.irange(hi=1)) == [(1.0, 2), (0.5, 1), (0.0, 0)]
+        assert asc.range(5, 4) == []
+        assert len(asc.range()) == 20
+
+    d = SortedDict({i: i for i in range(10)}, max_depth=3)
+    assert d.bisect(100) == 3
+    assert d.range(1, 8) == [(1, 1), (2, 2)]
+    with pytest.raises(KeyError):
+        d.rank(5)
+
+    d = SortedDict({1: 1, 2: 2})
+    with pytest.raises(TypeError):
+        d.bisect('a')
+
+
+def test_depth_queries():
+    for kwargs in ({}, {'key_type': 'fixed', 'tick': '0.5'}, {'ladder': True, 'tick': '0.5', 'band': 64}):
+        asks = SortedDict({100.0: 2, 100.5: 3, 101.0: Decimal('5')}, **kwargs)
+        bids = SortedDict({99.0: 1, 98.5: 4}, ordering='DESC', **kwargs)
+
+        assert asks.cumulative() == 10.0
+        assert asks.cumulative(2) == 5.0
+        assert asks.cumulative(0) == 0.0
+        assert asks.size_to_price(100.7) == 5.0
+        assert bids.size_to_price(98.5) == 5.0
+        assert bids.size_to_price(99.5) == 0.0
+
+        assert asks.price_for_size(2) == 100.0
+        assert asks.price_for_size(2.5) == 100.5
+        assert asks.price_for_size(11) is None
+        assert asks.vwap(4) == (2 * 100.0 + 2 * 100.5) / 4
+        assert bids.vwap(3) == (99.0 + 2 * 98.5) / 3
+        assert bids.vwap(6) is None
+
+        # writes inside the cached levels reach the totals
+        asks[100.0] = 6
+        assert asks.vwap(4) == 100.0
+        del asks[100.0]
+        asks[99.5] = 1
+        assert asks.cumulative(2) == 4.0
+        assert asks.price_for_size(4) == 100.5
+
+        with pytest.raises(ValueError):
+            asks.vwap(0)
+
+    d = SortedDict({i: 1 for i in range(10)}, max_depth=3)
+    assert d.cumulative() == 3.0
+    assert d.vwap(4) is None
+
+
+def test_intern():
+    d = SortedDict({'1.5': 1}, intern=Decimal)
+    assert d.keys() == (Decimal('1.5'),)
+
+    d['2.5'] = 2
+    d[Decimal('0.5')] = 3
+    key = d.index(2)[0]
+    d['2.5'] = 4
+    assert d.index(2)[0] is key
+    assert d['2.5'] == 4 and '2.5' in d and Decimal('2.5') in d
+    assert d.bisect('2.0') == 2
+    assert d.keys() == (Decimal('0.5'), Decimal('1.5'), Decimal('2.5'))
+
+    del d['1.5']
+    assert '1.5' not in d
+    with pytest.raises(KeyError):
+        del d['1.5']
+    d.update([['3.5', '1'], ['0.5', '0']])
+    assert d.to_list() == [(Decimal('2.5'), 4), (Decimal('3.5'), '1')]
+
+    # prices that leave the book are dropped from the pool
+    for i in range(5000):
+        d[str(i)] = 1
+        del d[str(i)]
+    assert len(d) == 2
+
+    with pytest.raises(TypeError):
+        SortedDict(intern=1)
+    with pytest.raises(ValueError):
+        SortedDict(intern=Decimal, key_type='fixed', tick='0.1')
+
+
+def test_snapshot():
+    for kwargs in ({}, {'key_type': 'fixed', 'tick': '0.5'}, {'ladder': True, 'tick': '0.5', 'band': 64}):
+        d = SortedDict({100.0: 1, 100.5: 2, 101.0: 3}, **kwargs)
+        snap = d.snapshot()
+        assert snap.snapshot() is snap
+
+        d[99.5] = 4
+        del d[101.0]
+        d[100.0] = 5
+        assert snap.to_list() == [(100.0, 1), (100.5, 2), (101.0, 3)]
+        assert d.to_list() == [(99.5, 4), (100.0, 5), (100.5, 2)]
+        assert snap.index(0) == (100.0, 1)
+        assert snap.bisect(100.5) == 1
+
+        with pytest.raises(TypeError):
+            snap[102.0] = 1
+        with pytest.raises(TypeError):
+            del snap[100.0]
+        with pytest.raises(TypeError):
+            snap.truncate()
+
+        del d
+        assert len(snap) == 3
+
+
+def test_to_bytes():
+    for kwargs in ({}, {'intern': Decimal}, {'key_type': 'fixed', 'tick': '0.5'}, {'ladder': True, 'tick': '0.5', 'band': 64}):
+        d = SortedDict({'100.5': Decimal('1.25'), '99': 2, '101': 'x', '98.5': None}, ordering='DESC', max_depth=3, truncate=True, **kwargs)
+
+        for copy in (SortedDict.from_bytes(d.to_bytes()), pickle.loads(pickle.dumps(d))):
+            assert copy.to_list() == d.to_list()
+            assert [type(k) for k in copy.keys()] == [type(k) for k in d.keys()]
+            assert copy.__max_depth == 3
+
+            copy['102'] = 1
+            assert len(copy) == 3
+
+    with pytest.raises(ValueError):
+        SortedDict.from_bytes(b'not a side')
+    with pytest.raises(ValueError):
+        SortedDict.from_bytes(SortedDict({1: 2}).to_bytes()[:-1])
+
+
+def test_delta():
+    for kwargs in ({}, {'key_type': 'fixed', 'tick': '0.5'}, {'ladder': True, 'tick': '0.5', 'band': 64}):
+        source = SortedDict({100.0: 1, 100.5: 2, 101.0: 3}, delta_log=16, **kwargs)
+        replica = SortedDict(**kwargs)
+
+        assert replica.apply_delta(source.delta_since(None)) == source.version
+        version = source.version
+
+        source[99.5] = 4
+        source[100.0] = 5
+        del source[101.0]
+        source[101.0] = 6
+        del source[101.0]
+        assert source.version == version + 5
+
+        blob = source.delta_since(version)
+        assert replica.apply_delta(blob) == source.version
+        assert replica.to_list() == source.to_list()
+
+        # a delta that does not follow the last one applied is refused
+        with pytest.raises(ValueError):
+            replica.apply_delta(blob)
+
+        # past the log's reach a delta resends every level
+        for i in range(20):
+            source[102.0] = i
+        replica.apply_delta(source.delta_since(version))
+        assert replica.to_list() == source.to_list()
+
+    with pytest.raises(ValueError):
+        SortedDict().delta_since(1)
+
+
+def test_reconcile():
+    for kwargs in ({}, {'key_type': 'fixed', 'tick': '0.5'}, {'ladder': True, 'tick': '0.5', 'band': 64}):
+        d = SortedDict({100.0: 1, 100.5: 2, 101.0: 3}, **kwargs)
+        version = d.version
+
+        added, changed, removed = d.reconcile({100.0: 1, 100.5: 7, 99.5: 4})
+        assert (added, changed, removed) == ([99.5], [100.5], [101.0])
+        assert d.to_list() == [(99.5, 4), (100.0, 1), (100.5, 7)]
+        # only the differences were written
+        assert d.version == version + 3
+
+        assert d.reconcile({99.5: 4, 100.0: 1, 100.5: 7}) == ([], [], [])
+        assert d.reconcile({}) == ([], [], [99.5, 100.0, 100.5])
+        assert len(d) == 0
+
+    # equal values that render differently are a change
+    d = SortedDict({1: Decimal('1.0')})
+    assert d.reconcile({1: Decimal('1.00')}) == ([], [1], [])
+
+    d = SortedDict({i: i for i in range(10)}, max_depth=5, truncate=True)
+    d.reconcile({i: i for i in range(20)})
+    assert list(d.keys()) == [0, 1, 2, 3, 4]
+
+    d = SortedDict({1: 1}, key_type='fixed', tick=1)
+    with pytest.raises(ValueError):
+        d.reconcile({2: 2, 1.5: 3})
+    assert d.to_list() == [(1, 1)]
+
+    with pytest.raises(TypeError):
+        d.reconcile([(1, 1)])
+    with pytest.raises(TypeError):
+        d.snapshot().reconcile({})
+
+
+def test_reconcile_intern():
+    class Unprintable:
+        def __str__(self):
+            raise RuntimeError('cannot stringify')
+
+    built = []
+
+    def factory(price):
+        built.append(price)
+        return Decimal(price)
+
+    d = SortedDict({'1': Unprintable()}, intern=factory)
+    assert d.reconcile({'1': 2, '2': 3}) == ([Decimal('2')], [Decimal('1')], [])
+    d['2'] = 4
+    assert built == ['1', '2']
+
+    # a reconcile that fails before writing a level does not pool its price
+    d['1'] = Unprintable()
+    with pytest.raises(RuntimeError):
+        d.reconcile({'1': Unprintable(), '3': 3})
+    d['3'] = 3
+    assert built == ['1', '2', '3', '3']
+
+
+def test_observe():
+    for kwargs in ({}, {'key_type': 'fixed', 'tick': '0.5'}):
+        d = SortedDict({100.0: 1, 100.5: 2, 101.0: 3}, ordering='DESC', **kwargs)
+        events = []
+        d.observe(events.append, depth=2)
+
+        # behind the watched levels, nothing fires
+        d[100.0] = 5
+        del d[100.0]
+        assert events == []
+
+        d[100.5] = 7
+        d[102.0] = 1
+        assert events == [((101.0, 3), (100.5, 7)), ((102.0, 1), (101.0, 3))]
+
+        # a batch reports once
+        events.clear()
+        d.update([(103.0, 1), (104.0, 1)])
+        assert events == [((104.0, 1), (103.0, 1))]
+
+        d.unobserve(events.append)
+        d[105.0] = 1
+        assert len(events) == 1
+
+    with pytest.raises(ValueError):
+        d.unobserve(events.append)
+    with pytest.raises(ValueError):
+        d.observe(events.append, depth=0)
+
+
+def test_journal():
+    for kwargs in ({}, {'key_type': 'fixed', 'tick': '0.5'}):
+        d = SortedDict(journal=4, **kwargs)
+        d[100.0] = 1
+        d[100.0] = 2
+        d[100.5] = 3
+        del d[100.0]
+        assert [entry[:3] for entry in d.journal()] == [
+            ('insert', 100.0, 1), ('update', 100.0, 2), ('insert', 100.5, 3), ('delete', 100.0, None)
+        ]
+        assert [entry[3] for entry in d.journal()] == list(range(d.version - 3, d.version + 1))
+        assert all(entry[4] > 0 for entry in d.journal())
+
+        replica = SortedDict(**kwargs)
+        replica.replay(d.journal())
+        assert replica.to_list() == d.to_list()
+
+        # only the last N changes are kept
+        d[101.0] = 4
+        assert len(d.journal()) == 4
+        assert d.journal()[0][0] == 'update'
+
+    d = SortedDict(journal=8, journal_time=False, max_depth=2, truncate=True)
+    d.update([(1, 1), (2, 2), (3, 3)])
+    d.__init__({5: 5})
+    assert [entry[:2] for entry in d.journal()] == [('insert', 1), ('insert', 2), ('insert', 3), ('delete', 3), ('reset', None)]
+    assert d.journal()[-1][2] == {5: 5}
+    assert d.journal()[-1][4] == 0
+
+    with pytest.raises(ValueError):
+        d.replay([('move', 1, 1, 1, 0)])
+    assert SortedDict().journal() == []
+
+
+def test_batch():
+    for kwargs in ({}, {'key_type': 'fixed', 'tick': '0.5'}):
+        d = SortedDict(max_depth=2, truncate=True, **kwargs)
+        events = []
+        d.observe(events.append)
+
+        with d.batch():
+            d[3.0] = 1
+            d[2.0] = 1
+            d[1.0] = 1
+            # levels past max_depth are held until the batch closes
+            del d[1.0]
+            assert events == []
+        assert d.to_list() == [(2.0, 1), (3.0, 1)]
+        assert events == [((2.0, 1),)]
+
+        # whatever the block wrote before raising is kept and truncated
+        with pytest.raises(KeyError):
+            with d.batch():
+                d[1.0] = 2
+                del d[10.0]
+        assert d.to_list() == [(1.0, 2), (2.0, 1)]
+        assert events[-1] == ((1.0, 2),)
+
+
+def test_load_snapshot():
+    for kwargs in ({}, {'key_type': 'fixed', 'tick': '0.5'}, {'ladder': True, 'tick': '0.5', 'band': 64}):
+        d = SortedDict({1: 1}, ordering='DESC', **kwargs)
+        d.load_snapshot([['101.5', '2', 7], ['101.0', '0'], ['100.5', '1.25']])
+        assert d.to_list() == [(Decimal('101.5'), Decimal('2')), (Decimal('100.5'), Decimal('1.25'))]
+
+        # out of order levels are sorted, the last of a repeated price wins
+        d.load_snapshot([('100.0', '1'), ('102.0', '3'), ('100.0', '4')], parse='float')
+        assert d.to_list() == [(102.0, 3.0), (100.0, 4.0)]
+
+        # nothing changes unless every level parses
+        with pytest.raises(ValueError):
+            d.load_snapshot([['99.0', '1'], ['abc', '1']], parse='float')
+        with pytest.raises(ValueError):
+            d.load_snapshot([['99.0']])
+        assert len(d) == 2
+
+    # interned prices are pooled only by a snapshot that loads
+    built = []
+
+    def factory(price):
+        built.append(price)
+        return Decimal(price)
+
+    d = SortedDict(intern=factory)
+    with pytest.raises(ArithmeticError):
+        d.load_snapshot([['100.5', '1'], ['99.5', 'bad']])
+    assert len(d) == 0
+    d['100.5'] = 2
+    assert built == ['100.5', '100.5']
+
+    d.load_snapshot([['101.0', '1']])
+    d['101.0'] = 2
+    assert built == ['100.5', '100.5', '101.0']
+
+    with pytest.raises(ValueError):
+        SortedDict().load_snapshot([], parse='fixed')
+    with pytest.raises(ValueError):
+        SortedDict(key_type='fixed', tick='0.5').load_snapshot([['1.25', '1']])